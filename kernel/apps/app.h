@@ -0,0 +1,22 @@
+#ifndef APP_H
+#define APP_H
+
+#include "drivers/app_api.h"
+#include "drivers/pins.h"
+#include "drivers/graphics/os.h"
+
+// The kernel, for the app: every call goes through this table (see
+// drivers/app_api.h), set before each step.
+extern const KernelApi_t* kernel;
+
+/**
+ * The app, called each time its task runs: first when it's launched, then
+ * whenever what it last waited for (kernel->task_wait, task_sleep) comes
+ * round. A step that doesn't wait for anything runs again on the next pass.
+ *
+ * @param task The app's task.
+ * @returns `APP_RUNNING`, or `APP_EXIT` to go back to the launcher.
+ */
+int app_step(Task_t* task);
+
+#endif
@@ -0,0 +1,26 @@
+#include "app.h"
+
+const KernelApi_t* kernel;
+
+/**
+ * The entry point in the app's header: keeps the kernel's table for the app
+ * and runs a step.
+ */
+int _app_entry(const KernelApi_t* api, Task_t* task) {
+	kernel = api;
+	return app_step(task);
+}
+
+// the compiler calls these for struct copies and the like whatever the app
+// says, and apps link against nothing but the kernel
+void* memcpy(void* dest, const void* src, size_t n) {
+	return kernel->memcpy(dest, src, n);
+}
+
+void* memmove(void* dest, const void* src, size_t n) {
+	return kernel->memmove(dest, src, n);
+}
+
+void* memset(void* dest, int value, size_t n) {
+	return kernel->memset(dest, value, n);
+}
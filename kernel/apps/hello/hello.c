@@ -0,0 +1,43 @@
+#include "app.h"
+
+// A square UP and DOWN move, OK goes back to the launcher. It remembers where
+// it was left in the save store.
+
+#define SIZE  40
+#define STEP  20
+#define X     100
+
+static int _y = -1;
+
+static void _draw(uint16_t colour) {
+	kernel->lcd_fill_rect(X, (uint16_t)_y, SIZE, SIZE, colour);
+}
+
+int app_step(Task_t* task) {
+	if (_y < 0) {
+		int32_t saved;
+		_y = kernel->save_get("hello.y", &saved, sizeof(saved)) == sizeof(saved) ? saved : 140;
+		kernel->lcd_fill_rect(0, 0, 240, 320, DARKGREY);
+		_draw(YELLOW);
+	}
+
+	ButtonEvent_t event;
+	while (kernel->button_poll(&event)) {
+		if (event.type == BUTTON_RELEASE || event.type == BUTTON_CHORD) continue;
+
+		if (event.button == PIN_BTN_OK) {
+			int32_t saved = _y;
+			kernel->save_put("hello.y", &saved, sizeof(saved));
+			kernel->save_commit();
+			return APP_EXIT;
+		}
+
+		_draw(DARKGREY);
+		if (event.button == PIN_BTN_UP && _y >= STEP) _y -= STEP;
+		if (event.button == PIN_BTN_DOWN && _y + SIZE + STEP <= 320) _y += STEP;
+		_draw(YELLOW);
+	}
+
+	kernel->task_wait(task, SCHED_EVENT_INPUT);
+	return APP_RUNNING;
+}
@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pico_host.h"
+#include "kernel_alloc.h"
+
+/*
+ * Cycles per malloc/free/realloc of the kernel allocator, and of its fixed
+ * size pools and frame arenas, on a few synthetic workloads, with the average, 99th percentile
+ * and worst case of each.
+ * Host cycles, so only meaningful relative to other runs on the same machine.
+ *
+ * The workloads are deterministic, so each one is run REPEATS times and every
+ * operation keeps its fastest time: what's left is the allocator's own cost
+ * rather than the odd interrupt or preemption landing in a measurement.
+ */
+
+#define HEAP_SIZE    (256 * 1024)
+#define SLOTS        1024
+#define OPERATIONS   200000
+#define FRAMES       2000
+#define FRAME_ALLOCS 64
+#define REPEATS      5
+#define OBJECT_SIZE  24 // a small entity or event
+#define SAMPLE_EVERY 1024 // operations between fragmentation samples (frames: 16 frames)
+#define SESSIONS       200
+#define SESSION_FRAMES 60
+#define APP_OBJECTS    96 // relocatable (or not) objects an app keeps
+#define KEPT_OBJECTS   32 // small long lived ones, never movable
+#define BIG_BUFFER     (HEAP_SIZE / 2) // what the launcher wants back between apps, a framebuffer say
+#define COMPACT_STEPS  4  // alloc_compact(0) calls a frame
+
+typedef struct Timing {
+	const char* name;
+	uint64_t* samples;
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t cursor;   // next operation in the current repeat
+	uint32_t failures; // in the last repeat
+} Timing_t;
+
+static uint8_t _heap[HEAP_SIZE] __attribute__((aligned(64)));
+static void* _slots[SLOTS];
+static uint32_t _slot_sizes[SLOTS];
+static Handle_t _handles[APP_OBJECTS];
+
+static uint32_t _random = 1;
+
+// sizing data from the last frame arena
+static uintptr_t _arena_high_water;
+static uintptr_t _arena_capacity;
+
+// heap fragmentation sampled through the last run of a workload
+static double _fragmentation_total;
+static float _fragmentation_worst;
+static uint32_t _fragmentation_samples;
+
+// mostly small objects, now and then a buffer
+static uint32_t _random_size() {
+	uint32_t shift = 3 + pico_host_rand(&_random) % 8; // 8 B .. 2 KiB
+	return (1u << shift) + pico_host_rand(&_random) % (1u << shift);
+}
+
+static void _record(Timing_t* timing, uint64_t cycles) {
+	if (timing->cursor < timing->count) {
+		// seen this operation in an earlier repeat
+		if (cycles < timing->samples[timing->cursor]) timing->samples[timing->cursor] = cycles;
+		timing->cursor++;
+		return;
+	}
+
+	if (timing->count == timing->capacity) {
+		timing->capacity = timing->capacity ? timing->capacity * 2 : 4096;
+		timing->samples = realloc(timing->samples, timing->capacity * sizeof(uint64_t));
+	}
+	timing->samples[timing->count++] = cycles;
+	timing->cursor++;
+}
+
+static void _start_repeat(Timing_t* timing) {
+	timing->cursor = 0;
+	timing->failures = 0;
+}
+
+static int _compare(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static void _report(const char* workload, Timing_t* timing) {
+	if (timing->count == 0) return;
+
+	qsort(timing->samples, timing->count, sizeof(uint64_t), _compare);
+	uint64_t total = 0;
+	for (uint32_t i = 0; i < timing->count; i++) total += timing->samples[i];
+
+	printf("%-10s %-10s %8u %10.1f %8llu %10llu %8u\n", workload, timing->name, timing->count,
+		(double)total / timing->count,
+		(unsigned long long)timing->samples[timing->count * 99 / 100],
+		(unsigned long long)timing->samples[timing->count - 1], timing->failures);
+
+	free(timing->samples);
+	*timing = (Timing_t){ .name = timing->name };
+}
+
+static void* _timed_malloc(Timing_t* timing, uint32_t size) {
+	uint64_t start = pico_host_cycles();
+	void* ptr = kernel_malloc(size);
+	_record(timing, pico_host_cycles() - start);
+	if (ptr == NULL) {
+		timing->failures++;
+	} else {
+		memset(ptr, 0xA5, size);
+	}
+	return ptr;
+}
+
+static void _timed_free(Timing_t* timing, void* ptr) {
+	uint64_t start = pico_host_cycles();
+	kernel_free(ptr);
+	_record(timing, pico_host_cycles() - start);
+}
+
+static void _reset() {
+	// touch every page first so page faults don't land in the timings
+	memset(_heap, 0, sizeof(_heap));
+	alloc_init(_heap, sizeof(_heap));
+	memset(_slots, 0, sizeof(_slots));
+	_random = 1;
+
+	_fragmentation_total = 0;
+	_fragmentation_worst = 0;
+	_fragmentation_samples = 0;
+}
+
+// walks the heap, so only now and then and outside the timings
+static void _sample() {
+	AllocStats_t stats;
+	alloc_stats(&stats);
+	_fragmentation_total += stats.fragmentation;
+	if (stats.fragmentation > _fragmentation_worst) _fragmentation_worst = stats.fragmentation;
+	_fragmentation_samples++;
+}
+
+/**
+ * Random churn: a slot is freed if it holds something, otherwise filled.
+ */
+static void _steady(Timing_t* mallocs, Timing_t* frees) {
+	_reset();
+	_start_repeat(mallocs);
+	_start_repeat(frees);
+	for (uint32_t op = 0; op < OPERATIONS; op++) {
+		uint32_t slot = pico_host_rand(&_random) % SLOTS;
+		if (_slots[slot] != NULL) {
+			_timed_free(frees, _slots[slot]);
+			_slots[slot] = NULL;
+		} else {
+			_slots[slot] = _timed_malloc(mallocs, _random_size());
+		}
+		if (op % SAMPLE_EVERY == 0) _sample();
+	}
+}
+
+/**
+ * A game loop: some long lived objects churn slowly while every frame
+ * allocates a burst of short lived ones and frees them at the end.
+ */
+static void _frames(Timing_t* mallocs, Timing_t* frees, Timing_t* arena_allocs) {
+	_reset();
+	_start_repeat(mallocs);
+	_start_repeat(frees);
+	_start_repeat(arena_allocs);
+	void* frame[FRAME_ALLOCS];
+
+	for (uint32_t f = 0; f < FRAMES; f++) {
+		for (int i = 0; i < 4; i++) {
+			uint32_t slot = pico_host_rand(&_random) % (SLOTS / 4);
+			if (_slots[slot] != NULL) _timed_free(frees, _slots[slot]);
+			_slots[slot] = _timed_malloc(mallocs, _random_size());
+		}
+
+		for (int i = 0; i < FRAME_ALLOCS; i++) {
+			frame[i] = _timed_malloc(mallocs, 16 + pico_host_rand(&_random) % 240);
+		}
+		// freed in a different order than allocated
+		for (int i = 0; i < FRAME_ALLOCS; i++) {
+			int j = (i * 37) % FRAME_ALLOCS;
+			if (frame[j] != NULL) _timed_free(frees, frame[j]);
+		}
+		if (f % 16 == 0) _sample();
+	}
+
+	// the same frames from an arena, freed with one reset
+	_random = 1;
+	Arena_t* arena = arena_create(FRAME_ALLOCS * 256);
+	for (uint32_t f = 0; f < FRAMES; f++) {
+		for (int i = 0; i < 4; i++) pico_host_rand(&_random), pico_host_rand(&_random), pico_host_rand(&_random);
+
+		for (int i = 0; i < FRAME_ALLOCS; i++) {
+			uint32_t size = 16 + pico_host_rand(&_random) % 240;
+			uint64_t start = pico_host_cycles();
+			frame[i] = arena_alloc(arena, size);
+			_record(arena_allocs, pico_host_cycles() - start);
+			if (frame[i] == NULL) {
+				arena_allocs->failures++;
+			} else {
+				memset(frame[i], 0xA5, size);
+			}
+		}
+		arena_reset(arena);
+	}
+	_arena_high_water = arena_high_water(arena);
+	_arena_capacity = arena_capacity(arena);
+	arena_destroy(arena);
+}
+
+/**
+ * Buffers growing a little at a time, like dynamic arrays.
+ */
+static void _grow(Timing_t* reallocs) {
+	_reset();
+	_start_repeat(reallocs);
+	memset(_slot_sizes, 0, sizeof(_slot_sizes));
+	for (uint32_t op = 0; op < OPERATIONS / 4; op++) {
+		uint32_t slot = pico_host_rand(&_random) % 64;
+		uint32_t size = _slot_sizes[slot] + 16 + pico_host_rand(&_random) % 64;
+		if (size > 4096) size = 16;
+
+		uint64_t start = pico_host_cycles();
+		void* ptr = kernel_realloc(_slots[slot], size);
+		_record(reallocs, pico_host_cycles() - start);
+
+		if (ptr == NULL) {
+			reallocs->failures++;
+			continue;
+		}
+		_slots[slot] = ptr;
+		_slot_sizes[slot] = size;
+		if (op % SAMPLE_EVERY == 0) _sample();
+	}
+}
+
+/**
+ * Small objects of one size churning, from the heap and from a pool.
+ */
+static void _objects(Timing_t* mallocs, Timing_t* frees, Timing_t* pool_allocs, Timing_t* pool_frees) {
+	_reset();
+	_start_repeat(mallocs);
+	_start_repeat(frees);
+	for (uint32_t op = 0; op < OPERATIONS; op++) {
+		uint32_t slot = pico_host_rand(&_random) % SLOTS;
+		if (_slots[slot] != NULL) {
+			_timed_free(frees, _slots[slot]);
+			_slots[slot] = NULL;
+		} else {
+			_slots[slot] = _timed_malloc(mallocs, OBJECT_SIZE);
+		}
+	}
+
+	_reset();
+	_start_repeat(pool_allocs);
+	_start_repeat(pool_frees);
+	Pool_t* pool = pool_create(OBJECT_SIZE, SLOTS);
+	for (uint32_t op = 0; op < OPERATIONS; op++) {
+		uint32_t slot = pico_host_rand(&_random) % SLOTS;
+		uint64_t start = pico_host_cycles();
+		if (_slots[slot] != NULL) {
+			pool_free(pool, _slots[slot]);
+			_record(pool_frees, pico_host_cycles() - start);
+			_slots[slot] = NULL;
+		} else {
+			_slots[slot] = pool_alloc(pool);
+			_record(pool_allocs, pico_host_cycles() - start);
+			if (_slots[slot] == NULL) {
+				pool_allocs->failures++;
+			} else {
+				memset(_slots[slot], 0xA5, OBJECT_SIZE);
+			}
+		}
+	}
+	pool_destroy(pool);
+}
+
+static void _app_free(int slot, bool handles) {
+	if (handles) {
+		handle_free(_handles[slot]);
+		_handles[slot] = 0;
+	} else {
+		kernel_free(_slots[slot]);
+		_slots[slot] = NULL;
+	}
+}
+
+/**
+ * Launcher -> app -> launcher, over and over: an app churns through objects
+ * of a few KiB for a while (plus a few small ones that outlive it), mostly
+ * frees them on the way out, and the launcher then wants a big buffer. With
+ * `handles` the app's objects are relocatable and the heap gets a few
+ * compaction steps every frame, timed in `compacts`.
+ */
+static void _sessions(Timing_t* big_mallocs, Timing_t* compacts, bool handles) {
+	_reset();
+	_start_repeat(big_mallocs);
+	_start_repeat(compacts);
+	memset(_handles, 0, sizeof(_handles));
+	void** kept = &_slots[APP_OBJECTS];
+
+	for (uint32_t session = 0; session < SESSIONS; session++) {
+		// launching the app
+		for (int i = 0; i < 2; i++) {
+			int slot = pico_host_rand(&_random) % KEPT_OBJECTS;
+			kernel_free(kept[slot]);
+			kept[slot] = kernel_malloc(64 + pico_host_rand(&_random) % 192);
+		}
+
+		for (uint32_t f = 0; f < SESSION_FRAMES; f++) {
+			for (int i = 0; i < 4; i++) {
+				int slot = pico_host_rand(&_random) % APP_OBJECTS;
+				uint32_t size = 512 + pico_host_rand(&_random) % 3584;
+				bool taken = handles ? _handles[slot] != 0 : _slots[slot] != NULL;
+				if (taken) {
+					_app_free(slot, handles);
+				} else if (handles) {
+					_handles[slot] = handle_alloc(size);
+				} else {
+					_slots[slot] = kernel_malloc(size);
+				}
+			}
+
+			if (handles) {
+				// what the app works on this frame stays put
+				Handle_t busy = _handles[pico_host_rand(&_random) % APP_OBJECTS];
+				uint8_t* data = handle_lock(busy);
+				if (data != NULL) memset(data, 0xA5, 64);
+
+				for (int i = 0; i < COMPACT_STEPS; i++) {
+					uint64_t start = pico_host_cycles();
+					alloc_compact(0);
+					_record(compacts, pico_host_cycles() - start);
+				}
+				handle_unlock(busy);
+			}
+
+			if (f % 16 == 0) _sample();
+		}
+
+		// quitting the app, a few things are left behind
+		for (int slot = 0; slot < APP_OBJECTS; slot++) {
+			if (pico_host_rand(&_random) % 4 != 0) _app_free(slot, handles);
+		}
+
+		uint64_t start = pico_host_cycles();
+		void* buffer = kernel_malloc(BIG_BUFFER);
+		_record(big_mallocs, pico_host_cycles() - start);
+		if (buffer == NULL) big_mallocs->failures++;
+		kernel_free(buffer);
+	}
+
+	for (int slot = 0; slot < APP_OBJECTS; slot++) _app_free(slot, handles);
+}
+
+static void _report_fragmentation(const char* workload) {
+	AllocStats_t stats;
+	alloc_stats(&stats);
+	printf("%-10s fragmentation %.1f%% average, %.1f%% worst, largest free block %u of %u free bytes at the end\n",
+		workload, _fragmentation_samples ? 100.0 * _fragmentation_total / _fragmentation_samples : 0.0,
+		100.0 * _fragmentation_worst, (unsigned)stats.largest_free, (unsigned)stats.free_bytes);
+}
+
+// after each workload, the heap has to still be in one piece
+static void _validate(const char* workload) {
+	if (!alloc_validate()) {
+		AllocStats_t stats;
+		alloc_stats(&stats);
+		printf("%-10s heap corrupted: %s\n", workload, stats.corruption);
+		exit(1);
+	}
+}
+
+int main(int argc, char** argv) {
+	bool dump = argc > 1 && strcmp(argv[1], "--dump") == 0;
+
+	Timing_t mallocs = { .name = "malloc" };
+	Timing_t frees = { .name = "free" };
+	Timing_t reallocs = { .name = "realloc" };
+	Timing_t pool_allocs = { .name = "pool_alloc" };
+	Timing_t pool_frees = { .name = "pool_free" };
+	Timing_t arena_allocs = { .name = "arena" };
+	Timing_t big_mallocs = { .name = "big malloc" };
+	Timing_t compacts = { .name = "compact" };
+
+	printf("%-10s %-10s %8s %10s %8s %10s %8s\n", "workload", "op", "count", "avg", "p99", "worst", "failed");
+
+	for (int i = 0; i < REPEATS; i++) _steady(&mallocs, &frees);
+	_validate("steady");
+	if (dump) alloc_dump();
+	_report("steady", &mallocs);
+	_report("steady", &frees);
+	_report_fragmentation("steady");
+
+	for (int i = 0; i < REPEATS; i++) _frames(&mallocs, &frees, &arena_allocs);
+	_validate("frames");
+	_report("frames", &mallocs);
+	_report("frames", &frees);
+	_report("frames", &arena_allocs);
+	_report_fragmentation("frames");
+	printf("%-10s arena high water %u of %u bytes\n", "frames", (unsigned)_arena_high_water, (unsigned)_arena_capacity);
+
+	for (int i = 0; i < REPEATS; i++) _grow(&reallocs);
+	_validate("grow");
+	if (dump) alloc_dump();
+	_report("grow", &reallocs);
+	_report_fragmentation("grow");
+
+	for (int i = 0; i < REPEATS; i++) _objects(&mallocs, &frees, &pool_allocs, &pool_frees);
+	_validate("objects");
+	_report("objects", &mallocs);
+	_report("objects", &frees);
+	_report("objects", &pool_allocs);
+	_report("objects", &pool_frees);
+
+	for (int i = 0; i < REPEATS; i++) _sessions(&big_mallocs, &compacts, false);
+	_validate("sessions");
+	_report("sessions", &big_mallocs);
+	_report_fragmentation("sessions");
+
+	for (int i = 0; i < REPEATS; i++) _sessions(&big_mallocs, &compacts, true);
+	_validate("handles");
+	if (dump) alloc_dump();
+	_report("handles", &big_mallocs);
+	_report("handles", &compacts);
+	_report_fragmentation("handles");
+
+	return 0;
+}
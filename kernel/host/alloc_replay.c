@@ -0,0 +1,878 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "pico_host.h"
+#include "kernel_alloc.h"
+
+/*
+ * Replays allocation traces (alloc_trace_start() on the device, then
+ * alloc_trace_dump() over USB serial) against the kernel allocator and the C
+ * library's malloc, and reports for each: throughput, latency per call in host
+ * cycles (average, 99th percentile, worst), calls that failed where they
+ * didn't on the device, and the most memory in use at once, headers included.
+ * For the kernel allocator also how high up the heap blocks went (how big the
+ * heap has to be) and fragmentation. A last pass validates the kernel heap
+ * after every event.
+ *
+ *   alloc_replay [--heap BYTES] TRACE...
+ *   alloc_replay --record OUT [--ops N] [--seed S]
+ *   alloc_replay --fuzz [--handles] [--ops N] [--seed S] [--save FILE]
+ *
+ * --record writes a trace of a synthetic game session, recorded by the
+ * kernel's own recorder, for when there's no device at hand. --fuzz throws
+ * random calls at a small kernel heap, checking every block's contents and
+ * the heap's invariants after each one; a failure saves the trace so far,
+ * which replays to the same failure. With --handles it also allocates,
+ * locks and frees relocatable blocks and compacts the heap as it goes; those
+ * aren't in the trace, run the same seed again to reproduce a failure.
+ */
+
+#define REPEATS      3 // every call keeps its fastest time, as in alloc_bench
+#define HEAP_MAX     (4 * 1024 * 1024)
+#define TRACE_BUFFER (16 * 1024 * 1024)
+#define RECORD_OPS   200000
+#define RECORD_HEAP  (448 * 1024) // about what the device has left after the kernel
+#define FUZZ_OPS     1000000
+#define FUZZ_HEAP    (64 * 1024)
+#define FUZZ_SLOTS   256
+#define FUZZ_HANDLES 64 // of the kernel's ALLOC_HANDLES
+
+typedef struct Event {
+	uint8_t op;     // ALLOC_TRACE_MALLOC etc.
+	bool failed;    // on the device
+	uint32_t size;
+	uint32_t id;    // block returned (malloc, realloc) or freed
+	uint32_t old_id; // realloc
+} Event_t;
+
+typedef struct Trace {
+	AllocTraceHeader_t header;
+	Event_t* events;
+	uint32_t count;
+	uint32_t max_id;
+	uint64_t duration_us;
+
+	uint32_t mallocs;
+	uint32_t frees;
+	uint32_t reallocs;
+	uint32_t failed;    // on the device, skipped when replaying
+	uint32_t unmatched; // free or realloc of a block allocated before recording started
+	uint64_t peak_requested;
+} Trace_t;
+
+typedef struct Allocator {
+	const char* name;
+	void (*reset)(uintptr_t heap_size);
+	void* (*malloc)(uintptr_t bytes);
+	void* (*realloc)(void* ptr, uintptr_t bytes);
+	void (*free)(void* ptr);
+	// bytes in use, headers included, and of the free memory the fraction
+	// outside the largest free block (negative if the allocator can't tell)
+	void (*measure)(uintptr_t* in_use, float* fragmentation);
+	// heap invariants, NULL if there's nothing to check
+	bool (*check)();
+	// start of its heap, NULL if it doesn't have one
+	const uint8_t* heap;
+} Allocator_t;
+
+typedef struct Result {
+	uint64_t* samples; // fastest time of each call
+	double best_seconds;
+	uint32_t failures;
+	uintptr_t peak_in_use;
+	uintptr_t heap_top; // end of the highest block handed out
+	double fragmentation_total;
+	float fragmentation_worst;
+	uint32_t fragmentation_samples;
+} Result_t;
+
+static uint8_t _heap[HEAP_MAX] __attribute__((aligned(64)));
+static bool _measuring;        // in the checking pass
+static uintptr_t _libc_in_use; // bytes the replay has from the C library
+
+static uint32_t _random = 1;
+
+static double _seconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/* --- ALLOCATORS --- */
+
+static void _kernel_reset(uintptr_t heap_size) {
+	// touch every page first so page faults don't land in the timings
+	memset(_heap, 0, heap_size);
+	alloc_init(_heap, heap_size);
+}
+
+static void _kernel_measure(uintptr_t* in_use, float* fragmentation) {
+	AllocStats_t stats;
+	alloc_stats(&stats);
+	*in_use = stats.heap_size - stats.free_bytes;
+	*fragmentation = stats.fragmentation;
+}
+
+// block size and header, only counted in the checking pass (mallinfo can't
+// tell the replay's blocks from this tool's, or from its own caches)
+static uintptr_t _libc_block_bytes(void* ptr) {
+#ifdef __GLIBC__
+	if (_measuring && ptr != NULL) return malloc_usable_size(ptr) + sizeof(size_t);
+#endif
+	(void)ptr;
+	return 0;
+}
+
+static void _libc_reset(uintptr_t heap_size) {
+	(void)heap_size;
+	_libc_in_use = 0;
+}
+
+static void* _libc_malloc(uintptr_t bytes) {
+	void* ptr = malloc(bytes);
+	_libc_in_use += _libc_block_bytes(ptr);
+	return ptr;
+}
+
+static void* _libc_realloc(void* ptr, uintptr_t bytes) {
+	uintptr_t old_bytes = _libc_block_bytes(ptr);
+	void* result = realloc(ptr, bytes);
+	if (result != NULL) _libc_in_use += _libc_block_bytes(result) - old_bytes;
+	return result;
+}
+
+static void _libc_free(void* ptr) {
+	_libc_in_use -= _libc_block_bytes(ptr);
+	free(ptr);
+}
+
+static void _libc_measure(uintptr_t* in_use, float* fragmentation) {
+	*in_use = _libc_in_use;
+	*fragmentation = -1.0f;
+}
+
+static const Allocator_t _allocators[] = {
+	{ "kernel", _kernel_reset, kernel_malloc, kernel_realloc, kernel_free, _kernel_measure, alloc_validate, _heap },
+	{ "libc", _libc_reset, _libc_malloc, _libc_realloc, _libc_free, _libc_measure, NULL, NULL },
+};
+#define ALLOCATORS (sizeof(_allocators) / sizeof(_allocators[0]))
+
+/* --- TRACES --- */
+
+static int _hex(int c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/**
+ * Pull the last trace out of a serial log from `alloc_trace_dump`: the hex
+ * after "trace: " on every line, up to "trace: end". Decoded in place.
+ *
+ * @returns Bytes of trace, 0 if there's none.
+ */
+static size_t _from_log(uint8_t* data, size_t size) {
+	size_t length = 0;
+	size_t start = 0; // of the trace being read, a later dump replaces it
+	bool reading = false;
+	const char* text = (const char*)data;
+
+	for (size_t i = 0; i < size;) {
+		size_t line_end = i;
+		while (line_end < size && text[line_end] != '\n') line_end++;
+
+		// anything may come before it on the line (timestamps from the terminal)
+		const char* line = NULL;
+		for (size_t j = i; j + 7 <= line_end && line == NULL; j++) {
+			if (memcmp(text + j, "trace: ", 7) == 0) line = text + j;
+		}
+
+		if (line != NULL) {
+			const char* hex = line + 7;
+			if (text + line_end - hex >= 3 && memcmp(hex, "end", 3) == 0) {
+				reading = false;
+			} else {
+				if (!reading) {
+					start = length;
+					reading = true;
+				}
+				while (hex + 1 < text + line_end && _hex(hex[0]) >= 0 && _hex(hex[1]) >= 0) {
+					// never outruns the text it's decoded from
+					data[length++] = (uint8_t)(_hex(hex[0]) << 4 | _hex(hex[1]));
+					hex += 2;
+				}
+			}
+		}
+
+		i = line_end + 1;
+	}
+
+	memmove(data, data + start, length - start);
+	return length - start;
+}
+
+static bool _varint(const uint8_t** in, const uint8_t* end, uint32_t* value) {
+	uint64_t result = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (*in == end) return false;
+		uint8_t byte = *(*in)++;
+		result |= (uint64_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) {
+			*value = (uint32_t)result;
+			return result <= UINT32_MAX;
+		}
+	}
+	return false;
+}
+
+/**
+ * Load a trace, binary as written by `--record`/`--fuzz` (or copied off the
+ * device) or a serial log, and work out what it asks of an allocator.
+ */
+static bool _load(const char* path, Trace_t* trace) {
+	*trace = (Trace_t){ 0 };
+
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) {
+		perror(path);
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	long file_size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	uint8_t* data = malloc(file_size > 0 ? (size_t)file_size : 1);
+	size_t size = fread(data, 1, (size_t)file_size, file);
+	fclose(file);
+
+	uint32_t magic = ALLOC_TRACE_MAGIC;
+	if (size < sizeof(magic) || memcmp(data, &magic, sizeof(magic)) != 0) size = _from_log(data, size);
+
+	if (size < sizeof(AllocTraceHeader_t)) {
+		fprintf(stderr, "%s: no trace found\n", path);
+		free(data);
+		return false;
+	}
+	memcpy(&trace->header, data, sizeof(AllocTraceHeader_t));
+	if (trace->header.magic != ALLOC_TRACE_MAGIC || trace->header.version != ALLOC_TRACE_VERSION ||
+		trace->header.length > size - sizeof(AllocTraceHeader_t)) {
+		fprintf(stderr, "%s: not a version %d trace, or cut short\n", path, ALLOC_TRACE_VERSION);
+		free(data);
+		return false;
+	}
+
+	const uint8_t* in = data + sizeof(AllocTraceHeader_t);
+	const uint8_t* end = in + trace->header.length;
+	trace->events = malloc((trace->header.events + 1) * sizeof(Event_t));
+
+	// first pass: decode
+	while (in < end && trace->count < trace->header.events) {
+		Event_t* event = &trace->events[trace->count];
+		uint8_t op = *in++;
+		uint32_t delta;
+		*event = (Event_t){ .op = op & ALLOC_TRACE_OP, .failed = (op & ALLOC_TRACE_FAILED) != 0 };
+
+		bool ok = _varint(&in, end, &delta);
+		if (ok && event->op != ALLOC_TRACE_MALLOC) ok = _varint(&in, end, &event->old_id);
+		if (ok && event->op != ALLOC_TRACE_FREE) ok = _varint(&in, end, &event->size);
+		if (ok && event->op != ALLOC_TRACE_FREE && !event->failed) ok = _varint(&in, end, &event->id);
+		if (!ok || event->op > ALLOC_TRACE_REALLOC) {
+			fprintf(stderr, "%s: bad event %u\n", path, trace->count);
+			free(data);
+			return false;
+		}
+		if (event->op == ALLOC_TRACE_FREE) event->id = event->old_id, event->old_id = 0;
+
+		trace->duration_us += delta;
+		if (event->id > trace->max_id) trace->max_id = event->id;
+		if (event->old_id > trace->max_id) trace->max_id = event->old_id;
+		trace->count++;
+	}
+	free(data);
+
+	// second pass: follow the blocks for the requested bytes and the odd ones out
+	uint32_t* live = calloc(trace->max_id + 1, sizeof(uint32_t));
+	uint64_t requested = 0;
+	for (uint32_t i = 0; i < trace->count; i++) {
+		Event_t* event = &trace->events[i];
+		if (event->failed) trace->failed++;
+
+		switch (event->op) {
+			case ALLOC_TRACE_MALLOC:
+				trace->mallocs++;
+				if (event->failed) break;
+				live[event->id] = event->size;
+				requested += event->size;
+				break;
+			case ALLOC_TRACE_FREE:
+				trace->frees++;
+				if (event->id == 0) break;
+				if (live[event->id] == 0) trace->unmatched++;
+				requested -= live[event->id];
+				live[event->id] = 0;
+				break;
+			case ALLOC_TRACE_REALLOC:
+				trace->reallocs++;
+				if (event->failed) break;
+				if (live[event->old_id] == 0) trace->unmatched++;
+				requested -= live[event->old_id];
+				live[event->old_id] = 0;
+				live[event->id] = event->size;
+				requested += event->size;
+				break;
+		}
+		if (requested > trace->peak_requested) trace->peak_requested = requested;
+	}
+	free(live);
+
+	return true;
+}
+
+/* --- REPLAY --- */
+
+/**
+ * Replay every event of `trace` once. Blocks are tracked by their id on the
+ * device, calls that failed there are skipped.
+ *
+ * @param samples If not NULL, each call's time is kept there when it beats
+ * the one already there.
+ * @param checking Measure footprint and fragmentation and check the heap
+ * after every event.
+ * @returns `false` if a heap check failed.
+ */
+static bool _replay(const Trace_t* trace, const Allocator_t* allocator, void** blocks, Result_t* result,
+	uint64_t* samples, bool checking) {
+	uintptr_t heap_size = trace->header.heap_size;
+	allocator->reset(heap_size);
+	memset(blocks, 0, (trace->max_id + 1) * sizeof(void*));
+	result->failures = 0;
+	_measuring = checking;
+
+	bool ok = true;
+	uint32_t sample = 0;
+	for (uint32_t i = 0; i < trace->count && ok; i++) {
+		const Event_t* event = &trace->events[i];
+		if (event->failed) continue;
+
+		void* block = NULL;
+		uint64_t start = pico_host_cycles();
+		switch (event->op) {
+			case ALLOC_TRACE_MALLOC:
+				block = allocator->malloc(event->size);
+				break;
+			case ALLOC_TRACE_FREE:
+				allocator->free(blocks[event->id]);
+				break;
+			case ALLOC_TRACE_REALLOC:
+				block = allocator->realloc(blocks[event->old_id], event->size);
+				break;
+		}
+		uint64_t cycles = pico_host_cycles() - start;
+		if (samples != NULL) {
+			if (cycles < samples[sample] || samples[sample] == 0) samples[sample] = cycles;
+			sample++;
+		}
+
+		switch (event->op) {
+			case ALLOC_TRACE_MALLOC:
+				if (block == NULL) result->failures++;
+				blocks[event->id] = block;
+				break;
+			case ALLOC_TRACE_FREE:
+				blocks[event->id] = NULL;
+				break;
+			case ALLOC_TRACE_REALLOC:
+				if (block == NULL) {
+					// the device moved it, here it stays where it was
+					result->failures++;
+					block = blocks[event->old_id];
+				}
+				blocks[event->old_id] = NULL;
+				blocks[event->id] = block;
+				break;
+		}
+
+		if (!checking) continue;
+
+		if (allocator->heap != NULL && block != NULL && event->op != ALLOC_TRACE_FREE) {
+			uintptr_t top = (uintptr_t)((const uint8_t*)block - allocator->heap) + event->size;
+			if (top > result->heap_top) result->heap_top = top;
+		}
+
+		uintptr_t in_use;
+		float fragmentation;
+		allocator->measure(&in_use, &fragmentation);
+		if (in_use > result->peak_in_use) result->peak_in_use = in_use;
+		if (fragmentation >= 0) {
+			result->fragmentation_total += fragmentation;
+			if (fragmentation > result->fragmentation_worst) result->fragmentation_worst = fragmentation;
+			result->fragmentation_samples++;
+		}
+
+		if (allocator->check != NULL && !allocator->check()) {
+			AllocStats_t stats;
+			alloc_stats(&stats);
+			printf("%-8s heap check failed after event %u: %s\n", allocator->name, i, stats.corruption);
+			ok = false;
+		}
+	}
+
+	// whatever the trace left allocated
+	for (uint32_t id = 0; id <= trace->max_id; id++) {
+		if (blocks[id] != NULL) allocator->free(blocks[id]);
+	}
+	_measuring = false;
+
+	return ok;
+}
+
+static int _compare(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static bool _run(const char* path, uintptr_t heap_size) {
+	Trace_t trace;
+	if (!_load(path, &trace)) return false;
+
+	if (heap_size != 0) trace.header.heap_size = (uint32_t)heap_size;
+	if (trace.header.heap_size > HEAP_MAX) trace.header.heap_size = HEAP_MAX;
+
+	printf("%s: %u events over %.2f s, recorded on core %u with %u byte alignment\n", path, trace.count,
+		(double)trace.duration_us / 1e6, trace.header.core, trace.header.align);
+	printf("%s: %u malloc, %u free, %u realloc, %u failed on the device, %u unmatched, %u dropped\n", path,
+		trace.mallocs, trace.frees, trace.reallocs, trace.failed, trace.unmatched, trace.header.dropped);
+	printf("%s: peak %llu bytes requested, replayed on a %u byte heap\n", path,
+		(unsigned long long)trace.peak_requested, trace.header.heap_size);
+	printf("%-8s %8s %8s %8s %8s %8s %10s %10s %10s %10s\n", "alloc", "Mops/s", "avg", "p99", "worst", "failed",
+		"peak used", "heap top", "frag avg", "frag worst");
+
+	void** blocks = malloc((trace.max_id + 1) * sizeof(void*));
+	bool ok = true;
+
+	for (uint32_t a = 0; a < ALLOCATORS; a++) {
+		const Allocator_t* allocator = &_allocators[a];
+		Result_t result = { 0 };
+		result.samples = calloc(trace.count + 1, sizeof(uint64_t));
+
+		for (int repeat = 0; repeat < REPEATS; repeat++) {
+			// latency of each call, then throughput without the clock reads
+			_replay(&trace, allocator, blocks, &result, result.samples, false);
+
+			double start = _seconds();
+			_replay(&trace, allocator, blocks, &result, NULL, false);
+			double seconds = _seconds() - start;
+			if (repeat == 0 || seconds < result.best_seconds) result.best_seconds = seconds;
+		}
+		uint32_t failures = result.failures;
+
+		ok = _replay(&trace, allocator, blocks, &result, NULL, true) && ok;
+
+		uint32_t calls = trace.count - trace.failed;
+		qsort(result.samples, calls, sizeof(uint64_t), _compare);
+		uint64_t total = 0;
+		for (uint32_t i = 0; i < calls; i++) total += result.samples[i];
+
+		printf("%-8s %8.2f %8.1f %8llu %8llu %8u %10lu", allocator->name,
+			result.best_seconds > 0 ? calls / result.best_seconds / 1e6 : 0.0,
+			calls ? (double)total / calls : 0.0,
+			calls ? (unsigned long long)result.samples[calls * 99 / 100] : 0ull,
+			calls ? (unsigned long long)result.samples[calls - 1] : 0ull,
+			failures, (unsigned long)result.peak_in_use);
+		if (allocator->heap != NULL) {
+			printf(" %10lu", (unsigned long)result.heap_top);
+		} else {
+			printf(" %10s", "-");
+		}
+		if (result.fragmentation_samples > 0) {
+			printf(" %9.1f%% %9.1f%%\n", 100.0 * result.fragmentation_total / result.fragmentation_samples,
+				100.0 * result.fragmentation_worst);
+		} else {
+			printf(" %10s %10s\n", "-", "-");
+		}
+
+		free(result.samples);
+	}
+
+	free(blocks);
+	free(trace.events);
+	return ok;
+}
+
+/* --- RECORDING --- */
+
+static bool _save(const char* path, const uint8_t* trace, uint32_t length) {
+	FILE* file = fopen(path, "wb");
+	if (file == NULL || fwrite(trace, 1, length, file) != length) {
+		perror(path);
+		if (file != NULL) fclose(file);
+		return false;
+	}
+	fclose(file);
+	return true;
+}
+
+// mostly small objects, now and then a buffer
+static uint32_t _random_size() {
+	uint32_t shift = 3 + pico_host_rand(&_random) % 8; // 8 B .. 2 KiB
+	return (1u << shift) + pico_host_rand(&_random) % (1u << shift);
+}
+
+/**
+ * Record a synthetic game session with the kernel's recorder: long lived
+ * objects churning, a burst of short lived ones every frame, and a few
+ * buffers growing like dynamic arrays.
+ */
+static bool _record(const char* path, uint32_t operations, uint32_t seed) {
+	static void* objects[512];
+	static void* buffers[16];
+	static uint32_t buffer_sizes[16];
+	void* frame[32];
+
+	uint8_t* trace = malloc(TRACE_BUFFER);
+	_kernel_reset(RECORD_HEAP);
+	_random = seed ? seed : 1;
+	alloc_trace_start(trace, TRACE_BUFFER);
+
+	for (uint32_t op = 0; op < operations;) {
+		for (int i = 0; i < 8; i++, op++) {
+			uint32_t slot = pico_host_rand(&_random) % 512;
+			if (objects[slot] != NULL) {
+				kernel_free(objects[slot]);
+				objects[slot] = NULL;
+			} else {
+				objects[slot] = kernel_malloc(_random_size());
+			}
+		}
+
+		uint32_t burst = 8 + pico_host_rand(&_random) % 24;
+		for (uint32_t i = 0; i < burst; i++, op++) frame[i] = kernel_malloc(16 + pico_host_rand(&_random) % 240);
+		// freed evens first, then odds, not in the order allocated
+		for (uint32_t i = 0; i < burst; i++, op++) {
+			uint32_t half = (burst + 1) / 2;
+			kernel_free(frame[i < half ? 2 * i : 2 * (i - half) + 1]);
+		}
+
+		uint32_t slot = pico_host_rand(&_random) % 16;
+		buffer_sizes[slot] += 16 + pico_host_rand(&_random) % 128;
+		if (buffer_sizes[slot] > 8192) buffer_sizes[slot] = 16;
+		void* grown = kernel_realloc(buffers[slot], buffer_sizes[slot]);
+		if (grown != NULL) buffers[slot] = grown;
+		op++;
+	}
+
+	for (int i = 0; i < 512; i++) kernel_free(objects[i]);
+	for (int i = 0; i < 16; i++) kernel_free(buffers[i]);
+	memset(objects, 0, sizeof(objects));
+	memset(buffers, 0, sizeof(buffers));
+
+	uint32_t length = alloc_trace_stop();
+	const AllocTraceHeader_t* header = (const AllocTraceHeader_t*)trace;
+	bool ok = _save(path, trace, length);
+	if (ok) printf("%s: %u events, %u bytes\n", path, header->events, length);
+	free(trace);
+	return ok;
+}
+
+/* --- FUZZING --- */
+
+typedef struct Slot {
+	uint8_t* block;
+	uint32_t size;
+	uint8_t seed; // contents are seed, seed + 1, ...
+} Slot_t;
+
+static bool _intact(const Slot_t* slot) {
+	for (uint32_t i = 0; i < slot->size; i++) {
+		if (slot->block[i] != (uint8_t)(slot->seed + i)) return false;
+	}
+	return true;
+}
+
+static void _fill(Slot_t* slot, uint32_t from) {
+	for (uint32_t i = from; i < slot->size; i++) slot->block[i] = (uint8_t)(slot->seed + i);
+}
+
+// small sizes most of the time, sometimes big, now and then too big to fit
+static uint32_t _fuzz_size() {
+	uint32_t kind = pico_host_rand(&_random) % 100;
+	if (kind < 70) return 1 + pico_host_rand(&_random) % 64;
+	if (kind < 95) return 1 + pico_host_rand(&_random) % 1024;
+	if (kind < 99) return 1 + pico_host_rand(&_random) % 16384;
+	return FUZZ_HEAP / 2 + pico_host_rand(&_random) % FUZZ_HEAP;
+}
+
+/**
+ * Check a block just returned to the fuzzer: aligned, inside the heap.
+ */
+static const char* _check_block(const void* block, uint32_t size) {
+	if ((uintptr_t)block % ALIGN != 0) return "misaligned block";
+	if ((const uint8_t*)block < _heap || (const uint8_t*)block + size > _heap + FUZZ_HEAP) return "block outside the heap";
+	return NULL;
+}
+
+typedef struct HandleSlot {
+	Handle_t handle;
+	Slot_t data;  // block only set while locked
+	bool pinned;  // kept locked between operations
+} HandleSlot_t;
+
+/**
+ * Lock a handle slot's block, if it isn't already, into `data.block`.
+ */
+static bool _lock(HandleSlot_t* slot) {
+	if (slot->pinned) return true;
+	slot->data.block = handle_lock(slot->handle);
+	return slot->data.block != NULL;
+}
+
+static void _unlock(HandleSlot_t* slot) {
+	if (slot->pinned) return;
+	handle_unlock(slot->handle);
+	slot->data.block = NULL;
+}
+
+/**
+ * A random call on a relocatable block: allocate, free, check its contents,
+ * or pin it (keep it locked) for a while.
+ *
+ * @returns What went wrong, or `NULL`.
+ */
+static const char* _fuzz_handle(HandleSlot_t* slot, uint32_t size, uint32_t* failed_calls) {
+	const char* failure = NULL;
+
+	if (slot->handle == 0) {
+		slot->handle = handle_alloc(size);
+		if (slot->handle == 0) {
+			(*failed_calls)++;
+			return NULL;
+		}
+		if (handle_size(slot->handle) < size) return "handle smaller than asked for";
+
+		slot->pinned = false;
+		if (!_lock(slot)) return "new handle won't lock";
+		slot->data.size = size;
+		slot->data.seed = (uint8_t)pico_host_rand(&_random);
+		_fill(&slot->data, 0);
+		failure = _check_block(slot->data.block, size);
+		slot->pinned = pico_host_rand(&_random) % 8 == 0;
+		_unlock(slot);
+		return failure;
+	}
+
+	switch (pico_host_rand(&_random) % 4) {
+		case 0: // free, pinned or not
+			handle_free(slot->handle);
+			if (handle_lock(slot->handle) != NULL) return "freed handle still locks";
+			*slot = (HandleSlot_t){ 0 };
+			return NULL;
+		case 1: // pin or unpin
+			if (slot->pinned) {
+				slot->pinned = false;
+				_unlock(slot);
+			} else {
+				if (!_lock(slot)) return "handle won't lock";
+				slot->pinned = true;
+			}
+			return NULL;
+		default: // check the contents, nested in a second lock when pinned
+			if (!_lock(slot)) return "handle won't lock";
+			if (handle_lock(slot->handle) != slot->data.block) failure = "nested lock moved the block";
+			handle_unlock(slot->handle);
+			if (failure == NULL && !_intact(&slot->data)) failure = "handle contents changed";
+			_unlock(slot);
+			return failure;
+	}
+}
+
+static bool _fuzz(uint32_t operations, uint32_t seed, bool handles, const char* save) {
+	static Slot_t slots[FUZZ_SLOTS];
+	static HandleSlot_t handle_slots[FUZZ_HANDLES];
+	memset(slots, 0, sizeof(slots));
+	memset(handle_slots, 0, sizeof(handle_slots));
+
+	uint8_t* trace = malloc(TRACE_BUFFER);
+	_kernel_reset(FUZZ_HEAP);
+	_random = seed ? seed : 1;
+	alloc_trace_start(trace, TRACE_BUFFER);
+
+	const char* failure = NULL;
+	uint32_t op;
+	uint32_t failed_calls = 0;
+	uint64_t compacted = 0;
+	for (op = 0; op < operations; op++) {
+		Slot_t* slot = &slots[pico_host_rand(&_random) % FUZZ_SLOTS];
+		if (slot->block != NULL && !_intact(slot)) {
+			failure = "block contents changed";
+			break;
+		}
+
+		uint32_t size = _fuzz_size();
+		if (handles) {
+			// a compaction step before every call, now and then all of it
+			compacted += alloc_compact(pico_host_rand(&_random) % 256 == 0 ? UINT32_MAX : 0);
+		}
+		switch (pico_host_rand(&_random) % (handles ? 6 : 4)) {
+			case 0: // malloc or free
+				if (slot->block != NULL) {
+					kernel_free(slot->block);
+					slot->block = NULL;
+					break;
+				}
+				slot->block = kernel_malloc(size);
+				if (slot->block == NULL) {
+					failed_calls++;
+					break;
+				}
+				slot->size = size;
+				slot->seed = (uint8_t)pico_host_rand(&_random);
+				_fill(slot, 0);
+				failure = _check_block(slot->block, size);
+				break;
+			case 1: // calloc, after freeing whatever was there
+				kernel_free(slot->block);
+				slot->block = kernel_calloc(1, size);
+				if (slot->block == NULL) {
+					failed_calls++;
+					break;
+				}
+				for (uint32_t i = 0; i < size; i++) {
+					if (slot->block[i] != 0) failure = "calloc block not zeroed";
+				}
+				slot->size = size;
+				slot->seed = (uint8_t)pico_host_rand(&_random);
+				_fill(slot, 0);
+				if (failure == NULL) failure = _check_block(slot->block, size);
+				break;
+			case 4: // only with --handles
+			case 5:
+				failure = _fuzz_handle(&handle_slots[pico_host_rand(&_random) % FUZZ_HANDLES], size, &failed_calls);
+				break;
+			default: { // realloc, growing, shrinking or to nothing
+				if (pico_host_rand(&_random) % 32 == 0) size = 0;
+				uint8_t* block = kernel_realloc(slot->block, size);
+				if (size == 0) {
+					slot->block = NULL;
+					break;
+				}
+				if (block == NULL) {
+					// the old block has to be left alone
+					failed_calls++;
+					break;
+				}
+				uint32_t kept = slot->block == NULL ? 0 : slot->size < size ? slot->size : size;
+				if (slot->block == NULL) slot->seed = (uint8_t)pico_host_rand(&_random);
+				slot->block = block;
+				slot->size = kept;
+				if (!_intact(slot)) failure = "realloc lost the contents";
+				slot->size = size;
+				_fill(slot, kept);
+				if (failure == NULL) failure = _check_block(block, size);
+				break;
+			}
+		}
+
+		if (failure == NULL && !alloc_validate()) {
+			AllocStats_t stats;
+			alloc_stats(&stats);
+			failure = stats.corruption;
+		}
+#if ALLOC_STATS
+		if (failure == NULL) {
+			AllocStats_t stats;
+			alloc_stats(&stats);
+			if (stats.live_bytes != stats.used_bytes) failure = "live bytes out of step with the heap";
+		}
+#endif
+		if (failure == NULL && op % 4096 == 0) {
+			for (int i = 0; i < FUZZ_SLOTS; i++) {
+				if (slots[i].block != NULL && !_intact(&slots[i])) failure = "block contents changed";
+			}
+			for (int i = 0; i < FUZZ_HANDLES && failure == NULL; i++) {
+				if (handle_slots[i].handle == 0) continue;
+				if (!_lock(&handle_slots[i])) failure = "handle won't lock";
+				else if (!_intact(&handle_slots[i].data)) failure = "handle contents changed";
+				_unlock(&handle_slots[i]);
+			}
+		}
+		if (failure != NULL) break;
+	}
+
+	for (int i = 0; i < FUZZ_SLOTS; i++) kernel_free(slots[i].block);
+	for (int i = 0; i < FUZZ_HANDLES; i++) handle_free(handle_slots[i].handle);
+
+	uint32_t length = alloc_trace_stop();
+	if (failure != NULL) {
+		printf("fuzz: %s at operation %u (seed %u)\n", failure, op, seed);
+		if (_save(save, trace, length)) printf("fuzz: trace so far saved to %s\n", save);
+	} else {
+		printf("fuzz: %u operations (seed %u), %u failed for lack of memory, heap checked after each\n",
+			operations, seed, failed_calls);
+		if (handles) printf("fuzz: %llu bytes moved by compaction\n", (unsigned long long)compacted);
+	}
+	free(trace);
+	return failure == NULL;
+}
+
+static void _usage() {
+	fprintf(stderr,
+		"usage: alloc_replay [--heap BYTES] TRACE...\n"
+		"       alloc_replay --record OUT [--ops N] [--seed S]\n"
+		"       alloc_replay --fuzz [--handles] [--ops N] [--seed S] [--save FILE]\n"
+		"TRACE is a binary trace or a serial log with alloc_trace_dump() output\n");
+}
+
+int main(int argc, char** argv) {
+	const char* record = NULL;
+	const char* save = "alloc_fuzz.trace";
+	bool fuzz = false;
+	bool handles = false;
+	uint32_t operations = 0;
+	uint32_t seed = 1;
+	uintptr_t heap_size = 0;
+	int traces = 0;
+
+	for (int i = 1; i < argc; i++) {
+		bool more = i + 1 < argc;
+		if (strcmp(argv[i], "--record") == 0 && more) {
+			record = argv[++i];
+		} else if (strcmp(argv[i], "--fuzz") == 0) {
+			fuzz = true;
+		} else if (strcmp(argv[i], "--handles") == 0) {
+			handles = true;
+		} else if (strcmp(argv[i], "--ops") == 0 && more) {
+			operations = (uint32_t)strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--seed") == 0 && more) {
+			seed = (uint32_t)strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--save") == 0 && more) {
+			save = argv[++i];
+		} else if (strcmp(argv[i], "--heap") == 0 && more) {
+			heap_size = strtoul(argv[++i], NULL, 0);
+		} else if (argv[i][0] == '-') {
+			_usage();
+			return 2;
+		} else {
+			argv[++traces] = argv[i];
+		}
+	}
+
+	if (record != NULL) return _record(record, operations ? operations : RECORD_OPS, seed) ? 0 : 1;
+	if (fuzz) return _fuzz(operations ? operations : FUZZ_OPS, seed, handles, save) ? 0 : 1;
+	if (traces == 0) {
+		_usage();
+		return 2;
+	}
+
+	bool ok = true;
+	for (int i = 1; i <= traces; i++) {
+		ok = _run(argv[i], heap_size) && ok;
+	}
+	return ok ? 0 : 1;
+}
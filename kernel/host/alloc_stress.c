@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "pico/platform.h"
+#include "kernel_alloc.h"
+
+/*
+ * Two threads standing in for the two cores, each allocating from its own
+ * heap. Every few allocations a block is handed to the other thread, which
+ * checks its contents and frees it, so cross-core frees go through the remote
+ * free queues all the time. At the end both heaps have to validate and hold
+ * nothing but what was there before.
+ *
+ * Then the same work is timed three ways: one thread alone, both threads on
+ * their own heaps, and both threads sharing core 0's heap behind one lock
+ * (what wrapping the allocator in a spinlock would do). Scaling needs a host
+ * with at least two CPUs.
+ */
+
+#define HEAP_SIZE  (1024 * 1024)
+#define CORE1_HEAP (HEAP_SIZE / 2)
+#define SLOTS      512
+#define RING_SIZE  256      // blocks in flight between the threads, power of two
+#define HAND_OFF   8        // one allocation in this many goes to the other thread
+#define OPERATIONS 2000000
+
+typedef struct Block {
+	uint32_t owner;    // thread that allocated it
+	uint32_t sequence;
+	uint32_t size;
+	uint32_t check;
+} Block_t;
+
+// single producer, single consumer ring of blocks going to one thread
+typedef struct Ring {
+	void* blocks[RING_SIZE];
+	_Atomic uint32_t head; // written by the producer
+	_Atomic uint32_t tail; // written by the consumer
+} Ring_t;
+
+typedef struct Worker {
+	uint32_t id;
+	uint32_t core;
+	uint32_t operations;
+	bool hand_off;
+	bool locked; // share one heap behind _lock
+	uint32_t random;
+	uint32_t sequence;
+	uint32_t failures;
+	uint32_t received;
+	void* slots[SLOTS];
+} Worker_t;
+
+static uint8_t _heap[HEAP_SIZE] __attribute__((aligned(64)));
+static Ring_t _rings[2];
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t _barrier;
+static _Atomic uint32_t _errors = 0;
+
+static uint32_t _rand(Worker_t* worker) {
+	worker->random ^= worker->random << 13;
+	worker->random ^= worker->random >> 17;
+	worker->random ^= worker->random << 5;
+	return worker->random;
+}
+
+static void* _malloc(Worker_t* worker, uintptr_t size) {
+	if (!worker->locked) return kernel_malloc(size);
+
+	pthread_mutex_lock(&_lock);
+	void* ptr = kernel_malloc(size);
+	pthread_mutex_unlock(&_lock);
+	return ptr;
+}
+
+static void _free(Worker_t* worker, void* ptr) {
+	if (!worker->locked) {
+		kernel_free(ptr);
+		return;
+	}
+
+	pthread_mutex_lock(&_lock);
+	kernel_free(ptr);
+	pthread_mutex_unlock(&_lock);
+}
+
+static uint32_t _pattern(const Block_t* block, uint32_t i) {
+	return block->owner * 0x9E3779B9u ^ block->sequence * 0x85EBCA6Bu ^ i;
+}
+
+static void* _new_block(Worker_t* worker) {
+	uint32_t size = sizeof(Block_t) + 4 * (_rand(worker) % 128);
+	Block_t* block = _malloc(worker, size);
+	if (block == NULL) {
+		worker->failures++;
+		return NULL;
+	}
+
+	block->owner = worker->id;
+	block->sequence = worker->sequence++;
+	block->size = size;
+	uint32_t* words = (uint32_t*)(block + 1);
+	for (uint32_t i = 0; i < (size - sizeof(Block_t)) / 4; i++) words[i] = _pattern(block, i);
+	block->check = block->owner ^ block->sequence ^ block->size;
+	return block;
+}
+
+static void _check_block(const Block_t* block) {
+	bool ok = block->check == (block->owner ^ block->sequence ^ block->size);
+	const uint32_t* words = (const uint32_t*)(block + 1);
+	for (uint32_t i = 0; ok && i < (block->size - sizeof(Block_t)) / 4; i++) ok = words[i] == _pattern(block, i);
+
+	if (!ok && atomic_fetch_add(&_errors, 1) < 10) {
+		printf("block %p from thread %u (#%u) damaged\n", (void*)block, block->owner, block->sequence);
+	}
+}
+
+static bool _send(Ring_t* ring, void* block) {
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == RING_SIZE) return false;
+
+	ring->blocks[head % RING_SIZE] = block;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return true;
+}
+
+// check and free whatever the other thread sent
+static void _receive(Worker_t* worker) {
+	Ring_t* ring = &_rings[worker->id];
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	for (; tail != head; tail++) {
+		Block_t* block = ring->blocks[tail % RING_SIZE];
+		_check_block(block);
+		_free(worker, block);
+		worker->received++;
+	}
+	atomic_store_explicit(&ring->tail, tail, memory_order_release);
+}
+
+static void* _run(void* argument) {
+	Worker_t* worker = argument;
+	pico_host_set_core(worker->core);
+	pthread_barrier_wait(&_barrier);
+
+	for (uint32_t op = 0; op < worker->operations; op++) {
+		uint32_t slot = _rand(worker) % SLOTS;
+		if (worker->slots[slot] != NULL) {
+			_check_block(worker->slots[slot]);
+			_free(worker, worker->slots[slot]);
+			worker->slots[slot] = NULL;
+		} else {
+			void* block = _new_block(worker);
+			if (block != NULL && worker->hand_off && worker->sequence % HAND_OFF == 0 && _send(&_rings[worker->id ^ 1], block)) {
+				block = NULL;
+			}
+			worker->slots[slot] = block;
+		}
+
+		if (worker->hand_off && op % 64 == 0) _receive(worker);
+	}
+
+	for (uint32_t slot = 0; slot < SLOTS; slot++) {
+		if (worker->slots[slot] != NULL) _free(worker, worker->slots[slot]);
+		worker->slots[slot] = NULL;
+	}
+
+	// wait for the other thread to stop sending, then take the rest
+	pthread_barrier_wait(&_barrier);
+	if (worker->hand_off) _receive(worker);
+	pthread_barrier_wait(&_barrier);
+
+	// anything queued for this heap is released here
+	if (!worker->locked && !alloc_validate()) {
+		AllocStats_t stats;
+		alloc_stats(&stats);
+		printf("core %u heap corrupted: %s\n", worker->core, stats.corruption);
+		atomic_fetch_add(&_errors, 1);
+	}
+
+	return NULL;
+}
+
+static double _seconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// run `threads` workers, returns wall clock seconds
+static double _go(Worker_t* workers, int threads) {
+	pthread_t handles[2];
+	pthread_barrier_init(&_barrier, NULL, threads);
+	for (int i = 0; i < 2; i++) _rings[i] = (Ring_t){ 0 };
+
+	double start = _seconds();
+	for (int i = 0; i < threads; i++) pthread_create(&handles[i], NULL, _run, &workers[i]);
+	for (int i = 0; i < threads; i++) pthread_join(handles[i], NULL);
+	double seconds = _seconds() - start;
+
+	pthread_barrier_destroy(&_barrier);
+	return seconds;
+}
+
+static void _setup(Worker_t* workers, uint32_t operations, bool hand_off, bool locked) {
+	alloc_init(_heap, sizeof(_heap));
+	alloc_init_core(1, CORE1_HEAP);
+
+	for (uint32_t i = 0; i < 2; i++) {
+		workers[i] = (Worker_t){
+			.id = i,
+			.core = locked ? 0 : i,
+			.operations = operations,
+			.hand_off = hand_off,
+			.locked = locked,
+			.random = 0x1234567 + i * 77,
+		};
+	}
+}
+
+static void _usage() {
+	fprintf(stderr,
+		"usage: alloc_stress [OPERATIONS]\n"
+		"OPERATIONS per thread, default %u\n", OPERATIONS);
+}
+
+int main(int argc, char** argv) {
+	uint32_t operations = OPERATIONS;
+	if (argc > 2) {
+		_usage();
+		return 2;
+	}
+	if (argc == 2) {
+		char* end;
+		unsigned long parsed = strtoul(argv[1], &end, 0);
+		if (end == argv[1] || *end != '\0' || argv[1][0] == '-' || parsed == 0 || parsed > UINT32_MAX) {
+			_usage();
+			return 2;
+		}
+		operations = (uint32_t)parsed;
+	}
+	static Worker_t workers[2];
+
+	// correctness: both cores allocating, freeing, and freeing each other's blocks
+	_setup(workers, operations, true, false);
+	AllocStats_t before;
+	alloc_stats(&before);
+
+	_go(workers, 2);
+
+	AllocStats_t after;
+	alloc_stats(&after);
+	if (after.used_bytes != before.used_bytes) {
+		printf("core 0 heap: %lu bytes still in use, expected %lu\n", (unsigned long)after.used_bytes, (unsigned long)before.used_bytes);
+		_errors++;
+	}
+	printf("stress: %u operations per core, %u + %u blocks freed by the other core, %u + %u failed allocations, %u errors\n",
+		operations, workers[0].received, workers[1].received, workers[0].failures, workers[1].failures, (unsigned)_errors);
+	if (_errors > 0) return 1;
+
+	// scaling
+	_setup(workers, operations, false, false);
+	double alone = _go(workers, 1);
+	_setup(workers, operations, false, false);
+	double per_core = _go(workers, 2);
+	_setup(workers, operations, false, true);
+	double locked = _go(workers, 2);
+
+	printf("\n%-24s %10s %10s\n", "", "Mops/s", "vs alone");
+	printf("%-24s %10.2f %10.2f\n", "one thread", operations / alone / 1e6, 1.0);
+	printf("%-24s %10.2f %10.2f\n", "two, per core heaps", 2 * operations / per_core / 1e6, 2 * alone / per_core);
+	printf("%-24s %10.2f %10.2f\n", "two, one locked heap", 2 * operations / locked / 1e6, 2 * alone / locked);
+
+	return _errors > 0;
+}
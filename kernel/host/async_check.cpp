@@ -0,0 +1,227 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "pico_host.h"
+#include "sd_model.h"
+#include "async.hpp"
+
+extern "C" {
+#include "sd_card.h"
+}
+
+/*
+ * The coroutine layer (async.hpp) on the simulated card and bus, run by the
+ * real executor under sched_run: sectors written and read back through
+ * async_sd_write/async_sd_read with two reads in flight at once, a coroutine
+ * returning a value to the one awaiting it, DMA copies and SPI writes
+ * (which keep the bus to themselves until they're done),
+ * yields and sleeps resuming in the right order at the right time, and
+ * coroutines that can't get a frame not starting. Exits once every check
+ * has run, or fails if they haven't after TIMEOUT_US of simulated time.
+ */
+
+#define FIRST_SECTOR 64
+#define SECTORS      16
+#define TIMEOUT_US   10000000
+
+static uint8_t _written[SECTORS * SD_BLOCK_SIZE] __attribute__((aligned(4)));
+static uint8_t _read[SECTORS * SD_BLOCK_SIZE] __attribute__((aligned(4)));
+static uint8_t _sector[SD_BLOCK_SIZE];
+
+// what the ordering checks' coroutines did, in order
+static char _order[32];
+static uint32_t _order_length = 0;
+static uint32_t _woken_us[3];
+
+static uint32_t _errors = 0;
+static bool _finished = false;
+
+// the drivers ask which core they're on, there's only the one here
+extern "C" uint get_core_num() {
+	return 0;
+}
+
+static void _fail(const char* what) {
+	printf("FAILED: %s\n", what);
+	_errors++;
+}
+
+static void _log(char c) {
+	if (_order_length < sizeof(_order) - 1) _order[_order_length++] = c;
+}
+
+// --- SD ---
+
+static Async<uint32_t> _sum_sector(uint32_t sector) {
+	int result = co_await async_sd_read(sector, 1, _sector);
+	if (result != SD_OK) co_return 0;
+	uint32_t sum = 0;
+	for (uint32_t i = 0; i < SD_BLOCK_SIZE; i++) sum += _sector[i];
+	co_return sum;
+}
+
+static Async<bool> _check_sd() {
+	for (uint32_t i = 0; i < sizeof(_written); i++) _written[i] = (uint8_t)(i * 7 + i / SD_BLOCK_SIZE);
+	int result = co_await async_sd_write(FIRST_SECTOR, SECTORS, _written);
+	if (result != SD_OK) {
+		_fail("async_sd_write");
+		co_return false;
+	}
+
+	// both queued before either is awaited, then awaited the other way round
+	memset(_read, 0, sizeof(_read));
+	AsyncSd first = async_sd_read(FIRST_SECTOR, SECTORS / 2, _read);
+	AsyncSd second = async_sd_read(FIRST_SECTOR + SECTORS / 2, SECTORS / 2, _read + SECTORS / 2 * SD_BLOCK_SIZE);
+	int second_result = co_await second;
+	int first_result = co_await first;
+	if (first_result != SD_OK || second_result != SD_OK) _fail("async_sd_read");
+	if (memcmp(_read, _written, sizeof(_read)) != 0) _fail("sectors read back differ from those written");
+
+	uint32_t expected = 0;
+	for (uint32_t i = 0; i < SD_BLOCK_SIZE; i++) expected += _written[3 * SD_BLOCK_SIZE + i];
+	uint32_t sum = co_await _sum_sector(FIRST_SECTOR + 3);
+	if (sum != expected) _fail("value returned by an awaited coroutine");
+	co_return true;
+}
+
+// --- DMA ---
+
+static Async<> _check_dma() {
+	memset(_read, 0, sizeof(_read));
+	co_await async_dma_copy(_read, _written, sizeof(_read));
+	if (memcmp(_read, _written, sizeof(_read)) != 0) _fail("word DMA copy");
+
+	// unaligned, a byte at a time
+	memset(_read, 0, sizeof(_read));
+	co_await async_dma_copy(_read + 1, _written + 3, 1001);
+	if (memcmp(_read + 1, _written + 3, 1001) != 0 || _read[0] != 0 || _read[1002] != 0) _fail("byte DMA copy");
+
+	uint64_t before = pico_host_stats()->bytes_clocked;
+	co_await async_spi_write(SPI_DEVICE_LCD, _written, 1000);
+	if (pico_host_stats()->bytes_clocked - before != 1000) _fail("bytes clocked by async_spi_write");
+	if (spi_bus_owner() != SPI_DEVICE_NONE) _fail("bus left taken after async_spi_write");
+
+	// while the transfer is on the bus, the same device's blocking drawing
+	// mustn't nest into its transaction and write alongside the DMA
+	pico_host_hold_dma(true);
+	AsyncDma write = async_spi_write(SPI_DEVICE_LCD, _written, 100);
+	if (spi_bus_owner() != SPI_DEVICE_LCD) _fail("async_spi_write didn't take the bus");
+	if (spi_bus_try_begin(SPI_DEVICE_LCD)) {
+		_fail("transaction nested into a DMA transfer");
+		spi_bus_end(SPI_DEVICE_LCD);
+	}
+	pico_host_hold_dma(false);
+	spi_bus_begin(SPI_DEVICE_LCD);
+	if (!write.done()) _fail("blocking transaction started before the DMA transfer finished");
+	spi_bus_end(SPI_DEVICE_LCD);
+	co_await write;
+	if (spi_bus_owner() != SPI_DEVICE_NONE) _fail("bus left taken after a blocking transaction");
+}
+
+// --- ORDERING ---
+
+static Async<> _yielder(char name) {
+	_log(name);
+	co_await async_yield();
+	_log((char)(name - 'a' + 'A'));
+}
+
+static Async<> _sleeper(char name, uint32_t us) {
+	co_await async_sleep(us);
+	_woken_us[name - 'x'] = time_us_32();
+	_log(name);
+}
+
+static Async<> _idle() {
+	co_await async_sleep(1000);
+}
+
+static Async<> _check_ordering() {
+	_order_length = 0;
+	uint32_t start = time_us_32();
+	async_spawn(_yielder('a'));
+	async_spawn(_yielder('b'));
+	async_spawn(_sleeper('z', 3000));
+	async_spawn(_sleeper('x', 1000));
+	async_spawn(_sleeper('y', 2000));
+	co_await async_sleep(5000);
+
+	// the yielders each run twice, one after the other, before any sleeper
+	// is due
+	_order[_order_length] = '\0';
+	if (strcmp(_order, "abABxyz") != 0) {
+		printf("order: %s\n", _order);
+		_fail("yields and sleeps resumed out of order");
+	}
+	for (uint32_t i = 0; i < 3; i++) {
+		if (_woken_us[i] - start < (i + 1) * 1000) _fail("sleeper resumed early");
+	}
+}
+
+static Async<> _check_frames() {
+	// frames in use now (this coroutine and _main's) aren't there for the
+	// spawned ones, the last few don't start
+	AsyncStats_t before;
+	async_stats(&before);
+	uint32_t started = 0;
+	for (uint32_t i = 0; i < ASYNC_FRAMES; i++) started += async_spawn(_idle());
+	AsyncStats_t during;
+	async_stats(&during);
+	if (started != ASYNC_FRAMES - before.frames) _fail("coroutines started");
+	if (during.failures != before.failures + ASYNC_FRAMES - started) _fail("coroutines without a frame counted");
+
+	co_await async_sleep(2000);
+	AsyncStats_t after;
+	async_stats(&after);
+	if (after.frames != before.frames) _fail("frames not given back");
+}
+
+static Async<> _main() {
+	bool sd = co_await _check_sd();
+	if (sd) co_await _check_dma();
+	co_await _check_ordering();
+	co_await _check_frames();
+	_finished = true;
+}
+
+static void _watchdog(Task_t* task) {
+	if (_finished || time_us_32() > TIMEOUT_US) {
+		if (!_finished) _fail("checks didn't finish");
+		async_dump();
+		printf("%s\n", _errors == 0 ? "all checks passed" : "CHECKS FAILED");
+		exit(_errors == 0 ? 0 : 1);
+	}
+	task_sleep(task, 1000);
+}
+
+int main(int argc, char** argv) {
+	if (argc != 2) {
+		fprintf(stderr, "usage: async_check IMAGE\nIMAGE is used as scratch space and overwritten.\n");
+		return 2;
+	}
+
+	SdModelConfig_t config;
+	sd_model_default_config(&config);
+	config.sectors = FIRST_SECTOR + SECTORS;
+	if (!sd_model_open(argv[1], &config)) {
+		fprintf(stderr, "cannot open %s\n", argv[1]);
+		return 1;
+	}
+
+	spi_bus_init();
+	if (!sd_init()) {
+		fprintf(stderr, "sd_init failed\n");
+		return 1;
+	}
+	sd_queue_init();
+
+	async_init();
+	if (!async_spawn(_main())) {
+		fprintf(stderr, "no frame for the checks\n");
+		return 1;
+	}
+	static Task_t watchdog;
+	task_start(&watchdog, "watchdog", _watchdog, nullptr);
+	sched_run();
+}
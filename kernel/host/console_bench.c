@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pico_host.h"
+#include "sd_model.h"
+#include "pins.h"
+#include "spi_bus.h"
+#include "sd_card.h"
+#include "sd_queue.h"
+#include "kernel_alloc.h"
+#include "graphics/lcd.h"
+
+#include "bench/suite.h"
+
+/*
+ * The firmware's benchmark suite (src/bench/suite.c) on the host, printing the
+ * same CSV. The LCD and SD tests run on the simulated SPI bus and card, so
+ * their times are simulated like sd_bench's and should come close to the
+ * device's; malloc, free and memcpy are timed with the host's clock, so
+ * those only compare with other runs on the same machine.
+ */
+
+#define HEAP_SIZE (256 * 1024)
+
+static uint8_t _heap[HEAP_SIZE] __attribute__((aligned(64)));
+
+// the kernel's drivers ask which core they're on, there's only the one here
+uint get_core_num() {
+	return 0;
+}
+
+/**
+ * Real nanoseconds, for the CPU-bound tests (time_us_64 is the simulated
+ * clock, which only moves with the SPI bus).
+ */
+uint32_t bench_ticks() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)((uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec);
+}
+
+uint32_t bench_ticks_hz() {
+	return 1000000000u;
+}
+
+static void _usage() {
+	fprintf(stderr,
+		"usage: console_bench [options] IMAGE\n"
+		"  --latency US  read access time per block (default 200)\n"
+		"  --no-sd       skip the SD tests\n"
+		"IMAGE is the simulated card, only read (created if missing).\n");
+}
+
+int main(int argc, char** argv) {
+	SdModelConfig_t config;
+	sd_model_default_config(&config);
+	const char* image = NULL;
+	bool sd = true;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--latency") == 0 && i + 1 < argc) {
+			config.read_latency_us = (uint32_t)strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--no-sd") == 0) {
+			sd = false;
+		} else if (argv[i][0] != '-' && image == NULL) {
+			image = argv[i];
+		} else {
+			_usage();
+			return 2;
+		}
+	}
+	if (image == NULL && sd) {
+		_usage();
+		return 2;
+	}
+
+	if (sd) {
+		config.sectors = BENCH_SD_FIRST_SECTOR + BENCH_SD_SECTORS;
+		if (!sd_model_open(image, &config)) {
+			fprintf(stderr, "cannot open %s\n", image);
+			return 1;
+		}
+	}
+
+	spi_bus_init();
+	pin_init(PIN_DC);
+	pin_init(PIN_RST);
+	lcd_init();
+	alloc_init(_heap, sizeof(_heap));
+
+	if (sd) {
+		sd = sd_init();
+		if (sd) {
+			sd_queue_init();
+		} else {
+			fprintf(stderr, "sd_init failed\n");
+		}
+	}
+
+	printf("# console_bench %u, host, %u runs per test, seed %08x\n", BENCH_VERSION, BENCH_RUNS, BENCH_SEED);
+	bool ok = bench_run(sd);
+	printf("# %s\n", ok ? "done" : "failed");
+
+	if (sd) sd_model_close();
+	return ok ? 0 : 1;
+}
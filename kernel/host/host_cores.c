@@ -0,0 +1,42 @@
+#include <time.h>
+#include <pthread.h>
+
+#include "pico/platform.h"
+#include "pico/multicore.h"
+
+// core the calling thread stands in for, core 0 unless it says otherwise
+static _Thread_local uint _core = 0;
+
+uint get_core_num() {
+	return _core;
+}
+
+void pico_host_set_core(uint core) {
+	_core = core;
+}
+
+// real time for the allocator's trace recorder (pico_host.c, for the storage
+// tools, has a simulated clock instead, so the two aren't linked together)
+uint32_t time_us_32() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint32_t)((uint64_t)now.tv_sec * 1000000u + (uint64_t)now.tv_nsec / 1000u);
+}
+
+uint64_t time_us_64() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000u + (uint64_t)now.tv_nsec / 1000u;
+}
+
+static void* _core1(void* entry) {
+	pico_host_set_core(1);
+	((void (*)(void))entry)();
+	return NULL;
+}
+
+void multicore_launch_core1(void (*entry)(void)) {
+	pthread_t thread;
+	pthread_create(&thread, NULL, _core1, (void*)entry);
+	pthread_detach(thread);
+}
@@ -0,0 +1,69 @@
+#ifndef HOST_HARDWARE_SPI_H
+#define HOST_HARDWARE_SPI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+	volatile uint32_t cr0;
+	volatile uint32_t cr1;
+	volatile uint32_t dr;
+	volatile uint32_t sr;
+	volatile uint32_t cpsr;
+	volatile uint32_t imsc;
+	volatile uint32_t ris;
+	volatile uint32_t mis;
+	volatile uint32_t icr;
+	volatile uint32_t dmacr;
+} spi_hw_t;
+
+#define SPI_SSPICR_RORIC_BITS 0x00000001
+
+typedef struct spi_inst spi_inst_t;
+
+extern spi_hw_t pico_host_spi0_hw;
+#define spi0 ((spi_inst_t*)&pico_host_spi0_hw)
+
+typedef enum { SPI_CPOL_0 = 0, SPI_CPOL_1 = 1 } spi_cpol_t;
+typedef enum { SPI_CPHA_0 = 0, SPI_CPHA_1 = 1 } spi_cpha_t;
+typedef enum { SPI_LSB_FIRST = 0, SPI_MSB_FIRST = 1 } spi_order_t;
+
+unsigned int spi_init(spi_inst_t* spi, unsigned int baudrate);
+unsigned int spi_set_baudrate(spi_inst_t* spi, unsigned int baudrate);
+unsigned int spi_get_baudrate(const spi_inst_t* spi);
+void spi_set_format(spi_inst_t* spi, unsigned int data_bits, spi_cpol_t cpol, spi_cpha_t cpha, spi_order_t order);
+
+int spi_write_blocking(spi_inst_t* spi, const uint8_t* src, size_t len);
+int spi_read_blocking(spi_inst_t* spi, uint8_t repeated_tx_data, uint8_t* dst, size_t len);
+int spi_write_read_blocking(spi_inst_t* spi, const uint8_t* src, uint8_t* dst, size_t len);
+
+static inline spi_hw_t* spi_get_hw(spi_inst_t* spi) {
+	return (spi_hw_t*)spi;
+}
+
+// transfers are synchronous, nothing is ever left shifting or unread
+static inline bool spi_is_busy(const spi_inst_t* spi) {
+	(void)spi;
+	return false;
+}
+
+static inline bool spi_is_readable(const spi_inst_t* spi) {
+	(void)spi;
+	return false;
+}
+
+static inline unsigned int spi_get_dreq(spi_inst_t* spi, bool is_tx) {
+	(void)spi;
+	return is_tx ? 24 : 25;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef HOST_HARDWARE_SYNC_H
+#define HOST_HARDWARE_SYNC_H
+
+#include <sched.h>
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// single threaded host, interrupts only ever run synchronously
+static inline uint32_t save_and_disable_interrupts() {
+	return 0;
+}
+
+static inline void restore_interrupts(uint32_t status) {
+	(void)status;
+}
+
+// threads standing in for cores (host_cores.c) have no events to sleep on,
+// waiting is giving up the CPU
+static inline void __wfe() {
+	sched_yield();
+}
+
+static inline void __sev() {
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef HOST_PICO_MULTICORE_H
+#define HOST_PICO_MULTICORE_H
+
+/*
+ * Host stand-in for launching core 1: a thread that says it's core 1 (see
+ * pico/platform.h) and runs `entry`, which never returns.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void multicore_launch_core1(void (*entry)(void));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
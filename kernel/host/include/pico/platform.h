@@ -0,0 +1,31 @@
+#ifndef HOST_PICO_PLATFORM_H
+#define HOST_PICO_PLATFORM_H
+
+/*
+ * Host stand-in for the core and exception queries the allocator uses.
+ * Threads play the cores: each one says which core it is with
+ * pico_host_set_core() (host_cores.c). Nothing runs in an exception.
+ */
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint get_core_num();
+void pico_host_set_core(uint core);
+
+// no scratch banks, hot state stays where it is
+#define __scratch_x(group)
+#define __scratch_y(group)
+
+static inline uint __get_current_exception() {
+	return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
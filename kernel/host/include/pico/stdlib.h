@@ -0,0 +1,42 @@
+#ifndef HOST_PICO_STDLIB_H
+#define HOST_PICO_STDLIB_H
+
+/*
+ * Host stand-in for the parts of the Pico SDK the kernel's storage code uses.
+ * Time is simulated (see pico_host.h): it only moves when bytes are clocked
+ * over SPI, when code sleeps, or when it spins in tight_loop_contents().
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+typedef unsigned int uint;
+
+#include "hardware/gpio.h"
+#include "hardware/spi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void sleep_us(uint64_t us);
+void sleep_ms(uint32_t ms);
+uint32_t time_us_32();
+uint64_t time_us_64();
+void tight_loop_contents();
+
+// an idle core sleeping until a deadline: nothing interrupts it on the host,
+// so the clock moves straight to the deadline
+typedef uint64_t absolute_time_t;
+absolute_time_t make_timeout_time_us(uint64_t us);
+bool best_effort_wfe_or_timeout(absolute_time_t timeout);
+
+void stdio_init_all();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
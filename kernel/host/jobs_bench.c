@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "pico/platform.h"
+#include "jobs.h"
+
+/*
+ * The kernel's job system (jobs.c) on threads standing in for the two
+ * cores. First the checks: every item of a parallel_for is run exactly
+ * once, follow-up jobs only start once all the jobs before them are done,
+ * even when they finish as job_then is called, and jobs submitting more jobs
+ * from either core all get run. Then the same
+ * CPU-bound work (CRC32 of a buffer, and drawing bands of a frame) is timed
+ * on core 0 alone and with core 1 stealing, reporting the speedup, the
+ * steals and how busy each core was. Scaling needs a host with at least two
+ * CPUs.
+ */
+
+#define ITEMS        100000
+#define CHAIN_JOBS   64
+#define RACE_JOBS    4
+#define SPAWN_DEPTH  6
+#define SPAWN_FANOUT 4
+#define CRC_BYTES    (8 * 1024 * 1024)
+#define CRC_BLOCK    4096
+#define FRAME_WIDTH  240
+#define FRAME_HEIGHT 320
+#define BAND_ROWS    16
+#define FRAMES       200
+
+static _Atomic uint32_t _errors = 0;
+
+static void _fail(const char* what) {
+	if (atomic_fetch_add(&_errors, 1) < 10) printf("FAILED: %s\n", what);
+}
+
+static double _seconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// --- checks ---
+
+static _Atomic uint8_t _visits[ITEMS];
+
+static void _visit(void* data, uint32_t start, uint32_t end) {
+	(void)data;
+	for (uint32_t i = start; i < end; i++) atomic_fetch_add(&_visits[i], 1);
+}
+
+// every item once, whatever the batch size
+static void _check_parallel_for() {
+	const uint32_t batches[] = { 1, 7, 64, 1000, ITEMS, ITEMS * 2 };
+	for (uint32_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+		for (uint32_t i = 0; i < ITEMS; i++) atomic_store(&_visits[i], 0);
+		job_parallel_for(_visit, NULL, ITEMS, batches[b]);
+		for (uint32_t i = 0; i < ITEMS; i++) {
+			if (atomic_load(&_visits[i]) != 1) {
+				_fail("parallel_for missed or repeated an item");
+				break;
+			}
+		}
+	}
+}
+
+typedef struct Chain {
+	_Atomic uint32_t first_done;
+	_Atomic uint32_t second_runs;
+	_Atomic uint32_t second_saw;
+	_Atomic uint32_t third_saw;
+} Chain_t;
+
+static void _first(void* data, uint32_t start, uint32_t end) {
+	(void)start;
+	(void)end;
+	Chain_t* chain = data;
+	// a bit of work so the other core gets some of these
+	volatile uint32_t spin = 0;
+	for (uint32_t i = 0; i < 2000; i++) spin += i;
+	atomic_fetch_add(&chain->first_done, 1);
+}
+
+static void _second(void* data, uint32_t start, uint32_t end) {
+	(void)start;
+	(void)end;
+	Chain_t* chain = data;
+	atomic_store(&chain->second_saw, atomic_load(&chain->first_done));
+	atomic_fetch_add(&chain->second_runs, 1);
+}
+
+static void _third(void* data, uint32_t start, uint32_t end) {
+	(void)start;
+	(void)end;
+	Chain_t* chain = data;
+	atomic_store(&chain->third_saw, atomic_load(&chain->second_runs));
+}
+
+// first jobs -> second (job_then) -> third (job_then), waited on through the
+// last counter only
+static void _check_dependencies(uint32_t rounds) {
+	for (uint32_t round = 0; round < rounds; round++) {
+		Chain_t chain = { 0 };
+		JobCounter_t first, second, third;
+		job_counter_init(&first);
+		job_counter_init(&second);
+		job_counter_init(&third);
+
+		for (uint32_t i = 0; i < CHAIN_JOBS; i++) job_submit(_first, &chain, 0, 1, &first);
+		job_then(&first, _second, &chain, 0, 1, &second);
+		job_then(&second, _third, &chain, 0, 1, &third);
+		job_wait(&third);
+
+		if (atomic_load(&chain.second_saw) != CHAIN_JOBS) _fail("follow-up job ran before the jobs it follows");
+		if (atomic_load(&chain.third_saw) != 1) _fail("second follow-up ran before the first");
+		if (atomic_load(&first.pending) != 0 || atomic_load(&second.pending) != 0) _fail("counter left pending");
+	}
+}
+
+typedef struct Race {
+	_Atomic uint32_t ready;
+	_Atomic bool go;
+	_Atomic uint32_t then_runs;
+} Race_t;
+
+static void _gated(void* data, uint32_t start, uint32_t end) {
+	(void)start;
+	(void)end;
+	Race_t* race = data;
+	atomic_fetch_add(&race->ready, 1);
+	while (!atomic_load(&race->go)) {}
+}
+
+static void _race_then(void* data, uint32_t start, uint32_t end) {
+	(void)start;
+	(void)end;
+	Race_t* race = data;
+	atomic_fetch_add(&race->then_runs, 1);
+}
+
+// jobs finishing on both cores just as job_then adds the follow-up: it must
+// run once, and both counters reach zero (a lost follow-up would leave
+// job_wait spinning, so the wait gives up after a second)
+static void _check_racing_then(uint32_t rounds) {
+	for (uint32_t round = 0; round < rounds; round++) {
+		static Race_t race;
+		static JobCounter_t jobs, then;
+		atomic_store(&race.ready, 0);
+		atomic_store(&race.go, false);
+		atomic_store(&race.then_runs, 0);
+		job_counter_init(&jobs);
+		job_counter_init(&then);
+
+		for (uint32_t i = 0; i < RACE_JOBS; i++) job_submit(_gated, &race, 0, 1, &jobs);
+		// once core 1 has stolen one, open the gate as the follow-up goes in;
+		// core 0 runs the rest while core 1 finishes its own
+		while (atomic_load(&race.ready) == 0) {}
+		atomic_store(&race.go, true);
+		job_then(&jobs, _race_then, &race, 0, 1, &then);
+
+		double deadline = _seconds() + 1.0;
+		while (atomic_load(&then.pending) != 0 && _seconds() < deadline) job_run_one();
+		if (atomic_load(&then.pending) != 0) {
+			_fail("follow-up job lost when jobs finished during job_then");
+			return;
+		}
+		if (atomic_load(&race.then_runs) != 1) _fail("follow-up job not run exactly once");
+		if (atomic_load(&jobs.pending) != 0) _fail("counter left pending");
+	}
+}
+
+typedef struct Spawn {
+	JobCounter_t counter;
+	_Atomic uint32_t runs;
+} Spawn_t;
+
+// each job submits SPAWN_FANOUT more until SPAWN_DEPTH, from whichever
+// core it runs on
+static void _spawn(void* data, uint32_t depth, uint32_t end) {
+	(void)end;
+	Spawn_t* spawn = data;
+	atomic_fetch_add(&spawn->runs, 1);
+	if (depth == SPAWN_DEPTH) return;
+	for (uint32_t i = 0; i < SPAWN_FANOUT; i++) job_submit(_spawn, spawn, depth + 1, 0, &spawn->counter);
+}
+
+static void _check_spawning(uint32_t rounds) {
+	uint32_t expected = 0;
+	for (uint32_t d = 0, n = 1; d <= SPAWN_DEPTH; d++, n *= SPAWN_FANOUT) expected += n;
+
+	for (uint32_t round = 0; round < rounds; round++) {
+		Spawn_t spawn = { 0 };
+		job_counter_init(&spawn.counter);
+		job_submit(_spawn, &spawn, 0, 0, &spawn.counter);
+		job_wait(&spawn.counter);
+		if (atomic_load(&spawn.runs) != expected) _fail("jobs submitted by jobs went missing");
+	}
+}
+
+static void _checks(const char* label, uint32_t rounds, bool stealing) {
+	uint32_t errors = atomic_load(&_errors);
+	_check_parallel_for();
+	_check_dependencies(rounds);
+	// needs core 1 to take one of the jobs
+	if (stealing) _check_racing_then(rounds);
+	_check_spawning(rounds);
+	printf("checks (%s): %s\n", label, atomic_load(&_errors) == errors ? "ok" : "FAILED");
+}
+
+// --- workloads ---
+
+static uint8_t* _buffer;
+static uint32_t _crcs[CRC_BYTES / CRC_BLOCK];
+static uint16_t _frame[FRAME_WIDTH * FRAME_HEIGHT];
+static uint32_t _crc_table[256];
+
+static void _crc_blocks(void* data, uint32_t start, uint32_t end) {
+	(void)data;
+	for (uint32_t block = start; block < end; block++) {
+		const uint8_t* bytes = _buffer + (size_t)block * CRC_BLOCK;
+		uint32_t crc = 0xFFFFFFFFu;
+		for (uint32_t i = 0; i < CRC_BLOCK; i++) crc = _crc_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+		_crcs[block] = ~crc;
+	}
+}
+
+// a band of a frame with a gradient and some circles, per pixel
+static void _draw_bands(void* data, uint32_t start, uint32_t end) {
+	uint32_t frame = *(uint32_t*)data;
+	for (uint32_t band = start; band < end; band++) {
+		for (uint32_t y = band * BAND_ROWS; y < (band + 1) * BAND_ROWS && y < FRAME_HEIGHT; y++) {
+			for (uint32_t x = 0; x < FRAME_WIDTH; x++) {
+				int32_t dx = (int32_t)x - 120 - (int32_t)(frame % 40);
+				int32_t dy = (int32_t)y - 160;
+				uint32_t d = (uint32_t)(dx * dx + dy * dy);
+				uint16_t colour = (uint16_t)(((x >> 3) << 11) | ((y >> 2) << 5) | (d >> 10 & 0x1F));
+				if (d % 997 < 300) colour = ~colour;
+				_frame[y * FRAME_WIDTH + x] = colour;
+			}
+		}
+	}
+}
+
+static uint32_t _checksum() {
+	uint32_t sum = 0;
+	for (uint32_t i = 0; i < CRC_BYTES / CRC_BLOCK; i++) sum = sum * 31 + _crcs[i];
+	for (uint32_t i = 0; i < FRAME_WIDTH * FRAME_HEIGHT; i++) sum = sum * 31 + _frame[i];
+	return sum;
+}
+
+typedef struct Times {
+	double crc;
+	double draw;
+} Times_t;
+
+static Times_t _workloads() {
+	Times_t times;
+
+	double start = _seconds();
+	for (uint32_t pass = 0; pass < 4; pass++) job_parallel_for(_crc_blocks, NULL, CRC_BYTES / CRC_BLOCK, 4);
+	times.crc = _seconds() - start;
+
+	start = _seconds();
+	for (uint32_t frame = 0; frame < FRAMES; frame++) {
+		job_parallel_for(_draw_bands, &frame, (FRAME_HEIGHT + BAND_ROWS - 1) / BAND_ROWS, 1);
+	}
+	times.draw = _seconds() - start;
+	return times;
+}
+
+int main(int argc, char** argv) {
+	uint32_t rounds = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 10) : 200;
+
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++) crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+		_crc_table[i] = crc;
+	}
+	_buffer = malloc(CRC_BYTES);
+	if (_buffer == NULL) return 1;
+	uint32_t seed = 12345;
+	for (uint32_t i = 0; i < CRC_BYTES; i++) {
+		seed = seed * 1103515245u + 12345u;
+		_buffer[i] = (uint8_t)(seed >> 16);
+	}
+
+	// core 0 on its own: nobody steals, job_wait runs everything
+	_checks("core 0 only", rounds / 10 + 1, false);
+	Times_t alone = _workloads();
+	uint32_t alone_sum = _checksum();
+
+	jobs_init();
+	_checks("both cores", rounds, true);
+	JobStats_t before[JOB_CORES];
+	for (uint32_t core = 0; core < JOB_CORES; core++) jobs_stats(core, &before[core]);
+	Times_t both = _workloads();
+	if (_checksum() != alone_sum) _fail("results differ between one and two cores");
+
+	printf("\n%-10s %12s %12s %8s\n", "workload", "core 0 (ms)", "both (ms)", "speedup");
+	printf("%-10s %12.1f %12.1f %7.2fx\n", "crc32", alone.crc * 1e3, both.crc * 1e3, alone.crc / both.crc);
+	printf("%-10s %12.1f %12.1f %7.2fx\n", "bands", alone.draw * 1e3, both.draw * 1e3, alone.draw / both.draw);
+
+	printf("\nduring the timed runs:\n");
+	double elapsed_us = (both.crc + both.draw) * 1e6;
+	for (uint32_t core = 0; core < JOB_CORES; core++) {
+		JobStats_t stats;
+		jobs_stats(core, &stats);
+		printf("  core %lu: %8lu jobs, %8lu stolen, busy %.1f%%\n", (unsigned long)core,
+			(unsigned long)(stats.jobs - before[core].jobs), (unsigned long)(stats.stolen - before[core].stolen),
+			100.0 * (double)(stats.busy_us - before[core].busy_us) / elapsed_us);
+	}
+
+	uint32_t errors = atomic_load(&_errors);
+	printf("\n%s\n", errors == 0 ? "all checks passed" : "CHECKS FAILED");
+	return errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,29 @@
+#ifndef HOST_KERNEL_ALLOC_H
+#define HOST_KERNEL_ALLOC_H
+
+#include <stdint.h>
+
+// the pool and arena APIs don't clash with anything on the host
+#include "pool.h"
+#include "arena.h"
+
+/*
+ * The kernel allocator built for the host. Its malloc/free/realloc/calloc
+ * and memcpy/memmove/memset are renamed with a kernel_ prefix (see
+ * CMakeLists.txt) so they don't replace the C library's.
+ */
+
+void alloc_init(uint8_t* heap_start, uintptr_t size);
+bool alloc_init_core(uint32_t core, uintptr_t size);
+void alloc_free();
+
+void* kernel_malloc(uintptr_t bytes);
+void* kernel_realloc(void* ptr, uintptr_t new_size);
+void* kernel_calloc(uintptr_t num, uintptr_t size);
+void kernel_free(void* ptr);
+
+void* kernel_memcpy(void* restrict dest, const void* restrict src, uintptr_t n);
+void* kernel_memmove(void* dest, const void* src, uintptr_t n);
+void* kernel_memset(void* dest, int value, uintptr_t n);
+
+#endif
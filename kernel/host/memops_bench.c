@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pico_host.h"
+#include "kernel_alloc.h"
+
+/*
+ * Checks the kernel's memcpy/memmove/memset against a byte by byte reference
+ * for every size up to CHECK_SIZES (and a few bigger ones around the block
+ * and DMA boundaries) at every source/destination alignment, with guard bytes
+ * either side. Then times them in host cycles per byte against the byte loops
+ * they replaced and the C library.
+ *
+ * The host build has no DMA and runs the C fallback of the LDM/STM blocks,
+ * so the timings show the word handling, not M33 numbers.
+ */
+
+#define CHECK_SIZES  160
+#define ALIGNMENTS   8
+#define GUARD        16
+#define BUFFER_SIZE  (16384 + 2 * GUARD + ALIGNMENTS)
+#define BENCH_BYTES  (8 * 1024 * 1024) // copied per size and implementation
+#define REPEATS      5
+
+static const uintptr_t _big_sizes[] = { 255, 256, 257, 1023, 1024, 1025, 1031, 4096, 4099 };
+
+static uint8_t _source[BUFFER_SIZE] __attribute__((aligned(64)));
+static uint8_t _actual[BUFFER_SIZE] __attribute__((aligned(64)));
+static uint8_t _expected[BUFFER_SIZE] __attribute__((aligned(64)));
+
+static uint32_t _failures = 0;
+static uint32_t _checks = 0;
+
+// the old byte loops, kept as they'd run on the M33: one byte at a time
+__attribute__((noinline, optimize("no-tree-loop-distribute-patterns", "no-tree-vectorize")))
+static void* _byte_memcpy(void* dest, const void* src, uintptr_t n) {
+	uint8_t* to = dest;
+	const uint8_t* from = src;
+	for (uintptr_t i = 0; i < n; i++) to[i] = from[i];
+	return dest;
+}
+
+__attribute__((noinline, optimize("no-tree-loop-distribute-patterns", "no-tree-vectorize")))
+static void* _byte_memset(void* dest, int value, uintptr_t n) {
+	uint8_t* to = dest;
+	for (uintptr_t i = 0; i < n; i++) to[i] = (uint8_t)value;
+	return dest;
+}
+
+__attribute__((noinline, optimize("no-tree-loop-distribute-patterns", "no-tree-vectorize")))
+static void _byte_memmove(uint8_t* dest, const uint8_t* src, uintptr_t n) {
+	if (dest < src) {
+		for (uintptr_t i = 0; i < n; i++) dest[i] = src[i];
+	} else {
+		for (uintptr_t i = n; i > 0; i--) dest[i - 1] = src[i - 1];
+	}
+}
+
+static void _fill_pattern(uint8_t* buffer, uintptr_t size, uint32_t seed) {
+	for (uintptr_t i = 0; i < size; i++) {
+		seed = seed * 1103515245 + 12345;
+		buffer[i] = (uint8_t)(seed >> 16);
+	}
+}
+
+static void _compare(const char* op, uintptr_t size, int dest_offset, int src_offset) {
+	_checks++;
+	if (memcmp(_actual, _expected, BUFFER_SIZE) == 0) return;
+
+	if (_failures++ < 10) {
+		uintptr_t at = 0;
+		while (_actual[at] == _expected[at]) at++;
+		printf("FAIL %s size %lu dest +%d src %+d: first difference at byte %ld of the destination\n",
+			op, (unsigned long)size, dest_offset, src_offset, (long)at - GUARD - dest_offset);
+	}
+}
+
+static void _check_size(uintptr_t size) {
+	for (int dest_offset = 0; dest_offset < ALIGNMENTS; dest_offset++) {
+		for (int src_offset = 0; src_offset < ALIGNMENTS; src_offset++) {
+			// separate buffers
+			_fill_pattern(_source, BUFFER_SIZE, size * 64 + src_offset);
+			_fill_pattern(_actual, BUFFER_SIZE, 7);
+			memcpy(_expected, _actual, BUFFER_SIZE);
+
+			uint8_t* dest = _actual + GUARD + dest_offset;
+			const uint8_t* src = _source + GUARD + src_offset;
+			if (kernel_memcpy(dest, src, size) != dest) printf("FAIL memcpy return value\n");
+			_byte_memcpy(_expected + GUARD + dest_offset, src, size);
+			_compare("memcpy", size, dest_offset, src_offset);
+
+			_fill_pattern(_actual, BUFFER_SIZE, 9);
+			memcpy(_expected, _actual, BUFFER_SIZE);
+			if (kernel_memmove(dest, src, size) != dest) printf("FAIL memmove return value\n");
+			_byte_memcpy(_expected + GUARD + dest_offset, src, size);
+			_compare("memmove", size, dest_offset, src_offset);
+
+			// overlapping, source up to ALIGNMENTS bytes either side of the destination
+			for (int shift = -ALIGNMENTS; shift <= ALIGNMENTS; shift++) {
+				_fill_pattern(_actual, BUFFER_SIZE, size + shift);
+				memcpy(_expected, _actual, BUFFER_SIZE);
+
+				uintptr_t base = GUARD + ALIGNMENTS + dest_offset;
+				if (base + shift + size + GUARD > BUFFER_SIZE) continue;
+				kernel_memmove(_actual + base, _actual + base + shift, size);
+				_byte_memmove(_expected + base, _expected + base + shift, size);
+				_compare("memmove overlap", size, dest_offset, shift);
+			}
+		}
+
+		static const int values[] = { 0, 0xA5, 0xFF, 0x1C3 };
+		for (int v = 0; v < 4; v++) {
+			_fill_pattern(_actual, BUFFER_SIZE, 11);
+			memcpy(_expected, _actual, BUFFER_SIZE);
+			uint8_t* dest = _actual + GUARD + dest_offset;
+			if (kernel_memset(dest, values[v], size) != dest) printf("FAIL memset return value\n");
+			_byte_memset(_expected + GUARD + dest_offset, values[v], size);
+			_compare("memset", size, dest_offset, 0);
+		}
+	}
+}
+
+typedef void* (*Copy_t)(void* dest, const void* src, uintptr_t n);
+typedef void* (*Fill_t)(void* dest, int value, uintptr_t n);
+
+static double _time_copy(Copy_t copy, uintptr_t size, int offset) {
+	uint64_t best = UINT64_MAX;
+	uint32_t rounds = BENCH_BYTES / size;
+
+	for (int r = 0; r < REPEATS; r++) {
+		uint64_t start = pico_host_cycles();
+		for (uint32_t i = 0; i < rounds; i++) {
+			copy(_actual + GUARD, _source + GUARD + offset, size);
+			__asm__ volatile ("" ::: "memory");
+		}
+		uint64_t cycles = pico_host_cycles() - start;
+		if (cycles < best) best = cycles;
+	}
+
+	return (double)best / ((uint64_t)rounds * size);
+}
+
+static double _time_fill(Fill_t fill, uintptr_t size, int offset) {
+	uint64_t best = UINT64_MAX;
+	uint32_t rounds = BENCH_BYTES / size;
+
+	for (int r = 0; r < REPEATS; r++) {
+		uint64_t start = pico_host_cycles();
+		for (uint32_t i = 0; i < rounds; i++) {
+			fill(_actual + GUARD + offset, 0x5A, size);
+			__asm__ volatile ("" ::: "memory");
+		}
+		uint64_t cycles = pico_host_cycles() - start;
+		if (cycles < best) best = cycles;
+	}
+
+	return (double)best / ((uint64_t)rounds * size);
+}
+
+static void* _libc_memcpy(void* dest, const void* src, uintptr_t n) {
+	return memcpy(dest, src, n);
+}
+
+static void* _libc_memset(void* dest, int value, uintptr_t n) {
+	return memset(dest, value, n);
+}
+
+int main(int argc, char** argv) {
+	bool check_only = argc > 1 && strcmp(argv[1], "--check") == 0;
+
+	for (uintptr_t size = 0; size <= CHECK_SIZES; size++) _check_size(size);
+	for (size_t i = 0; i < sizeof(_big_sizes) / sizeof(_big_sizes[0]); i++) _check_size(_big_sizes[i]);
+
+	printf("%u checks, %u failed\n", _checks, _failures);
+	if (_failures > 0) return 1;
+	if (check_only) return 0;
+
+	static const uintptr_t sizes[] = { 16, 64, 256, 1024, 4096, 16384 };
+
+	printf("\ncycles per byte\n");
+	printf("%-7s %6s %-10s %8s %8s %8s\n", "op", "size", "alignment", "bytes", "kernel", "libc");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (int offset = 0; offset < 2; offset++) {
+			const char* alignment = offset ? "src +1" : "aligned";
+			printf("%-7s %6lu %-10s %8.3f %8.3f %8.3f\n", "memcpy", (unsigned long)sizes[i], alignment,
+				_time_copy(_byte_memcpy, sizes[i], offset),
+				_time_copy(kernel_memcpy, sizes[i], offset),
+				_time_copy(_libc_memcpy, sizes[i], offset));
+		}
+		for (int offset = 0; offset < 2; offset++) {
+			const char* alignment = offset ? "dest +1" : "aligned";
+			printf("%-7s %6lu %-10s %8.3f %8.3f %8.3f\n", "memset", (unsigned long)sizes[i], alignment,
+				_time_fill(_byte_memset, sizes[i], offset),
+				_time_fill(kernel_memset, sizes[i], offset),
+				_time_fill(_libc_memset, sizes[i], offset));
+		}
+	}
+
+	return 0;
+}
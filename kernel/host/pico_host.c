@@ -0,0 +1,495 @@
+#include "pico_host.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+
+/*
+ * Host implementation of the SDK shim in include/: GPIO levels, one SPI
+ * peripheral whose bytes are exchanged with the device behind whichever chip
+ * select is low, synchronous DMA and synchronous interrupts (DMA_IRQ_0 and
+ * DMA_IRQ_1), all on a simulated clock.
+ */
+
+#define HOST_GPIO_COUNT    48
+#define HOST_SPI_DEVICES   4
+#define HOST_IRQ_HANDLERS  4
+#define HOST_SPIN_NS       7 // one cycle at 150 MHz
+
+typedef struct HostSpiDevice {
+	unsigned int cs_pin;
+	PicoHostSpiExchange_t exchange;
+	PicoHostSpiSelect_t select;
+} HostSpiDevice_t;
+
+typedef struct HostDmaChannel {
+	bool claimed;
+	bool busy;
+	bool irq_enabled[2]; // DMA_IRQ_0, DMA_IRQ_1
+	bool irq_status[2];
+	dma_channel_config config;
+	volatile void* write_addr;
+	const volatile void* read_addr;
+	uint32_t count;
+} HostDmaChannel_t;
+
+// dma_channel_config.ctrl bits
+#define HOST_DMA_SIZE_MASK  0x3
+#define HOST_DMA_READ_INC   0x4
+#define HOST_DMA_WRITE_INC  0x8
+#define HOST_DMA_SNIFF      0x10
+
+spi_hw_t pico_host_spi0_hw;
+
+static uint64_t _now_ns = 0;
+static PicoHostStats_t _stats;
+
+static bool _gpio[HOST_GPIO_COUNT];
+static HostSpiDevice_t _spi_devices[HOST_SPI_DEVICES];
+static uint32_t _spi_devices_count = 0;
+static uint32_t _baudrate = 0;
+
+static HostDmaChannel_t _dma[NUM_DMA_CHANNELS];
+static bool _sniff_enabled = false;
+static uint32_t _sniff_channel = 0;
+static uint32_t _sniff_mode = 0;
+static uint32_t _sniff_accumulator = 0;
+
+static irq_handler_t _dma_irq_handlers[2][HOST_IRQ_HANDLERS];
+static uint32_t _dma_irq_handlers_count[2] = { 0 };
+static bool _dma_irq_enabled[2] = { false };
+static bool _in_irq = false;
+static bool _dma_held = false;
+
+// --- TIME ---
+
+uint64_t pico_host_time_ns() {
+	return _now_ns;
+}
+
+void pico_host_advance_ns(uint64_t ns) {
+	_now_ns += ns;
+}
+
+void sleep_us(uint64_t us) {
+	_now_ns += us * 1000;
+	_stats.sleep_ns += us * 1000;
+}
+
+void sleep_ms(uint32_t ms) {
+	sleep_us((uint64_t)ms * 1000);
+}
+
+uint32_t time_us_32() {
+	return (uint32_t)(_now_ns / 1000);
+}
+
+uint64_t time_us_64() {
+	return _now_ns / 1000;
+}
+
+absolute_time_t make_timeout_time_us(uint64_t us) {
+	return time_us_64() + us;
+}
+
+bool best_effort_wfe_or_timeout(absolute_time_t timeout) {
+	uint64_t now = time_us_64();
+	if (timeout > now) sleep_us(timeout - now);
+	return true;
+}
+
+void tight_loop_contents() {
+	_now_ns += HOST_SPIN_NS;
+	_stats.spin_ns += HOST_SPIN_NS;
+}
+
+void stdio_init_all() {}
+
+const PicoHostStats_t* pico_host_stats() {
+	return &_stats;
+}
+
+void pico_host_reset_stats() {
+	_stats = (PicoHostStats_t){ 0 };
+}
+
+// --- GPIO ---
+
+void pico_host_attach_spi(unsigned int cs_pin, PicoHostSpiExchange_t exchange, PicoHostSpiSelect_t select) {
+	if (_spi_devices_count == HOST_SPI_DEVICES) abort();
+	_spi_devices[_spi_devices_count++] = (HostSpiDevice_t){ cs_pin, exchange, select };
+}
+
+void gpio_init(unsigned int gpio) {
+	_gpio[gpio] = false;
+}
+
+void gpio_set_dir(unsigned int gpio, bool out) {
+	(void)gpio;
+	(void)out;
+}
+
+void gpio_set_function(unsigned int gpio, enum gpio_function function) {
+	(void)gpio;
+	(void)function;
+}
+
+void gpio_pull_up(unsigned int gpio) {
+	_gpio[gpio] = true;
+}
+
+void gpio_put(unsigned int gpio, bool value) {
+	bool changed = _gpio[gpio] != value;
+	_gpio[gpio] = value;
+	if (!changed) return;
+
+	for (uint32_t i = 0; i < _spi_devices_count; i++) {
+		if (_spi_devices[i].cs_pin == gpio && _spi_devices[i].select != NULL) {
+			_spi_devices[i].select(!value);
+		}
+	}
+}
+
+bool gpio_get(unsigned int gpio) {
+	return _gpio[gpio];
+}
+
+// --- SPI ---
+
+/**
+ * Clock one byte: the selected device (if any) sees `mosi` and answers,
+ * an undriven MISO reads back as 0xFF (pull-up).
+ */
+static uint8_t _spi_exchange(uint8_t mosi) {
+	uint8_t miso = 0xFF;
+	for (uint32_t i = 0; i < _spi_devices_count; i++) {
+		if (!_gpio[_spi_devices[i].cs_pin]) {
+			miso &= _spi_devices[i].exchange(mosi);
+		}
+	}
+
+	_stats.bytes_clocked++;
+	_now_ns += 8000000000ull / (_baudrate != 0 ? _baudrate : 1000000);
+	return miso;
+}
+
+unsigned int spi_set_baudrate(spi_inst_t* spi, unsigned int baudrate) {
+	(void)spi;
+
+	// same divider search as the SDK, so simulated transfer times match the real clock
+	uint32_t prescale;
+	uint32_t postdiv;
+	for (prescale = 2; prescale <= 254; prescale += 2) {
+		if (PICO_HOST_CLK_PERI_HZ < prescale * 256 * (uint64_t)baudrate) break;
+	}
+	for (postdiv = 256; postdiv > 1; --postdiv) {
+		if (PICO_HOST_CLK_PERI_HZ / (prescale * (postdiv - 1)) > baudrate) break;
+	}
+
+	_baudrate = PICO_HOST_CLK_PERI_HZ / (prescale * postdiv);
+	_stats.baud_changes++;
+	return _baudrate;
+}
+
+unsigned int spi_init(spi_inst_t* spi, unsigned int baudrate) {
+	return spi_set_baudrate(spi, baudrate);
+}
+
+unsigned int spi_get_baudrate(const spi_inst_t* spi) {
+	(void)spi;
+	return _baudrate;
+}
+
+void spi_set_format(spi_inst_t* spi, unsigned int data_bits, spi_cpol_t cpol, spi_cpha_t cpha, spi_order_t order) {
+	(void)spi;
+	(void)data_bits;
+	(void)cpol;
+	(void)cpha;
+	(void)order;
+}
+
+int spi_write_blocking(spi_inst_t* spi, const uint8_t* src, size_t len) {
+	(void)spi;
+	_stats.spi_calls++;
+	for (size_t i = 0; i < len; i++) _spi_exchange(src[i]);
+	return (int)len;
+}
+
+int spi_read_blocking(spi_inst_t* spi, uint8_t repeated_tx_data, uint8_t* dst, size_t len) {
+	(void)spi;
+	_stats.spi_calls++;
+	for (size_t i = 0; i < len; i++) dst[i] = _spi_exchange(repeated_tx_data);
+	return (int)len;
+}
+
+int spi_write_read_blocking(spi_inst_t* spi, const uint8_t* src, uint8_t* dst, size_t len) {
+	(void)spi;
+	_stats.spi_calls++;
+	for (size_t i = 0; i < len; i++) dst[i] = _spi_exchange(src[i]);
+	return (int)len;
+}
+
+// --- DMA ---
+
+int dma_claim_unused_channel(bool required) {
+	for (int channel = 0; channel < NUM_DMA_CHANNELS; channel++) {
+		if (!_dma[channel].claimed) {
+			_dma[channel].claimed = true;
+			return channel;
+		}
+	}
+	if (required) abort();
+	return -1;
+}
+
+void dma_channel_unclaim(uint channel) {
+	_dma[channel].claimed = false;
+}
+
+dma_channel_config dma_channel_get_default_config(uint channel) {
+	(void)channel;
+	return (dma_channel_config){ DMA_SIZE_32 | HOST_DMA_READ_INC };
+}
+
+static void _set_bit(dma_channel_config* c, uint32_t bit, bool set) {
+	c->ctrl = set ? (c->ctrl | bit) : (c->ctrl & ~bit);
+}
+
+void channel_config_set_transfer_data_size(dma_channel_config* c, enum dma_channel_transfer_size size) {
+	c->ctrl = (c->ctrl & ~HOST_DMA_SIZE_MASK) | size;
+}
+
+void channel_config_set_read_increment(dma_channel_config* c, bool incr) {
+	_set_bit(c, HOST_DMA_READ_INC, incr);
+}
+
+void channel_config_set_write_increment(dma_channel_config* c, bool incr) {
+	_set_bit(c, HOST_DMA_WRITE_INC, incr);
+}
+
+void channel_config_set_dreq(dma_channel_config* c, uint dreq) {
+	(void)c;
+	(void)dreq;
+}
+
+void channel_config_set_sniff_enable(dma_channel_config* c, bool sniff_enable) {
+	_set_bit(c, HOST_DMA_SNIFF, sniff_enable);
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config* config, volatile void* write_addr,
+		const volatile void* read_addr, uint transfer_count, bool trigger) {
+	HostDmaChannel_t* dma = &_dma[channel];
+	dma->config = *config;
+	dma->write_addr = write_addr;
+	dma->read_addr = read_addr;
+	dma->count = transfer_count;
+	if (trigger) dma_channel_start(channel);
+}
+
+static void _sniff(uint32_t channel, uint8_t byte) {
+	if (!_sniff_enabled || _sniff_channel != channel) return;
+	if (!(_dma[channel].config.ctrl & HOST_DMA_SNIFF)) return;
+	if (_sniff_mode != DMA_SNIFF_CTRL_CALC_VALUE_CRC16) return;
+
+	// CRC-16-CCITT, MSB first
+	uint16_t crc = (uint16_t)_sniff_accumulator ^ ((uint16_t)byte << 8);
+	for (int bit = 0; bit < 8; bit++) {
+		crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+	}
+	_sniff_accumulator = crc;
+}
+
+static bool _is_spi_dr(const volatile void* address) {
+	return address == &pico_host_spi0_hw.dr;
+}
+
+/**
+ * Run a TX/RX channel pair on the SPI data register to completion, one byte
+ * exchange per element. The sniffer sees the bytes its channel moved.
+ */
+static void _run_spi_pair(int tx, int rx) {
+	uint32_t count = tx >= 0 ? _dma[tx].count : _dma[rx].count;
+	const volatile uint8_t* src = tx >= 0 ? _dma[tx].read_addr : NULL;
+	volatile uint8_t* dst = rx >= 0 ? _dma[rx].write_addr : NULL;
+
+	for (uint32_t i = 0; i < count; i++) {
+		uint8_t out = 0xFF;
+		if (src != NULL) {
+			out = (_dma[tx].config.ctrl & HOST_DMA_READ_INC) ? src[i] : src[0];
+			_sniff(tx, out);
+		}
+
+		uint8_t in = _spi_exchange(out);
+
+		if (dst != NULL) {
+			if (_dma[rx].config.ctrl & HOST_DMA_WRITE_INC) {
+				dst[i] = in;
+			} else {
+				dst[0] = in;
+			}
+			_sniff(rx, in);
+		}
+	}
+}
+
+static void _run_memory(int channel) {
+	HostDmaChannel_t* dma = &_dma[channel];
+	uint32_t size = 1u << (dma->config.ctrl & HOST_DMA_SIZE_MASK);
+	const volatile uint8_t* src = dma->read_addr;
+	volatile uint8_t* dst = dma->write_addr;
+
+	for (uint32_t i = 0; i < dma->count; i++) {
+		for (uint32_t b = 0; b < size; b++) dst[b] = src[b];
+		if (dma->config.ctrl & HOST_DMA_READ_INC) src += size;
+		if (dma->config.ctrl & HOST_DMA_WRITE_INC) dst += size;
+	}
+}
+
+static void _raise_irqs(uint32_t chan_mask) {
+	bool raised[2] = { false, false };
+	for (int channel = 0; channel < NUM_DMA_CHANNELS; channel++) {
+		if (!(chan_mask & (1u << channel))) continue;
+		for (int irq = 0; irq < 2; irq++) {
+			if (_dma[channel].irq_enabled[irq]) {
+				_dma[channel].irq_status[irq] = true;
+				raised[irq] = true;
+			}
+		}
+	}
+
+	// no nesting, like exceptions at the same priority
+	if (_in_irq) return;
+	_in_irq = true;
+	for (int irq = 0; irq < 2; irq++) {
+		if (!raised[irq] || !_dma_irq_enabled[irq]) continue;
+		for (uint32_t i = 0; i < _dma_irq_handlers_count[irq]; i++) {
+			_dma_irq_handlers[irq][i]();
+		}
+	}
+	_in_irq = false;
+}
+
+void dma_start_channel_mask(uint32_t chan_mask) {
+	_stats.dma_transfers++;
+
+	int tx = -1;
+	int rx = -1;
+	for (int channel = 0; channel < NUM_DMA_CHANNELS; channel++) {
+		if (!(chan_mask & (1u << channel))) continue;
+
+		if (_is_spi_dr(_dma[channel].write_addr)) {
+			tx = channel;
+		} else if (_is_spi_dr(_dma[channel].read_addr)) {
+			rx = channel;
+		} else {
+			_run_memory(channel);
+		}
+	}
+
+	if (tx >= 0 || rx >= 0) _run_spi_pair(tx, rx);
+
+	if (_dma_held) {
+		for (int channel = 0; channel < NUM_DMA_CHANNELS; channel++) {
+			if (chan_mask & (1u << channel)) _dma[channel].busy = true;
+		}
+		return;
+	}
+	_raise_irqs(chan_mask);
+}
+
+void pico_host_hold_dma(bool hold) {
+	_dma_held = hold;
+	if (hold) return;
+
+	uint32_t held = 0;
+	for (int channel = 0; channel < NUM_DMA_CHANNELS; channel++) {
+		if (!_dma[channel].busy) continue;
+		_dma[channel].busy = false;
+		held |= 1u << channel;
+	}
+	_raise_irqs(held);
+}
+
+void dma_channel_start(uint channel) {
+	dma_start_channel_mask(1u << channel);
+}
+
+bool dma_channel_is_busy(uint channel) {
+	return _dma[channel].busy;
+}
+
+void dma_channel_wait_for_finish_blocking(uint channel) {
+	(void)channel;
+}
+
+void dma_sniffer_enable(uint channel, uint mode, bool force_channel_enable) {
+	_sniff_enabled = true;
+	_sniff_channel = channel;
+	_sniff_mode = mode;
+	if (force_channel_enable) _set_bit(&_dma[channel].config, HOST_DMA_SNIFF, true);
+}
+
+void dma_sniffer_disable() {
+	_sniff_enabled = false;
+}
+
+void dma_sniffer_set_data_accumulator(uint32_t seed_value) {
+	_sniff_accumulator = seed_value;
+}
+
+uint32_t dma_sniffer_get_data_accumulator() {
+	return _sniff_accumulator;
+}
+
+void dma_channel_set_irq0_enabled(uint channel, bool enabled) {
+	_dma[channel].irq_enabled[0] = enabled;
+}
+
+bool dma_channel_get_irq0_status(uint channel) {
+	return _dma[channel].irq_status[0];
+}
+
+void dma_channel_acknowledge_irq0(uint channel) {
+	_dma[channel].irq_status[0] = false;
+}
+
+void dma_channel_set_irq1_enabled(uint channel, bool enabled) {
+	_dma[channel].irq_enabled[1] = enabled;
+}
+
+bool dma_channel_get_irq1_status(uint channel) {
+	return _dma[channel].irq_status[1];
+}
+
+void dma_channel_acknowledge_irq1(uint channel) {
+	_dma[channel].irq_status[1] = false;
+}
+
+// --- IRQ ---
+
+void irq_add_shared_handler(uint num, irq_handler_t handler, uint8_t order_priority) {
+	(void)order_priority;
+	if (num != DMA_IRQ_0 && num != DMA_IRQ_1) return;
+	uint irq = num - DMA_IRQ_0;
+
+	// drivers re-run their init after a (simulated) power cycle
+	for (uint32_t i = 0; i < _dma_irq_handlers_count[irq]; i++) {
+		if (_dma_irq_handlers[irq][i] == handler) return;
+	}
+	if (_dma_irq_handlers_count[irq] == HOST_IRQ_HANDLERS) abort();
+	_dma_irq_handlers[irq][_dma_irq_handlers_count[irq]++] = handler;
+}
+
+void irq_set_exclusive_handler(uint num, irq_handler_t handler) {
+	if (num != DMA_IRQ_0 && num != DMA_IRQ_1) return;
+	uint irq = num - DMA_IRQ_0;
+	_dma_irq_handlers[irq][0] = handler;
+	_dma_irq_handlers_count[irq] = 1;
+}
+
+void irq_set_enabled(uint num, bool enabled) {
+	if (num == DMA_IRQ_0 || num == DMA_IRQ_1) _dma_irq_enabled[num - DMA_IRQ_0] = enabled;
+}
@@ -0,0 +1,69 @@
+#ifndef HOST_PICO_HOST_H
+#define HOST_PICO_HOST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the SPI peripheral clock on the RP2350 (clk_peri at the default 150 MHz)
+#define PICO_HOST_CLK_PERI_HZ 150000000u
+
+// an SPI device attached behind a chip select
+typedef uint8_t (*PicoHostSpiExchange_t)(uint8_t mosi);
+typedef void (*PicoHostSpiSelect_t)(bool selected);
+
+typedef struct PicoHostStats {
+	uint64_t bytes_clocked;  // all SPI bytes, whoever was selected
+	uint64_t spi_calls;      // blocking SPI calls
+	uint64_t dma_transfers;  // started channel masks
+	uint64_t baud_changes;   // spi_set_baudrate calls
+	uint64_t spin_ns;        // simulated time spent in tight_loop_contents
+	uint64_t sleep_ns;       // simulated time spent sleeping
+} PicoHostStats_t;
+
+void pico_host_attach_spi(unsigned int cs_pin, PicoHostSpiExchange_t exchange, PicoHostSpiSelect_t select);
+
+uint64_t pico_host_time_ns();
+void pico_host_advance_ns(uint64_t ns);
+
+// DMA transfers still run when started, but while held their channels stay
+// busy and their interrupts wait for the release
+void pico_host_hold_dma(bool hold);
+
+const PicoHostStats_t* pico_host_stats();
+void pico_host_reset_stats();
+
+// the host's own clock for timing the CPU-bound benchmarks: the TSC on x86,
+// nanoseconds elsewhere, so only comparable between runs on one machine
+static inline uint64_t pico_host_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+// xorshift32, for the tools' workloads: the same sequence from the same seed
+// on every host
+static inline uint32_t pico_host_rand(uint32_t* state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
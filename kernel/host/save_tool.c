@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sd_model.h"
+#include "spi_bus.h"
+#include "sd_queue.h"
+#include "storage/save_store.h"
+
+/*
+ * Host tool for the save store: inspect/modify a save region inside a disk
+ * image, or run power-cut recovery loops against one. Runs the real SD
+ * driver and request queue against the simulated card.
+ */
+
+#define IMAGE_SECTORS (SAVE_STORE_FIRST_SECTOR + SAVE_STORE_SECTORS)
+
+#define CRASH_KEYS      24
+#define CRASH_VALUE_MAX 400
+
+typedef struct ModelEntry {
+	bool present;
+	uint16_t length;
+	uint8_t value[CRASH_VALUE_MAX];
+} ModelEntry_t;
+
+static ModelEntry_t _committed[CRASH_KEYS];
+static ModelEntry_t _next[CRASH_KEYS];
+
+static void _usage() {
+	fprintf(stderr,
+		"usage: save_tool IMAGE format\n"
+		"       save_tool IMAGE put KEY VALUE\n"
+		"       save_tool IMAGE get KEY\n"
+		"       save_tool IMAGE del KEY\n"
+		"       save_tool IMAGE list\n"
+		"       save_tool IMAGE stats\n"
+		"       save_tool IMAGE crash-loop ITERATIONS [SEED]\n"
+		"       save_tool IMAGE format-check\n");
+}
+
+static void _print_stats() {
+	SaveStoreStats_t stats;
+	save_store_get_stats(&stats);
+	printf("generation %u, sequence %u, keys %u, segment %u/%u sectors, "
+		"recovered %u batches%s\n",
+		stats.generation, stats.sequence, stats.keys, stats.used_sectors,
+		stats.segment_sectors, stats.recovered_batches,
+		stats.compacting ? ", compaction in progress" : "");
+}
+
+static void _key_name(char* out, int i) {
+	sprintf(out, "key%02d", i);
+}
+
+/**
+ * Compare the mounted store against a model.
+ *
+ * @returns `true` if every key matches.
+ */
+static bool _matches(const ModelEntry_t* model) {
+	uint8_t value[CRASH_VALUE_MAX];
+	uint32_t present = 0;
+
+	for (int i = 0; i < CRASH_KEYS; i++) {
+		char key[8];
+		_key_name(key, i);
+		int length = save_store_get(key, value, sizeof(value));
+
+		if (!model[i].present) {
+			if (length != SAVE_ERR_NOT_FOUND) return false;
+			continue;
+		}
+		present++;
+		if (length != model[i].length) return false;
+		if (memcmp(value, model[i].value, length) != 0) return false;
+	}
+
+	return save_store_key_count() == present;
+}
+
+/**
+ * Repeatedly commit random changes with a power cut scheduled at a random
+ * point, remount, and check the store holds either everything or nothing of
+ * the interrupted commit.
+ *
+ * @returns Process exit code.
+ */
+static int _crash_loop(uint32_t iterations, uint32_t seed) {
+	srand(seed);
+
+	if (save_store_format() != SAVE_OK) {
+		fprintf(stderr, "format failed\n");
+		return 1;
+	}
+	memset(_committed, 0, sizeof(_committed));
+	memset(_next, 0, sizeof(_next));
+
+	uint32_t cuts = 0;
+	uint32_t commits = 0;
+
+	for (uint32_t iteration = 0; iteration < iterations; iteration++) {
+		sd_model_set_power_cut(rand() % 48, rand() & 1);
+
+		while (sd_model_powered()) {
+			memcpy(_next, _committed, sizeof(_next));
+
+			int ops = 1 + rand() % 4;
+			for (int op = 0; op < ops; op++) {
+				int i = rand() % CRASH_KEYS;
+				char key[8];
+				_key_name(key, i);
+
+				if (rand() % 5 == 0) {
+					save_store_delete(key);
+					_next[i].present = false;
+				} else {
+					_next[i].present = true;
+					_next[i].length = 1 + rand() % CRASH_VALUE_MAX;
+					for (int b = 0; b < _next[i].length; b++) {
+						_next[i].value[b] = (uint8_t)rand();
+					}
+					save_store_put(key, _next[i].value, _next[i].length);
+				}
+			}
+
+			if (save_store_commit() != SAVE_OK) break;
+			memcpy(_committed, _next, sizeof(_committed));
+			commits++;
+
+			save_store_compact_step();
+		}
+
+		cuts++;
+		sd_model_power_on();
+		if (!sd_init()) {
+			fprintf(stderr, "iteration %u: card did not come back\n", iteration);
+			return 1;
+		}
+		if (save_store_mount() != SAVE_OK) {
+			fprintf(stderr, "iteration %u: mount failed\n", iteration);
+			return 1;
+		}
+
+		// the interrupted commit must have landed completely or not at all
+		if (_matches(_next)) {
+			memcpy(_committed, _next, sizeof(_committed));
+		} else if (!_matches(_committed)) {
+			fprintf(stderr, "iteration %u: store matches neither the old nor the new state\n", iteration);
+			_print_stats();
+			return 1;
+		}
+	}
+
+	SaveStoreStats_t stats;
+	save_store_get_stats(&stats);
+	printf("%u power cuts, %u commits, %u compactions survived (seed %u)\n",
+		cuts, commits, stats.compactions, seed);
+	return 0;
+}
+
+/**
+ * Fill a store with commits, format it and check a mount finds it empty and
+ * takes new commits; once with the log still in its first segment, once
+ * after compactions have moved it on.
+ *
+ * @returns Process exit code.
+ */
+static int _format_check() {
+	for (int round = 0; round < 2; round++) {
+		if (save_store_format() != SAVE_OK) {
+			fprintf(stderr, "format failed\n");
+			return 1;
+		}
+
+		// a few commits, or until a compaction has happened
+		SaveStoreStats_t stats;
+		uint32_t commits = 0;
+		do {
+			char key[8];
+			_key_name(key, commits % CRASH_KEYS);
+			uint8_t value[CRASH_VALUE_MAX];
+			memset(value, (int)commits, sizeof(value));
+			if (save_store_put(key, value, sizeof(value)) != SAVE_OK || save_store_commit() != SAVE_OK) {
+				fprintf(stderr, "round %d: commit %u failed\n", round, commits);
+				return 1;
+			}
+			commits++;
+			save_store_get_stats(&stats);
+		} while (round == 0 ? commits < 4 : stats.compactions == 0 || stats.compacting);
+
+		if (save_store_format() != SAVE_OK) {
+			fprintf(stderr, "round %d: second format failed\n", round);
+			return 1;
+		}
+		save_store_unmount();
+		if (save_store_mount() != SAVE_OK || save_store_key_count() != 0) {
+			fprintf(stderr, "round %d: %u keys after %u commits and a format\n", round, save_store_key_count(), commits);
+			return 1;
+		}
+
+		char value[8];
+		if (save_store_put("fresh", "new", 3) != SAVE_OK || save_store_commit() != SAVE_OK) {
+			fprintf(stderr, "round %d: commit after format failed\n", round);
+			return 1;
+		}
+		save_store_unmount();
+		if (save_store_mount() != SAVE_OK || save_store_key_count() != 1
+				|| save_store_get("fresh", value, sizeof(value)) != 3 || memcmp(value, "new", 3) != 0) {
+			fprintf(stderr, "round %d: store doesn't hold just the commit after the format\n", round);
+			return 1;
+		}
+		printf("round %d: formatted after %u commits, mounted empty\n", round, commits);
+	}
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		_usage();
+		return 2;
+	}
+
+	SdModelConfig_t config;
+	sd_model_default_config(&config);
+	config.sectors = IMAGE_SECTORS;
+	if (!sd_model_open(argv[1], &config)) {
+		fprintf(stderr, "cannot open %s\n", argv[1]);
+		return 1;
+	}
+
+	spi_bus_init();
+	if (!sd_init()) {
+		fprintf(stderr, "card init failed\n");
+		sd_model_close();
+		return 1;
+	}
+	sd_queue_init();
+
+	const char* command = argv[2];
+	int result = 0;
+
+	if (strcmp(command, "format") == 0) {
+		result = save_store_format() == SAVE_OK ? 0 : 1;
+	} else if (strcmp(command, "format-check") == 0) {
+		result = _format_check();
+	} else if (strcmp(command, "crash-loop") == 0 && argc >= 4) {
+		uint32_t seed = argc >= 5 ? (uint32_t)strtoul(argv[4], NULL, 0) : 1;
+		result = _crash_loop((uint32_t)strtoul(argv[3], NULL, 0), seed);
+	} else {
+		if (save_store_mount() != SAVE_OK) {
+			fprintf(stderr, "mount failed\n");
+			sd_model_close();
+			return 1;
+		}
+
+		if (strcmp(command, "put") == 0 && argc >= 5) {
+			result = save_store_put(argv[3], argv[4], (uint16_t)strlen(argv[4])) == SAVE_OK
+				&& save_store_commit() == SAVE_OK ? 0 : 1;
+		} else if (strcmp(command, "get") == 0 && argc >= 4) {
+			char value[SAVE_BATCH_SECTORS * 512];
+			int length = save_store_get(argv[3], value, sizeof(value));
+			if (length < 0) {
+				result = 1;
+			} else {
+				fwrite(value, 1, length, stdout);
+				putchar('\n');
+			}
+		} else if (strcmp(command, "del") == 0 && argc >= 4) {
+			result = save_store_delete(argv[3]) == SAVE_OK
+				&& save_store_commit() == SAVE_OK ? 0 : 1;
+		} else if (strcmp(command, "list") == 0) {
+			for (uint32_t i = 0; i < save_store_key_count(); i++) {
+				puts(save_store_key_at(i));
+			}
+		} else if (strcmp(command, "stats") == 0) {
+			_print_stats();
+		} else {
+			_usage();
+			result = 2;
+		}
+	}
+
+	sd_model_close();
+	return result;
+}
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico_host.h"
+#include "sd_model.h"
+#include "spi_bus.h"
+#include "sd_card.h"
+#include "sd_queue.h"
+#include "storage/save_store.h"
+
+/*
+ * Storage benchmarks on the simulated card. Times are simulated (SPI clock,
+ * card latency and busy time), so results are repeatable and comparable
+ * between runs on any machine.
+ */
+
+#define BENCH_MAX_BLOCKS 64
+
+typedef struct BenchMark {
+	uint64_t time_ns;
+	uint64_t commands;
+	uint64_t bytes;
+	uint64_t blocks;
+} BenchMark_t;
+
+static bool _csv = false;
+static uint8_t _buffer[BENCH_MAX_BLOCKS * SD_BLOCK_SIZE];
+
+static BenchMark_t _mark() {
+	const SdModelStats_t* card = sd_model_stats();
+	return (BenchMark_t){
+		pico_host_time_ns(),
+		card->commands,
+		pico_host_stats()->bytes_clocked,
+		card->blocks_read + card->blocks_written,
+	};
+}
+
+static void _report(const char* name, uint32_t ops, BenchMark_t start, bool ok) {
+	BenchMark_t end = _mark();
+	double ms = (end.time_ns - start.time_ns) / 1e6;
+	uint64_t blocks = end.blocks - start.blocks;
+	double kib_s = ms > 0 ? blocks * (SD_BLOCK_SIZE / 1024.0) / (ms / 1000.0) : 0;
+	double us_op = ops > 0 ? ms * 1000.0 / ops : 0;
+
+	if (_csv) {
+		printf("%s,%u,%llu,%llu,%llu,%.3f,%.1f,%.1f,%s\n", name, ops,
+			(unsigned long long)blocks, (unsigned long long)(end.commands - start.commands),
+			(unsigned long long)(end.bytes - start.bytes), ms, kib_s, us_op, ok ? "ok" : "failed");
+	} else {
+		printf("%-22s %6u %7llu %8llu %10llu %10.3f %9.1f %9.1f%s\n", name, ops,
+			(unsigned long long)blocks, (unsigned long long)(end.commands - start.commands),
+			(unsigned long long)(end.bytes - start.bytes), ms, kib_s, us_op, ok ? "" : "  FAILED");
+	}
+}
+
+static bool _bench_blocking_reads(uint32_t count) {
+	BenchMark_t start = _mark();
+	bool ok = true;
+	for (uint32_t i = 0; i < count && ok; i++) {
+		ok = sd_read_sector(i, _buffer);
+	}
+	_report("read 1 (blocking)", count, start, ok);
+	return ok;
+}
+
+static bool _bench_queue(const char* name, uint8_t op, uint32_t total_blocks, uint32_t blocks_per_request) {
+	static SdRequest_t requests[2];
+	uint32_t ops = total_blocks / blocks_per_request;
+	BenchMark_t start = _mark();
+	bool ok = true;
+
+	// two requests in flight, like double buffering
+	for (uint32_t i = 0; i < ops && ok; i++) {
+		SdRequest_t* request = &requests[i & 1];
+		if (request->status != SD_REQ_IDLE) ok = sd_queue_wait(request) == SD_OK;
+		uint8_t* buffer = _buffer + (i & 1) * (BENCH_MAX_BLOCKS / 2) * SD_BLOCK_SIZE;
+		ok = ok && sd_queue_submit(request, op, 1024 + i * blocks_per_request, blocks_per_request, buffer, NULL, NULL);
+	}
+	for (int i = 0; i < 2; i++) {
+		if (requests[i].status != SD_REQ_IDLE) ok = sd_queue_wait(&requests[i]) == SD_OK && ok;
+		requests[i].status = SD_REQ_IDLE;
+	}
+
+	_report(name, ops, start, ok);
+	return ok;
+}
+
+static bool _bench_save_store(uint32_t commits) {
+	BenchMark_t start = _mark();
+	bool ok = save_store_format() == SAVE_OK;
+
+	uint8_t value[200];
+	for (uint32_t i = 0; i < commits && ok; i++) {
+		char key[16];
+		sprintf(key, "slot%u", i % 8);
+		memset(value, (int)i, sizeof(value));
+		ok = save_store_put(key, value, sizeof(value)) == SAVE_OK && save_store_commit() == SAVE_OK;
+		save_store_compact_step();
+	}
+
+	_report("save store commit", commits, start, ok);
+	return ok;
+}
+
+static void _usage() {
+	fprintf(stderr,
+		"usage: sd_bench [options] IMAGE\n"
+		"  --blocks N          blocks per transfer benchmark (default 256)\n"
+		"  --latency US        read access time per block (default 200)\n"
+		"  --busy US           write programming time per block (default 600)\n"
+		"  --command-errors P  injected command CRC errors, parts per million\n"
+		"  --read-errors P     injected read data corruption, parts per million\n"
+		"  --write-errors P    injected write CRC rejections, parts per million\n"
+		"  --seed N            error injection seed\n"
+		"  --csv               machine readable output\n"
+		"IMAGE is used as scratch space and overwritten.\n");
+}
+
+int main(int argc, char** argv) {
+	SdModelConfig_t config;
+	sd_model_default_config(&config);
+	uint32_t blocks = 256;
+	const char* image = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		bool has_value = i + 1 < argc;
+		if (strcmp(argv[i], "--csv") == 0) {
+			_csv = true;
+		} else if (strcmp(argv[i], "--blocks") == 0 && has_value) {
+			blocks = (uint32_t)strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--latency") == 0 && has_value) {
+			config.read_latency_us = (uint32_t)strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--busy") == 0 && has_value) {
+			config.write_busy_us = (uint32_t)strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--command-errors") == 0 && has_value) {
+			config.command_error_ppm = (uint32_t)strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--read-errors") == 0 && has_value) {
+			config.read_error_ppm = (uint32_t)strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--write-errors") == 0 && has_value) {
+			config.write_error_ppm = (uint32_t)strtoul(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "--seed") == 0 && has_value) {
+			config.seed = (uint32_t)strtoul(argv[++i], NULL, 0);
+		} else if (argv[i][0] != '-' && image == NULL) {
+			image = argv[i];
+		} else {
+			_usage();
+			return 2;
+		}
+	}
+	if (image == NULL || blocks < BENCH_MAX_BLOCKS) {
+		_usage();
+		return 2;
+	}
+
+	// save region at the start, transfer benchmarks from sector 1024
+	config.sectors = 1024 + blocks + BENCH_MAX_BLOCKS;
+	if (!sd_model_open(image, &config)) {
+		fprintf(stderr, "cannot open %s\n", image);
+		return 1;
+	}
+
+	spi_bus_init();
+
+	if (_csv) {
+		printf("benchmark,ops,blocks,commands,bytes,sim_ms,kib_s,us_op,result\n");
+	} else {
+		printf("%-22s %6s %7s %8s %10s %10s %9s %9s\n",
+			"benchmark", "ops", "blocks", "commands", "bytes", "sim ms", "KiB/s", "us/op");
+	}
+
+	BenchMark_t start = _mark();
+	bool ok = sd_init();
+	_report("init", 1, start, ok);
+	if (!ok) return 1;
+
+	sd_queue_init();
+
+	ok = _bench_blocking_reads(blocks) && ok;
+	ok = _bench_queue("queue read 1", SD_REQ_READ, blocks, 1) && ok;
+	ok = _bench_queue("queue read 8", SD_REQ_READ, blocks, 8) && ok;
+	ok = _bench_queue("queue read 32", SD_REQ_READ, blocks, 32) && ok;
+	ok = _bench_queue("queue write 1", SD_REQ_WRITE, blocks, 1) && ok;
+	ok = _bench_queue("queue write 8", SD_REQ_WRITE, blocks, 8) && ok;
+	ok = _bench_queue("queue write 32", SD_REQ_WRITE, blocks, 32) && ok;
+	ok = _bench_save_store(blocks / 4) && ok;
+
+	if (!_csv) {
+		printf("\n");
+		sd_model_print_stats();
+		sd_queue_dump_stats();
+		printf("sd crc errors seen by the driver: %u\n", sd_crc_error_count());
+	}
+
+	sd_model_close();
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,519 @@
+#include "sd_model.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pico_host.h"
+#include "pins.h"
+
+/*
+ * Byte-level model of an SDHC card in SPI mode, backed by a disk image file.
+ *
+ * Each byte the host clocks while the card is selected goes through
+ * `_exchange`: the card answers with whatever it is driving on MISO (decided
+ * before it sees the incoming byte, as on the wire) and then consumes the MOSI
+ * byte. Access latency and programming busy time are measured on the
+ * simulated clock, so the host code waits for them exactly as it would on a
+ * real card: by clocking 0xFF bytes.
+ *
+ * Covers what the kernel uses: CMD0/8/12/13/16/17/18/24/25/55/58/59 and
+ * ACMD41, CRC mode, data response tokens, the multi-block stop token, plus
+ * error injection and power cuts.
+ */
+
+#define BLOCK_SIZE       512
+#define READ_FRAME_SIZE  (1 + BLOCK_SIZE + 2) // token, data, CRC
+#define WRITE_FRAME_SIZE (BLOCK_SIZE + 2)     // data, CRC
+#define OUT_MAX          16
+
+// R1 bits
+#define R1_IDLE          0x01
+#define R1_ILLEGAL       0x04
+#define R1_CRC_ERROR     0x08
+#define R1_ADDRESS_ERROR 0x20
+
+typedef enum {
+	CARD_COMMAND,     // waiting for, or collecting, a command
+	CARD_READ_WAIT,   // access time before the next start token
+	CARD_READ_DATA,   // sending token, data and CRC
+	CARD_WRITE_TOKEN, // waiting for a start (or stop) token
+	CARD_WRITE_DATA   // receiving data and CRC
+} CardState_t;
+
+static FILE* _image = NULL;
+static SdModelConfig_t _config;
+static SdModelStats_t _stats;
+static uint32_t _random;
+
+// power
+static bool _powered = true;
+static int64_t _cut_after = -1;
+static bool _tear = false;
+
+// card state
+static CardState_t _state = CARD_COMMAND;
+static bool _awake = false;   // seen CMD0 since power on
+static bool _idle = true;     // still initialising (R1 idle bit)
+static bool _crc_on = false;
+static bool _app_cmd = false;
+static uint32_t _init_left = 0;
+static bool _multi = false;
+static uint32_t _sector = 0;
+static uint64_t _ready_ns = 0; // start token allowed from here
+static uint64_t _busy_ns = 0;  // MISO held low until here
+
+static uint8_t _cmd[6];
+static uint32_t _cmd_length = 0;
+
+static uint8_t _out[OUT_MAX];
+static uint32_t _out_length = 0;
+static uint32_t _out_position = 0;
+
+static uint8_t _frame[READ_FRAME_SIZE];
+static uint32_t _frame_position = 0;
+
+static uint8_t _crc7(const uint8_t* data, size_t length) {
+	uint8_t crc = 0;
+	for (size_t i = 0; i < length; i++) {
+		crc ^= data[i];
+		for (int bit = 0; bit < 8; bit++) {
+			crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x12) : (uint8_t)(crc << 1);
+		}
+	}
+	return crc;
+}
+
+static uint16_t _crc16(const uint8_t* data, size_t length) {
+	uint16_t crc = 0;
+	for (size_t i = 0; i < length; i++) {
+		crc ^= (uint16_t)data[i] << 8;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+		}
+	}
+	return crc;
+}
+
+/**
+ * Roll for an injected error.
+ *
+ * @param ppm Probability in parts per million.
+ */
+static bool _inject(uint32_t ppm) {
+	if (ppm == 0) return false;
+
+	// xorshift32
+	_random ^= _random << 13;
+	_random ^= _random >> 17;
+	_random ^= _random << 5;
+	return _random % 1000000 < ppm;
+}
+
+static bool _busy() {
+	return pico_host_time_ns() < _busy_ns;
+}
+
+static void _respond(const uint8_t* bytes, uint32_t length) {
+	_out_length = 0;
+	_out_position = 0;
+	for (uint8_t i = 0; i < _config.response_delay; i++) {
+		_out[_out_length++] = 0xFF;
+	}
+	memcpy(_out + _out_length, bytes, length);
+	_out_length += length;
+}
+
+static void _respond_r1(uint8_t r1) {
+	_respond(&r1, 1);
+}
+
+// data response tokens come straight after the CRC, with no Ncr delay
+static void _data_response(uint8_t token) {
+	_out[0] = token;
+	_out_length = 1;
+	_out_position = 0;
+}
+
+static uint8_t _r1() {
+	return _idle ? R1_IDLE : 0x00;
+}
+
+static bool _load_block(uint32_t sector, uint8_t* buffer) {
+	if (fseek(_image, (long)sector * BLOCK_SIZE, SEEK_SET) != 0) return false;
+	return fread(buffer, BLOCK_SIZE, 1, _image) == 1;
+}
+
+/**
+ * Fill the read frame for `_sector`: start token, data, CRC, or a lone
+ * "out of range" error token past the end of the card.
+ */
+static void _prepare_read() {
+	_frame_position = 0;
+
+	if (_sector >= _config.sectors || !_load_block(_sector, _frame + 1)) {
+		_frame[0] = 0x08;
+		return;
+	}
+
+	_frame[0] = 0xFE;
+	uint16_t crc = _crc16(_frame + 1, BLOCK_SIZE);
+	_frame[1 + BLOCK_SIZE] = crc >> 8;
+	_frame[2 + BLOCK_SIZE] = crc & 0xFF;
+
+	if (_inject(_config.read_error_ppm)) {
+		_stats.injected_read_errors++;
+		_frame[1 + _random % BLOCK_SIZE] ^= 0x10;
+	}
+
+	_ready_ns = pico_host_time_ns() + (uint64_t)_config.read_latency_us * 1000;
+}
+
+/**
+ * Handle a complete data frame from the host: check it, program it (unless the
+ * power is cut part way through) and queue the data response token.
+ */
+static void _write_frame() {
+	uint16_t received = ((uint16_t)_frame[BLOCK_SIZE] << 8) | _frame[BLOCK_SIZE + 1];
+	_state = _multi ? CARD_WRITE_TOKEN : CARD_COMMAND;
+
+	if (_crc_on && _crc16(_frame, BLOCK_SIZE) != received) {
+		_stats.crc_rejects++;
+		_data_response(0x0B);
+		return;
+	}
+	if (_inject(_config.write_error_ppm)) {
+		_stats.injected_write_errors++;
+		_data_response(0x0B);
+		return;
+	}
+
+	fseek(_image, (long)_sector * BLOCK_SIZE, SEEK_SET);
+
+	if (_cut_after == 0) {
+		if (_tear) fwrite(_frame, 1, BLOCK_SIZE / 2, _image);
+		fflush(_image);
+		_powered = false;
+		return;
+	}
+	if (_cut_after > 0) _cut_after--;
+
+	fwrite(_frame, BLOCK_SIZE, 1, _image);
+	_stats.blocks_written++;
+	_stats.busy_us += _config.write_busy_us;
+	_sector++;
+
+	// data accepted, then busy while programming
+	_data_response(0x05);
+	_busy_ns = pico_host_time_ns() + (uint64_t)_config.write_busy_us * 1000;
+}
+
+static void _command() {
+	uint8_t cmd = _cmd[0] & 0x3F;
+	uint32_t arg = ((uint32_t)_cmd[1] << 24) | ((uint32_t)_cmd[2] << 16) | ((uint32_t)_cmd[3] << 8) | _cmd[4];
+	bool app = _app_cmd;
+	_app_cmd = false;
+
+	// a card that hasn't been reset yet only listens for CMD0
+	if (!_awake && cmd != 0) return;
+
+	_stats.commands++;
+	_stats.command_counts[cmd]++;
+
+	// CMD0 and CMD8 are always CRC checked
+	bool crc_valid = (_crc7(_cmd, 5) | 0x01) == _cmd[5];
+	if (!crc_valid && (_crc_on || cmd == 0 || cmd == 8)) {
+		_stats.crc_rejects++;
+		_respond_r1(_r1() | R1_CRC_ERROR);
+		return;
+	}
+
+	bool streaming = _state == CARD_READ_WAIT || _state == CARD_READ_DATA;
+	if (streaming && cmd != 12) return;
+
+	switch (cmd) {
+	case 0:
+		_awake = true;
+		_idle = true;
+		_crc_on = false;
+		_init_left = _config.init_polls;
+		_state = CARD_COMMAND;
+		_respond_r1(R1_IDLE);
+		break;
+	case 8: {
+		uint8_t r7[5] = { _r1(), 0x00, 0x00, (arg >> 8) & 0x0F, arg & 0xFF };
+		_respond(r7, 5);
+		break;
+	}
+	case 12:
+		// stuff byte, then R1
+		_state = CARD_COMMAND;
+		_respond((const uint8_t[]){ 0xFF, _r1() }, 2);
+		break;
+	case 13:
+		_respond((const uint8_t[]){ _r1(), 0x00 }, 2);
+		break;
+	case 16:
+		_respond_r1(arg == BLOCK_SIZE ? _r1() : _r1() | 0x40);
+		break;
+	case 17:
+	case 18:
+	case 24:
+	case 25:
+		if (_idle) {
+			_respond_r1(_r1() | R1_ILLEGAL);
+			break;
+		}
+		if (arg >= _config.sectors) {
+			_respond_r1(R1_ADDRESS_ERROR);
+			break;
+		}
+		if (_inject(_config.command_error_ppm)) {
+			_stats.injected_command_errors++;
+			_respond_r1(R1_CRC_ERROR);
+			break;
+		}
+
+		_multi = cmd == 18 || cmd == 25;
+		_sector = arg;
+		_respond_r1(0x00);
+		if (cmd == 17 || cmd == 18) {
+			_state = CARD_READ_WAIT;
+			_prepare_read();
+		} else {
+			_state = CARD_WRITE_TOKEN;
+		}
+		break;
+	case 41:
+		if (!app) {
+			_respond_r1(_r1() | R1_ILLEGAL);
+		} else if (_init_left > 0) {
+			_init_left--;
+			_respond_r1(R1_IDLE);
+		} else {
+			_idle = false;
+			_respond_r1(0x00);
+		}
+		break;
+	case 55:
+		_app_cmd = true;
+		_respond_r1(_r1());
+		break;
+	case 58: {
+		// OCR: powered up, CCS (block addressed), 2.7-3.6V
+		uint8_t r3[5] = { _r1(), 0xC0, 0xFF, 0x80, 0x00 };
+		_respond(r3, 5);
+		break;
+	}
+	case 59:
+		_crc_on = arg & 1;
+		_respond_r1(_r1());
+		break;
+	default:
+		_respond_r1(_r1() | R1_ILLEGAL);
+		break;
+	}
+}
+
+/**
+ * What the card drives on MISO for the next byte.
+ */
+static uint8_t _output() {
+	if (_out_position < _out_length) return _out[_out_position++];
+
+	switch (_state) {
+	case CARD_READ_WAIT:
+		if (pico_host_time_ns() < _ready_ns) return 0xFF;
+		_state = CARD_READ_DATA;
+		// fall through
+	case CARD_READ_DATA: {
+		uint8_t byte = _frame[_frame_position++];
+
+		if (byte == 0x08 && _frame_position == 1) {
+			// error token, the transfer is over
+			_state = CARD_COMMAND;
+		} else if (_frame_position == READ_FRAME_SIZE) {
+			_stats.blocks_read++;
+			if (_multi) {
+				_sector++;
+				_state = CARD_READ_WAIT;
+				_prepare_read();
+			} else {
+				_state = CARD_COMMAND;
+			}
+		}
+		return byte;
+	}
+	case CARD_COMMAND:
+	case CARD_WRITE_TOKEN:
+		return _busy() ? 0x00 : 0xFF;
+	case CARD_WRITE_DATA:
+		return 0xFF;
+	}
+
+	return 0xFF;
+}
+
+/**
+ * Take in the byte the host sent.
+ */
+static void _input(uint8_t mosi) {
+	switch (_state) {
+	case CARD_COMMAND:
+	case CARD_READ_WAIT:
+	case CARD_READ_DATA:
+		if (_cmd_length == 0 && (mosi & 0xC0) != 0x40) return;
+		_cmd[_cmd_length++] = mosi;
+		if (_cmd_length == sizeof(_cmd)) {
+			_cmd_length = 0;
+			_command();
+		}
+		break;
+	case CARD_WRITE_TOKEN:
+		if (_busy() || _out_position < _out_length) return;
+		if (mosi == (_multi ? 0xFC : 0xFE)) {
+			_state = CARD_WRITE_DATA;
+			_frame_position = 0;
+		} else if (_multi && mosi == 0xFD) {
+			// stop tran, short busy while the card finishes up
+			_state = CARD_COMMAND;
+			_busy_ns = pico_host_time_ns() + 1000;
+		}
+		break;
+	case CARD_WRITE_DATA:
+		_frame[_frame_position++] = mosi;
+		if (_frame_position == WRITE_FRAME_SIZE) _write_frame();
+		break;
+	}
+}
+
+static uint8_t _exchange(uint8_t mosi) {
+	// no power, nothing drives MISO
+	if (!_powered || _image == NULL) return 0xFF;
+
+	_stats.bytes_selected++;
+	uint8_t miso = _output();
+	_input(mosi);
+	return miso;
+}
+
+static void _select(bool selected) {
+	if (selected) return;
+
+	// deselecting abandons whatever was half sent, busy carries on regardless
+	_cmd_length = 0;
+	_out_length = 0;
+	_out_position = 0;
+	_state = CARD_COMMAND;
+}
+
+void sd_model_default_config(SdModelConfig_t* config) {
+	*config = (SdModelConfig_t){
+		.sectors = 0,
+		.read_latency_us = 200,
+		.write_busy_us = 600,
+		.init_polls = 20,
+		.response_delay = 1,
+		.seed = 1,
+	};
+}
+
+/**
+ * Open (creating or growing as needed) the image backing the card and attach
+ * the card to the SD chip select.
+ *
+ * @param path Image file path.
+ * @param config Card behaviour, `sectors` must be set.
+ * @returns `true` on success.
+ */
+bool sd_model_open(const char* path, const SdModelConfig_t* config) {
+	_config = *config;
+	if (_config.response_delay == 0) _config.response_delay = 1;
+	_random = _config.seed != 0 ? _config.seed : 1;
+
+	_image = fopen(path, "r+b");
+	if (_image == NULL) _image = fopen(path, "w+b");
+	if (_image == NULL) return false;
+
+	fseek(_image, 0, SEEK_END);
+	long size = ftell(_image);
+	if (size < (long)_config.sectors * BLOCK_SIZE) {
+		// unwritten flash reads back as 0xFF
+		uint8_t blank[BLOCK_SIZE];
+		memset(blank, 0xFF, sizeof(blank));
+		for (long s = size / BLOCK_SIZE; s < (long)_config.sectors; s++) {
+			fseek(_image, s * BLOCK_SIZE, SEEK_SET);
+			fwrite(blank, 1, BLOCK_SIZE, _image);
+		}
+	}
+
+	static bool attached = false;
+	if (!attached) {
+		pico_host_attach_spi(PIN_SDCS, _exchange, _select);
+		attached = true;
+	}
+
+	sd_model_power_on();
+	sd_model_reset_stats();
+	return true;
+}
+
+void sd_model_close() {
+	if (_image != NULL) fclose(_image);
+	_image = NULL;
+}
+
+/**
+ * Schedule a power cut.
+ *
+ * @param sectors_until_cut Number of sectors that are programmed successfully
+ *        before power is lost, or -1 to cancel.
+ * @param tear Whether the sector being programmed when power is lost is left
+ *        half old, half new (otherwise it keeps its old contents).
+ */
+void sd_model_set_power_cut(int64_t sectors_until_cut, bool tear) {
+	_cut_after = sectors_until_cut;
+	_tear = tear;
+}
+
+bool sd_model_powered() {
+	return _powered;
+}
+
+/**
+ * Restore power. The card comes back uninitialised, as after a real power
+ * cycle, so `sd_init` has to run again.
+ */
+void sd_model_power_on() {
+	_powered = true;
+	_cut_after = -1;
+	_awake = false;
+	_idle = true;
+	_crc_on = false;
+	_app_cmd = false;
+	_busy_ns = 0;
+	_select(false);
+}
+
+const SdModelStats_t* sd_model_stats() {
+	return &_stats;
+}
+
+void sd_model_reset_stats() {
+	_stats = (SdModelStats_t){ 0 };
+}
+
+void sd_model_print_stats() {
+	printf("sd model: %llu commands (", (unsigned long long)_stats.commands);
+	bool first = true;
+	for (int cmd = 0; cmd < 64; cmd++) {
+		if (_stats.command_counts[cmd] == 0) continue;
+		printf("%sCMD%d %llu", first ? "" : ", ", cmd, (unsigned long long)_stats.command_counts[cmd]);
+		first = false;
+	}
+	printf("), %llu bytes selected, %llu blocks read, %llu written, %llu us busy\n",
+		(unsigned long long)_stats.bytes_selected, (unsigned long long)_stats.blocks_read,
+		(unsigned long long)_stats.blocks_written, (unsigned long long)_stats.busy_us);
+	printf("          crc rejects %u, injected errors: command %u, read %u, write %u\n",
+		_stats.crc_rejects, _stats.injected_command_errors, _stats.injected_read_errors,
+		_stats.injected_write_errors);
+}
@@ -0,0 +1,52 @@
+#ifndef HOST_SD_MODEL_H
+#define HOST_SD_MODEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct SdModelConfig {
+	uint32_t sectors;           // card size in 512-byte sectors
+	uint32_t read_latency_us;   // read command to start token, per block
+	uint32_t write_busy_us;     // programming time after each written block
+	uint32_t init_polls;        // ACMD41s answered "still initialising"
+	uint8_t response_delay;     // 0xFF bytes before each R1 (Ncr, 1-8)
+	uint32_t command_error_ppm; // commands answered with an R1 CRC error
+	uint32_t read_error_ppm;    // blocks sent with a corrupted byte
+	uint32_t write_error_ppm;   // blocks rejected with a CRC error token
+	uint32_t seed;              // error injection
+} SdModelConfig_t;
+
+typedef struct SdModelStats {
+	uint64_t commands;
+	uint64_t command_counts[64];
+	uint64_t bytes_selected;    // bytes clocked while the card was selected
+	uint64_t blocks_read;
+	uint64_t blocks_written;
+	uint64_t busy_us;           // simulated programming time
+	uint32_t crc_rejects;       // bad command/data CRCs seen from the host
+	uint32_t injected_command_errors;
+	uint32_t injected_read_errors;
+	uint32_t injected_write_errors;
+} SdModelStats_t;
+
+void sd_model_default_config(SdModelConfig_t* config);
+bool sd_model_open(const char* path, const SdModelConfig_t* config);
+void sd_model_close();
+
+void sd_model_set_power_cut(int64_t sectors_until_cut, bool tear);
+bool sd_model_powered();
+void sd_model_power_on();
+
+const SdModelStats_t* sd_model_stats();
+void sd_model_reset_stats();
+void sd_model_print_stats();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,67 @@
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+#include "pico/stdio_usb.h"
+#include "hardware/clocks.h"
+#include "hardware/structs/m33.h"
+
+#include "drivers/pins.h"
+#include "drivers/spi_bus.h"
+#include "drivers/memory.h"
+#include "drivers/allocator.h"
+#include "drivers/memops.h"
+#include "drivers/graphics/lcd.h"
+#include "drivers/sd_card.h"
+#include "drivers/sd_queue.h"
+
+#include "suite.h"
+
+// my_console_bench: the console's drivers set up the same way, but instead of
+// the menu the benchmark suite (suite.h) runs, once the serial port is open
+// and again each time a key is sent.
+
+/**
+ * The core's cycle counter (DWT), for timing CPU-bound tests.
+ */
+uint32_t bench_ticks() {
+	return m33_hw->dwt_cyccnt;
+}
+
+/**
+ * The rate bench_ticks counts at, the system clock.
+ */
+uint32_t bench_ticks_hz() {
+	return clock_get_hz(clk_sys);
+}
+
+int main() {
+	stdio_init_all();
+
+	spi_bus_init();
+	pin_init(PIN_DC);
+	pin_init(PIN_RST);
+	lcd_init();
+
+	memory_init();
+	alloc_init(heap_start(), total_free_bytes());
+	memops_init();
+
+	bool sd = sd_init();
+	if (sd) sd_queue_init();
+
+	m33_hw->demcr |= M33_DEMCR_TRCENA_BITS;
+	m33_hw->dwt_ctrl |= M33_DWT_CTRL_CYCCNTENA_BITS;
+
+	while (!stdio_usb_connected()) sleep_ms(100);
+
+	for (uint32_t run = 1;; run++) {
+		printf("# my_console_bench %u, run %lu, clk_sys %lu Hz, %u runs per test, seed %08x\n", BENCH_VERSION,
+			(unsigned long)run, (unsigned long)clock_get_hz(clk_sys), BENCH_RUNS, BENCH_SEED);
+		bool ok = bench_run(sd);
+		printf("# %s\n", ok ? "done" : "failed");
+
+		// wait for a key to run again
+		while (getchar_timeout_us(0) != PICO_ERROR_TIMEOUT) {}
+		while (getchar_timeout_us(1000000) == PICO_ERROR_TIMEOUT) {}
+	}
+}
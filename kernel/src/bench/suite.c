@@ -0,0 +1,330 @@
+#include "suite.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+
+#include "drivers/spi_bus.h"
+#include "drivers/allocator.h"
+#include "drivers/graphics/lcd.h"
+#include "drivers/sd_card.h"
+#include "drivers/sd_queue.h"
+
+#define SCREEN_WIDTH  240
+#define SCREEN_HEIGHT 320
+
+#define MEMCPY_MAX (16 * 1024)
+
+static uint32_t _random;
+
+static uint8_t _sectors[BENCH_SD_BATCH * SD_BLOCK_SIZE];
+static uint8_t _copy_src[MEMCPY_MAX] __attribute__((aligned(8)));
+static uint8_t _copy_dest[MEMCPY_MAX] __attribute__((aligned(8)));
+
+// per call timings of the allocator tests, all runs
+static uint32_t _malloc_ticks[BENCH_ALLOCS * BENCH_RUNS];
+static uint32_t _free_ticks[BENCH_ALLOCS * BENCH_RUNS];
+static uint32_t _pair_ticks[BENCH_PAIRS * BENCH_RUNS];
+static void* _blocks[BENCH_ALLOCS];
+static uint32_t _order[BENCH_ALLOCS];
+
+static uint32_t _rand() {
+	_random ^= _random << 13;
+	_random ^= _random >> 17;
+	_random ^= _random << 5;
+	return _random;
+}
+
+static void _row(const char* test, const char* metric, double value, const char* unit) {
+	printf("%s,%s,%.3f,%s\n", test, metric, value, unit);
+}
+
+static int _compare_double(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static int _compare_u32(const void* a, const void* b) {
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double _median(double* runs) {
+	qsort(runs, BENCH_RUNS, sizeof(double), _compare_double);
+	return runs[BENCH_RUNS / 2];
+}
+
+static double _ns(uint32_t ticks) {
+	return ticks * 1e9 / bench_ticks_hz();
+}
+
+/**
+ * Print the 50th, 99th percentile and slowest of a set of timings.
+ *
+ * @param test Test name.
+ * @param ticks Timings in bench_ticks, sorted here.
+ * @param count How many.
+ */
+static void _distribution(const char* test, uint32_t* ticks, uint32_t count) {
+	qsort(ticks, count, sizeof(uint32_t), _compare_u32);
+	_row(test, "p50", _ns(ticks[count / 2]), "ns");
+	_row(test, "p99", _ns(ticks[count - 1 - count / 100]), "ns");
+	_row(test, "max", _ns(ticks[count - 1]), "ns");
+}
+
+/**
+ * Fill rate: the whole screen at once, in alternating colours.
+ */
+static void _bench_fill() {
+	double runs[BENCH_RUNS];
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		uint64_t start = time_us_64();
+		lcd_fill_rect(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, run & 1 ? 0xFFFF : 0x0000);
+		runs[run] = (double)(time_us_64() - start);
+	}
+	double us = _median(runs);
+	_row("lcd_fill", "full_screen", us / 1000.0, "ms");
+	_row("lcd_fill", "rate", SCREEN_WIDTH * SCREEN_HEIGHT / us, "Mpx/s");
+}
+
+/**
+ * Small primitives: squares of a size at random positions, where the window
+ * setup is a good part of each.
+ *
+ * @param size Side, pixels.
+ */
+static void _bench_rects(uint16_t size) {
+	double runs[BENCH_RUNS];
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		_random = BENCH_SEED;
+		uint64_t start = time_us_64();
+		for (int i = 0; i < BENCH_RECTS; i++) {
+			uint16_t x = _rand() % (SCREEN_WIDTH - size);
+			uint16_t y = _rand() % (SCREEN_HEIGHT - size);
+			lcd_fill_rect(x, y, size, size, (uint16_t)_rand());
+		}
+		runs[run] = (double)(time_us_64() - start);
+	}
+
+	char test[16];
+	snprintf(test, sizeof(test), "lcd_rect_%u", size);
+	double us = _median(runs);
+	_row(test, "rate", BENCH_RECTS * 1e6 / us, "rects/s");
+	_row(test, "per_rect", us / BENCH_RECTS, "us");
+}
+
+/**
+ * Window setup on its own: the column and row address commands, inside one
+ * bus transaction.
+ */
+static void _bench_window() {
+	double runs[BENCH_RUNS];
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		_random = BENCH_SEED;
+		spi_bus_begin(SPI_DEVICE_LCD);
+		uint64_t start = time_us_64();
+		for (int i = 0; i < BENCH_WINDOWS; i++) {
+			uint16_t x = _rand() % SCREEN_WIDTH;
+			uint16_t y = _rand() % SCREEN_HEIGHT;
+			lcd_set_window(x, y, SCREEN_WIDTH - 1, SCREEN_HEIGHT - 1);
+		}
+		runs[run] = (double)(time_us_64() - start);
+		spi_bus_end(SPI_DEVICE_LCD);
+	}
+	_row("lcd_window", "per_call", _median(runs) / BENCH_WINDOWS, "us");
+}
+
+/**
+ * Report a read test's throughput.
+ *
+ * @param test Test name.
+ * @param runs Microseconds each run took, sorted here.
+ * @param sectors Sectors each run read.
+ * @param reads Reads (commands or requests) each run made.
+ */
+static void _sd_rows(const char* test, double* runs, uint32_t sectors, uint32_t reads) {
+	double us = _median(runs);
+	_row(test, "throughput", sectors * (double)SD_BLOCK_SIZE / us, "MB/s");
+	_row(test, "iops", reads * 1e6 / us, "reads/s");
+}
+
+/**
+ * Read sectors through the request queue and wait for them. sd_queue_init
+ * has given the card to the queue, so even single sectors don't go through
+ * the blocking sd_read_sector.
+ *
+ * @param sector First sector.
+ * @param count Sectors to read into `_sectors`.
+ * @returns `true` if the read succeeded.
+ */
+static bool _sd_read(uint32_t sector, uint32_t count) {
+	SdRequest_t request = { 0 };
+	return sd_queue_submit(&request, SD_REQ_READ, sector, count, _sectors, NULL, NULL)
+		&& sd_queue_wait(&request) == SD_OK;
+}
+
+/**
+ * Sequential reads one sector at a time and in batches, and random single
+ * sectors across the region, all through the request queue.
+ *
+ * @returns `false` if a read failed.
+ */
+static bool _bench_sd() {
+	double runs[BENCH_RUNS];
+
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		uint64_t start = time_us_64();
+		for (uint32_t i = 0; i < BENCH_SD_SECTORS; i++) {
+			if (!_sd_read(BENCH_SD_FIRST_SECTOR + i, 1)) {
+				printf("# sd_seq_1: read of sector %lu failed\n", (unsigned long)(BENCH_SD_FIRST_SECTOR + i));
+				return false;
+			}
+		}
+		runs[run] = (double)(time_us_64() - start);
+	}
+	_sd_rows("sd_seq_1", runs, BENCH_SD_SECTORS, BENCH_SD_SECTORS);
+
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		uint64_t start = time_us_64();
+		for (uint32_t i = 0; i < BENCH_SD_SECTORS; i += BENCH_SD_BATCH) {
+			if (!_sd_read(BENCH_SD_FIRST_SECTOR + i, BENCH_SD_BATCH)) {
+				printf("# sd_seq_%u: read at sector %lu failed\n", BENCH_SD_BATCH, (unsigned long)(BENCH_SD_FIRST_SECTOR + i));
+				return false;
+			}
+		}
+		runs[run] = (double)(time_us_64() - start);
+	}
+	char test[16];
+	snprintf(test, sizeof(test), "sd_seq_%u", BENCH_SD_BATCH);
+	_sd_rows(test, runs, BENCH_SD_SECTORS, BENCH_SD_SECTORS / BENCH_SD_BATCH);
+
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		_random = BENCH_SEED;
+		uint64_t start = time_us_64();
+		for (uint32_t i = 0; i < BENCH_SD_RANDOM_READS; i++) {
+			uint32_t sector = BENCH_SD_FIRST_SECTOR + _rand() % BENCH_SD_SECTORS;
+			if (!_sd_read(sector, 1)) {
+				printf("# sd_random_1: read of sector %lu failed\n", (unsigned long)sector);
+				return false;
+			}
+		}
+		runs[run] = (double)(time_us_64() - start);
+	}
+	_sd_rows("sd_random_1", runs, BENCH_SD_RANDOM_READS, BENCH_SD_RANDOM_READS);
+	return true;
+}
+
+/**
+ * malloc and free latency: blocks of mostly small sizes allocated one after
+ * another, then freed in a random order, then a 32 byte malloc and free over
+ * and over. Everything's freed again, so each run starts from the same heap.
+ *
+ * @returns `false` if an allocation failed.
+ */
+static bool _bench_alloc() {
+	uint32_t samples = 0;
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		_random = BENCH_SEED;
+		for (uint32_t i = 0; i < BENCH_ALLOCS; i++) {
+			uint32_t shift = 3 + _rand() % 7; // 8 B .. 1 KiB
+			uint32_t bytes = (1u << shift) + _rand() % (1u << shift);
+
+			uint32_t start = bench_ticks();
+			_blocks[i] = malloc(bytes);
+			_malloc_ticks[samples + i] = bench_ticks() - start;
+			if (_blocks[i] == NULL) {
+				printf("# malloc: %lu bytes failed after %lu blocks\n", (unsigned long)bytes, (unsigned long)i);
+				while (i > 0) free(_blocks[--i]);
+				return false;
+			}
+			_order[i] = i;
+		}
+
+		for (uint32_t i = BENCH_ALLOCS - 1; i > 0; i--) {
+			uint32_t j = _rand() % (i + 1);
+			uint32_t swap = _order[i];
+			_order[i] = _order[j];
+			_order[j] = swap;
+		}
+		for (uint32_t i = 0; i < BENCH_ALLOCS; i++) {
+			uint32_t start = bench_ticks();
+			free(_blocks[_order[i]]);
+			_free_ticks[samples + i] = bench_ticks() - start;
+		}
+		samples += BENCH_ALLOCS;
+
+		for (uint32_t i = 0; i < BENCH_PAIRS; i++) {
+			uint32_t start = bench_ticks();
+			free(malloc(32));
+			_pair_ticks[run * BENCH_PAIRS + i] = bench_ticks() - start;
+		}
+	}
+
+	_distribution("malloc", _malloc_ticks, samples);
+	_distribution("free", _free_ticks, samples);
+	_distribution("malloc_free_32", _pair_ticks, BENCH_PAIRS * BENCH_RUNS);
+	return true;
+}
+
+/**
+ * memcpy bandwidth at a few sizes, copying about a megabyte each run.
+ */
+static void _bench_memcpy() {
+	static const uint32_t sizes[] = { 64, 1024, MEMCPY_MAX };
+	for (uint32_t i = 0; i < MEMCPY_MAX; i++) _copy_src[i] = (uint8_t)i;
+
+	for (uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		uint32_t size = sizes[s];
+		uint32_t copies = (1024 * 1024) / size;
+
+		double runs[BENCH_RUNS];
+		for (int run = 0; run < BENCH_RUNS; run++) {
+			uint32_t start = bench_ticks();
+			for (uint32_t i = 0; i < copies; i++) {
+				// a different part of the buffer each time for the small ones
+				uint32_t offset = (i * size) % MEMCPY_MAX;
+				memcpy(_copy_dest + offset, _copy_src + offset, size);
+			}
+			runs[run] = _ns(bench_ticks() - start);
+		}
+
+		char test[16];
+		snprintf(test, sizeof(test), "memcpy_%lu", (unsigned long)size);
+		_row(test, "bandwidth", copies * (double)size * 1000.0 / _median(runs), "MB/s");
+	}
+
+	if (memcmp(_copy_dest, _copy_src, MEMCPY_MAX) != 0) printf("# memcpy: copy doesn't match\n");
+}
+
+/**
+ * Run the suite and print its results: the LCD tests, the SD tests if
+ * there's a card, then the allocator and memcpy. The LCD and the card's bus
+ * must be set up (lcd_init, sd_init and sd_queue_init), and the heap.
+ *
+ * @param sd Whether there's a card to read.
+ * @returns `false` if a test failed, its rows are missing.
+ */
+bool bench_run(bool sd) {
+	bool ok = true;
+	printf("test,metric,value,unit\n");
+
+	_bench_fill();
+	_bench_rects(8);
+	_bench_rects(32);
+	_bench_window();
+	lcd_fill_rect(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, 0x0000);
+
+	if (sd) {
+		ok = _bench_sd() && ok;
+	} else {
+		printf("# sd: no card, skipped\n");
+	}
+
+	ok = _bench_alloc() && ok;
+	_bench_memcpy();
+	return ok;
+}
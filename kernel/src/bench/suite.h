@@ -0,0 +1,42 @@
+#ifndef KERNEL_BENCH_SUITE_H
+#define KERNEL_BENCH_SUITE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The benchmark suite, run by the my_console_bench firmware (main.c here)
+// and host/console_bench against the same drivers. Results are CSV on stdout,
+// one `test,metric,value,unit` row each, so runs can be compared release over
+// release; bump BENCH_VERSION when a test changes what it measures.
+#define BENCH_VERSION 2
+
+// each throughput is the median of this many runs
+#ifndef BENCH_RUNS
+#define BENCH_RUNS 5
+#endif
+
+// every run draws the same positions, sizes and sectors
+#define BENCH_SEED 0x2545F491u
+
+// read-only region of the card the SD tests use, past the save and app
+// stores (32 MiB in)
+#ifndef BENCH_SD_FIRST_SECTOR
+#define BENCH_SD_FIRST_SECTOR 65536
+#endif
+#define BENCH_SD_SECTORS      2048 // 1 MiB
+#define BENCH_SD_RANDOM_READS 256
+#define BENCH_SD_BATCH        8    // sectors per queued request
+
+#define BENCH_RECTS   500
+#define BENCH_WINDOWS 1000
+#define BENCH_ALLOCS  500 // about 110 KiB at once
+#define BENCH_PAIRS   1000
+
+// provided by whatever runs the suite: a counter for timing CPU-bound work
+// (malloc, memcpy) and its rate; I/O is timed with time_us_64
+uint32_t bench_ticks();
+uint32_t bench_ticks_hz();
+
+bool bench_run(bool sd);
+
+#endif
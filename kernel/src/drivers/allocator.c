@@ -1,15 +1,133 @@
 #include "allocator.h"
 
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "pico/platform.h"
+#include "pico/stdlib.h"
+
+#include "trace.h"
+
+#if ALLOC_TRACE
+#include "hardware/sync.h"
+#endif
+
 #ifdef DEBUG
 #include <stdlib.h>
-#include <stdio.h>
 #endif
 
-static uint8_t* _heap_start = NULL;
-static uintptr_t _heap_size;
+// bytes in front of every block's data, the free list links overlap the data
+#define HEADER_SIZE offsetof(MemoryHeader_t, next_free)
+// smallest data area, has to hold the free list links once freed
+#define BLOCK_MIN (sizeof(MemoryHeader_t) - HEADER_SIZE)
+// largest request that can be served, see `_mapping_search`
+#define BLOCK_MAX ((uintptr_t)1 << ALLOC_FL_MAX)
+
+_Static_assert(HEADER_SIZE % ALIGN == 0, "block data must stay ALIGN aligned");
+_Static_assert((1 << ALLOC_ALIGN_LOG2) == ALIGN, "ALLOC_ALIGN_LOG2 doesn't match ALIGN");
+
+// block states, in the low bits of MemoryHeader_t.size
+#define BLOCK_USED   0
+#define BLOCK_FREE   1
+#define BLOCK_QUEUED 2 // freed on another core, waiting in the owner's remote free queue
+#define BLOCK_STATE  ((uintptr_t)3)
+// flag next to the state: the block belongs to a handle and the compactor may move it
+#define BLOCK_MOVABLE ((uintptr_t)4)
+#define BLOCK_FLAGS   ((uintptr_t)ALIGN - 1)
+
+// call site index in the top byte of MemoryHeader_t.size, the size in between
+#define SITE_SHIFT (sizeof(uintptr_t) * 8 - 8)
+#define SIZE_MASK  ((((uintptr_t)1 << SITE_SHIFT) - 1) & ~BLOCK_FLAGS)
+
+_Static_assert(((uintptr_t)2 << ALLOC_FL_MAX) <= SIZE_MASK, "block sizes run into the call site bits");
+_Static_assert(ALLOC_SITES <= 256, "call site index doesn't fit in a byte");
+_Static_assert(BLOCK_MOVABLE < ALIGN, "block flags run into the size");
+
+// a handle is its table entry's index + 1, the core whose table it is and the
+// entry's generation, so a freed handle (or one from the other core) is caught
+#define HANDLE_INDEX_BITS       12
+#define HANDLE_CORE_SHIFT       12
+#define HANDLE_GENERATION_SHIFT 16
+// a movable block's data starts with its table index, the caller's follows
+#define HANDLE_OVERHEAD ALIGN
+// blocks the compactor looks at between checks of its time budget
+#define COMPACT_CHECK_EVERY 32
+
+_Static_assert(ALLOC_HANDLES < (1 << HANDLE_INDEX_BITS), "too many handles for their index bits");
+_Static_assert(ALLOC_CORES <= (1 << (HANDLE_GENERATION_SHIFT - HANDLE_CORE_SHIFT)), "too many cores for the handle's core bits");
+
+typedef struct HandleEntry {
+	MemoryHeader_t* block; // NULL while unused
+	uint16_t locks;
+	uint16_t generation;   // bumped every time the entry is freed
+	uint16_t next_unused;  // while unused, the next unused entry + 1 (0 for none)
+} HandleEntry_t;
+
+typedef struct Heap {
+	uint8_t* start;
+	uintptr_t size;
+
+	// first block, and the zero sized block that marks the end of the heap
+	MemoryHeader_t* first;
+	MemoryHeader_t* last;
+
+	// segregated free lists, a set bit means the list (or any list in the
+	// first level) is non-empty
+	MemoryHeader_t* free_lists[ALLOC_FL_COUNT][ALLOC_SL_COUNT];
+	uint32_t fl_bitmap;
+	uint32_t sl_bitmap[ALLOC_FL_COUNT];
+
+	// blocks freed by the other core or by interrupt handlers, linked through
+	// next_free; pushed lock-free by anyone, taken all at once by the owner
+	_Atomic(MemoryHeader_t*) remote_frees;
+
+	// first sign of heap corruption, once set the heap is left alone
+	const char* corruption;
+
+	// relocatable blocks: handles name table entries and the entries point at
+	// the blocks, so the compactor only has to update the entry of one it moves
+	HandleEntry_t handles[ALLOC_HANDLES];
+	uint16_t handle_unused; // first unused entry + 1, 0 once the table is full
+	uint32_t handle_count;
+
+	// where alloc_compact carries on from; `compact_dirty` is set whenever a
+	// block is freed or unlocked, and a whole pass over the heap without it
+	// set leaves the compactor idle until it is
+	MemoryHeader_t* compact_cursor;
+	bool compact_dirty;
+	bool compact_idle;
+	uintptr_t compacted;
+
+#if ALLOC_STATS
+	// sites[0] counts untagged allocations
+	AllocSite_t sites[ALLOC_SITES];
+	uint32_t site_count;
+
+	uintptr_t live_bytes;
+	uintptr_t peak_bytes;
+	uint32_t allocations;
+	uint32_t frees;
+	uint32_t failures;
+	uint32_t histogram[ALLOC_HISTOGRAM_BUCKETS];
+#endif
+
+#if ALLOC_TRACE
+	// see alloc_trace_start, `trace` is NULL while not recording; the last
+	// recording stays in `trace_buffer` for alloc_trace_dump
+	uint8_t* trace;
+	uint8_t* trace_buffer;
+	uint32_t trace_size;
+	uint32_t trace_length;
+	uint32_t trace_events;
+	uint32_t trace_dropped;
+	uint32_t trace_time; // time_us_32() of the last event
+#endif
+} Heap_t;
 
-static MemoryHeader_t* _heap_first = NULL;
-static MemoryHeader_t* _heap_last = NULL;
+// one heap per core: a core only ever touches its own heap's free lists and
+// headers, so the fast paths need no locks at all
+static Heap_t _heaps[ALLOC_CORES];
 
 static uintptr_t _align(uintptr_t size, uintptr_t alignment) {
 	return (size + (alignment - 1)) & ~(alignment - 1);
@@ -24,130 +142,545 @@ static uintptr_t _align(uintptr_t size, uintptr_t alignment) {
  * is undefined.
  */
 static MemoryHeader_t* _get_header(void* ptr) {
-	return (MemoryHeader_t*)ptr - 1;
+	return (MemoryHeader_t*)((uint8_t*)ptr - HEADER_SIZE);
+}
+
+// the other core sets BLOCK_QUEUED on blocks next to ones this core may be
+// merging, so the size word is always read as a single access
+static uintptr_t _size_word(const MemoryHeader_t* header) {
+	return __atomic_load_n(&header->size, __ATOMIC_RELAXED);
+}
+
+static uintptr_t _block_size(const MemoryHeader_t* header) {
+	return _size_word(header) & SIZE_MASK;
+}
+
+static uintptr_t _block_state(const MemoryHeader_t* header) {
+	return _size_word(header) & BLOCK_STATE;
+}
+
+static uint8_t _block_site(const MemoryHeader_t* header) {
+	return (uint8_t)(_size_word(header) >> SITE_SHIFT);
+}
+
+static void _set_block_size(MemoryHeader_t* header, uintptr_t size) {
+	header->size = (_size_word(header) & ~SIZE_MASK) | size;
+}
+
+static void _set_block_state(MemoryHeader_t* header, uintptr_t state) {
+	header->size = (_size_word(header) & ~BLOCK_STATE) | state;
+}
+
+static void _set_block_site(MemoryHeader_t* header, uint8_t site) {
+	header->size = (_size_word(header) & (SIZE_MASK | BLOCK_FLAGS)) | ((uintptr_t)site << SITE_SHIFT);
+}
+
+static bool _is_movable(const MemoryHeader_t* header) {
+	return (_size_word(header) & BLOCK_MOVABLE) != 0;
 }
 
 static bool _is_free(MemoryHeader_t* header) {
-	return header->freed != 0;
+	return _block_state(header) == BLOCK_FREE;
 }
 
 static void* _get_buffer_start(MemoryHeader_t* header) {
-	return (void*)(header + 1);
+	return (uint8_t*)header + HEADER_SIZE;
 }
 
 /**
- * Compute the address immediately after the last block's usable data in the managed heap.
+ * Get the block physically following `header` in the heap.
+ */
+static MemoryHeader_t* _next_block(MemoryHeader_t* header) {
+	return (MemoryHeader_t*)((uint8_t*)header + HEADER_SIZE + _block_size(header));
+}
+
+/**
+ * Get the block physically before `header`, from its boundary tag. Not valid
+ * for the heap's first block.
+ */
+static MemoryHeader_t* _prev_block(MemoryHeader_t* header) {
+	return (MemoryHeader_t*)((uint8_t*)header - header->prev_size - HEADER_SIZE);
+}
+
+/**
+ * Update the boundary tag of the block after `header` once `header` changed size.
+ */
+static void _update_boundary_tag(MemoryHeader_t* header) {
+	_next_block(header)->prev_size = _block_size(header);
+}
+
+/**
+ * Merge `next`, the block physically after `header`, into it. `next` must be
+ * off the free lists and `header` too.
+ */
+static void _absorb_block(Heap_t* heap, MemoryHeader_t* header, MemoryHeader_t* next) {
+	_set_block_size(header, _block_size(header) + HEADER_SIZE + _block_size(next));
+	_update_boundary_tag(header);
+
+	// the compactor mustn't be left pointing into the middle of a block
+	if (heap->compact_cursor == next) heap->compact_cursor = header;
+}
+
+static int _fls(uintptr_t value) {
+	return 31 - __builtin_clz((uint32_t)value);
+}
+
+/**
+ * Find the free list a block of `size` bytes belongs on.
  *
- * @returns The byte address (as `uintptr_t`) one past the last block's data region; `0` if the allocator is uninitialized (`_heap_last` is `NULL`).
+ * @param size Block data size.
+ * @param fl Set to the first level index (power of two).
+ * @param sl Set to the second level index (subdivision of that power of two).
  */
-static uintptr_t _current_heap_end() {
-	if (_heap_last == NULL) return 0;
+static void _mapping(uintptr_t size, int* fl, int* sl) {
+	if (size < ALLOC_SMALL_BLOCK) {
+		*fl = 0;
+		*sl = (int)(size / (ALLOC_SMALL_BLOCK / ALLOC_SL_COUNT));
+		return;
+	}
+
+	int bit = _fls(size);
+	*sl = (int)(size >> (bit - ALLOC_SL_LOG2)) ^ ALLOC_SL_COUNT;
+	*fl = bit - (ALLOC_FL_SHIFT - 1);
+}
+
+/**
+ * Find the first free list whose blocks are all at least `size` bytes, by
+ * rounding `size` up to the next size class.
+ */
+static void _mapping_search(uintptr_t size, int* fl, int* sl) {
+	if (size >= ALLOC_SMALL_BLOCK) {
+		size += ((uintptr_t)1 << (_fls(size) - ALLOC_SL_LOG2)) - 1;
+	}
+	_mapping(size, fl, sl);
+}
+
+static void _insert_free(Heap_t* heap, MemoryHeader_t* header) {
+	int fl, sl;
+	_mapping(_block_size(header), &fl, &sl);
+
+	header->prev_free = NULL;
+	header->next_free = heap->free_lists[fl][sl];
+	if (header->next_free != NULL) header->next_free->prev_free = header;
+	heap->free_lists[fl][sl] = header;
+
+	heap->fl_bitmap |= 1u << fl;
+	heap->sl_bitmap[fl] |= 1u << sl;
+}
+
+static void _remove_free(Heap_t* heap, MemoryHeader_t* header) {
+	int fl, sl;
+	_mapping(_block_size(header), &fl, &sl);
+
+	if (header->prev_free != NULL) {
+		header->prev_free->next_free = header->next_free;
+	} else {
+		heap->free_lists[fl][sl] = header->next_free;
+	}
+	if (header->next_free != NULL) header->next_free->prev_free = header->prev_free;
 
-	return (uintptr_t)_heap_last + sizeof(MemoryHeader_t) + _heap_last->size;
+	if (heap->free_lists[fl][sl] == NULL) {
+		heap->sl_bitmap[fl] &= ~(1u << sl);
+		if (heap->sl_bitmap[fl] == 0) heap->fl_bitmap &= ~(1u << fl);
+	}
 }
 
 /**
- * Merge consecutive free blocks after `header` into `header`, enlarging its usable size.
+ * Find a free block of at least `size` bytes in constant time: the head of
+ * the first non-empty list at or above `size`'s (rounded up) size class.
  *
- * If the merged region reaches the end of the managed heap, `header->next` is set to NULL
- * and the global `_heap_last` is updated to point to `header`. If a heap corruption is
- * detected (invalid pointer ordering), a diagnostic is emitted and the process aborts in
- * debug builds.
+ * Failing that, the blocks in `size`'s own class are checked one by one, as
+ * some of them may still be big enough (e.g. the whole heap when nearly all
+ * of it is asked for).
  *
- * @param header Header whose following free blocks should be absorbed; no action is taken if `header` is NULL or its immediate successor is not free.
+ * @returns The block (still on its free list), or `NULL` if none is big enough.
  */
-static void _extend_block(MemoryHeader_t* header) {
-	if (header == NULL) return;
-	if (header->next == NULL || !_is_free(header->next)) return;
+static MemoryHeader_t* _find_free(Heap_t* heap, uintptr_t size) {
+	int fl, sl;
+	_mapping_search(size, &fl, &sl);
+
+	if (fl < ALLOC_FL_COUNT) {
+		uint32_t sl_map = heap->sl_bitmap[fl] & (~0u << sl);
+		if (sl_map == 0) {
+			// nothing left in this power of two, move up to the next non-empty one
+			uint32_t fl_map = heap->fl_bitmap & (~0u << (fl + 1));
+			if (fl_map != 0) {
+				fl = __builtin_ctz(fl_map);
+				sl_map = heap->sl_bitmap[fl];
+			}
+		}
+		if (sl_map != 0) return heap->free_lists[fl][__builtin_ctz(sl_map)];
+	}
 
-	MemoryHeader_t* next = header->next;
-	while (next->next != NULL && _is_free(next->next)) {
-		next = next->next;
+	_mapping(size, &fl, &sl);
+	for (MemoryHeader_t* header = heap->free_lists[fl][sl]; header != NULL; header = header->next_free) {
+		if (_block_size(header) >= size) return header;
 	}
 
-	if (next->next == NULL) {
-		// this has to be the end, otherwise something has gone very wrong...
-		header->next = NULL;
-		_heap_last = header;
-		// dropping extra headers is intentional, it enables avoiding a search
-		// in malloc and just appending to the end of the heap
-	} else {
-		if ((uintptr_t)next->next <= (uintptr_t)header) {
-			// this should never happen, corrupted heap...
+	return NULL;
+}
 
-			// you fucked veeeeery up bad if you got here
-			// that or i've done something really dumb
+/**
+ * Record that the heap is corrupted. Debug builds stop here; release builds
+ * stop touching the heap: malloc and realloc fail and free does nothing, so a
+ * damaged block is never handed out twice. `alloc_stats` reports the reason.
+ *
+ * @param reason What was found.
+ * @param where Address of the offending block.
+ */
+static void _heap_corrupted(Heap_t* heap, const char* reason, const void* where) {
+	if (heap->corruption == NULL) heap->corruption = reason;
 
 #ifdef DEBUG
-			fprintf(stderr, "Error: corrupted heap detected\n");
-			abort();
+	fprintf(stderr, "Error: corrupted heap detected (%s at %p)\n", reason, where);
+	abort();
+#else
+	(void)where;
 #endif
+}
 
-			// TODO: figure out what behaviour should be in release
+#if ALLOC_STATS
+static uint8_t _site_index(Heap_t* heap, const char* tag) {
+	if (tag == NULL) return 0;
 
-			return;
-		}
-		header->size = (uintptr_t)next->next
-			- (uintptr_t)header
-			- sizeof(MemoryHeader_t);
-		header->next = next->next;
+	for (uint32_t i = 1; i < heap->site_count; i++) {
+		if (heap->sites[i].tag == tag || strcmp(heap->sites[i].tag, tag) == 0) return (uint8_t)i;
+	}
+
+	// out of slots, lump the rest together in the last one
+	if (heap->site_count == ALLOC_SITES) {
+		heap->sites[ALLOC_SITES - 1].tag = "other";
+		return ALLOC_SITES - 1;
 	}
 
-	return;
+	heap->sites[heap->site_count].tag = tag;
+	return (uint8_t)heap->site_count++;
+}
+
+static void _account_request(Heap_t* heap, uintptr_t bytes) {
+	int bucket = bytes < 8 ? 0 : _fls(bytes) - 2;
+	if (bucket >= ALLOC_HISTOGRAM_BUCKETS) bucket = ALLOC_HISTOGRAM_BUCKETS - 1;
+	heap->histogram[bucket]++;
+}
+
+static void _account_alloc(Heap_t* heap, MemoryHeader_t* header, uint8_t site) {
+	_set_block_site(header, site);
+	heap->allocations++;
+	heap->sites[site].allocations++;
+
+	heap->live_bytes += _block_size(header);
+	if (heap->live_bytes > heap->peak_bytes) heap->peak_bytes = heap->live_bytes;
+	heap->sites[site].live_bytes += _block_size(header);
+	if (heap->sites[site].live_bytes > heap->sites[site].peak_bytes) heap->sites[site].peak_bytes = heap->sites[site].live_bytes;
+}
+
+static void _account_free(Heap_t* heap, MemoryHeader_t* header) {
+	heap->frees++;
+	heap->live_bytes -= _block_size(header);
+	heap->sites[_block_site(header)].live_bytes -= _block_size(header);
+}
+
+// block resized in place from `old_size`
+static void _account_resize(Heap_t* heap, MemoryHeader_t* header, uintptr_t old_size) {
+	AllocSite_t* site = &heap->sites[_block_site(header)];
+
+	heap->live_bytes = heap->live_bytes - old_size + _block_size(header);
+	if (heap->live_bytes > heap->peak_bytes) heap->peak_bytes = heap->live_bytes;
+	site->live_bytes = site->live_bytes - old_size + _block_size(header);
+	if (site->live_bytes > site->peak_bytes) site->peak_bytes = site->live_bytes;
+}
+#endif
+
+/**
+ * Get the block after `header`, if it's free.
+ *
+ * @returns The block (still on its free list), or `NULL` if it isn't free or
+ * `header` runs past the end of the heap (recorded with `_heap_corrupted`).
+ */
+static MemoryHeader_t* _free_next_block(Heap_t* heap, MemoryHeader_t* header) {
+	MemoryHeader_t* next = _next_block(header);
+
+	if ((uintptr_t)next <= (uintptr_t)header || (uintptr_t)next > (uintptr_t)heap->last) {
+		// this should never happen, corrupted heap...
+
+		// you fucked veeeeery up bad if you got here
+		// that or i've done something really dumb
+		_heap_corrupted(heap, "block runs past the end of the heap", header);
+		return NULL;
+	}
+
+	return _is_free(next) ? next : NULL;
 }
 
 /**
- * Ensure a free block is coalesced with adjacent free blocks and that the heap end sentinel is correct.
+ * Merge the block after `header` into it if that one is free, enlarging its
+ * usable size.
  *
- * If `header` refers to a free block, this will merge it with any following free blocks and update
- * the allocator's end-of-heap marker when `header` becomes the last block. If `header` is NULL or
- * not free, the function does nothing.
+ * Free blocks are merged with both neighbours as soon as they're released, so
+ * there's never more than one free block to absorb. It is taken off its free
+ * list; `header` itself must not be on one (its size changes).
  *
- * @param header Pointer to the block header to defragment (must belong to this allocator).
+ * @param header Header whose following free block should be absorbed.
  */
-static void _defragment_block(MemoryHeader_t* header) {
-	if (header == NULL || !_is_free(header)) return;
-	if (header->next == NULL) {
-		_heap_last = header;
-		return;
+static void _extend_block(Heap_t* heap, MemoryHeader_t* header) {
+	MemoryHeader_t* next = _free_next_block(heap, header);
+	if (next == NULL) return;
+
+	_remove_free(heap, next);
+	_absorb_block(heap, header, next);
+}
+
+/**
+ * Get the block before `header` through its boundary tag, if that one is free.
+ *
+ * @returns The block (still on its free list), or `NULL` if `header` is the
+ * first block, the one before it isn't free, or the tag is damaged (recorded
+ * with `_heap_corrupted`).
+ */
+static MemoryHeader_t* _free_prev_block(Heap_t* heap, MemoryHeader_t* header) {
+	if (header == heap->first) return NULL;
+
+	MemoryHeader_t* prev = _prev_block(header);
+	if ((uintptr_t)prev < (uintptr_t)heap->first || _next_block(prev) != header) {
+		_heap_corrupted(heap, "bad boundary tag", header);
+		return NULL;
 	}
-	_extend_block(header);
+
+	return _is_free(prev) ? prev : NULL;
 }
 
 /**
- * Split a free memory block into a leading block of the requested size and a trailing free fragment when there is sufficient leftover space.
+ * Mark a block free, merge it with the free blocks on either side of it and
+ * put the result on its free list.
  *
- * If the header's size minus `size` is smaller than the space required for a new MemoryHeader_t plus MINIMUM_BLOCK_SIZE, no action is taken.
+ * The block after is found from the block's size and the block before from
+ * its boundary tag, so this takes constant time, and no two free blocks are
+ * ever left next to each other. Blocks queued by the other core aren't free
+ * yet, they merge when their owner releases them.
  *
- * @param header Pointer to the free block's header to be potentially split.
+ * @param header Block to release, must not be on a free list.
+ */
+static void _release_block(Heap_t* heap, MemoryHeader_t* header) {
+	_set_block_state(header, BLOCK_FREE);
+	_extend_block(heap, header);
+
+	MemoryHeader_t* prev = _free_prev_block(heap, header);
+	if (prev != NULL) {
+		_remove_free(heap, prev);
+		_absorb_block(heap, prev, header);
+		header = prev;
+	}
+
+	_insert_free(heap, header);
+
+	// a new hole for the compactor to fill
+	heap->compact_dirty = true;
+	heap->compact_idle = false;
+}
+
+/**
+ * Split a block into a leading block of the requested size and a trailing free fragment when there is sufficient leftover space.
+ *
+ * If the header's size minus `size` is smaller than the space required for a new block header plus `BLOCK_MIN`, no action is taken.
+ *
+ * @param header Pointer to the block's header to be potentially split, must be in use.
  * @param size Requested size (in bytes) for the leading block; remaining bytes (if large enough) form a new free fragment.
  */
-static void _fragment_block(MemoryHeader_t* header, uintptr_t size) {
-	if (size > header->size) return;
-	uintptr_t remaining_space = header->size - size;
+static void _fragment_block(Heap_t* heap, MemoryHeader_t* header, uintptr_t size) {
+	uintptr_t block_size = _block_size(header);
+	if (size > block_size) return;
+	uintptr_t remaining_space = block_size - size;
 	// if there isn't enough space for anything really
-	if (remaining_space < sizeof(MemoryHeader_t) + MINIMUM_BLOCK_SIZE) {
+	if (remaining_space < HEADER_SIZE + BLOCK_MIN) {
 		return;
 	}
 
 	// otherwise fragment to leave extra space free
-	MemoryHeader_t* fragment =
-		(MemoryHeader_t*)((uint8_t*)header + sizeof(MemoryHeader_t) + size);
-	fragment->size = remaining_space - sizeof(MemoryHeader_t);
-	fragment->next = header->next;
-	fragment->freed = 0;
-	free(_get_buffer_start(fragment));
-	
-	header->size = size;
-	header->next = fragment;
+	_set_block_size(header, size);
+
+	MemoryHeader_t* fragment = _next_block(header);
+	fragment->size = (remaining_space - HEADER_SIZE) | BLOCK_USED;
+	fragment->prev_size = size;
+	_update_boundary_tag(fragment);
+	_release_block(heap, fragment);
+}
+
+static Heap_t* _local_heap() {
+	return &_heaps[get_core_num()];
+}
+
+static bool _in_interrupt() {
+	return __get_current_exception() != 0;
 }
 
 /**
- * Initialize the allocator to manage a contiguous heap region.
+ * Find the heap a block belongs to. A core's region is itself a block of core
+ * 0's heap (see `alloc_init_core`), so later cores are checked first.
  *
- * Sets the internal heap base and size and installs an initial sentinel
- * header at the start of the region which serves as the first list node for
- * allocations.
+ * @returns The heap, or `NULL` if `ptr` isn't in any heap.
+ */
+static Heap_t* _owner(const void* ptr) {
+	const MemoryHeader_t* header = (const MemoryHeader_t*)((const uint8_t*)ptr - HEADER_SIZE);
+
+	for (int core = ALLOC_CORES - 1; core >= 0; core--) {
+		Heap_t* heap = &_heaps[core];
+		if (heap->start != NULL && header >= heap->first && header < heap->last) return heap;
+	}
+
+	return NULL;
+}
+
+#if ALLOC_TRACE
+static uint8_t* _trace_varint(uint8_t* out, uintptr_t value) {
+	while (value >= 0x80) {
+		*out++ = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	*out++ = (uint8_t)value;
+	return out;
+}
+
+// block ids are offsets into core 0's heap, which holds every other core's
+static uintptr_t _trace_id(const void* ptr) {
+	if (ptr == NULL) return 0;
+	return ((uintptr_t)ptr - (uintptr_t)_heaps[0].start) / ALIGN + 1;
+}
+
+/**
+ * Append an event to the calling core's trace, if it's recording (see
+ * `alloc_trace_start`). Interrupts are held off while it's written, as
+ * handlers may free too.
+ *
+ * @param op ALLOC_TRACE_MALLOC, ALLOC_TRACE_FREE or ALLOC_TRACE_REALLOC.
+ * @param ptr Block passed in (free, realloc), otherwise `NULL`.
+ * @param size Bytes asked for (malloc, realloc).
+ * @param result Block returned (malloc, realloc).
+ */
+static void _trace_event(int op, const void* ptr, uintptr_t size, const void* result) {
+	Heap_t* heap = _local_heap();
+	if (heap->trace == NULL) return;
+
+	uint32_t irq = save_and_disable_interrupts();
+
+	uint8_t event[ALLOC_TRACE_EVENT_MAX];
+	uint8_t* out = event;
+	bool failed = op != ALLOC_TRACE_FREE && result == NULL;
+
+	uint32_t now = time_us_32();
+	*out++ = (uint8_t)(op | (failed ? ALLOC_TRACE_FAILED : 0));
+	out = _trace_varint(out, now - heap->trace_time);
+	if (op != ALLOC_TRACE_MALLOC) out = _trace_varint(out, _trace_id(ptr));
+	if (op != ALLOC_TRACE_FREE) out = _trace_varint(out, size);
+	if (op != ALLOC_TRACE_FREE && !failed) out = _trace_varint(out, _trace_id(result));
+
+	uint32_t length = (uint32_t)(out - event);
+	if (heap->trace_dropped == 0 && heap->trace_length + length <= heap->trace_size) {
+		memcpy(heap->trace + heap->trace_length, event, length);
+		heap->trace_length += length;
+		heap->trace_events++;
+		heap->trace_time = now;
+	} else {
+		// stop at the first event that doesn't fit, so the trace stays replayable
+		heap->trace_dropped++;
+	}
+
+	restore_interrupts(irq);
+}
+#endif
+
+/**
+ * Set up `heap` to manage a contiguous region.
+ *
+ * The region becomes a single free block followed by a zero sized end marker
+ * block, so merging never runs off the end of the heap.
+ *
+ * @returns `false` if the region is too small.
+ */
+static bool _init_heap(Heap_t* heap, uint8_t* heap_start, uintptr_t size) {
+	// just to filter out basic errors
+	if (heap_start == NULL) return false;
+
+	uintptr_t aligned_start = _align((uintptr_t)heap_start, ALIGN);
+	uintptr_t alignment_loss = aligned_start - (uintptr_t)heap_start;
+
+	if (size < alignment_loss + 2 * HEADER_SIZE + BLOCK_MIN + MINIMUM_HEAP_SIZE) return false;
+
+	uintptr_t heap_size = (size - alignment_loss) & ~(uintptr_t)(ALIGN - 1);
+
+	// the largest block the free lists can hold
+	uintptr_t largest = ((uintptr_t)2 << ALLOC_FL_MAX) - ALIGN;
+	if (heap_size > largest + 2 * HEADER_SIZE) heap_size = largest + 2 * HEADER_SIZE;
+
+	heap->first = (MemoryHeader_t*)aligned_start;
+	heap->last = (MemoryHeader_t*)(aligned_start + heap_size - HEADER_SIZE);
+	heap->last->size = 0 | BLOCK_USED;
+
+	heap->first->size = ((uintptr_t)heap->last - (uintptr_t)heap->first - HEADER_SIZE) | BLOCK_USED;
+	heap->first->prev_size = 0;
+	_update_boundary_tag(heap->first);
+	_release_block(heap, heap->first);
+
+	// set last, `_owner` on the other core goes by it
+	heap->size = heap_size;
+	heap->start = (uint8_t*)aligned_start;
+	return true;
+}
+
+/**
+ * Forget every block and free list of `heap`, see `alloc_free`.
+ */
+static void _reset_heap(Heap_t* heap) {
+	heap->start = NULL;
+	heap->size = 0;
+	heap->first = NULL;
+	heap->last = NULL;
+
+	for (int fl = 0; fl < ALLOC_FL_COUNT; fl++) {
+		for (int sl = 0; sl < ALLOC_SL_COUNT; sl++) {
+			heap->free_lists[fl][sl] = NULL;
+		}
+		heap->sl_bitmap[fl] = 0;
+	}
+	heap->fl_bitmap = 0;
+	atomic_store(&heap->remote_frees, NULL);
+	heap->corruption = NULL;
+
+	for (uint32_t i = 0; i < ALLOC_HANDLES; i++) {
+		heap->handles[i] = (HandleEntry_t){ .next_unused = i + 1 < ALLOC_HANDLES ? (uint16_t)(i + 2) : 0 };
+	}
+	heap->handle_unused = 1;
+	heap->handle_count = 0;
+
+	heap->compact_cursor = NULL;
+	heap->compact_dirty = false;
+	heap->compact_idle = true;
+	heap->compacted = 0;
+
+#if ALLOC_STATS
+	for (uint32_t i = 0; i < ALLOC_SITES; i++) {
+		heap->sites[i] = (AllocSite_t){ 0 };
+	}
+	heap->sites[0].tag = "untagged";
+	heap->site_count = 1;
+
+	heap->live_bytes = heap->peak_bytes = 0;
+	heap->allocations = heap->frees = heap->failures = 0;
+	for (int i = 0; i < ALLOC_HISTOGRAM_BUCKETS; i++) {
+		heap->histogram[i] = 0;
+	}
+#endif
+
+#if ALLOC_TRACE
+	heap->trace = NULL;
+	heap->trace_buffer = NULL;
+	heap->trace_size = heap->trace_length = 0;
+	heap->trace_events = heap->trace_dropped = 0;
+#endif
+}
+
+/**
+ * Initialize the allocator to manage a contiguous heap region, all of it
+ * belonging to core 0. Give other cores a heap with `alloc_init_core`.
  *
  * @param heap_start Pointer to the start of the heap memory region to manage.
  * @param size Size of the heap region in bytes.
@@ -156,171 +689,412 @@ void alloc_init(uint8_t* heap_start, uintptr_t size) {
 	// just to filter out basic errors
 	if (heap_start == NULL) return;
 
-	uintptr_t aligned_start = _align((uintptr_t)heap_start, ALIGN);
-	uintptr_t alignment_loss = aligned_start - (uintptr_t)heap_start;
+	alloc_free();
+	_init_heap(&_heaps[0], heap_start, size);
+}
 
-	if (size < alignment_loss + sizeof(MemoryHeader_t) + MINIMUM_HEAP_SIZE) return;
+/**
+ * Give a core its own heap of `size` bytes, carved out of core 0's heap.
+ *
+ * Each core allocates only from its own heap, without locks; memory can still
+ * be freed from either core (blocks go back to the heap they came from). Call
+ * on core 0 before `core` starts allocating, e.g. before launching it.
+ *
+ * @param core Core to set up, 1 .. ALLOC_CORES - 1.
+ * @param size Bytes for its heap.
+ * @returns `false` if called on the wrong core, the core already has a heap,
+ * or core 0's heap can't spare `size` bytes.
+ */
+bool alloc_init_core(uint32_t core, uintptr_t size) {
+	if (core == 0 || core >= ALLOC_CORES || get_core_num() != 0) return false;
+	if (_heaps[core].start != NULL) return false;
 
-	_heap_start = (uint8_t*)aligned_start;
-	_heap_size = size - alignment_loss;
+	uint8_t* region = malloc_tagged(size, "core heap");
+	if (region == NULL) return false;
 
-	_heap_first = (MemoryHeader_t*)_heap_start;
-	_heap_first->size = 0;
-	_heap_first->freed = 0;
-	_heap_first->next = NULL;
-	_heap_last = _heap_first;
+	if (!_init_heap(&_heaps[core], region, size)) {
+		free(region);
+		return false;
+	}
+
+	return true;
 }
 
 /**
  * Release all allocated heap blocks and reset the allocator state.
  *
- * Frees every MemoryHeader_t in the managed heap and sets internal allocator
- * globals (_heap_start, _heap_size, _heap_first, _heap_last) to indicate
- * the heap is uninitialized. After this call, allocations will fail until
- * alloc_init is called again.
+ * Forgets every block and free list of every core's heap, marking them
+ * uninitialized. After this call, allocations will fail until alloc_init is
+ * called again. Neither core may be allocating while this runs.
  */
 void alloc_free() {
-	_heap_start = NULL;
-	_heap_size = 0;
-	_heap_first = NULL;
-	_heap_last = NULL;
+	for (int core = 0; core < ALLOC_CORES; core++) {
+		_reset_heap(&_heaps[core]);
+	}
 }
 
 /**
- * Allocate a contiguous block of memory from the custom heap.
- *
- * Requests a block of at least `bytes` bytes from the allocator and returns
- * a pointer to the start of the usable data region.
- * @param bytes Number of bytes requested; value is rounded up to the allocator's alignment (ALIGN). A request of 0 returns NULL.
- * @return Pointer to the start of the allocated usable memory, or NULL if the heap is uninitialized, `bytes` is zero, or no suitable block is available.
+ * Queue a block freed away from its heap's core (or in an interrupt handler)
+ * for the owner to release. Lock-free: the block's `next_free` links it in
+ * front of whatever is queued already.
  */
-void* malloc(uintptr_t bytes) {
-	if (_heap_start == NULL || bytes == 0) return NULL;
+static void _push_remote_free(Heap_t* heap, MemoryHeader_t* header) {
+	__atomic_store_n(&header->size, _size_word(header) | BLOCK_QUEUED, __ATOMIC_RELAXED);
+
+	MemoryHeader_t* head = atomic_load_explicit(&heap->remote_frees, memory_order_relaxed);
+	do {
+		header->next_free = head;
+	} while (!atomic_compare_exchange_weak_explicit(&heap->remote_frees, &head, header,
+		memory_order_release, memory_order_relaxed));
+}
 
-	// make sure bytes is aligned (round up)
-	bytes = _align(bytes, ALIGN);
+/**
+ * Give a block back to the free lists of the heap it belongs to, which must
+ * be the calling core's.
+ */
+static void _free_local(Heap_t* heap, MemoryHeader_t* header) {
+#if ALLOC_STATS
+	_account_free(heap, header);
+#endif
+	_release_block(heap, header);
+}
+
+/**
+ * Release every block the other core (or an interrupt handler) queued for
+ * this heap. Costs one load when the queue is empty.
+ */
+static void _drain_remote_frees(Heap_t* heap) {
+	if (atomic_load_explicit(&heap->remote_frees, memory_order_relaxed) == NULL) return;
+
+	MemoryHeader_t* header = atomic_exchange_explicit(&heap->remote_frees, NULL, memory_order_acquire);
+	while (header != NULL) {
+		MemoryHeader_t* next = header->next_free;
+		_free_local(heap, header);
+		header = next;
+	}
+}
 
-	// check if the last block is free, if so we can extend it
-	if (_is_free(_heap_last)) {
-		if (_heap_last->size >= bytes) {
-			_heap_last->size = bytes;
-			_heap_last->freed = 0;
-			return _get_buffer_start(_heap_last);
+/**
+ * Whether the compactor may move `header`: a handle's block, in use and not
+ * locked.
+ */
+static bool _can_move(Heap_t* heap, const MemoryHeader_t* header) {
+	if ((_size_word(header) & (BLOCK_STATE | BLOCK_MOVABLE)) != (BLOCK_USED | BLOCK_MOVABLE)) return false;
+
+	uintptr_t index = *(const uintptr_t*)((const uint8_t*)header + HEADER_SIZE);
+	return heap->handles[index].locks == 0;
+}
+
+/**
+ * Slide a movable block down into the free block right before it, leaving
+ * the free space after it instead (merged with whatever is free there), and
+ * point its handle at its new place.
+ *
+ * @param hole Free block.
+ * @param block Movable block following it, see `_can_move`.
+ * @returns The free block now after the moved one.
+ */
+static MemoryHeader_t* _slide_block(Heap_t* heap, MemoryHeader_t* hole, MemoryHeader_t* block) {
+	uintptr_t hole_size = _block_size(hole);
+	uintptr_t size_word = _size_word(block);
+	uintptr_t size = _block_size(block);
+
+	_remove_free(heap, hole);
+
+	// the hole's header becomes the block's, keeping its boundary tag; the
+	// data overlaps its old place (and header) when the hole is the smaller
+	hole->size = size_word;
+	memmove(_get_buffer_start(hole), _get_buffer_start(block), size);
+	heap->handles[*(uintptr_t*)_get_buffer_start(hole)].block = hole;
+
+	MemoryHeader_t* rest = _next_block(hole);
+	rest->size = hole_size | BLOCK_USED;
+	rest->prev_size = size;
+	_update_boundary_tag(rest);
+	_release_block(heap, rest);
+
+	heap->compacted += size;
+	return rest;
+}
+
+/**
+ * Move unlocked handle blocks down into the holes before them, walking the
+ * heap from where the last call stopped, until `budget_us` microseconds have
+ * passed (checked after every move and every COMPACT_CHECK_EVERY blocks) or
+ * a whole pass finds nothing to do. See `alloc_compact`.
+ *
+ * @returns Bytes moved.
+ */
+static uint32_t _compact(Heap_t* heap, uint32_t budget_us) {
+	if (heap->handle_count == 0 || heap->compact_idle) return 0;
+
+	uint32_t start = time_us_32();
+	uint32_t moved = 0;
+	uint32_t visited = 0;
+	MemoryHeader_t* header = heap->compact_cursor != NULL ? heap->compact_cursor : heap->first;
+	while (true) {
+		if (header == heap->last) {
+			// a whole pass with nothing freed or unlocked leaves nothing to move
+			if (!heap->compact_dirty) {
+				heap->compact_idle = true;
+				header = heap->first;
+				break;
+			}
+			heap->compact_dirty = false;
+			header = heap->first;
 		}
 
-		uintptr_t space_needed = bytes - _heap_last->size;
-		uintptr_t heap_end = _current_heap_end();
-		if (space_needed > UINTPTR_MAX - heap_end) return NULL;
+		MemoryHeader_t* next = _next_block(header);
+		if (next <= header || next > heap->last) {
+			_heap_corrupted(heap, "block runs past the end of the heap", header);
+			header = NULL;
+			break;
+		}
 
-		// make sure there's enough space to extend
-		if (heap_end + space_needed
-				<= (uintptr_t)_heap_start + _heap_size) {
-			_heap_last->size = bytes;
-			_heap_last->freed = 0;
-			return _get_buffer_start(_heap_last);
+		if (_is_free(header) && _can_move(heap, next)) {
+			moved += (uint32_t)_block_size(next);
+			header = _slide_block(heap, header, next);
+			visited = COMPACT_CHECK_EVERY;
+		} else {
+			header = next;
+			visited++;
 		}
 
-		// otherwise just fall through and continue as normal
+		if (visited >= COMPACT_CHECK_EVERY) {
+			visited = 0;
+			if (time_us_32() - start >= budget_us) break;
+		}
 	}
 
-	// otherwise check if we have room to allocate memory
-	// at the end of the currently used heap
-	// (quicker than searching, so this is prioritised)
-	uintptr_t heap_end = _current_heap_end();
-	uintptr_t new_block_size = sizeof(MemoryHeader_t) + bytes;
-	if (new_block_size > UINTPTR_MAX - heap_end) return NULL;
-
-	if (heap_end + new_block_size
-			<= (uintptr_t)_heap_start + _heap_size) {
-		_heap_last->next = (MemoryHeader_t*)(
-			(uint8_t*)_heap_last
-			+ _heap_last->size
-			+ sizeof(MemoryHeader_t)
-		);
+	heap->compact_cursor = header;
+	return moved;
+}
 
-		_heap_last = _heap_last->next;
+/**
+ * Take a block of at least `bytes` bytes off the free lists, charged to call
+ * site `site` in ALLOC_STATS builds. See `malloc`.
+ */
+static void* _allocate(Heap_t* heap, uintptr_t bytes, uint8_t site) {
+	if (heap->start == NULL || heap->corruption != NULL || bytes == 0 || bytes > BLOCK_MAX) return NULL;
 
-		_heap_last->size = bytes;
-		_heap_last->freed = 0;
-		_heap_last->next = NULL;
+	_drain_remote_frees(heap);
 
-		return _get_buffer_start(_heap_last);
-	}
+#if ALLOC_STATS
+	_account_request(heap, bytes);
+#else
+	(void)site;
+#endif
 
-	// search for an unused block
-	MemoryHeader_t* search = _heap_first;
-	while (search != NULL &&
-			(!_is_free(search) ||
-			bytes > search->size)) {
-		// if possible, defragment
-		MemoryHeader_t* next = search->next;
-		if (next != NULL && _is_free(search) && _is_free(next)) {
-			_defragment_block(search);
+	// make sure bytes is aligned (round up)
+	bytes = _align(bytes, ALIGN);
+	if (bytes < BLOCK_MIN) bytes = BLOCK_MIN;
 
-			// if the defragmented block is now large enough
-			if (bytes <= search->size) break;
-		}
+	MemoryHeader_t* block = _find_free(heap, bytes);
 
-		search = search->next;
-	}
+	// unlocked handle blocks may be all that's in the way, move them all down
+	// (however long that takes) and look again
+	if (block == NULL && _compact(heap, UINT32_MAX) > 0) block = _find_free(heap, bytes);
 
 	// no free memory
-	if (search == NULL) {
+	if (block == NULL) {
+#if ALLOC_STATS
+		heap->failures++;
+#endif
 		return NULL;
 	}
-	
-	search->freed = 0;
 
-	// already correct size
-	if (search->size == bytes) {
-		return _get_buffer_start(search);
-	}
+	_remove_free(heap, block);
+	_set_block_state(block, BLOCK_USED);
 
-	_fragment_block(search, bytes);
+	_fragment_block(heap, block, bytes);
 
-	return _get_buffer_start(search);
+#if ALLOC_STATS
+	_account_alloc(heap, block, site);
+#endif
+
+	return _get_buffer_start(block);
 }
 
 /**
- * Resize an allocated memory block to hold at least `new_size` bytes, preserving existing data up to the smaller of the old and new sizes.
+ * Allocate a contiguous block of memory from the calling core's heap.
  *
- * If `ptr` is `NULL`, the call is equivalent to `malloc(new_size)`. If `new_size` is 0, the allocation is freed and `NULL` is returned. The requested size is rounded up to the allocator's alignment before allocation.
- * @param ptr Pointer to a previously allocated memory block returned by this allocator, or `NULL`.
- * @param new_size Desired size in bytes for the allocation.
- * @returns Pointer to a memory region containing the original data (possibly relocated), or `NULL` if allocation failed or `new_size` was 0.
-void* realloc(void* ptr, uintptr_t new_size) {
-	if (ptr == NULL) return malloc(new_size);
-	if (new_size == 0) {
-		free(ptr);
+ * Takes a block from the first non-empty free list whose size class is large
+ * enough (two bitmap scans, no search) and returns the unused tail to the
+ * free lists.
+ *
+ * Not for interrupt handlers, they'd race the core they interrupted; they get
+ * `NULL` (and an abort in debug builds).
+ * @param bytes Number of bytes requested; value is rounded up to the allocator's alignment (ALIGN). A request of 0 returns NULL.
+ * @return Pointer to the start of the allocated usable memory, or NULL if the heap is uninitialized, `bytes` is zero, or no suitable block is available.
+ */
+void* malloc(uintptr_t bytes) {
+	return malloc_tagged(bytes, NULL);
+}
+
+/**
+ * `malloc` that, in ALLOC_STATS builds, charges the block to `tag` (see
+ * `alloc_sites`). Usually called through `TAGGED_MALLOC`, which tags with the
+ * file and line.
+ *
+ * @param bytes Number of bytes requested.
+ * @param tag Call site name, compared by content and kept by pointer, so it
+ * has to outlive the allocator (a string literal). `NULL` means untagged.
+ * @returns Same as `malloc`.
+ */
+void* malloc_tagged(uintptr_t bytes, const char* tag) {
+	if (_in_interrupt()) {
+#ifdef DEBUG
+		fprintf(stderr, "Error: malloc called from an interrupt handler\n");
+		abort();
+#endif
 		return NULL;
 	}
 
+	TRACE_BEGIN("malloc");
+	Heap_t* heap = _local_heap();
+	void* result = NULL;
+#if ALLOC_STATS
+	if (heap->start != NULL && heap->corruption == NULL) result = _allocate(heap, bytes, _site_index(heap, tag));
+#else
+	(void)tag;
+	result = _allocate(heap, bytes, 0);
+#endif
+
+#if ALLOC_TRACE
+	_trace_event(ALLOC_TRACE_MALLOC, NULL, bytes, result);
+#endif
+	TRACE_END("malloc");
+	return result;
+}
+
+/**
+ * `free` without the trace event, see there.
+ */
+static void _free(void* ptr) {
+	Heap_t* heap = _owner(ptr);
+	if (heap == NULL) {
+		Heap_t* local = _local_heap();
+		if (local->start != NULL) _heap_corrupted(local, "free of a pointer outside the heap", ptr);
+		return;
+	}
+	if (heap->corruption != NULL) return;
+
+	MemoryHeader_t* header = _get_header(ptr);
+	if (_block_state(header) != BLOCK_USED) {
+#ifdef DEBUG
+		fprintf(stderr, "Error: double free detected at %p\n", ptr);
+		abort();
+#endif
+		return;
+	}
+
+	if (heap != _local_heap() || _in_interrupt()) {
+		_push_remote_free(heap, header);
+		return;
+	}
+
+	_drain_remote_frees(heap);
+	_free_local(heap, header);
+}
+
+/**
+ * `realloc` of a block to a size that isn't 0, without the trace event.
+ */
+static void* _reallocate(void* ptr, uintptr_t new_size) {
+	Heap_t* heap = _local_heap();
+	if (heap->corruption != NULL || new_size > BLOCK_MAX) return NULL;
+
 	new_size = _align(new_size, ALIGN);
+	if (new_size < BLOCK_MIN) new_size = BLOCK_MIN;
 
 	MemoryHeader_t* old_header = _get_header(ptr);
-	// extend in case that gives us the space we need
-	_extend_block(old_header);
-	if (old_header->size >= new_size) {
-		_fragment_block(old_header, new_size);
-		return _get_buffer_start(old_header);
+	uintptr_t old_size = _block_size(old_header);
+	uint8_t site = 0;
+
+	if (_owner(ptr) == heap) {
+		// the other core's frees may be what's next to this block
+		_drain_remote_frees(heap);
+
+		// the heap is only touched once it's certain the block fits, a failed
+		// attempt leaves every free list as it was
+		MemoryHeader_t* next = _free_next_block(heap, old_header);
+		uintptr_t after = next != NULL ? HEADER_SIZE + _block_size(next) : 0;
+
+		// extend into the free block after it if that gives us the space we need
+		if (old_size + after >= new_size) {
+			_extend_block(heap, old_header);
+			_fragment_block(heap, old_header, new_size);
+#if ALLOC_STATS
+			_account_request(heap, new_size);
+			_account_resize(heap, old_header, old_size);
+#endif
+			return ptr;
+		}
+
+		// failing that, take the free block before it as well, but only a hole
+		// too small to hold the data by itself: bigger blocks are left whole
+		// for malloc, carving them up here fragments the heap more than moving
+		MemoryHeader_t* prev = _free_prev_block(heap, old_header);
+		if (prev != NULL && _block_size(prev) < new_size && _block_size(prev) + HEADER_SIZE + old_size + after >= new_size) {
+			_extend_block(heap, old_header);
+			_remove_free(heap, prev);
+			_absorb_block(heap, prev, old_header);
+			_set_block_state(prev, BLOCK_USED);
+			_set_block_site(prev, _block_site(old_header));
+
+			// overlaps when the block before is smaller than the data
+			memmove(_get_buffer_start(prev), ptr, old_size);
+
+			_fragment_block(heap, prev, new_size);
+#if ALLOC_STATS
+			_account_request(heap, new_size);
+			_account_resize(heap, prev, old_size);
+#endif
+			return _get_buffer_start(prev);
+		}
+
+		// the moved block stays charged to the same call site
+		site = _block_site(old_header);
 	}
 
-	uint8_t* buffer = malloc(new_size);
+	uint8_t* buffer = _allocate(heap, new_size, site);
 	if (buffer == NULL) return NULL;
 
 	// copy old data to new buffer
-	uintptr_t copy_size = old_header->size;
+	uintptr_t copy_size = old_size;
 	if (copy_size > new_size) copy_size = new_size;
 
-	for (uintptr_t i = 0; i < copy_size; i++) {
-		buffer[i] = ((uint8_t*)ptr)[i];
-	}
+	memcpy(buffer, ptr, copy_size);
 
-	free(ptr);
+	_free(ptr);
 
 	return buffer;
 }
 
+/**
+ * Resize an allocated memory block to hold at least `new_size` bytes, preserving existing data up to the smaller of the old and new sizes.
+ *
+ * If `ptr` is `NULL`, the call is equivalent to `malloc(new_size)`. If `new_size` is 0, the allocation is freed and `NULL` is returned. The requested size is rounded up to the allocator's alignment before allocation.
+ * The block is grown in place into the free blocks on either side of it when possible (moving the data down into the one before), otherwise the data is moved. Blocks from the other core's heap are always moved to this core's.
+ * @param ptr Pointer to a previously allocated memory block returned by this allocator, or `NULL`.
+ * @param new_size Desired size in bytes for the allocation.
+ * @returns Pointer to a memory region containing the original data (possibly relocated), or `NULL` if allocation failed or `new_size` was 0.
+ */
+void* realloc(void* ptr, uintptr_t new_size) {
+	if (ptr == NULL) return malloc(new_size);
+	if (new_size == 0) {
+		free(ptr);
+		return NULL;
+	}
+	if (_in_interrupt()) return malloc(new_size);
+
+	void* result = _reallocate(ptr, new_size);
+#if ALLOC_TRACE
+	_trace_event(ALLOC_TRACE_REALLOC, ptr, new_size, result);
+#endif
+	return result;
+}
+
 /**
  * Allocate memory for an array of elements and initialize all bytes to zero.
  *
@@ -344,9 +1118,7 @@ void* calloc(uintptr_t num, uintptr_t size) {
 	if (buffer == NULL) return NULL;
 
 	// zero the memory
-	for (uintptr_t i = 0; i < total_bytes; i++) {
-		buffer[i] = 0;
-	}
+	memset(buffer, 0, total_bytes);
 
 	return (void*)buffer;
 }
@@ -357,56 +1129,517 @@ void* calloc(uintptr_t num, uintptr_t size) {
  * If the allocator is uninitialized or `ptr` is `NULL`, the call is a no-op.
  * If the block has already been freed, a double-free is detected: in debug
  * builds this prints an error and aborts; otherwise the call returns without
- * modifying state. Otherwise the block's free counter is incremented (capped
- * at `UINT8_MAX`) and the allocator attempts to coalesce adjacent free blocks.
+ * modifying state. Otherwise the block is merged with the free blocks on
+ * either side of it (in constant time, through its boundary tag) and put on
+ * the matching free list.
+ *
+ * Blocks from the other core's heap, and anything freed in an interrupt
+ * handler, are queued for the owning core instead (lock-free) and released
+ * the next time it allocates or frees.
  *
  * @param ptr Pointer to a data region previously returned by `malloc`,
  *            `calloc`, or `realloc`. Behavior is undefined if `ptr` was not
  *            allocated by this allocator.
  */
 void free(void* ptr) {
-	if (_heap_start == NULL || ptr == NULL) return;
-	
-	MemoryHeader_t* header = _get_header(ptr);
-	if (header->freed > 0) {
+	if (ptr == NULL) return;
+
+#if ALLOC_TRACE
+	_trace_event(ALLOC_TRACE_FREE, ptr, 0, NULL);
+#endif
+	TRACE_BEGIN("free");
+	_free(ptr);
+	TRACE_END("free");
+}
+
+/**
+ * Find the calling core's table entry for `handle`.
+ *
+ * @returns The entry, or `NULL` if the handle is 0, was freed, or belongs to
+ * the other core.
+ */
+static HandleEntry_t* _handle_entry(Heap_t* heap, Handle_t handle) {
+	uint32_t index = (handle & ((1u << HANDLE_INDEX_BITS) - 1)) - 1;
+	uint32_t core = (handle >> HANDLE_CORE_SHIFT) & ((1u << (HANDLE_GENERATION_SHIFT - HANDLE_CORE_SHIFT)) - 1);
+	if (index >= ALLOC_HANDLES || core != get_core_num()) return NULL;
+
+	HandleEntry_t* entry = &heap->handles[index];
+	if (entry->block == NULL || entry->generation != (uint16_t)(handle >> HANDLE_GENERATION_SHIFT)) return NULL;
+	return entry;
+}
+
+/**
+ * Allocate a relocatable block from the calling core's heap. Its data is
+ * only reachable through `handle_lock`, and while it isn't locked the
+ * compactor (`alloc_compact`, or `malloc` when nothing fits) may move it to
+ * close up the holes in the heap, so big allocations keep fitting however
+ * long the console runs.
+ *
+ * Use it for data that lives a while but is only touched now and then (an
+ * app's level, a cache), not for things used every few lines. Handles belong
+ * to the core that allocated them and aren't for interrupt handlers.
+ *
+ * @param bytes Number of bytes requested.
+ * @returns The handle, or 0 if `bytes` is 0, the heap has no room, or all
+ * ALLOC_HANDLES handles are taken.
+ */
+Handle_t handle_alloc(uintptr_t bytes) {
+	Heap_t* heap = _local_heap();
+	if (_in_interrupt() || heap->start == NULL || heap->corruption != NULL) return 0;
+	if (bytes == 0 || bytes > BLOCK_MAX - HANDLE_OVERHEAD || heap->handle_unused == 0) return 0;
+
+#if ALLOC_STATS
+	uint8_t* data = _allocate(heap, bytes + HANDLE_OVERHEAD, _site_index(heap, "handles"));
+#else
+	uint8_t* data = _allocate(heap, bytes + HANDLE_OVERHEAD, 0);
+#endif
+	if (data == NULL) return 0;
+
+	uint32_t index = heap->handle_unused - 1u;
+	HandleEntry_t* entry = &heap->handles[index];
+	heap->handle_unused = entry->next_unused;
+	heap->handle_count++;
+
+	MemoryHeader_t* header = _get_header(data);
+	header->size = _size_word(header) | BLOCK_MOVABLE;
+	*(uintptr_t*)data = index;
+	entry->block = header;
+	entry->locks = 0;
+
+	return ((Handle_t)entry->generation << HANDLE_GENERATION_SHIFT) | (get_core_num() << HANDLE_CORE_SHIFT) | (index + 1);
+}
+
+/**
+ * Free a block from `handle_alloc`, locked or not. Pointers from
+ * `handle_lock` are invalid afterwards and so is the handle.
+ *
+ * @param handle Handle to free, 0 is a no-op.
+ */
+void handle_free(Handle_t handle) {
+	if (handle == 0 || _in_interrupt()) return;
+
+	Heap_t* heap = _local_heap();
+	if (heap->corruption != NULL) return;
+
+	HandleEntry_t* entry = _handle_entry(heap, handle);
+	if (entry == NULL) {
 #ifdef DEBUG
-		fprintf(stderr, "Error: double free detected at %p\n", ptr);
+		fprintf(stderr, "Error: free of an invalid handle %08lx\n", (unsigned long)handle);
 		abort();
 #endif
 		return;
 	}
 
-	if (header->freed < UINT8_MAX) {
-		header->freed++;
+	MemoryHeader_t* header = entry->block;
+	header->size = _size_word(header) & ~BLOCK_MOVABLE;
+	_drain_remote_frees(heap);
+	_free_local(heap, header);
+
+	entry->block = NULL;
+	entry->generation++;
+	entry->next_unused = heap->handle_unused;
+	heap->handle_unused = (uint16_t)(entry - heap->handles + 1);
+	heap->handle_count--;
+}
+
+/**
+ * Pin a handle's block where it is and get its data. Locks nest, the block
+ * can move again once every lock has been undone with `handle_unlock`.
+ * Unlock what you can before calling `alloc_compact`, a locked block is a
+ * wall the rest of the heap can't be moved past.
+ *
+ * @param handle Handle from `handle_alloc`.
+ * @returns The data, ALIGN aligned, or `NULL` if the handle isn't valid on
+ * this core.
+ */
+void* handle_lock(Handle_t handle) {
+	if (_in_interrupt()) return NULL;
+
+	HandleEntry_t* entry = _handle_entry(_local_heap(), handle);
+	if (entry == NULL || entry->locks == UINT16_MAX) return NULL;
+
+	entry->locks++;
+	return (uint8_t*)_get_buffer_start(entry->block) + HANDLE_OVERHEAD;
+}
+
+/**
+ * Undo one `handle_lock`. The pointer it returned mustn't be used once the
+ * last lock is gone.
+ */
+void handle_unlock(Handle_t handle) {
+	Heap_t* heap = _local_heap();
+	HandleEntry_t* entry = _handle_entry(heap, handle);
+	if (entry == NULL || entry->locks == 0) return;
+
+	if (--entry->locks == 0) {
+		heap->compact_dirty = true;
+		heap->compact_idle = false;
 	}
+}
 
-	_defragment_block(header);
+/**
+ * Get the usable size of a handle's block, at least what was asked for.
+ *
+ * @returns Bytes, 0 if the handle isn't valid on this core.
+ */
+uintptr_t handle_size(Handle_t handle) {
+	HandleEntry_t* entry = _handle_entry(_local_heap(), handle);
+	if (entry == NULL) return 0;
+	return _block_size(entry->block) - HANDLE_OVERHEAD;
 }
 
 /**
- * Coalesces adjacent free blocks in the allocator's heap to reduce fragmentation.
+ * Compact the calling core's heap for about `budget_us` microseconds: slide
+ * unlocked handle blocks (see `handle_alloc`) down into the holes before
+ * them, so free memory gathers into big blocks at the top of the heap. Call
+ * it once a frame with whatever time is left over; it carries on where it
+ * left off, and costs next to nothing once there's nothing left to move.
  *
- * Iterates headers from the first managed block and merges consecutive freed
- * blocks by increasing the earlier block's size and updating next pointers,
- * keeping the allocator's heap metadata consistent.
+ * A block is never left half moved, so a big one can overrun the budget by
+ * its copy. A budget of 0 does the least work possible: one move, or a few
+ * blocks looked at.
+ *
+ * @param budget_us Time to spend, in microseconds.
+ * @returns Bytes moved.
+ */
+uint32_t alloc_compact(uint32_t budget_us) {
+	Heap_t* heap = _local_heap();
+	if (_in_interrupt() || heap->start == NULL || heap->corruption != NULL) return 0;
+
+	_drain_remote_frees(heap);
+	return _compact(heap, budget_us);
+}
+
+/**
+ * Gather statistics for the calling core's heap. Walks every block, so it costs time proportional to
+ * the number of blocks; don't call it every frame.
+ *
+ * @param stats Filled in; the counters, peak and histogram are zero unless
+ * built with ALLOC_STATS.
  */
-static void _defragment_all() {
-	if (_heap_first == NULL) return;
+void alloc_stats(AllocStats_t* stats) {
+	Heap_t* heap = _local_heap();
+	if (heap->start != NULL && heap->corruption == NULL) _drain_remote_frees(heap);
+
+	*stats = (AllocStats_t){
+		.heap_size = heap->size,
+		.corruption = heap->corruption,
+		.handles = heap->handle_count,
+		.compacted = heap->compacted,
+	};
+	if (heap->start == NULL) return;
+
+	for (MemoryHeader_t* header = heap->first; header != heap->last; header = _next_block(header)) {
+		MemoryHeader_t* next = _next_block(header);
+		if (next <= header || next > heap->last) {
+			_heap_corrupted(heap, "block runs past the end of the heap", header);
+			stats->corruption = heap->corruption;
+			break;
+		}
+
+		stats->blocks++;
+		if (_is_free(header)) {
+			stats->free_blocks++;
+			stats->free_bytes += _block_size(header);
+			if (_block_size(header) > stats->largest_free) stats->largest_free = _block_size(header);
+		} else {
+			stats->used_bytes += _block_size(header);
+			if (_is_movable(header)) stats->movable_bytes += _block_size(header);
+		}
+	}
+
+	if (stats->free_bytes > 0) {
+		stats->fragmentation = 1.0f - (float)stats->largest_free / (float)stats->free_bytes;
+	}
 
-	MemoryHeader_t* current = _heap_first;
-	while (current->next != NULL) {
-		_defragment_block(current);
-		current = current->next;
+#if ALLOC_STATS
+	stats->live_bytes = heap->live_bytes;
+	stats->peak_bytes = heap->peak_bytes;
+	stats->allocations = heap->allocations;
+	stats->frees = heap->frees;
+	stats->failures = heap->failures;
+	for (int i = 0; i < ALLOC_HISTOGRAM_BUCKETS; i++) {
+		stats->histogram[i] = heap->histogram[i];
 	}
+#endif
 }
 
-void* memcpy(void* restrict dest, const void* restrict src, uintptr_t n) {
-	uint8_t* _dest = (uint8_t*)dest;
-	const uint8_t* _src = (const uint8_t*)src;
+/**
+ * Get the calling core's per call site counters (see `TAGGED_MALLOC`).
+ *
+ * @param count Set to the number of sites, 0 unless built with ALLOC_STATS.
+ * @returns The sites, the first one counts untagged allocations.
+ */
+const AllocSite_t* alloc_sites(uint32_t* count) {
+#if ALLOC_STATS
+	Heap_t* heap = _local_heap();
+	*count = heap->site_count;
+	return heap->sites;
+#else
+	*count = 0;
+	return NULL;
+#endif
+}
 
-	for (uintptr_t i = 0; i < n; i++) {
-		_dest[i] = _src[i];
+/**
+ * Check the calling core's heap for consistency: every block's size, bounds
+ * and boundary tag, that no two free blocks are left next to each other, the
+ * end marker, that every handle's block points back at its handle, and that
+ * the free lists hold exactly the free blocks, each on the right list, with
+ * links and bitmaps that agree.
+ *
+ * The first problem found is recorded as heap corruption (aborting in debug
+ * builds, see `_heap_corrupted`). Costs a walk of the heap and the free lists.
+ *
+ * @returns `true` if the heap is intact (or not initialised).
+ */
+bool alloc_validate() {
+	Heap_t* heap = _local_heap();
+	if (heap->start == NULL) return true;
+	if (heap->corruption != NULL) return false;
+
+	_drain_remote_frees(heap);
+
+	uint32_t free_blocks = 0;
+	uint32_t movable_blocks = 0;
+	MemoryHeader_t* previous = NULL;
+	for (MemoryHeader_t* header = heap->first; header != heap->last; header = _next_block(header)) {
+		if (_block_size(header) < BLOCK_MIN) {
+			_heap_corrupted(heap, "bad block size", header);
+			return false;
+		}
+		if (_block_state(header) > BLOCK_QUEUED) {
+			_heap_corrupted(heap, "bad free flag", header);
+			return false;
+		}
+		if (header->prev_size != (previous != NULL ? _block_size(previous) : 0)) {
+			_heap_corrupted(heap, "bad boundary tag", header);
+			return false;
+		}
+		if (previous != NULL && _is_free(previous) && _is_free(header)) {
+			_heap_corrupted(heap, "free blocks left unmerged", header);
+			return false;
+		}
+
+		MemoryHeader_t* next = _next_block(header);
+		if (next <= header || next > heap->last) {
+			_heap_corrupted(heap, "block runs past the end of the heap", header);
+			return false;
+		}
+
+		if (_is_movable(header)) {
+			uintptr_t index = *(uintptr_t*)_get_buffer_start(header);
+			if (_block_state(header) != BLOCK_USED || index >= ALLOC_HANDLES || heap->handles[index].block != header) {
+				_heap_corrupted(heap, "bad handle", header);
+				return false;
+			}
+			movable_blocks++;
+		}
+
+		if (_is_free(header)) free_blocks++;
+		previous = header;
+	}
+
+	uint32_t handles = 0;
+	for (uint32_t i = 0; i < ALLOC_HANDLES; i++) {
+		if (heap->handles[i].block != NULL) handles++;
+	}
+	if (handles != heap->handle_count || movable_blocks != heap->handle_count) {
+		_heap_corrupted(heap, "handle table out of sync", heap->handles);
+		return false;
+	}
+
+	if (_size_word(heap->last) != (0 | BLOCK_USED) || heap->last->prev_size != _block_size(previous)) {
+		_heap_corrupted(heap, "end of heap marker overwritten", heap->last);
+		return false;
+	}
+
+	uint32_t listed = 0;
+	for (int fl = 0; fl < ALLOC_FL_COUNT; fl++) {
+		if (((heap->fl_bitmap >> fl) & 1) != (heap->sl_bitmap[fl] != 0)) {
+			_heap_corrupted(heap, "free list bitmap out of sync", &heap->sl_bitmap[fl]);
+			return false;
+		}
+
+		for (int sl = 0; sl < ALLOC_SL_COUNT; sl++) {
+			MemoryHeader_t* head = heap->free_lists[fl][sl];
+			if (((heap->sl_bitmap[fl] >> sl) & 1) != (head != NULL)) {
+				_heap_corrupted(heap, "free list bitmap out of sync", &heap->free_lists[fl][sl]);
+				return false;
+			}
+
+			MemoryHeader_t* previous = NULL;
+			for (MemoryHeader_t* header = head; header != NULL; header = header->next_free) {
+				if (header < heap->first || header >= heap->last || ++listed > free_blocks) {
+					_heap_corrupted(heap, "broken free list", header);
+					return false;
+				}
+				if (!_is_free(header) || header->prev_free != previous) {
+					_heap_corrupted(heap, "broken free list", header);
+					return false;
+				}
+
+				int block_fl, block_sl;
+				_mapping(_block_size(header), &block_fl, &block_sl);
+				if (block_fl != fl || block_sl != sl) {
+					_heap_corrupted(heap, "block on the wrong free list", header);
+					return false;
+				}
+
+				previous = header;
+			}
+		}
+	}
+
+	if (listed != free_blocks) {
+		_heap_corrupted(heap, "free block missing from the free lists", heap->first);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Print the calling core's heap statistics to stdio (USB serial on the
+ * device), and in ALLOC_STATS builds the size histogram and per call site
+ * counters too.
+ */
+void alloc_dump() {
+	AllocStats_t stats;
+	alloc_stats(&stats);
+
+	printf("heap: core %u\n", (unsigned)get_core_num());
+	printf("heap: %lu bytes, %lu used, %lu free in %lu blocks (%lu free)\n",
+		(unsigned long)stats.heap_size, (unsigned long)stats.used_bytes, (unsigned long)stats.free_bytes,
+		(unsigned long)stats.blocks, (unsigned long)stats.free_blocks);
+	printf("heap: largest free block %lu bytes, fragmentation %.1f%%\n",
+		(unsigned long)stats.largest_free, stats.fragmentation * 100.0f);
+	if (stats.handles > 0 || stats.compacted > 0) {
+		printf("heap: %lu handles holding %lu bytes, %lu bytes moved by compaction\n",
+			(unsigned long)stats.handles, (unsigned long)stats.movable_bytes, (unsigned long)stats.compacted);
+	}
+	if (stats.corruption != NULL) printf("heap: CORRUPTED (%s)\n", stats.corruption);
+
+#if ALLOC_STATS
+	printf("heap: %lu live, %lu peak, %lu allocations, %lu frees, %lu failed\n",
+		(unsigned long)stats.live_bytes, (unsigned long)stats.peak_bytes, (unsigned long)stats.allocations,
+		(unsigned long)stats.frees, (unsigned long)stats.failures);
+
+	printf("sizes:\n");
+	for (int i = 0; i < ALLOC_HISTOGRAM_BUCKETS; i++) {
+		if (stats.histogram[i] == 0) continue;
+		unsigned long low = i == 0 ? 0 : 1ul << (i + 2);
+		if (i == ALLOC_HISTOGRAM_BUCKETS - 1) {
+			printf("  %7lu+      %lu\n", low, (unsigned long)stats.histogram[i]);
+		} else {
+			printf("  %7lu-%-6lu %lu\n", low, (1ul << (i + 3)) - 1, (unsigned long)stats.histogram[i]);
+		}
 	}
 
-	return dest;
-}
\ No newline at end of file
+	uint32_t count;
+	const AllocSite_t* sites = alloc_sites(&count);
+	printf("sites:\n");
+	for (uint32_t i = 0; i < count; i++) {
+		printf("  %-32s %8lu allocs %8lu live %8lu peak\n", sites[i].tag, (unsigned long)sites[i].allocations,
+			(unsigned long)sites[i].live_bytes, (unsigned long)sites[i].peak_bytes);
+	}
+#else
+	printf("heap: build with ALLOC_STATS for counters, sizes and call sites\n");
+#endif
+}
+
+/**
+ * Start recording the calling core's malloc, free and realloc calls (calloc
+ * counts as malloc) into `buffer`, as an AllocTraceHeader_t followed by
+ * compact events (see ALLOC_TRACE_MALLOC). Replay it on the host with
+ * `alloc_replay`. Recording stops at the first event that doesn't fit.
+ *
+ * Only in ALLOC_TRACE builds. The buffer shouldn't come from the heap being
+ * traced (a static array is best).
+ *
+ * @param buffer Where the trace goes, 4-byte aligned.
+ * @param bytes Size of `buffer`.
+ * @returns `false` if not built with ALLOC_TRACE, the core has no heap, it's
+ * already recording, or `buffer` can't even hold the header.
+ */
+bool alloc_trace_start(void* buffer, uint32_t bytes) {
+#if ALLOC_TRACE
+	Heap_t* heap = _local_heap();
+	if (heap->start == NULL || heap->trace != NULL || bytes < sizeof(AllocTraceHeader_t)) return false;
+
+	uint32_t irq = save_and_disable_interrupts();
+	heap->trace_buffer = buffer;
+	heap->trace_size = bytes - sizeof(AllocTraceHeader_t);
+	heap->trace_length = 0;
+	heap->trace_events = 0;
+	heap->trace_dropped = 0;
+	heap->trace_time = time_us_32();
+	heap->trace = heap->trace_buffer + sizeof(AllocTraceHeader_t);
+	restore_interrupts(irq);
+
+	return true;
+#else
+	(void)buffer;
+	(void)bytes;
+	return false;
+#endif
+}
+
+/**
+ * Stop recording the calling core's trace and fill in its header.
+ *
+ * @returns Bytes of the buffer used (header included), 0 if it wasn't recording.
+ */
+uint32_t alloc_trace_stop() {
+#if ALLOC_TRACE
+	Heap_t* heap = _local_heap();
+	if (heap->trace == NULL) return 0;
+
+	uint32_t irq = save_and_disable_interrupts();
+	heap->trace = NULL;
+	restore_interrupts(irq);
+
+	AllocTraceHeader_t* header = (AllocTraceHeader_t*)heap->trace_buffer;
+	*header = (AllocTraceHeader_t){
+		.magic = ALLOC_TRACE_MAGIC,
+		.version = ALLOC_TRACE_VERSION,
+		.core = (uint8_t)get_core_num(),
+		.align = (uint8_t)ALIGN,
+		.heap_size = (uint32_t)heap->size,
+		.events = heap->trace_events,
+		.dropped = heap->trace_dropped,
+		.length = heap->trace_length,
+	};
+
+	return sizeof(AllocTraceHeader_t) + heap->trace_length;
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Print the calling core's last stopped trace to stdio (USB serial on the
+ * device) as hex, in lines starting with "trace:". `alloc_replay` reads a
+ * captured log as is.
+ */
+void alloc_trace_dump() {
+#if ALLOC_TRACE
+	Heap_t* heap = _local_heap();
+	if (heap->trace != NULL || heap->trace_buffer == NULL) {
+		printf("trace: none, stop recording first\n");
+		return;
+	}
+
+	uint32_t length = sizeof(AllocTraceHeader_t) + heap->trace_length;
+	for (uint32_t i = 0; i < length; i += 32) {
+		printf("trace: ");
+		for (uint32_t j = i; j < length && j < i + 32; j++) {
+			printf("%02x", heap->trace_buffer[j]);
+		}
+		printf("\n");
+	}
+	printf("trace: end\n");
+#else
+	printf("trace: build with ALLOC_TRACE to record traces\n");
+#endif
+}
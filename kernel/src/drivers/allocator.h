@@ -6,28 +6,165 @@
 #include <stddef.h>
 #include <stdalign.h>
 
+#include "memops.h"
+
 #define ALIGN alignof(max_align_t)
 #define WORD_SIZE sizeof(size_t)
 
 #define MINIMUM_HEAP_SIZE  4
 #define MINIMUM_BLOCK_SIZE 4
 
+// two level segregated fit (TLSF) free lists: one first level list per power
+// of two, split into ALLOC_SL_COUNT second level size classes
+#if UINTPTR_MAX == 0xFFFFFFFF
+#define ALLOC_ALIGN_LOG2 3
+#else
+#define ALLOC_ALIGN_LOG2 4
+#endif
+#define ALLOC_SL_LOG2     4
+#define ALLOC_SL_COUNT    (1 << ALLOC_SL_LOG2)
+#define ALLOC_FL_SHIFT    (ALLOC_SL_LOG2 + ALLOC_ALIGN_LOG2)
+#define ALLOC_SMALL_BLOCK (1 << ALLOC_FL_SHIFT) // below this sizes are classed linearly
+#ifndef ALLOC_FL_MAX
+#define ALLOC_FL_MAX      20 // blocks up to 2 MiB, plenty for 520 KB of SRAM
+#endif
+#define ALLOC_FL_COUNT    (ALLOC_FL_MAX - ALLOC_FL_SHIFT + 2)
+
+// every core gets its own heap, see alloc_init_core()
+#define ALLOC_CORES 2
+
+// relocatable blocks (handle_alloc) each core can have at once
+#ifndef ALLOC_HANDLES
+#define ALLOC_HANDLES 128
+#endif
+
 typedef struct MemoryHeader {
-	// alignas forces start address to be at an ALIGN byte boundary
-	// and the total struct size to be a multiple of ALIGN
+	// data size of the block, a multiple of ALIGN; the bits below ALIGN hold
+	// its state (in use, free, or queued for its core to free) and whether it
+	// can be moved (handle_alloc), and in ALLOC_STATS builds the top byte
+	// holds its call site index. alignas keeps headers on an ALIGN boundary
+	// and the struct a multiple of ALIGN in size
 	alignas(ALIGN) uintptr_t size;
-	struct MemoryHeader* next;
-	uint8_t freed;
+	// boundary tag: data size of the block physically before this one (0 for
+	// the first), so a freed block finds that neighbour in constant time
+	uintptr_t prev_size;
+	// free list links, only valid while the block is free
+	// (they live in the first bytes of what would be the caller's data)
+	struct MemoryHeader* next_free;
+	struct MemoryHeader* prev_free;
 } MemoryHeader_t;
 
+// allocator statistics, call site accounting and a size histogram are only
+// kept when built with ALLOC_STATS (CMake option), the heap walk parts of
+// `alloc_stats` and `alloc_validate` always work; all of them are per core
+#ifndef ALLOC_STATS
+#define ALLOC_STATS 0
+#endif
+#define ALLOC_SITES             32 // distinct call sites tracked, the rest count as the last
+#define ALLOC_HISTOGRAM_BUCKETS 16 // powers of two from 8 bytes, the last is everything bigger
+
+#define ALLOC_STRINGIFY_(x) #x
+#define ALLOC_STRINGIFY(x)  ALLOC_STRINGIFY_(x)
+
+// malloc tagged with its call site, for ALLOC_STATS accounting
+#if ALLOC_STATS
+#define TAGGED_MALLOC(bytes) malloc_tagged((bytes), __FILE__ ":" ALLOC_STRINGIFY(__LINE__))
+#else
+#define TAGGED_MALLOC(bytes) malloc(bytes)
+#endif
+
+// allocation traces (alloc_trace_start) are only recorded when built with
+// ALLOC_TRACE (CMake option), for replaying with host/alloc_replay
+#ifndef ALLOC_TRACE
+#define ALLOC_TRACE 0
+#endif
+#define ALLOC_TRACE_MAGIC   0x43525441 // "ATRC"
+#define ALLOC_TRACE_VERSION 1
+
+// trace events: one byte with the op in the low bits, then LEB128 varints:
+// microseconds since the previous event, then
+//   malloc:  size, block id
+//   free:    block id
+//   realloc: old block id, size, new block id
+// A block id is the block's offset into the heap in ALIGN units plus one, 0
+// is NULL. A failed call leaves out the id of the block it would've returned.
+#define ALLOC_TRACE_MALLOC  0
+#define ALLOC_TRACE_FREE    1
+#define ALLOC_TRACE_REALLOC 2
+#define ALLOC_TRACE_OP      0x03
+#define ALLOC_TRACE_FAILED  0x04
+#define ALLOC_TRACE_EVENT_MAX (1 + 4 * ((sizeof(uintptr_t) * 8 + 6) / 7))
+
+// at the start of a trace, followed by `length` bytes of events
+typedef struct AllocTraceHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint8_t core;       // core whose calls were recorded
+	uint8_t align;      // ALIGN of the allocator that recorded it
+	uint32_t heap_size; // that core's heap
+	uint32_t events;
+	uint32_t dropped;   // events after the buffer filled up
+	uint32_t length;
+} AllocTraceHeader_t;
+
+// relocatable allocation, see handle_alloc; 0 is never a valid handle
+typedef uint32_t Handle_t;
+
+typedef struct AllocSite {
+	const char* tag;
+	uint32_t allocations;
+	uintptr_t live_bytes;
+	uintptr_t peak_bytes;
+} AllocSite_t;
+
+typedef struct AllocStats {
+	// from a walk of the heap
+	uintptr_t heap_size;
+	uintptr_t used_bytes;   // block data in use, headers and padding excluded
+	uintptr_t free_bytes;
+	uintptr_t largest_free;
+	uint32_t blocks;
+	uint32_t free_blocks;
+	float fragmentation;    // 1 - largest_free / free_bytes, 0 when all free memory is one block
+	const char* corruption; // what the first sign of heap corruption was, or NULL
+
+	uint32_t handles;        // relocatable blocks, see handle_alloc
+	uintptr_t movable_bytes; // their size, in the walk's used_bytes too
+	uintptr_t compacted;     // bytes moved by the compactor since alloc_init
+
+	// ALLOC_STATS builds only
+	uintptr_t live_bytes;   // same as used_bytes, kept as blocks come and go
+	uintptr_t peak_bytes;
+	uint32_t allocations;
+	uint32_t frees;
+	uint32_t failures;
+	uint32_t histogram[ALLOC_HISTOGRAM_BUCKETS]; // requested sizes
+} AllocStats_t;
+
 void alloc_init(uint8_t* heap_start, uintptr_t size);
+bool alloc_init_core(uint32_t core, uintptr_t size);
 void alloc_free();
 
+void alloc_stats(AllocStats_t* stats);
+const AllocSite_t* alloc_sites(uint32_t* count);
+bool alloc_validate();
+void alloc_dump();
+
+bool alloc_trace_start(void* buffer, uint32_t bytes);
+uint32_t alloc_trace_stop();
+void alloc_trace_dump();
+
+Handle_t handle_alloc(uintptr_t bytes);
+void handle_free(Handle_t handle);
+void* handle_lock(Handle_t handle);
+void handle_unlock(Handle_t handle);
+uintptr_t handle_size(Handle_t handle);
+uint32_t alloc_compact(uint32_t budget_us);
+
 void* malloc(uintptr_t bytes);
+void* malloc_tagged(uintptr_t bytes, const char* tag);
 void* realloc(void* ptr, uintptr_t new_size);
 void* calloc(uintptr_t num, uintptr_t size);
 void free(void* ptr);
 
-void* memcpy(void* restrict dest, const void* restrict src, uintptr_t n);
-
 #endif
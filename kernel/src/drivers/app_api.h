@@ -0,0 +1,85 @@
+#ifndef KERNEL_APP_API_H
+#define KERNEL_APP_API_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "scheduler.h"
+#include "buttons.h"
+
+// What apps are built against (see apps/app.h): the image format
+// tools/mkapp.py writes and the kernel's syscall table. Apps link against
+// nothing else, every kernel function they use goes through the table.
+
+#define APP_MAGIC         0x50504143 // "CAPP"
+#define APP_IMAGE_VERSION 1
+#define APP_NAME_MAX      24         // with the NUL
+
+// bump when the table changes in a way older apps can't cope with; new
+// functions go at the end, apps check `size` before using them
+#define APP_API_VERSION 1
+
+// what an app's step returns
+#define APP_RUNNING 0
+#define APP_EXIT    1
+
+// An app image: this header, then its code and read-only data (text), its
+// initialised data, and the relocation table. The app is linked at address 0
+// and loaded anywhere: the table lists the offsets (from the end of the
+// header) of the words in text and data holding addresses, which get the
+// load address added. Bss follows the data once loaded.
+typedef struct AppHeader {
+	uint32_t magic;
+	uint16_t version;     // APP_IMAGE_VERSION
+	uint16_t api_version; // APP_API_VERSION the app was built against
+	uint32_t text_size;
+	uint32_t data_size;
+	uint32_t bss_size;
+	uint32_t entry;       // offset of the entry point (AppEntry_t), Thumb bit clear
+	uint32_t reloc_count; // uint32_t offsets, after the data
+	uint32_t checksum;    // FNV-1a of everything after the header
+	uint32_t app_version;
+	uint32_t reserved;
+	char name[APP_NAME_MAX];
+} AppHeader_t;
+
+// The kernel's syscall table, handed to the app's entry point every step.
+typedef struct KernelApi {
+	uint32_t version; // APP_API_VERSION
+	uint32_t size;    // sizeof(KernelApi_t) of the running kernel
+
+	// the app is a task (see scheduler.h): each step it says what it waits
+	// for next, a step that doesn't runs again on the next pass
+	void (*task_wait)(Task_t* task, uint32_t events);
+	void (*task_sleep)(Task_t* task, uint32_t us);
+	void (*task_sleep_until)(Task_t* task, uint32_t time_us);
+	void (*task_wake)(Task_t* task);
+	uint32_t (*time_us)();
+
+	bool (*button_poll)(ButtonEvent_t* event);
+	bool (*button_pressed)(unsigned int button);
+
+	void (*lcd_fill_rect)(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t colour);
+	void (*lcd_draw_bitmap)(uint16_t x, uint16_t y, uint16_t w, uint16_t h, const uint8_t* pixels);
+
+	void* (*malloc)(size_t size);
+	void (*free)(void* ptr);
+	void* (*realloc)(void* ptr, size_t size);
+	void* (*memcpy)(void* dest, const void* src, size_t n);
+	void* (*memmove)(void* dest, const void* src, size_t n);
+	void* (*memset)(void* dest, int value, size_t n);
+
+	int (*save_get)(const char* key, void* buffer, uint16_t capacity);
+	int (*save_put)(const char* key, const void* value, uint16_t length);
+	int (*save_commit)();
+
+	const void* (*asset_data)(const char* name, uint32_t* size);
+
+	int (*printf)(const char* format, ...);
+} KernelApi_t;
+
+// an app's entry point, called every time its task runs
+typedef int (*AppEntry_t)(const KernelApi_t* kernel, Task_t* task);
+
+#endif
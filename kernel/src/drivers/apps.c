@@ -0,0 +1,426 @@
+#include "apps.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+
+#include "allocator.h"
+#include "sd_card.h"
+#include "sd_queue.h"
+#include "graphics/lcd.h"
+#include "storage/save_store.h"
+#include "storage/assets.h"
+
+// bigger than the RAM there is, the sizes in the header must be wrong
+#define APP_MAX_BYTES (512 * 1024)
+
+// A loaded app: the image as read from the card (header, text, data, then
+// the relocation table until bss is zeroed over it), followed by a copy of
+// the relocated data for warm launches.
+typedef struct AppImage {
+	uint8_t* block; // NULL if the slot's free
+	uint8_t* base;  // where text starts, what the app was relocated to
+	uint8_t* data_copy;
+	const AppHeader_t* header;
+	AppEntry_t entry;
+	uint32_t index; // in the directory
+	uint32_t last_used;
+	uint32_t bytes;
+} AppImage_t;
+
+static AppStoreEntry_t _entries[APP_STORE_MAX_APPS];
+static uint32_t _count = 0;
+static bool _mounted = false;
+
+static AppImage_t _cache[APP_CACHE_SLOTS];
+static AppStats_t _stats[APP_STORE_MAX_APPS];
+static uint32_t _launches = 0;
+
+// the app running, its task and who to wake when it exits
+static Task_t _task;
+static AppImage_t* _running = NULL;
+static Task_t* _on_exit = NULL;
+static bool _starting = false;
+static bool _warm = false;
+static uint32_t _launch_start_us = 0;
+
+static uint8_t _sector[SD_BLOCK_SIZE] __attribute__((aligned(4)));
+
+static void* _memcpy(void* dest, const void* src, size_t n) {
+	return memcpy(dest, src, n);
+}
+
+static void* _memmove(void* dest, const void* src, size_t n) {
+	return memmove(dest, src, n);
+}
+
+static void* _memset(void* dest, int value, size_t n) {
+	return memset(dest, value, n);
+}
+
+static uint32_t _time_us() {
+	return time_us_32();
+}
+
+static const KernelApi_t _api = {
+	.version = APP_API_VERSION,
+	.size = sizeof(KernelApi_t),
+	.task_wait = task_wait,
+	.task_sleep = task_sleep,
+	.task_sleep_until = task_sleep_until,
+	.task_wake = task_wake,
+	.time_us = _time_us,
+	.button_poll = button_poll,
+	.button_pressed = button_pressed,
+	.lcd_fill_rect = lcd_fill_rect,
+	.lcd_draw_bitmap = lcd_draw_bitmap,
+	.malloc = malloc,
+	.free = free,
+	.realloc = realloc,
+	.memcpy = _memcpy,
+	.memmove = _memmove,
+	.memset = _memset,
+	.save_get = save_store_get,
+	.save_put = save_store_put,
+	.save_commit = save_store_commit,
+	.asset_data = assets_data,
+	.printf = printf,
+};
+
+static uint32_t _fnv1a(const uint8_t* data, uint32_t length) {
+	uint32_t hash = 0x811C9DC5u;
+	for (uint32_t i = 0; i < length; i++) {
+		hash ^= data[i];
+		hash *= 0x01000193u;
+	}
+	return hash;
+}
+
+/**
+ * Synchronously read whole sectors of the app store.
+ *
+ * @returns `true` if they were read.
+ */
+static bool _read(uint32_t sector, uint32_t count, uint8_t* buffer) {
+	SdRequest_t request = { 0 };
+	if (!sd_queue_submit(&request, SD_REQ_READ, APP_STORE_FIRST_SECTOR + sector, count, buffer, NULL, NULL)) {
+		return false;
+	}
+	return sd_queue_wait(&request) == SD_OK;
+}
+
+/**
+ * Drop a cached app and free its memory.
+ *
+ * @param image Cache slot, not the running app.
+ */
+static void _evict(AppImage_t* image) {
+	if (image->block == NULL) return;
+	_stats[image->index].bytes = 0;
+	free(image->block);
+	*image = (AppImage_t){ 0 };
+}
+
+/**
+ * Drop the least recently launched cached app that isn't running.
+ *
+ * @returns `false` if there was none.
+ */
+static bool _evict_oldest() {
+	AppImage_t* oldest = NULL;
+	for (uint32_t i = 0; i < APP_CACHE_SLOTS; i++) {
+		AppImage_t* image = &_cache[i];
+		if (image->block == NULL || image == _running) continue;
+		if (oldest == NULL || image->last_used < oldest->last_used) oldest = image;
+	}
+	if (oldest == NULL) return false;
+	_evict(oldest);
+	return true;
+}
+
+/**
+ * Find a free cache slot.
+ *
+ * @returns The slot, or `NULL` if every one holds an app.
+ */
+static AppImage_t* _free_slot() {
+	for (uint32_t i = 0; i < APP_CACHE_SLOTS; i++) {
+		if (_cache[i].block == NULL) return &_cache[i];
+	}
+	return NULL;
+}
+
+/**
+ * Check an image header against its directory entry and the limits of the
+ * format, before anything's allocated for it.
+ *
+ * @returns `true` if the app can be loaded.
+ */
+static bool _check_header(const AppHeader_t* header, const AppStoreEntry_t* entry) {
+	if (header->magic != APP_MAGIC || header->version != APP_IMAGE_VERSION) return false;
+	if (header->api_version > APP_API_VERSION) return false;
+	if (header->checksum != entry->checksum) return false;
+
+	// everything's word aligned and the sizes add up to the file
+	if ((header->text_size | header->data_size | header->bss_size) & 3) return false;
+	uint64_t image = (uint64_t)header->text_size + header->data_size;
+	if (image + header->bss_size > APP_MAX_BYTES || header->entry >= header->text_size) return false;
+	return sizeof(AppHeader_t) + image + (uint64_t)header->reloc_count * 4 == entry->size;
+}
+
+/**
+ * Reset a loaded app's data and bss to how they were right after it was
+ * relocated, as if it had just been read from the card.
+ *
+ * @param image Loaded app.
+ */
+static void _reset(AppImage_t* image) {
+	const AppHeader_t* header = image->header;
+	memcpy(image->base + header->text_size, image->data_copy, header->data_size);
+	memset(image->base + header->text_size + header->data_size, 0, header->bss_size);
+}
+
+/**
+ * Read an app from the card into a free cache slot (evicting the oldest if
+ * there's none, or if the heap's too full), check it, relocate it to where
+ * it landed and set up its data and bss.
+ *
+ * @param index App, in the directory.
+ * @param loaded Set to the cache slot.
+ * @returns `APP_OK` or one of the `APP_ERR_` codes.
+ */
+static int _load(uint32_t index, AppImage_t** loaded) {
+	const AppStoreEntry_t* entry = &_entries[index];
+	AppStats_t* stats = &_stats[index];
+
+	uint32_t start = time_us_32();
+	if (!_read(entry->sector, 1, _sector)) return APP_ERR_IO;
+	AppHeader_t header;
+	memcpy(&header, _sector, sizeof(header));
+	if (!_check_header(&header, entry)) return APP_ERR_BAD_IMAGE;
+
+	// the whole file is read in, then bss is zeroed over the relocation
+	// table; the copy of the data for warm launches goes after both
+	uint32_t sectors = (entry->size + SD_BLOCK_SIZE - 1) / SD_BLOCK_SIZE;
+	uint32_t span = sectors * SD_BLOCK_SIZE;
+	uint32_t loaded_end = sizeof(AppHeader_t) + header.text_size + header.data_size + header.bss_size;
+	if (loaded_end > span) span = loaded_end;
+	uint32_t bytes = span + header.data_size;
+
+	AppImage_t* image = _free_slot();
+	if (image == NULL && _evict_oldest()) image = _free_slot();
+	if (image == NULL) return APP_ERR_NO_MEMORY;
+
+	uint8_t* block;
+	while ((block = malloc_tagged(bytes, "app")) == NULL) {
+		if (!_evict_oldest()) return APP_ERR_NO_MEMORY;
+	}
+
+	if (!_read(entry->sector, sectors, block)) {
+		free(block);
+		return APP_ERR_IO;
+	}
+	uint8_t* base = block + sizeof(AppHeader_t);
+	uint32_t image_size = header.text_size + header.data_size;
+	if (memcmp(block, &header, sizeof(header)) != 0 ||
+		_fnv1a(base, entry->size - sizeof(AppHeader_t)) != header.checksum) {
+		free(block);
+		return APP_ERR_BAD_IMAGE;
+	}
+	stats->read_us = time_us_32() - start;
+
+	start = time_us_32();
+	const uint32_t* relocs = (const uint32_t*)(base + image_size);
+	for (uint32_t i = 0; i < header.reloc_count; i++) {
+		uint32_t offset = relocs[i];
+		if ((offset & 3) || (uint64_t)offset + 4 > image_size) {
+			free(block);
+			return APP_ERR_BAD_IMAGE;
+		}
+		*(uint32_t*)(base + offset) += (uint32_t)(uintptr_t)base;
+	}
+
+	*image = (AppImage_t){
+		.block = block,
+		.base = base,
+		.data_copy = block + span,
+		.header = (const AppHeader_t*)block,
+		.entry = (AppEntry_t)((uintptr_t)(base + header.entry) | 1),
+		.index = index,
+		.bytes = bytes,
+	};
+	memcpy(image->data_copy, base + header.text_size, header.data_size);
+	memset(base + image_size, 0, header.bss_size);
+	stats->relocate_us = time_us_32() - start;
+	stats->bytes = bytes;
+
+	*loaded = image;
+	return APP_OK;
+}
+
+/**
+ * The running app's task: calls its entry point each time the task runs,
+ * and wakes the launcher once it returns APP_EXIT.
+ *
+ * @param task The app task.
+ */
+static void _app_task(Task_t* task) {
+	AppImage_t* image = _running;
+	if (image == NULL) return;
+
+	if (_starting) {
+		AppStats_t* stats = &_stats[image->index];
+		uint32_t us = time_us_32() - _launch_start_us;
+		if (_warm) {
+			stats->warm_us = us;
+		} else {
+			stats->cold_us = us;
+		}
+		printf("apps: %s, %s launch %lu us\n", _entries[image->index].name, _warm ? "warm" : "cold", (unsigned long)us);
+		_starting = false;
+	}
+
+	if (image->entry(&_api, task) == APP_RUNNING) {
+		if (task->state == TASK_STOPPED) task_wake(task);
+		return;
+	}
+
+	_running = NULL;
+	if (_on_exit != NULL) task_wake(_on_exit);
+}
+
+/**
+ * Start the app task on the calling core. It does nothing until an app is
+ * launched.
+ */
+void apps_init() {
+	task_start(&_task, "app", _app_task, NULL);
+}
+
+/**
+ * Read the app store's directory from the card. Needs sd_queue_init. Drops
+ * every cached app, they may have changed.
+ *
+ * @returns `true` if the card has an app store.
+ */
+bool apps_mount() {
+	apps_flush();
+	_mounted = false;
+	_count = 0;
+
+	if (!_read(0, 1, _sector)) return false;
+	const AppStoreHeader_t* header = (const AppStoreHeader_t*)_sector;
+	if (header->magic != APP_STORE_MAGIC || header->version != APP_STORE_VERSION) return false;
+	if (header->count > APP_STORE_MAX_APPS) return false;
+
+	memcpy(_entries, _sector + sizeof(AppStoreHeader_t), header->count * sizeof(AppStoreEntry_t));
+	for (uint32_t i = 0; i < header->count; i++) {
+		_entries[i].name[APP_NAME_MAX - 1] = '\0';
+		_stats[i] = (AppStats_t){ 0 };
+	}
+	_count = header->count;
+	_mounted = true;
+	return true;
+}
+
+/**
+ * Get how many apps the store has.
+ *
+ * @returns Apps, 0 if no store is mounted.
+ */
+uint32_t apps_count() {
+	return _count;
+}
+
+/**
+ * Get an app's name.
+ *
+ * @param index App, 0 .. apps_count() - 1.
+ * @returns The name, or `NULL`.
+ */
+const char* apps_name(uint32_t index) {
+	return index < _count ? _entries[index].name : NULL;
+}
+
+/**
+ * Launch an app: from the cache if it's there (warm, only its data is reset)
+ * or from the card (cold). It runs as the app task from the scheduler's next
+ * pass until it returns APP_EXIT, then `on_exit` is woken. Blocks while the
+ * app is read.
+ *
+ * @param index App, 0 .. apps_count() - 1.
+ * @param on_exit Task to wake when the app exits, or `NULL`.
+ * @returns `APP_OK` or one of the `APP_ERR_` codes.
+ */
+int apps_launch(uint32_t index, Task_t* on_exit) {
+	if (!_mounted || index >= _count) return APP_ERR_NOT_FOUND;
+	if (_running != NULL) return APP_ERR_BUSY;
+
+	_launch_start_us = time_us_32();
+
+	AppImage_t* image = NULL;
+	for (uint32_t i = 0; i < APP_CACHE_SLOTS; i++) {
+		if (_cache[i].block != NULL && _cache[i].index == index) image = &_cache[i];
+	}
+
+	_warm = image != NULL;
+	if (_warm) {
+		_reset(image);
+		_stats[index].warm++;
+	} else {
+		int result = _load(index, &image);
+		if (result != APP_OK) return result;
+		_stats[index].cold++;
+	}
+
+	image->last_used = ++_launches;
+	_running = image;
+	_on_exit = on_exit;
+	_starting = true;
+	task_wake(&_task);
+	return APP_OK;
+}
+
+/**
+ * Check whether an app is running.
+ *
+ * @returns `true` from apps_launch until the app exits.
+ */
+bool apps_running() {
+	return _running != NULL;
+}
+
+/**
+ * Drop every cached app but the running one, giving their memory back.
+ */
+void apps_flush() {
+	for (uint32_t i = 0; i < APP_CACHE_SLOTS; i++) {
+		if (&_cache[i] != _running) _evict(&_cache[i]);
+	}
+}
+
+/**
+ * Get an app's launch counters and times.
+ *
+ * @param index App, 0 .. apps_count() - 1.
+ * @param stats Filled in with the counters, zeroed for an unknown app.
+ */
+void apps_stats(uint32_t index, AppStats_t* stats) {
+	*stats = index < _count ? _stats[index] : (AppStats_t){ 0 };
+}
+
+/**
+ * Print each app's cold and warm launches, their last times and what it
+ * takes in the cache over stdio.
+ */
+void apps_dump() {
+	printf("apps: %lu in the store, %u cache slots\n", (unsigned long)_count, APP_CACHE_SLOTS);
+	for (uint32_t i = 0; i < _count; i++) {
+		const AppStats_t* stats = &_stats[i];
+		printf("  %-23s cold %3lu x %7lu us (read %lu, relocate %lu) warm %3lu x %6lu us, %lu bytes cached\n",
+			_entries[i].name, (unsigned long)stats->cold, (unsigned long)stats->cold_us, (unsigned long)stats->read_us,
+			(unsigned long)stats->relocate_us, (unsigned long)stats->warm, (unsigned long)stats->warm_us,
+			(unsigned long)stats->bytes);
+	}
+}
@@ -0,0 +1,69 @@
+#ifndef KERNEL_APPS_H
+#define KERNEL_APPS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "app_api.h"
+
+// The app store on the SD card, after the save store: a directory sector,
+// then each app image (see app_api.h) starting on a sector of its own.
+// tools/mkapp.py builds it.
+#ifndef APP_STORE_FIRST_SECTOR
+#define APP_STORE_FIRST_SECTOR 4096
+#endif
+
+#define APP_STORE_MAGIC    0x53505041 // "APPS"
+#define APP_STORE_VERSION  1
+#define APP_STORE_MAX_APPS 12         // what fits in the directory sector
+
+// loaded apps kept in RAM after they exit, most recently launched first;
+// launching one of them again skips the card and the relocation
+#ifndef APP_CACHE_SLOTS
+#define APP_CACHE_SLOTS 3
+#endif
+
+// results
+#define APP_OK            0
+#define APP_ERR_IO       -1
+#define APP_ERR_NOT_FOUND -2
+#define APP_ERR_BAD_IMAGE -3
+#define APP_ERR_NO_MEMORY -4
+#define APP_ERR_BUSY      -5 // an app is running
+
+typedef struct AppStoreHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t count;
+	uint32_t reserved[2];
+} AppStoreHeader_t;
+
+typedef struct AppStoreEntry {
+	char name[APP_NAME_MAX];
+	uint32_t sector;   // of the image, from APP_STORE_FIRST_SECTOR
+	uint32_t size;     // of the image, bytes
+	uint32_t checksum; // the image header's, to tell rebuilt apps apart
+	uint32_t reserved;
+} AppStoreEntry_t;
+
+typedef struct AppStats {
+	uint32_t cold;        // launches that loaded the app from the card
+	uint32_t warm;        // launches from the cache
+	uint32_t cold_us;     // last cold launch, until the app's first step
+	uint32_t read_us;     //   of which reading the card
+	uint32_t relocate_us; //   and relocating
+	uint32_t warm_us;     // last warm launch, until the app's first step
+	uint32_t bytes;       // RAM it takes while cached, 0 if it isn't
+} AppStats_t;
+
+void apps_init();
+bool apps_mount();
+uint32_t apps_count();
+const char* apps_name(uint32_t index);
+int apps_launch(uint32_t index, Task_t* on_exit);
+bool apps_running();
+void apps_flush();
+void apps_stats(uint32_t index, AppStats_t* stats);
+void apps_dump();
+
+#endif
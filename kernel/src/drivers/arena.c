@@ -0,0 +1,189 @@
+#include "arena.h"
+
+#ifdef DEBUG
+#include <stdlib.h>
+#include <stdio.h>
+#endif
+
+// the arena's bookkeeping sits in front of its buffer in one heap block
+#define ARENA_HEADER_SIZE ((sizeof(Arena_t) + (ARENA_ALIGN - 1)) & ~(uintptr_t)(ARENA_ALIGN - 1))
+
+/**
+ * Create an arena with a `size` byte buffer, taken from the heap in one
+ * allocation.
+ *
+ * @param size Bytes available for allocations.
+ * @returns The arena, or `NULL` if the heap couldn't fit it.
+ */
+Arena_t* arena_create(uintptr_t size) {
+	if (size == 0 || size > UINTPTR_MAX - ARENA_HEADER_SIZE) return NULL;
+
+	uint8_t* block = malloc_tagged(ARENA_HEADER_SIZE + size, "arena");
+	if (block == NULL) return NULL;
+
+	Arena_t* arena = (Arena_t*)block;
+	arena_init(arena, block + ARENA_HEADER_SIZE, size);
+	arena->owns_storage = true;
+	return arena;
+}
+
+/**
+ * Set up an arena over caller supplied storage, e.g. a static buffer.
+ *
+ * @param arena Arena to initialise.
+ * @param buffer Storage for the allocations.
+ * @param size Size of `buffer` in bytes.
+ * @returns `false` if the arguments are invalid.
+ */
+bool arena_init(Arena_t* arena, void* buffer, uintptr_t size) {
+	if (arena == NULL || buffer == NULL || size == 0) return false;
+
+	arena->start = buffer;
+	arena->top = arena->start;
+	arena->end = arena->start + size;
+	arena->high_water = 0;
+	arena->failures = 0;
+	arena->owns_storage = false;
+	return true;
+}
+
+/**
+ * Destroy an arena. Storage from `arena_create` goes back to the heap, caller
+ * supplied storage is left alone.
+ *
+ * @param arena Arena to destroy, may be `NULL`.
+ */
+void arena_destroy(Arena_t* arena) {
+	if (arena == NULL) return;
+
+	if (arena->owns_storage) {
+		free(arena);
+	} else {
+		arena->start = arena->top = arena->end = NULL;
+	}
+}
+
+/**
+ * Allocate from the arena, aligned like malloc.
+ *
+ * @param arena Arena to allocate from.
+ * @param size Bytes to allocate.
+ * @returns Pointer to uninitialised memory, or `NULL` if it doesn't fit.
+ */
+void* arena_alloc(Arena_t* arena, uintptr_t size) {
+	return arena_alloc_aligned(arena, size, ARENA_ALIGN);
+}
+
+/**
+ * Allocate from the arena with a given alignment, e.g. 32 for DMA buffers.
+ *
+ * @param arena Arena to allocate from.
+ * @param size Bytes to allocate.
+ * @param alignment Power of two.
+ * @returns Pointer to uninitialised memory, or `NULL` if it doesn't fit.
+ */
+void* arena_alloc_aligned(Arena_t* arena, uintptr_t size, uintptr_t alignment) {
+	uintptr_t top = (uintptr_t)arena->top;
+	uintptr_t aligned = (top + (alignment - 1)) & ~(alignment - 1);
+
+	if (aligned < top || aligned > (uintptr_t)arena->end || size > (uintptr_t)arena->end - aligned) {
+		arena->failures++;
+		return NULL;
+	}
+
+	arena->top = (uint8_t*)(aligned + size);
+
+	uintptr_t used = arena->top - arena->start;
+	if (used > arena->high_water) arena->high_water = used;
+
+	return (void*)aligned;
+}
+
+/**
+ * Allocate zeroed memory for `num` elements of `size` bytes from the arena.
+ *
+ * @returns Pointer to zeroed memory, or `NULL` if it doesn't fit.
+ */
+void* arena_calloc(Arena_t* arena, uintptr_t num, uintptr_t size) {
+	if (size != 0 && num > UINTPTR_MAX / size) {
+		arena->failures++;
+		return NULL;
+	}
+
+	void* ptr = arena_alloc(arena, num * size);
+	if (ptr == NULL) return NULL;
+
+	memset(ptr, 0, num * size);
+	return ptr;
+}
+
+/**
+ * Remember the arena's current position, everything allocated after it can be
+ * freed in one go with `arena_restore`. Markers nest: restoring an outer one
+ * also frees everything from inner scopes.
+ *
+ * @param arena Arena to mark.
+ * @returns Marker for `arena_restore`.
+ */
+ArenaMarker_t arena_mark(const Arena_t* arena) {
+	return arena->top - arena->start;
+}
+
+/**
+ * Free everything allocated since `marker` was taken.
+ *
+ * @param arena Arena the marker came from.
+ * @param marker From `arena_mark`, must not be past the current position.
+ */
+void arena_restore(Arena_t* arena, ArenaMarker_t marker) {
+	if (marker > (uintptr_t)(arena->top - arena->start)) {
+#ifdef DEBUG
+		fprintf(stderr, "Error: arena restored to a marker that was already freed\n");
+		abort();
+#endif
+		return;
+	}
+
+	arena->top = arena->start + marker;
+}
+
+/**
+ * Free everything in the arena, e.g. at the end of a frame. The high water
+ * mark is kept.
+ *
+ * @param arena Arena to reset.
+ */
+void arena_reset(Arena_t* arena) {
+	arena->top = arena->start;
+}
+
+/**
+ * Get how much of an arena is allocated now.
+ *
+ * @param arena Arena to inspect.
+ * @returns Bytes in use, alignment padding included.
+ */
+uintptr_t arena_used(const Arena_t* arena) {
+	return arena->top - arena->start;
+}
+
+/**
+ * Get an arena's size.
+ *
+ * @param arena Arena to inspect.
+ * @returns Bytes the arena can hand out in all.
+ */
+uintptr_t arena_capacity(const Arena_t* arena) {
+	return arena->end - arena->start;
+}
+
+/**
+ * Get the most an arena has had allocated at once, across resets and
+ * restores, for sizing it.
+ *
+ * @param arena Arena to inspect.
+ * @returns Bytes, alignment padding included.
+ */
+uintptr_t arena_high_water(const Arena_t* arena) {
+	return arena->high_water;
+}
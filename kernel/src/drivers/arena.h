@@ -0,0 +1,43 @@
+#ifndef KERNEL_ARENA_H
+#define KERNEL_ARENA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "allocator.h"
+
+// default alignment of arena allocations, same as malloc's
+#define ARENA_ALIGN ALIGN
+
+// linear allocator: allocations bump a pointer and are only ever freed all
+// at once, by `arena_reset` or by going back to a marker
+typedef struct Arena {
+	uint8_t* start;
+	uint8_t* top;
+	uint8_t* end;
+	uintptr_t high_water; // most bytes in use at once, alignment padding included
+	uint32_t failures;    // allocations that didn't fit
+	bool owns_storage;
+} Arena_t;
+
+// position in an arena to go back to, see `arena_mark`
+typedef uintptr_t ArenaMarker_t;
+
+Arena_t* arena_create(uintptr_t size);
+bool arena_init(Arena_t* arena, void* buffer, uintptr_t size);
+void arena_destroy(Arena_t* arena);
+
+void* arena_alloc(Arena_t* arena, uintptr_t size);
+void* arena_alloc_aligned(Arena_t* arena, uintptr_t size, uintptr_t alignment);
+void* arena_calloc(Arena_t* arena, uintptr_t num, uintptr_t size);
+
+ArenaMarker_t arena_mark(const Arena_t* arena);
+void arena_restore(Arena_t* arena, ArenaMarker_t marker);
+void arena_reset(Arena_t* arena);
+
+uintptr_t arena_used(const Arena_t* arena);
+uintptr_t arena_capacity(const Arena_t* arena);
+uintptr_t arena_high_water(const Arena_t* arena);
+
+#endif
@@ -0,0 +1,342 @@
+#include "async.hpp"
+
+#include <stdio.h>
+
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/spi.h"
+
+extern "C" {
+#include "pool.h"
+}
+
+// coroutines the executor resumes on its next pass, in order
+static AsyncWaiter* _ready_head = nullptr;
+static AsyncWaiter* _ready_tail = nullptr;
+
+// finished operations' coroutines, pushed from interrupt handlers, newest first
+static std::atomic<AsyncWaiter*> _completed{ nullptr };
+
+// sleeping coroutines, soonest first
+static AsyncWaiter* _timers = nullptr;
+
+// DMA transfers, the head is the one in flight once _dma_started is set
+static AsyncDma* _dma_head = nullptr;
+static AsyncDma* _dma_tail = nullptr;
+static bool _dma_started = false;
+static int _dma_channel = -1;
+
+alignas(POOL_ALIGN) static uint8_t _frame_buffer[POOL_BUFFER_SIZE(ASYNC_FRAME_SIZE, ASYNC_FRAMES)];
+static Pool_t _frames;
+static bool _frames_ready = false;
+
+static Task_t _task;
+static AsyncStats_t _stats;
+
+/**
+ * Get a coroutine frame from the pool, for the promises' operator new.
+ *
+ * @param size Bytes the compiler needs for the frame.
+ * @returns The frame, or `nullptr` if it's bigger than ASYNC_FRAME_SIZE or
+ *          the pool is empty (the coroutine then isn't started).
+ */
+void* async_frame_alloc(std::size_t size) noexcept {
+	if (!_frames_ready) {
+		pool_init(&_frames, _frame_buffer, ASYNC_FRAME_SIZE, ASYNC_FRAMES);
+		_frames_ready = true;
+	}
+
+	if (size > _stats.largest) _stats.largest = size;
+	void* frame = size <= ASYNC_FRAME_SIZE ? pool_alloc(&_frames) : nullptr;
+	if (frame == nullptr) _stats.failures++;
+	return frame;
+}
+
+/**
+ * Give a coroutine frame back to the pool.
+ *
+ * @param frame Frame from async_frame_alloc.
+ */
+void async_frame_free(void* frame) noexcept {
+	pool_free(&_frames, frame);
+}
+
+/**
+ * Queue a coroutine to be resumed on the executor's next pass. Only from the
+ * executor's core, outside interrupt handlers.
+ *
+ * @param waiter Waiter of the suspended coroutine.
+ */
+void async_ready(AsyncWaiter* waiter) {
+	waiter->next = nullptr;
+	if (_ready_tail == nullptr) {
+		_ready_head = waiter;
+	} else {
+		_ready_tail->next = waiter;
+	}
+	_ready_tail = waiter;
+	task_wake(&_task);
+}
+
+/**
+ * Hand a coroutine whose operation finished back to the executor. Safe from
+ * interrupt handlers and either core.
+ *
+ * @param waiter Waiter of the suspended coroutine.
+ */
+void async_complete(AsyncWaiter* waiter) {
+	AsyncWaiter* head = _completed.load(std::memory_order_relaxed);
+	do {
+		waiter->next = head;
+	} while (!_completed.compare_exchange_weak(head, waiter, std::memory_order_release, std::memory_order_relaxed));
+	sched_signal(SCHED_EVENT_ASYNC);
+}
+
+/**
+ * Have a coroutine resumed at a given time.
+ *
+ * @param waiter Waiter of the suspended coroutine.
+ * @param time_us Deadline, from time_us_32.
+ */
+void async_at(AsyncWaiter* waiter, uint32_t time_us) {
+	waiter->deadline_us = time_us;
+
+	AsyncWaiter** link = &_timers;
+	while (*link != nullptr && (int32_t)((*link)->deadline_us - time_us) <= 0) link = &(*link)->next;
+	waiter->next = *link;
+	*link = waiter;
+}
+
+static void _dma_service();
+
+/**
+ * Start the transfer at the head of the DMA queue: take the SPI bus for it
+ * if it goes to a device, and point the channel at it. The bus is the
+ * transfer's alone until _dma_end, a blocking transaction for the same
+ * device waits for it (finishing it through _dma_service) instead of nesting.
+ *
+ * @param dma Transfer.
+ * @returns `false` if the bus is in use, try again later.
+ */
+static bool _dma_start(AsyncDma* dma) {
+	dma_channel_config config = dma_channel_get_default_config(_dma_channel);
+	uint32_t count = dma->bytes;
+
+	if (dma->device != SPI_DEVICE_NONE) {
+		if (!spi_bus_try_begin_exclusive(dma->device, _dma_service)) return false;
+
+		channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+		channel_config_set_write_increment(&config, false);
+		channel_config_set_dreq(&config, spi_get_dreq(SPI_PORT, true));
+		dma->dest = (void*)&spi_get_hw(SPI_PORT)->dr;
+	} else {
+		// the default config only moves the read address
+		channel_config_set_write_increment(&config, true);
+		if ((((uintptr_t)dma->dest | (uintptr_t)dma->src | dma->bytes) & 3) == 0) {
+			channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+			count /= 4;
+		} else {
+			channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+		}
+	}
+
+	dma_channel_configure(_dma_channel, &config, dma->dest, dma->src, count, true);
+	return true;
+}
+
+/**
+ * Finish a transfer whose DMA is done: for SPI, wait for the last bytes to
+ * shift out, throw away what came back and end the bus transaction.
+ *
+ * @param dma Transfer.
+ */
+static void _dma_end(AsyncDma* dma) {
+	if (dma->device == SPI_DEVICE_NONE) return;
+
+	while (spi_is_busy(SPI_PORT)) tight_loop_contents();
+	while (spi_is_readable(SPI_PORT)) (void)spi_get_hw(SPI_PORT)->dr;
+	spi_get_hw(SPI_PORT)->icr = SPI_SSPICR_RORIC_BITS;
+	spi_bus_end(dma->device);
+}
+
+/**
+ * Move the DMA queue along: finish the transfer in flight if the channel's
+ * done with it and start the next.
+ */
+static void _dma_service() {
+	while (_dma_head != nullptr) {
+		AsyncDma* dma = _dma_head;
+		if (!_dma_started) {
+			if (!_dma_start(dma)) return;
+			_dma_started = true;
+		}
+		if (dma_channel_is_busy(_dma_channel)) return;
+
+		_dma_end(dma);
+		_dma_started = false;
+		_dma_head = dma->next;
+		if (_dma_head == nullptr) _dma_tail = nullptr;
+		dma->finish();
+	}
+}
+
+static void _dma_irq_handler() {
+	if (_dma_channel < 0 || !dma_channel_get_irq1_status(_dma_channel)) return;
+	dma_channel_acknowledge_irq1(_dma_channel);
+	sched_signal(SCHED_EVENT_ASYNC);
+}
+
+/**
+ * Queue a DMA transfer, starting it now if the channel's free.
+ */
+AsyncDma::AsyncDma(void* dest, const void* src, uint32_t bytes, uint8_t device)
+	: dest(dest), src(src), bytes(bytes), device(device) {
+	if (_dma_channel < 0 || bytes == 0) {
+		state.store(DONE, std::memory_order_release);
+		return;
+	}
+
+	if (_dma_tail == nullptr) {
+		_dma_head = this;
+	} else {
+		_dma_tail->next = this;
+	}
+	_dma_tail = this;
+	_dma_service();
+}
+
+/**
+ * A transfer that's never awaited is waited for here, the channel still
+ * points at its buffer.
+ */
+AsyncDma::~AsyncDma() {
+	while (!done()) async_service();
+}
+
+/**
+ * Move the drivers along without resuming anything, for operations waiting
+ * for themselves to finish outside the executor.
+ */
+void async_service() {
+	_dma_service();
+	if (!sd_queue_idle()) sd_queue_poll();
+	tight_loop_contents();
+}
+
+/**
+ * Hand a coroutine to the executor, which runs it until it's done and then
+ * frees it.
+ *
+ * @param task Coroutine, given up.
+ * @returns `false` if it couldn't be started (no frame).
+ */
+bool async_spawn(Async<void>&& task) {
+	if (!task.valid()) return false;
+
+	std::coroutine_handle<AsyncPromise<void>> handle = task.release();
+	AsyncPromise<void>& promise = handle.promise();
+	promise.detached = true;
+	promise.waiter.handle = handle;
+	async_ready(&promise.waiter);
+	_stats.spawned++;
+	return true;
+}
+
+/**
+ * The executor, as a scheduler task: collects the coroutines whose
+ * operations finished or whose time came, resumes each once, and waits for
+ * the next completion or deadline. While SD requests or DMA transfers
+ * waiting for the bus are outstanding it runs every pass to poll them.
+ *
+ * @param task The executor's task.
+ */
+static void _executor(Task_t* task) {
+	async_service();
+
+	// finished operations, oldest first
+	AsyncWaiter* completed = _completed.exchange(nullptr, std::memory_order_acquire);
+	AsyncWaiter* reversed = nullptr;
+	while (completed != nullptr) {
+		AsyncWaiter* next = completed->next;
+		completed->next = reversed;
+		reversed = completed;
+		completed = next;
+	}
+	while (reversed != nullptr) {
+		AsyncWaiter* next = reversed->next;
+		async_ready(reversed);
+		reversed = next;
+	}
+
+	uint32_t now = time_us_32();
+	while (_timers != nullptr && (int32_t)(now - _timers->deadline_us) >= 0) {
+		AsyncWaiter* waiter = _timers;
+		_timers = waiter->next;
+		async_ready(waiter);
+	}
+
+	// what these make ready runs on the next pass, after the other tasks
+	AsyncWaiter* waiter = _ready_head;
+	_ready_head = nullptr;
+	_ready_tail = nullptr;
+	while (waiter != nullptr) {
+		// the coroutine can finish and take its waiter with it
+		AsyncWaiter* next = waiter->next;
+		_stats.resumes++;
+		waiter->handle.resume();
+		waiter = next;
+	}
+
+	_dma_service();
+	if (_ready_head != nullptr || !sd_queue_idle() || (_dma_head != nullptr && !_dma_started)) {
+		task_wake(task);
+		return;
+	}
+
+	task_wait(task, SCHED_EVENT_ASYNC);
+	if (_timers != nullptr) task_sleep_until(task, _timers->deadline_us);
+}
+
+/**
+ * Start the executor on the calling core's scheduler, and claim its DMA
+ * channel (completions on DMA_IRQ_1, shared with the button sampler).
+ * Coroutines run on this core from sched_run on.
+ */
+void async_init() {
+	_dma_channel = dma_claim_unused_channel(false);
+	if (_dma_channel >= 0) {
+		dma_channel_set_irq1_enabled(_dma_channel, true);
+		irq_add_shared_handler(DMA_IRQ_1, _dma_irq_handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+		irq_set_enabled(DMA_IRQ_1, true);
+	}
+
+	task_start(&_task, "async", _executor, nullptr);
+}
+
+/**
+ * Get the executor's counters and how full the frame pool is.
+ *
+ * @param stats Filled in with the counters.
+ */
+void async_stats(AsyncStats_t* stats) {
+	*stats = _stats;
+	stats->frames = 0;
+	stats->peak = 0;
+	if (_frames_ready) {
+		PoolStats_t pool;
+		pool_stats(&_frames, &pool);
+		stats->frames = pool.used;
+		stats->peak = pool.peak;
+	}
+}
+
+/**
+ * Print the executor's counters over stdio.
+ */
+void async_dump() {
+	AsyncStats_t stats;
+	async_stats(&stats);
+	printf("async: %lu spawned, %lu resumes, frames %lu/%u (peak %lu, largest %lu bytes), %lu not started\n",
+		(unsigned long)stats.spawned, (unsigned long)stats.resumes, (unsigned long)stats.frames, ASYNC_FRAMES,
+		(unsigned long)stats.peak, (unsigned long)stats.largest, (unsigned long)stats.failures);
+}
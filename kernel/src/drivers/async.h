@@ -0,0 +1,41 @@
+#ifndef KERNEL_ASYNC_H
+#define KERNEL_ASYNC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The C side of the coroutine layer (async.hpp, built with ASYNC_COROUTINES):
+// starting its executor and its counters.
+
+// coroutine frames come from a fixed pool of ASYNC_FRAMES slots; a coroutine
+// whose frame is bigger than a slot, or that's called with every slot taken,
+// doesn't start
+#ifndef ASYNC_FRAME_SIZE
+#define ASYNC_FRAME_SIZE 512
+#endif
+#ifndef ASYNC_FRAMES
+#define ASYNC_FRAMES 16
+#endif
+
+typedef struct AsyncStats {
+	uint32_t spawned;  // coroutines handed to the executor
+	uint32_t resumes;  // by the executor, not counting awaits of coroutines
+	uint32_t frames;   // in use
+	uint32_t peak;     // most in use at once
+	uint32_t failures; // coroutines that didn't start, no frame
+	uint32_t largest;  // biggest frame asked for, bytes
+} AsyncStats_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void async_init();
+void async_stats(AsyncStats_t* stats);
+void async_dump();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
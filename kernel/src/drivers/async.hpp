@@ -0,0 +1,358 @@
+#ifndef KERNEL_ASYNC_HPP
+#define KERNEL_ASYNC_HPP
+
+#include <coroutine>
+#include <atomic>
+#include <optional>
+#include <utility>
+
+#include "async.h"
+
+extern "C" {
+#include "scheduler.h"
+#include "sd_queue.h"
+#include "spi_bus.h"
+}
+
+// C++20 coroutines over the drivers, for apps that want to write "read
+// sectors, decode, draw" straight down instead of as a state machine:
+//
+//     Async<> show(uint32_t sector, uint8_t* pixels) {
+//         int result = co_await async_sd_read(sector, 8, pixels);
+//         if (result != SD_OK) co_return;
+//         decode(pixels);
+//         co_await async_spi_write(SPI_DEVICE_LCD, pixels, 4096);
+//     }
+//
+//     async_spawn(show(sector, pixels));
+//
+// A coroutine runs on the executor (a scheduler task on the core that called
+// async_init) until it awaits something, then the executor resumes it once
+// that's done. Frames come from a pool (see async.h), never the heap, and
+// nothing throws: the kernel is built without exceptions.
+//
+// Coroutines only run on the executor's core and aren't started from
+// interrupt handlers. SD, DMA and SPI operations start as soon as they're
+// created and are awaited later, so a coroutine can start a read, work on
+// the last block meanwhile, and then wait for it.
+//
+// GCC before 12.3 builds a broken frame for a coroutine with a co_await in an
+// if condition (bug 106188, the coroutine never gets past its start), so
+// await into a variable first, as above.
+
+// A suspended coroutine the executor is to resume, linked into its lists.
+struct AsyncWaiter {
+	AsyncWaiter* next = nullptr;
+	std::coroutine_handle<> handle;
+	uint32_t deadline_us = 0;
+};
+
+void* async_frame_alloc(std::size_t size) noexcept;
+void async_frame_free(void* frame) noexcept;
+void async_ready(AsyncWaiter* waiter);
+void async_complete(AsyncWaiter* waiter);
+void async_at(AsyncWaiter* waiter, uint32_t time_us);
+void async_service();
+
+template<typename T = void>
+class Async;
+
+struct AsyncPromiseBase {
+	AsyncWaiter waiter;                   // for async_spawn
+	std::coroutine_handle<> continuation; // the coroutine awaiting this one
+	bool detached = false;                // spawned, frees itself when done
+
+	static void* operator new(std::size_t size) noexcept {
+		return async_frame_alloc(size);
+	}
+
+	static void operator delete(void* frame) noexcept {
+		async_frame_free(frame);
+	}
+
+	// when it's done, carry straight on with whoever awaited it
+	struct Final {
+		bool await_ready() const noexcept {
+			return false;
+		}
+
+		template<typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+			AsyncPromiseBase& promise = handle.promise();
+			if (promise.continuation) return promise.continuation;
+			if (promise.detached) handle.destroy();
+			return std::noop_coroutine();
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+	std::suspend_always initial_suspend() const noexcept {
+		return {};
+	}
+
+	Final final_suspend() const noexcept {
+		return {};
+	}
+
+	void unhandled_exception() noexcept {}
+};
+
+template<typename T>
+struct AsyncPromise : AsyncPromiseBase {
+	std::optional<T> value;
+
+	Async<T> get_return_object() noexcept;
+
+	static Async<T> get_return_object_on_allocation_failure() noexcept;
+
+	template<typename U>
+	void return_value(U&& result) {
+		value.emplace(std::forward<U>(result));
+	}
+};
+
+template<>
+struct AsyncPromise<void> : AsyncPromiseBase {
+	Async<void> get_return_object() noexcept;
+
+	static Async<void> get_return_object_on_allocation_failure() noexcept;
+
+	void return_void() noexcept {}
+};
+
+// A coroutine returning T. It starts when it's awaited, or handed to
+// async_spawn; one that couldn't get a frame isn't valid, and awaiting it
+// gives T{} straight away.
+template<typename T>
+class Async {
+public:
+	using promise_type = AsyncPromise<T>;
+
+	Async() = default;
+
+	explicit Async(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+	Async(Async&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+
+	Async& operator=(Async&& other) noexcept {
+		if (this != &other) {
+			if (handle) handle.destroy();
+			handle = std::exchange(other.handle, nullptr);
+		}
+		return *this;
+	}
+
+	Async(const Async&) = delete;
+	Async& operator=(const Async&) = delete;
+
+	~Async() {
+		if (handle) handle.destroy();
+	}
+
+	bool valid() const {
+		return static_cast<bool>(handle);
+	}
+
+	bool await_ready() const noexcept {
+		return !handle || handle.done();
+	}
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+		handle.promise().continuation = awaiting;
+		return handle;
+	}
+
+	T await_resume() {
+		if constexpr (!std::is_void_v<T>) {
+			if (!handle || !handle.promise().value) return T{};
+			return std::move(*handle.promise().value);
+		}
+	}
+
+	// give up the coroutine, e.g. to the executor
+	std::coroutine_handle<promise_type> release() {
+		return std::exchange(handle, nullptr);
+	}
+
+private:
+	std::coroutine_handle<promise_type> handle;
+};
+
+template<typename T>
+Async<T> AsyncPromise<T>::get_return_object() noexcept {
+	return Async<T>(std::coroutine_handle<AsyncPromise<T>>::from_promise(*this));
+}
+
+template<typename T>
+Async<T> AsyncPromise<T>::get_return_object_on_allocation_failure() noexcept {
+	return Async<T>();
+}
+
+inline Async<void> AsyncPromise<void>::get_return_object() noexcept {
+	return Async<void>(std::coroutine_handle<AsyncPromise<void>>::from_promise(*this));
+}
+
+inline Async<void> AsyncPromise<void>::get_return_object_on_allocation_failure() noexcept {
+	return Async<void>();
+}
+
+bool async_spawn(Async<void>&& task);
+
+// An operation that starts when it's created and finishes in an interrupt
+// handler (or the executor), awaited whenever the coroutine needs its result.
+// Not copyable or movable: the drivers hold on to it until it's done.
+class AsyncOp {
+public:
+	AsyncOp() = default;
+	AsyncOp(const AsyncOp&) = delete;
+	AsyncOp& operator=(const AsyncOp&) = delete;
+
+	bool done() const {
+		return state.load(std::memory_order_acquire) == DONE;
+	}
+
+	bool await_ready() const noexcept {
+		return done();
+	}
+
+	// `false` (carry on) if it finished in the meantime
+	bool await_suspend(std::coroutine_handle<> handle) noexcept {
+		waiter.handle = handle;
+		uint32_t expected = RUNNING;
+		return state.compare_exchange_strong(expected, WAITING, std::memory_order_acq_rel);
+	}
+
+	// mark it done and hand its coroutine back to the executor if it's waiting;
+	// safe from interrupt handlers
+	void finish() {
+		if (state.exchange(DONE, std::memory_order_acq_rel) == WAITING) async_complete(&waiter);
+	}
+
+protected:
+	static constexpr uint32_t RUNNING = 0;
+	static constexpr uint32_t DONE = 1;
+	static constexpr uint32_t WAITING = 2;
+
+	std::atomic<uint32_t> state{ RUNNING };
+	AsyncWaiter waiter;
+};
+
+// SD sectors read or written through the request queue (sd_queue_init must
+// have run); awaiting it gives SD_OK or an SD_ERR_ code. One that's never
+// awaited waits for the card in its destructor.
+class AsyncSd : public AsyncOp {
+public:
+	AsyncSd(uint8_t op, uint32_t sector, uint32_t count, uint8_t* buffer) {
+		if (!sd_queue_submit(&request, op, sector, count, buffer, _done, this)) {
+			request.result = SD_ERR_IO;
+			state.store(DONE, std::memory_order_release);
+		}
+	}
+
+	~AsyncSd() {
+		while (!done()) async_service();
+	}
+
+	int await_resume() const noexcept {
+		return request.result;
+	}
+
+private:
+	static void _done(SdRequest_t* request) {
+		static_cast<AsyncSd*>(request->user)->finish();
+	}
+
+	SdRequest_t request = {};
+};
+
+inline AsyncSd async_sd_read(uint32_t sector, uint32_t count, uint8_t* buffer) {
+	return AsyncSd(SD_REQ_READ, sector, count, buffer);
+}
+
+inline AsyncSd async_sd_write(uint32_t sector, uint32_t count, const uint8_t* buffer) {
+	return AsyncSd(SD_REQ_WRITE, sector, count, const_cast<uint8_t*>(buffer));
+}
+
+// A DMA transfer on the executor's channel: memory to memory, or out to an
+// SPI device inside its own bus transaction (the device's chip select, and
+// anything else it needs like the LCD's DC pin, are up to the caller).
+// Transfers go one at a time in the order they were created. While one is
+// on the bus nothing else is, not even the same device's blocking drawing:
+// spi_bus_begin waits for the transfer to finish.
+class AsyncDma : public AsyncOp {
+public:
+	AsyncDma(void* dest, const void* src, uint32_t bytes, uint8_t device);
+	~AsyncDma();
+
+	void await_resume() const noexcept {}
+
+	// owned by the executor
+	AsyncDma* next = nullptr;
+	void* dest;
+	const void* src;
+	uint32_t bytes;
+	uint8_t device;
+};
+
+inline AsyncDma async_dma_copy(void* dest, const void* src, uint32_t bytes) {
+	return AsyncDma(dest, src, bytes, SPI_DEVICE_NONE);
+}
+
+inline AsyncDma async_spi_write(uint8_t device, const uint8_t* data, uint32_t bytes) {
+	return AsyncDma(nullptr, data, bytes, device);
+}
+
+// Resume at a time_us_32 time, or straight away if it's passed.
+class AsyncSleep {
+public:
+	explicit AsyncSleep(uint32_t time_us) {
+		waiter.deadline_us = time_us;
+	}
+
+	bool await_ready() const noexcept {
+		return (int32_t)(waiter.deadline_us - time_us_32()) <= 0;
+	}
+
+	void await_suspend(std::coroutine_handle<> handle) noexcept {
+		waiter.handle = handle;
+		async_at(&waiter, waiter.deadline_us);
+	}
+
+	void await_resume() const noexcept {}
+
+private:
+	AsyncWaiter waiter;
+};
+
+inline AsyncSleep async_sleep(uint32_t us) {
+	return AsyncSleep(time_us_32() + us);
+}
+
+inline AsyncSleep async_sleep_until(uint32_t time_us) {
+	return AsyncSleep(time_us);
+}
+
+// Let everything else that's ready run first.
+class AsyncYield {
+public:
+	bool await_ready() const noexcept {
+		return false;
+	}
+
+	void await_suspend(std::coroutine_handle<> handle) noexcept {
+		waiter.handle = handle;
+		async_ready(&waiter);
+	}
+
+	void await_resume() const noexcept {}
+
+private:
+	AsyncWaiter waiter;
+};
+
+inline AsyncYield async_yield() {
+	return AsyncYield();
+}
+
+#endif
@@ -1,6 +1,390 @@
 #include "buttons.h"
 
+#include <stdatomic.h>
+#include <string.h>
+
+#include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "hardware/timer.h"
+#if BUTTONS_PIO
+#include "hardware/pio.h"
+#include "hardware/dma.h"
+#include "hardware/clocks.h"
+
+#include "memory.h"
+#endif
+
 #include "pins.h"
+#include "scheduler.h"
+
+// Buttons come from one of two places:
+//  - BUTTONS_PIO: a PIO state machine samples every button pin together,
+//    debounces them and pushes the new state of all of them when one
+//    changes; the DMA copies each state into a ring, with the time. No CPU
+//    at all until button_poll finds something in the ring, and buttons
+//    changing together arrive together. The DMA's interrupt at the end of
+//    each entry only wakes the tasks waiting for input.
+//  - otherwise, or if no state machine is free: an edge interrupt reports a
+//    change at once (with the time of the edge) and starts the button
+//    settling, ignoring edges for BUTTON_DEBOUNCE_US; an alarm at the end
+//    reads the pin again, and if it has changed since (it was released
+//    while bouncing), reports that and settles again. Presses and releases
+//    go through a lock-free ring to button_poll.
+// button_poll adds the auto-repeats and chords either way. New presses and
+// releases signal SCHED_EVENT_INPUT.
+typedef struct Button {
+	uint8_t gpio;
+	volatile bool down;     // debounced state, as reported by the interrupts
+	volatile bool settling; // edges are ignored until the alarm fires
+	// button_poll's side
+	uint32_t repeat_delay_us;
+	uint32_t repeat_interval_us;
+	uint32_t repeat_at;
+} Button_t;
+
+// in pin order, the sampler reads them as consecutive pins from PIN_BTN_UP
+static Button_t _buttons[BUTTON_COUNT] = {
+	{ .gpio = PIN_BTN_UP },
+	{ .gpio = PIN_BTN_DOWN },
+	{ .gpio = PIN_BTN_OK },
+};
+
+static ButtonEvent_t _queue[BUTTON_QUEUE_SIZE];
+static atomic_uint _queue_head; // written by the interrupts
+static atomic_uint _queue_tail; // written by button_poll
+
+static uint32_t _held;   // BUTTON_MASK of the buttons down, as button_poll reported
+static bool _chord;      // report a chord next
+static bool _pressing;   // a press since the last chord check
+static uint32_t _chord_time;
+
+static ButtonStats_t _stats;
+
+#if BUTTONS_PIO
+#if PIN_BTN_DOWN != PIN_BTN_UP + 1 || PIN_BTN_OK != PIN_BTN_UP + 2
+#error "the PIO sampler needs the button pins in a row from PIN_BTN_UP"
+#endif
+#if BUTTON_SAMPLER_RING & (BUTTON_SAMPLER_RING - 1)
+#error "BUTTON_SAMPLER_RING must be a power of two"
+#endif
+
+// The sampler, built for BUTTON_COUNT pins at init. X is the state last
+// pushed (bit per pin from PIN_BTN_UP, inverted so pressed is 1), a new
+// state is pushed once two samples a debounce period apart agree on it:
+//  0 top:     mov isr, null
+//  1          in pins, BUTTON_COUNT
+//  2          mov y, isr
+//  3          jmp x!=y changed
+//  4          jmp top
+//  5 changed: mov osr, x            ; keep the last state
+//  6          set x, 31
+//  7 wait:    jmp x-- wait [31]     ; SAMPLER_WAIT_CYCLES, BUTTON_DEBOUNCE_US
+//  8          mov isr, null
+//  9          in pins, BUTTON_COUNT
+// 10          mov x, isr
+// 11          jmp x!=y bounced
+// 12          push block            ; X is the new state
+// 13          jmp top
+// 14 bounced: mov x, osr
+// 15          jmp top
+// The pins are sampled every 5 cycles while nothing changes.
+#define SAMPLER_LENGTH      16
+#define SAMPLER_WAIT_CYCLES (32 * 32)
+
+static bool _sampling;
+static int _sampler_dma;        // copies the time after each state, see _sampler_init
+static uint32_t* _sampler_states; // rings the DMA writes, aligned to their size
+static uint32_t* _sampler_times;
+static atomic_uint _sampler_written; // entries the DMA has finished, counted by _sampler_irq
+static uint _sampler_tail;      // entries button_poll has taken
+static uint32_t _sampler_state; // state of the last entry taken
+static uint32_t _sampler_changes; // bits of that entry not reported yet
+static uint32_t _sampler_time;
+
+/**
+ * DMA interrupt at the end of each sampler entry. Entries are at least a
+ * debounce period apart, so there's one interrupt for each.
+ */
+static void _sampler_irq() {
+	if (!dma_channel_get_irq1_status(_sampler_dma)) return;
+	dma_channel_acknowledge_irq1(_sampler_dma);
+	atomic_fetch_add_explicit(&_sampler_written, 1, memory_order_release);
+	sched_signal(SCHED_EVENT_INPUT);
+}
+
+/**
+ * Start the PIO sampler and its DMA, see the program above. The state
+ * machine's RX FIFO is drained by one DMA channel into a ring of states,
+ * which then triggers a second to copy the timer into a ring of times,
+ * which triggers the first again to wait for the next state; both write
+ * addresses wrap around their rings. The second one's completion raises
+ * DMA_IRQ_1 (the SD queue has DMA_IRQ_0).
+ *
+ * @returns `true` if the sampler is running, `false` if there was no free
+ *          state machine or room for the rings.
+ */
+static bool _sampler_init() {
+	uint16_t instructions[SAMPLER_LENGTH] = {
+		pio_encode_mov(pio_isr, pio_null),
+		pio_encode_in(pio_pins, BUTTON_COUNT),
+		pio_encode_mov(pio_y, pio_isr),
+		pio_encode_jmp_x_ne_y(5),
+		pio_encode_jmp(0),
+		pio_encode_mov(pio_osr, pio_x),
+		pio_encode_set(pio_x, 31),
+		pio_encode_jmp_x_dec(7) | pio_encode_delay(31),
+		pio_encode_mov(pio_isr, pio_null),
+		pio_encode_in(pio_pins, BUTTON_COUNT),
+		pio_encode_mov(pio_x, pio_isr),
+		pio_encode_jmp_x_ne_y(14),
+		pio_encode_push(false, true),
+		pio_encode_jmp(0),
+		pio_encode_mov(pio_x, pio_osr),
+		pio_encode_jmp(0),
+	};
+	pio_program_t program = {
+		.instructions = instructions,
+		.length = SAMPLER_LENGTH,
+		.origin = -1,
+	};
+
+	PIO pio;
+	uint sm;
+	uint offset;
+	if (!pio_claim_free_sm_and_add_program(&program, &pio, &sm, &offset)) return false;
+
+	// the DMA region is never given back, so only once there's a state
+	// machine to fill the rings
+	uint ring = BUTTON_SAMPLER_RING * sizeof(uint32_t);
+	_sampler_states = region_alloc(MEMORY_DMA, ring, ring);
+	_sampler_times = _sampler_states == NULL ? NULL : region_alloc(MEMORY_DMA, ring, ring);
+	if (_sampler_times == NULL) {
+		pio_remove_program_and_unclaim_sm(&program, pio, sm, offset);
+		return false;
+	}
+	memset(_sampler_states, 0, ring);
+	memset(_sampler_times, 0, ring);
+
+	for (uint i = 0; i < BUTTON_COUNT; i++) {
+		gpio_set_inover(_buttons[i].gpio, GPIO_OVERRIDE_INVERT);
+	}
+
+	pio_sm_config config = pio_get_default_sm_config();
+	sm_config_set_wrap(&config, offset, offset + SAMPLER_LENGTH - 1);
+	sm_config_set_in_pins(&config, PIN_BTN_UP);
+	sm_config_set_in_shift(&config, false, false, 32);
+	sm_config_set_fifo_join(&config, PIO_FIFO_JOIN_RX);
+	sm_config_set_clkdiv(&config, (float)clock_get_hz(clk_sys) * BUTTON_DEBOUNCE_US / (1000000.0f * SAMPLER_WAIT_CYCLES));
+	pio_sm_init(pio, sm, offset, &config);
+	pio_sm_exec(pio, sm, pio_encode_mov(pio_x, pio_null));
+
+	int states = dma_claim_unused_channel(true);
+	int times = dma_claim_unused_channel(true);
+	uint ring_bits = __builtin_ctz(ring);
+
+	dma_channel_config states_config = dma_channel_get_default_config(states);
+	channel_config_set_transfer_data_size(&states_config, DMA_SIZE_32);
+	channel_config_set_read_increment(&states_config, false);
+	channel_config_set_write_increment(&states_config, true);
+	channel_config_set_ring(&states_config, true, ring_bits);
+	channel_config_set_dreq(&states_config, pio_get_dreq(pio, sm, false));
+	channel_config_set_chain_to(&states_config, times);
+	dma_channel_configure(states, &states_config, _sampler_states, &pio->rxf[sm], 1, false);
+
+	dma_channel_config times_config = dma_channel_get_default_config(times);
+	channel_config_set_transfer_data_size(&times_config, DMA_SIZE_32);
+	channel_config_set_read_increment(&times_config, false);
+	channel_config_set_write_increment(&times_config, true);
+	channel_config_set_ring(&times_config, true, ring_bits);
+	channel_config_set_dreq(&times_config, DREQ_FORCE);
+	channel_config_set_chain_to(&times_config, states);
+	dma_channel_configure(times, &times_config, _sampler_times, &timer_hw->timerawl, 1, false);
+
+	_sampler_dma = times;
+	irq_add_shared_handler(DMA_IRQ_1, _sampler_irq, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+	irq_set_enabled(DMA_IRQ_1, true);
+	dma_channel_set_irq1_enabled(times, true);
+
+	dma_channel_start(states);
+	pio_sm_set_enabled(pio, sm, true);
+	return true;
+}
+
+/**
+ * Entry of the sampler's rings the DMA writes next. The time is written
+ * after the state, so every entry before it is complete.
+ *
+ * @returns Index into the rings.
+ */
+static uint _sampler_head() {
+	return (dma_hw->ch[_sampler_dma].write_addr - (uintptr_t)_sampler_times) / sizeof(uint32_t);
+}
+
+/**
+ * Take the next press or release from the sampler's rings. An entry is the
+ * state of every button, each one that changed since the last entry is
+ * reported in turn. If button_poll fell so far behind that the DMA came
+ * round to entries it hadn't taken, those are counted as dropped and it
+ * carries on from the oldest one left, reporting what changed since the last
+ * entry it took.
+ *
+ * @param event Filled in with the button, type and time.
+ * @param more Set if more changes of the same entry follow.
+ * @returns `true` if there was a change, `false` otherwise.
+ */
+static bool _sampler_next(ButtonEvent_t* event, bool* more) {
+	while (_sampler_changes == 0) {
+		uint written = atomic_load_explicit(&_sampler_written, memory_order_acquire);
+		if (written == _sampler_tail) return false;
+		// the slot after the newest entry may be being written, the rings
+		// hold one entry less than they have room for
+		if (written - _sampler_tail >= BUTTON_SAMPLER_RING) {
+			uint oldest = written - (BUTTON_SAMPLER_RING - 1);
+			_stats.dropped += oldest - _sampler_tail;
+			_sampler_tail = oldest;
+		}
+
+		uint entry = _sampler_tail & (BUTTON_SAMPLER_RING - 1);
+		uint32_t state = _sampler_states[entry];
+		uint32_t time = _sampler_times[entry];
+		// overwritten while it was read, try the next one
+		written = atomic_load_explicit(&_sampler_written, memory_order_acquire);
+		if (written - _sampler_tail >= BUTTON_SAMPLER_RING) continue;
+
+		// pushed a debounce period after the edge
+		_sampler_time = time - BUTTON_DEBOUNCE_US;
+		_sampler_tail++;
+		_sampler_changes = state ^ _sampler_state;
+		_sampler_state = state;
+	}
+
+	uint bit = __builtin_ctz(_sampler_changes);
+	_sampler_changes &= _sampler_changes - 1;
+	event->time_us = _sampler_time;
+	event->button = PIN_BTN_UP + bit;
+	event->type = (_sampler_state >> bit) & 1 ? BUTTON_PRESS : BUTTON_RELEASE;
+	*more = _sampler_changes != 0;
+	_stats.events++;
+	return true;
+}
+#endif
+
+/**
+ * Find the button on a GPIO pin.
+ *
+ * @param gpio GPIO pin number.
+ * @returns The button, or `NULL` if there's none on that pin.
+ */
+static Button_t* _button(uint gpio) {
+	for (uint i = 0; i < BUTTON_COUNT; i++) {
+		if (_buttons[i].gpio == gpio) return &_buttons[i];
+	}
+	return NULL;
+}
+
+/**
+ * Queue a press or release, dropping it if button_poll has fallen behind.
+ * Only called from the edge interrupt and the debounce alarm, which run at
+ * the same priority on the same core, so there's one writer at a time.
+ *
+ * @param button Button that changed.
+ * @param type BUTTON_PRESS or BUTTON_RELEASE.
+ * @param time_us When it changed, from time_us_32.
+ */
+static void _push(Button_t* button, uint8_t type, uint32_t time_us) {
+	uint head = atomic_load_explicit(&_queue_head, memory_order_relaxed);
+	uint tail = atomic_load_explicit(&_queue_tail, memory_order_acquire);
+	if (head - tail >= BUTTON_QUEUE_SIZE) {
+		_stats.dropped++;
+		return;
+	}
+
+	ButtonEvent_t* event = &_queue[head & (BUTTON_QUEUE_SIZE - 1)];
+	event->time_us = time_us;
+	event->button = button->gpio;
+	event->type = type;
+	atomic_store_explicit(&_queue_head, head + 1, memory_order_release);
+	_stats.events++;
+	sched_signal(SCHED_EVENT_INPUT);
+}
+
+static int64_t _settled(alarm_id_t id, void* user_data);
+
+/**
+ * Report a button's new state and ignore its pin until it has settled.
+ *
+ * @param button Button that changed.
+ * @param down Whether it's now pressed.
+ * @param time_us When it changed, from time_us_32.
+ * @returns `true` if the debounce alarm was set.
+ */
+static bool _change(Button_t* button, bool down, uint32_t time_us) {
+	button->down = down;
+	_push(button, down ? BUTTON_PRESS : BUTTON_RELEASE, time_us);
+
+	button->settling = true;
+	if (add_alarm_in_us(BUTTON_DEBOUNCE_US, _settled, button, true) > 0) return true;
+
+	// no alarm free, better bouncy than stuck
+	button->settling = false;
+	return false;
+}
+
+/**
+ * Debounce alarm: the button has been left alone long enough, catch up with
+ * its pin in case it changed again while settling.
+ *
+ * @param id Alarm.
+ * @param user_data The button.
+ * @returns 0, a change sets a new alarm.
+ */
+static int64_t _settled(alarm_id_t id, void* user_data) {
+	Button_t* button = user_data;
+	bool down = gpio_get(button->gpio) == 0;
+	if (down != button->down) {
+		_change(button, down, time_us_32());
+	} else {
+		button->settling = false;
+	}
+	return 0;
+}
+
+/**
+ * GPIO interrupt for the button pins.
+ */
+static void _edge_irq() {
+	uint32_t now = time_us_32();
+	for (uint i = 0; i < BUTTON_COUNT; i++) {
+		Button_t* button = &_buttons[i];
+		uint32_t events = gpio_get_irq_event_mask(button->gpio);
+		if (events == 0) continue;
+		gpio_acknowledge_irq(button->gpio, events);
+
+		if (button->settling) {
+			_stats.bounces++;
+			continue;
+		}
+		bool down = gpio_get(button->gpio) == 0;
+		if (down != button->down) _change(button, down, now);
+	}
+}
+
+/**
+ * Take the next press or release the interrupts queued.
+ *
+ * @param event Filled in with the button, type and time.
+ * @param more Cleared, presses and releases are queued one at a time.
+ * @returns `true` if there was one, `false` otherwise.
+ */
+static bool _queue_next(ButtonEvent_t* event, bool* more) {
+	uint tail = atomic_load_explicit(&_queue_tail, memory_order_relaxed);
+	if (tail == atomic_load_explicit(&_queue_head, memory_order_acquire)) return false;
+
+	*event = _queue[tail & (BUTTON_QUEUE_SIZE - 1)];
+	atomic_store_explicit(&_queue_tail, tail + 1, memory_order_release);
+	*more = false;
+	return true;
+}
 
 void button_init(uint button) {
 	gpio_init(button);
@@ -11,21 +395,163 @@ void button_init(uint button) {
 /**
  * Initialize hardware for all button inputs.
  *
- * Configures PIN_BTN_UP, PIN_BTN_DOWN, and PIN_BTN_OK for use (e.g., sets up
- * direction and pull state via pin_init).
+ * Configures PIN_BTN_UP, PIN_BTN_DOWN, and PIN_BTN_OK as pulled up inputs,
+ * then starts the PIO sampler (BUTTONS_PIO), or enables edge interrupts on
+ * them on the calling core. Every button auto-repeats with
+ * BUTTON_REPEAT_DELAY_US and BUTTON_REPEAT_INTERVAL_US until changed with
+ * button_set_repeat. Call after memory_init, the sampler's rings are in the
+ * DMA region.
  */
 void buttons_init() {
-	button_init(PIN_BTN_UP);
-	button_init(PIN_BTN_DOWN);
-	button_init(PIN_BTN_OK);
+	uint32_t mask = 0;
+	for (uint i = 0; i < BUTTON_COUNT; i++) {
+		Button_t* button = &_buttons[i];
+		button_init(button->gpio);
+		button->repeat_delay_us = BUTTON_REPEAT_DELAY_US;
+		button->repeat_interval_us = BUTTON_REPEAT_INTERVAL_US;
+		mask |= 1u << button->gpio;
+	}
+
+#if BUTTONS_PIO
+	_sampling = _sampler_init();
+	_stats.sampled = _sampling;
+	if (_sampling) return;
+#endif
+
+	for (uint i = 0; i < BUTTON_COUNT; i++) {
+		Button_t* button = &_buttons[i];
+		button->down = gpio_get(button->gpio) == 0;
+		if (button->down) _held |= BUTTON_MASK(button->gpio);
+	}
+
+	gpio_add_raw_irq_handler_masked(mask, _edge_irq);
+	for (uint i = 0; i < BUTTON_COUNT; i++) {
+		gpio_set_irq_enabled(_buttons[i].gpio, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE, true);
+	}
+	irq_set_enabled(IO_IRQ_BANK0, true);
 }
 
 /**
  * Determine whether the specified button is currently pressed.
  *
  * @param button GPIO pin number associated with the button.
- * @returns `true` if the button is pressed (GPIO reads low), `false` otherwise.
+ * @returns `true` if the button is pressed (debounced), `false` otherwise.
  */
 bool button_pressed(uint button) {
-	return gpio_get(button) == 0;
-}
\ No newline at end of file
+	Button_t* b = _button(button);
+	if (b == NULL) return false;
+#if BUTTONS_PIO
+	if (_sampling) {
+		uint newest = (_sampler_head() - 1) & (BUTTON_SAMPLER_RING - 1);
+		return (_sampler_states[newest] >> (button - PIN_BTN_UP)) & 1;
+	}
+#endif
+	return b->down;
+}
+
+/**
+ * Take the next button event, without waiting.
+ *
+ * Presses and releases come out in the order they happened. Presses that
+ * leave two or more buttons held are followed by a BUTTON_CHORD, after all
+ * of them when they came in together (the sampler reports buttons that
+ * settled at the same time together). While a button is held, BUTTON_REPEAT
+ * events follow its press after the repeat delay and then every repeat
+ * interval; a repeat that's overdue by more than an interval (button_poll
+ * wasn't called for a while) is only reported once.
+ *
+ * @param event Filled in with the event.
+ * @returns `true` if there was an event, `false` otherwise.
+ */
+bool button_poll(ButtonEvent_t* event) {
+	if (_chord) {
+		_chord = false;
+		event->time_us = _chord_time;
+		event->held = _held;
+		event->button = 0;
+		event->type = BUTTON_CHORD;
+		return true;
+	}
+
+	bool more;
+#if BUTTONS_PIO
+	bool changed = _sampling ? _sampler_next(event, &more) : _queue_next(event, &more);
+#else
+	bool changed = _queue_next(event, &more);
+#endif
+	if (changed) {
+		Button_t* button = _button(event->button);
+		if (event->type == BUTTON_PRESS) {
+			_held |= BUTTON_MASK(event->button);
+			_pressing = true;
+			button->repeat_at = event->time_us + button->repeat_delay_us;
+		} else {
+			_held &= ~BUTTON_MASK(event->button);
+		}
+		event->held = _held;
+
+		if (!more) {
+			_chord = _pressing && (_held & (_held - 1)) != 0;
+			_chord_time = event->time_us;
+			_pressing = false;
+		}
+		return true;
+	}
+
+	uint32_t now = time_us_32();
+	for (uint i = 0; i < BUTTON_COUNT; i++) {
+		Button_t* button = &_buttons[i];
+		if ((_held & BUTTON_MASK(button->gpio)) == 0 || button->repeat_delay_us == 0) continue;
+		if ((int32_t)(now - button->repeat_at) < 0) continue;
+
+		event->time_us = button->repeat_at;
+		event->held = _held;
+		event->button = button->gpio;
+		event->type = BUTTON_REPEAT;
+		button->repeat_at += button->repeat_interval_us;
+		if ((int32_t)(now - button->repeat_at) >= 0) button->repeat_at = now + button->repeat_interval_us;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * When button_poll will next have an auto-repeat, so a task can sleep until
+ * then (new presses and releases signal SCHED_EVENT_INPUT instead).
+ *
+ * @param time_us Set to the time of the next repeat, from time_us_32.
+ * @returns `true` if a held button will repeat, `false` otherwise.
+ */
+bool buttons_next_repeat(uint32_t* time_us) {
+	bool repeating = false;
+	for (uint i = 0; i < BUTTON_COUNT; i++) {
+		Button_t* button = &_buttons[i];
+		if ((_held & BUTTON_MASK(button->gpio)) == 0 || button->repeat_delay_us == 0) continue;
+		if (!repeating || (int32_t)(button->repeat_at - *time_us) < 0) *time_us = button->repeat_at;
+		repeating = true;
+	}
+	return repeating;
+}
+
+/**
+ * Set how a button auto-repeats while held.
+ *
+ * @param button GPIO pin number associated with the button.
+ * @param delay_us Time from the press to the first repeat, 0 for none.
+ * @param interval_us Time between repeats after that.
+ */
+void button_set_repeat(uint button, uint32_t delay_us, uint32_t interval_us) {
+	Button_t* b = _button(button);
+	if (b == NULL) return;
+	b->repeat_delay_us = delay_us;
+	b->repeat_interval_us = interval_us > 0 ? interval_us : 1;
+}
+
+/**
+ * Get the button event counters.
+ *
+ * @param stats Filled in with the counters.
+ */
+void buttons_stats(ButtonStats_t* stats) {
+	*stats = _stats;
+}
@@ -1,10 +1,64 @@
 #ifndef KERNEL_BUTTONS_H
 #define KERNEL_BUTTONS_H
 
+#include <stdint.h>
 #include <stdbool.h>
 #include "pico/stdlib.h"
 
+#define BUTTON_COUNT 3
+
+// a button has to stay put this long after an edge before another one counts
+#ifndef BUTTON_DEBOUNCE_US
+#define BUTTON_DEBOUNCE_US 5000
+#endif
+
+// events waiting for button_poll, a power of two; newer ones are dropped once full
+#ifndef BUTTON_QUEUE_SIZE
+#define BUTTON_QUEUE_SIZE 32
+#endif
+
+// entries in the PIO sampler's DMA ring, a power of two; it holds one state
+// change less, older ones are dropped once full, see BUTTONS_PIO in buttons.c
+#ifndef BUTTON_SAMPLER_RING
+#define BUTTON_SAMPLER_RING 16
+#endif
+
+// auto-repeat while held, see button_set_repeat
+#define BUTTON_REPEAT_DELAY_US    400000
+#define BUTTON_REPEAT_INTERVAL_US 100000
+
+// event types
+#define BUTTON_PRESS   0
+#define BUTTON_RELEASE 1
+#define BUTTON_REPEAT  2 // still held, see button_set_repeat
+#define BUTTON_CHORD   3 // follows the presses that left two or more buttons held
+
+// a button's bit in ButtonEvent_t.held, chords are tested with e.g.
+// event.held == (BUTTON_MASK(PIN_BTN_UP) | BUTTON_MASK(PIN_BTN_DOWN))
+#define BUTTON_MASK(gpio) (1u << (gpio))
+
+typedef struct ButtonEvent {
+	uint32_t time_us; // of the edge (time_us_32), or when the repeat was due
+	uint32_t held;    // BUTTON_MASK of every button down after this event
+	uint8_t button;   // GPIO pin, PIN_BTN_UP etc.
+	uint8_t type;
+} ButtonEvent_t;
+
+typedef struct ButtonStats {
+	uint32_t events;  // presses and releases
+	uint32_t dropped; // presses and releases lost to a full queue, or (with
+	                  // the sampler) entries the DMA wrote over before
+	                  // button_poll took them
+	uint32_t bounces; // edges ignored while debouncing
+	bool sampled;     // read by the PIO sampler (which doesn't count
+	                  // bounces) rather than interrupts
+} ButtonStats_t;
+
 void buttons_init();
 bool button_pressed(uint button);
+bool button_poll(ButtonEvent_t* event);
+bool buttons_next_repeat(uint32_t* time_us);
+void button_set_repeat(uint button, uint32_t delay_us, uint32_t interval_us);
+void buttons_stats(ButtonStats_t* stats);
 
 #endif
@@ -1,18 +1,30 @@
 #include "lcd.h"
 
 #include "../pins.h"
+#include "../spi_bus.h"
+#include "../memory.h"
+#include "../trace.h"
+
+// rows sent per band before offering the bus to other devices
+#define LCD_BAND_ROWS 16
+#define LCD_MAX_WIDTH 320
+
+// one row of pixels, refilled per fill with the fill colour; written and
+// streamed out by core 0 a byte at a time, so it lives in its scratch bank
+static uint8_t SCRATCH_CORE0("lcd") _line_buffer[LCD_MAX_WIDTH * 2];
 
 /**
- * Send a single command byte to the LCD controller, asserting chip select and selecting command mode.
+ * Send a single command byte to the LCD controller, in its own bus transaction
+ * (or as part of the caller's) with command mode selected.
  * @param cmd Command byte to transmit.
  */
 void lcd_cmd(uint8_t cmd) {
-	gpio_put(PIN_CS, 0);
+	spi_bus_begin(SPI_DEVICE_LCD);
 	gpio_put(PIN_DC, 0);
 	
 	spi_write_blocking(SPI_PORT, &cmd, 1);
 	
-	gpio_put(PIN_CS, 1);
+	spi_bus_end(SPI_DEVICE_LCD);
 }
 
 /**
@@ -21,12 +33,31 @@ void lcd_cmd(uint8_t cmd) {
  * @param data The byte to send as display data.
  */
 void lcd_data(uint8_t data) {
-	gpio_put(PIN_CS, 0);
+	spi_bus_begin(SPI_DEVICE_LCD);
 	gpio_put(PIN_DC, 1);
 	
 	spi_write_blocking(SPI_PORT, &data, 1);
 	
-	gpio_put(PIN_CS, 1);
+	spi_bus_end(SPI_DEVICE_LCD);
+}
+
+/**
+ * Send a command byte followed by its parameter bytes in one go.
+ *
+ * @param cmd Command byte to transmit.
+ * @param data Parameter bytes.
+ * @param len Number of parameter bytes.
+ */
+static void _lcd_cmd_data(uint8_t cmd, const uint8_t* data, size_t len) {
+	spi_bus_begin(SPI_DEVICE_LCD);
+
+	gpio_put(PIN_DC, 0);
+	spi_write_blocking(SPI_PORT, &cmd, 1);
+
+	gpio_put(PIN_DC, 1);
+	spi_write_blocking(SPI_PORT, data, len);
+
+	spi_bus_end(SPI_DEVICE_LCD);
 }
 
 /**
@@ -41,34 +72,28 @@ void lcd_data(uint8_t data) {
  * @param y1 Bottom row index (end, inclusive).
  */
 void lcd_set_window(uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1) {
-	spi_set_baudrate(SPI_PORT, DEFAULT_MHZ);
+	spi_bus_begin(SPI_DEVICE_LCD);
 
 	// set column address
-	lcd_cmd(0x2A);
-	
-	lcd_data(x0 >> 8);
-	lcd_data(x0 & 0xFF);
-	
-	lcd_data(x1 >> 8);
-	lcd_data(x1 & 0xFF);
+	uint8_t columns[4] = { x0 >> 8, x0 & 0xFF, x1 >> 8, x1 & 0xFF };
+	_lcd_cmd_data(0x2A, columns, 4);
 
 	// set row address
-	lcd_cmd(0x2B);
-	
-	lcd_data(y0 >> 8);
-	lcd_data(y0 & 0xFF);
-	
-	lcd_data(y1 >> 8);
-	lcd_data(y1 & 0xFF);
+	uint8_t rows[4] = { y0 >> 8, y0 & 0xFF, y1 >> 8, y1 & 0xFF };
+	_lcd_cmd_data(0x2B, rows, 4);
 
 	// memory write command
 	lcd_cmd(0x2C);
+
+	spi_bus_end(SPI_DEVICE_LCD);
 }
 
 /**
  * Fill a rectangular area on the LCD with the specified color.
  *
  * Defines a drawing window from (x, y) with width `w` and height `h`, then writes the same color value to every pixel in that area.
+ * Pixels are sent a row at a time in bands of `LCD_BAND_ROWS` rows; between bands the bus is offered
+ * to other devices (queued SD I/O), resuming with memory write continue if it was handed over.
  *
  * @param x      X coordinate of the rectangle's left edge (pixels).
  * @param y      Y coordinate of the rectangle's top edge (pixels).
@@ -77,24 +102,70 @@ void lcd_set_window(uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1) {
  * @param colour 16-bit color value in RGB565 format (transmitted as high byte then low byte).
  */
 void lcd_fill_rect(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t colour) {
-	spi_set_baudrate(SPI_PORT, DEFAULT_MHZ);
-
 	if (w == 0 || h == 0) return;
+	if (w > LCD_MAX_WIDTH) w = LCD_MAX_WIDTH;
+
+	TRACE_BEGIN("lcd_fill_rect");
+	spi_bus_begin(SPI_DEVICE_LCD);
 
 	lcd_set_window(x, y, x + w - 1, y + h - 1);
 
 	uint8_t hi = colour >> 8;
 	uint8_t lo = colour & 0xFF;
 
-	uint8_t buffer[2] = {hi, lo};
+	for (uint16_t i = 0; i < w; i++) {
+		_line_buffer[2 * i] = hi;
+		_line_buffer[2 * i + 1] = lo;
+	}
 
-	gpio_put(PIN_CS, 0);
 	gpio_put(PIN_DC, 1);
 
-	for (uint32_t i = 0; i < (uint32_t)w * h; i++) {
-		spi_write_blocking(SPI_PORT, buffer, 2);
+	for (uint16_t row = 0; row < h; row++) {
+		if (row != 0 && row % LCD_BAND_ROWS == 0 && spi_bus_yield(SPI_DEVICE_LCD)) {
+			// memory write continue, picks up where the last band stopped
+			lcd_cmd(0x3C);
+			gpio_put(PIN_DC, 1);
+		}
+		spi_write_blocking(SPI_PORT, _line_buffer, (size_t)w * 2);
 	}
-	gpio_put(PIN_CS, 1);
+
+	spi_bus_end(SPI_DEVICE_LCD);
+	TRACE_END("lcd_fill_rect");
+}
+
+/**
+ * Draw a block of RGB565 pixels (high byte first), e.g. a sprite asset used in
+ * place from flash.
+ *
+ * Rows are sent straight from `pixels` with no intermediate copy, in bands of
+ * `LCD_BAND_ROWS` rows like `lcd_fill_rect`.
+ *
+ * @param x      X coordinate of the left edge (pixels).
+ * @param y      Y coordinate of the top edge (pixels).
+ * @param w      Width of the bitmap (pixels).
+ * @param h      Height of the bitmap (pixels).
+ * @param pixels `w * h` pixels, row by row.
+ */
+void lcd_draw_bitmap(uint16_t x, uint16_t y, uint16_t w, uint16_t h, const uint8_t* pixels) {
+	if (w == 0 || h == 0) return;
+
+	TRACE_BEGIN("lcd_draw_bitmap");
+	spi_bus_begin(SPI_DEVICE_LCD);
+
+	lcd_set_window(x, y, x + w - 1, y + h - 1);
+	gpio_put(PIN_DC, 1);
+
+	size_t stride = (size_t)w * 2;
+	for (uint16_t row = 0; row < h; row++) {
+		if (row != 0 && row % LCD_BAND_ROWS == 0 && spi_bus_yield(SPI_DEVICE_LCD)) {
+			lcd_cmd(0x3C);
+			gpio_put(PIN_DC, 1);
+		}
+		spi_write_blocking(SPI_PORT, pixels + row * stride, stride);
+	}
+
+	spi_bus_end(SPI_DEVICE_LCD);
+	TRACE_END("lcd_draw_bitmap");
 }
 
 /**
@@ -105,7 +176,7 @@ void lcd_fill_rect(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t colo
  * turns the display on.
  */
 void lcd_init() {
-	spi_set_baudrate(SPI_PORT, DEFAULT_MHZ);
+	spi_bus_begin(SPI_DEVICE_LCD);
 
 	// reset the chip
 	gpio_put(PIN_RST, 1);
@@ -158,4 +229,6 @@ void lcd_init() {
 	// display on
 	lcd_cmd(0x29);
 	sleep_ms(20);
+
+	spi_bus_end(SPI_DEVICE_LCD);
 }
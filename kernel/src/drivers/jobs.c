@@ -0,0 +1,338 @@
+#include "jobs.h"
+
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+#include "pico/platform.h"
+#include "pico/multicore.h"
+#include "hardware/sync.h"
+
+#include "trace.h"
+
+#if JOB_QUEUE_SIZE & (JOB_QUEUE_SIZE - 1)
+#error "JOB_QUEUE_SIZE must be a power of two"
+#endif
+
+// A core's jobs, as a Chase-Lev deque: the core pushes and pops at the
+// bottom (newest first, while its data is fresh), the other core steals
+// from the top (oldest first, usually the biggest piece of work left).
+// Jobs are kept by value, a slot is only reused once top has moved past it.
+typedef struct JobQueue {
+	Job_t jobs[JOB_QUEUE_SIZE];
+	atomic_int top;
+	atomic_int bottom;
+} JobQueue_t;
+
+typedef struct JobCore {
+	JobQueue_t queue;
+	JobStats_t stats; // only written by the core itself
+	uint64_t start_us;
+} JobCore_t;
+
+static JobCore_t _cores[JOB_CORES];
+
+/**
+ * Get the calling core's jobs.
+ *
+ * @returns The core's queue and counters.
+ */
+static JobCore_t* _local_core() {
+	return &_cores[get_core_num()];
+}
+
+/**
+ * Add a job at the bottom of the calling core's queue.
+ *
+ * @param queue The calling core's queue.
+ * @param job Job to copy in.
+ * @returns `false` if the queue is full.
+ */
+static bool _push(JobQueue_t* queue, const Job_t* job) {
+	int bottom = atomic_load_explicit(&queue->bottom, memory_order_relaxed);
+	int top = atomic_load_explicit(&queue->top, memory_order_acquire);
+	if (bottom - top >= JOB_QUEUE_SIZE) return false;
+
+	queue->jobs[bottom & (JOB_QUEUE_SIZE - 1)] = *job;
+	atomic_store_explicit(&queue->bottom, bottom + 1, memory_order_release);
+	return true;
+}
+
+/**
+ * Take the newest job from the calling core's queue. The last job can be
+ * raced for by a thief, whoever moves top past it has it.
+ *
+ * @param queue The calling core's queue.
+ * @param job Filled in with the job.
+ * @returns `false` if the queue was empty.
+ */
+static bool _pop(JobQueue_t* queue, Job_t* job) {
+	int bottom = atomic_load_explicit(&queue->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&queue->bottom, bottom, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	int top = atomic_load_explicit(&queue->top, memory_order_relaxed);
+
+	if (top > bottom) {
+		atomic_store_explicit(&queue->bottom, bottom + 1, memory_order_relaxed);
+		return false;
+	}
+
+	*job = queue->jobs[bottom & (JOB_QUEUE_SIZE - 1)];
+	if (top == bottom) {
+		bool won = atomic_compare_exchange_strong_explicit(&queue->top, &top, top + 1,
+			memory_order_seq_cst, memory_order_relaxed);
+		atomic_store_explicit(&queue->bottom, bottom + 1, memory_order_relaxed);
+		return won;
+	}
+	return true;
+}
+
+/**
+ * Take the oldest job from another core's queue.
+ *
+ * @param queue The other core's queue.
+ * @param job Filled in with the job.
+ * @returns `false` if the queue was empty or its owner (or another thief)
+ *          got the job first.
+ */
+static bool _steal(JobQueue_t* queue, Job_t* job) {
+	int top = atomic_load_explicit(&queue->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	int bottom = atomic_load_explicit(&queue->bottom, memory_order_acquire);
+	if (top >= bottom) return false;
+
+	*job = queue->jobs[top & (JOB_QUEUE_SIZE - 1)];
+	return atomic_compare_exchange_strong_explicit(&queue->top, &top, top + 1,
+		memory_order_seq_cst, memory_order_relaxed);
+}
+
+static void _enqueue(const Job_t* job);
+
+/**
+ * Count a job of a counter as done; the last one submits the counter's
+ * follow-up job, if it has one, and wakes whoever's waiting.
+ *
+ * @param counter Counter.
+ */
+static void _release(JobCounter_t* counter) {
+	// every step is a swap from the value seen, so only the job that takes
+	// THEN | 1 to 1 submits the follow-up; it does so while it's still
+	// counted: a waiter can return (and the counter go out of scope) as soon
+	// as pending reaches zero, so that has to be the last time it's touched
+	int pending = atomic_load_explicit(&counter->pending, memory_order_acquire);
+	while (1) {
+		if (pending == (JOB_COUNTER_THEN | 1)) {
+			if (atomic_compare_exchange_weak_explicit(&counter->pending, &pending, 1,
+				memory_order_acq_rel, memory_order_acquire)) {
+				Job_t then = counter->then;
+				_enqueue(&then);
+				pending = 1;
+			}
+		} else if (atomic_compare_exchange_weak_explicit(&counter->pending, &pending, pending - 1,
+			memory_order_acq_rel, memory_order_acquire)) {
+			break;
+		}
+	}
+	__sev();
+}
+
+/**
+ * Run a job on the calling core and count it.
+ *
+ * @param core The calling core's jobs.
+ * @param job Job.
+ */
+static void _run(JobCore_t* core, const Job_t* job) {
+	uint32_t start = time_us_32();
+	TRACE_BEGIN("job");
+	job->func(job->data, job->start, job->end);
+	TRACE_END("job");
+	core->stats.busy_us += time_us_32() - start;
+	core->stats.jobs++;
+
+	if (job->counter != NULL) _release(job->counter);
+}
+
+/**
+ * Queue an already counted job on the calling core, or run it now if the
+ * queue is full, and wake the other core to steal it.
+ *
+ * @param job Job.
+ */
+static void _enqueue(const Job_t* job) {
+	JobCore_t* core = _local_core();
+	if (!_push(&core->queue, job)) {
+		core->stats.overflowed++;
+		_run(core, job);
+		return;
+	}
+	__sev();
+}
+
+/**
+ * Start the job system: core 0's counters start now, and core 1 is launched
+ * running jobs_worker. Give core 1 its heap (alloc_init_core) first if its
+ * jobs allocate.
+ */
+void jobs_init() {
+	_cores[0].start_us = time_us_64();
+	multicore_launch_core1(jobs_worker);
+}
+
+/**
+ * Run jobs on the calling core forever: its own, or stolen from the other
+ * core, sleeping (WFE) when there are none. Core 1's entry point.
+ */
+void jobs_worker() {
+#if CYCLE_TRACE
+	trace_init();
+#endif
+	_local_core()->start_us = time_us_64();
+	while (1) {
+		if (!job_run_one()) {
+			__wfe();
+			TRACE_SYNC();
+		}
+	}
+}
+
+/**
+ * Zero a counter, before submitting jobs with it.
+ *
+ * @param counter Caller-owned counter.
+ */
+void job_counter_init(JobCounter_t* counter) {
+	atomic_store(&counter->pending, 0);
+}
+
+/**
+ * Queue a job on the calling core. It may run on either core, or right away
+ * if the calling core has JOB_QUEUE_SIZE jobs waiting already.
+ *
+ * @param func Function to run.
+ * @param data First argument to `func`.
+ * @param start Second argument to `func`, e.g. the first item to work on.
+ * @param end Third argument to `func`, e.g. one past the last item.
+ * @param counter Counted up now and down when the job is done, or `NULL`.
+ */
+void job_submit(JobFunc_t func, void* data, uint32_t start, uint32_t end, JobCounter_t* counter) {
+	Job_t job = { .func = func, .data = data, .start = start, .end = end, .counter = counter };
+	if (counter != NULL) atomic_fetch_add_explicit(&counter->pending, 1, memory_order_relaxed);
+	_enqueue(&job);
+}
+
+/**
+ * Have a job submitted once every job of a counter is done (straight away
+ * if they already are). A counter holds one follow-up job at a time; submit
+ * the jobs it waits for first. `counter` (the new job's) is counted up now,
+ * so waiting on it also waits for the jobs before.
+ *
+ * @param after Counter of the jobs to follow.
+ * @param func Function to run.
+ * @param data First argument to `func`.
+ * @param start Second argument to `func`.
+ * @param end Third argument to `func`.
+ * @param counter Counter of the new job, or `NULL`.
+ */
+void job_then(JobCounter_t* after, JobFunc_t func, void* data, uint32_t start, uint32_t end, JobCounter_t* counter) {
+	// hold the counter open while the job is stored, so it can't reach zero
+	// half way through
+	atomic_fetch_add_explicit(&after->pending, 1, memory_order_relaxed);
+	if (counter != NULL) atomic_fetch_add_explicit(&counter->pending, 1, memory_order_relaxed);
+
+	after->then = (Job_t){ .func = func, .data = data, .start = start, .end = end, .counter = counter };
+	atomic_fetch_or_explicit(&after->pending, JOB_COUNTER_THEN, memory_order_release);
+	_release(after);
+}
+
+/**
+ * Run one job, the calling core's newest or else the other core's oldest.
+ *
+ * @returns `false` if there were none.
+ */
+bool job_run_one() {
+	uint32_t self = get_core_num();
+	JobCore_t* core = &_cores[self];
+
+	Job_t job;
+	if (_pop(&core->queue, &job)) {
+		_run(core, &job);
+		return true;
+	}
+
+	for (uint32_t i = 1; i < JOB_CORES; i++) {
+		JobCore_t* victim = &_cores[(self + i) % JOB_CORES];
+		if (_steal(&victim->queue, &job)) {
+			core->stats.stolen++;
+			_run(core, &job);
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Wait until every job of a counter is done, running jobs (any, not just
+ * the counter's) on the calling core meanwhile. Blocks the calling core's
+ * tasks, it's for work that's split up to finish sooner.
+ *
+ * @param counter Counter.
+ */
+void job_wait(JobCounter_t* counter) {
+	while (atomic_load_explicit(&counter->pending, memory_order_acquire) != 0) {
+		if (!job_run_one()) {
+			__wfe();
+			TRACE_SYNC();
+		}
+	}
+}
+
+/**
+ * Split `count` items into jobs of `batch` items, run them on both cores and
+ * wait for them all, see job_wait.
+ *
+ * @param func Called with `data` and each batch's first and one past last item.
+ * @param data First argument to `func`.
+ * @param count Items.
+ * @param batch Items per job, at least 1.
+ */
+void job_parallel_for(JobFunc_t func, void* data, uint32_t count, uint32_t batch) {
+	if (batch == 0) batch = 1;
+
+	JobCounter_t counter;
+	job_counter_init(&counter);
+	for (uint32_t start = 0; start < count; start += batch) {
+		uint32_t end = count - start > batch ? start + batch : count;
+		job_submit(func, data, start, end, &counter);
+	}
+	job_wait(&counter);
+}
+
+/**
+ * Get a core's job counters. Safe from either core, though the other core's
+ * may be a job behind.
+ *
+ * @param core Core, 0 .. JOB_CORES - 1.
+ * @param stats Filled in with the counters.
+ */
+void jobs_stats(uint32_t core, JobStats_t* stats) {
+	if (core >= JOB_CORES) {
+		*stats = (JobStats_t){ 0 };
+		return;
+	}
+	*stats = _cores[core].stats;
+	stats->up_us = _cores[core].start_us == 0 ? 0 : time_us_64() - _cores[core].start_us;
+}
+
+/**
+ * Print each core's jobs, steals and share of time spent running jobs over
+ * stdio.
+ */
+void jobs_dump() {
+	for (uint32_t core = 0; core < JOB_CORES; core++) {
+		JobStats_t stats;
+		jobs_stats(core, &stats);
+		double busy = stats.up_us > 0 ? 100.0 * stats.busy_us / stats.up_us : 0.0;
+		printf("jobs: core %lu, %lu jobs, %lu stolen, %lu run on submit, busy %.1f%%\n", (unsigned long)core,
+			(unsigned long)stats.jobs, (unsigned long)stats.stolen, (unsigned long)stats.overflowed, busy);
+	}
+}
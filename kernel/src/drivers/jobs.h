@@ -0,0 +1,61 @@
+#ifndef KERNEL_JOBS_H
+#define KERNEL_JOBS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define JOB_CORES 2
+
+// jobs waiting on each core, a power of two; submitting to a full core runs
+// the job straight away instead
+#ifndef JOB_QUEUE_SIZE
+#define JOB_QUEUE_SIZE 64
+#endif
+
+// A job runs func(data, start, end), on either core: the core that submitted
+// it, unless the other one is idle and steals it first. Jobs must not block
+// on anything but job_wait, and aren't run in interrupt handlers.
+typedef void (*JobFunc_t)(void* data, uint32_t start, uint32_t end);
+
+struct JobCounter;
+
+typedef struct Job {
+	JobFunc_t func;
+	void* data;
+	uint32_t start;
+	uint32_t end;
+	struct JobCounter* counter; // counted down when it's done, or NULL
+} Job_t;
+
+// set in a counter's pending count while it holds a follow-up job
+#define JOB_COUNTER_THEN 0x40000000
+
+// Jobs submitted with a counter count it up, and down again when they're
+// done: wait for them with job_wait, or have a job follow them with
+// job_then. Zero it with job_counter_init before use.
+typedef struct JobCounter {
+	atomic_int pending;
+	Job_t then;
+} JobCounter_t;
+
+typedef struct JobStats {
+	uint32_t jobs;       // run on the core
+	uint32_t stolen;     // of those, taken from the other core
+	uint32_t overflowed; // run straight away by job_submit, the queue was full
+	uint64_t busy_us;    // running jobs
+	uint64_t up_us;      // since jobs_init (core 0) or the worker started
+} JobStats_t;
+
+void jobs_init();
+void jobs_worker();
+void job_counter_init(JobCounter_t* counter);
+void job_submit(JobFunc_t func, void* data, uint32_t start, uint32_t end, JobCounter_t* counter);
+void job_then(JobCounter_t* after, JobFunc_t func, void* data, uint32_t start, uint32_t end, JobCounter_t* counter);
+void job_wait(JobCounter_t* counter);
+bool job_run_one();
+void job_parallel_for(JobFunc_t func, void* data, uint32_t count, uint32_t batch);
+void jobs_stats(uint32_t core, JobStats_t* stats);
+void jobs_dump();
+
+#endif
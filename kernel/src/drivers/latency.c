@@ -0,0 +1,193 @@
+#include "latency.h"
+
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+
+#define LATENCY_SUB (1u << LATENCY_SUB_BITS)
+
+#if INPUT_LATENCY
+static const char* const _stage_names[LATENCY_STAGES] = { "queue", "handler", "draw", "total" };
+
+static uint32_t _histograms[LATENCY_STAGES][LATENCY_BUCKETS];
+static uint32_t _max[LATENCY_STAGES];
+static uint32_t _count;
+
+// the press being measured, from latency_input to latency_flushed
+static bool _measuring;
+static bool _drawing;
+static uint32_t _edge_us;
+static uint32_t _handler_us;
+static uint32_t _draw_us;
+
+/**
+ * Histogram bucket of a latency, see LATENCY_BUCKETS.
+ *
+ * @param us Latency in microseconds.
+ * @returns Bucket index.
+ */
+static uint _bucket(uint32_t us) {
+	if (us < LATENCY_SUB) return us;
+	uint octave = 31 - __builtin_clz(us);
+	uint sub = (us >> (octave - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1);
+	uint bucket = (octave - LATENCY_SUB_BITS + 1) * LATENCY_SUB + sub;
+	return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+/**
+ * Smallest latency that falls in a bucket.
+ *
+ * @param bucket Bucket index, up to LATENCY_BUCKETS.
+ * @returns Latency in microseconds.
+ */
+static uint32_t _bucket_low(uint bucket) {
+	if (bucket < LATENCY_SUB) return bucket;
+	uint octave = bucket / LATENCY_SUB - 1 + LATENCY_SUB_BITS;
+	uint sub = bucket % LATENCY_SUB;
+	return (1u << octave) | (sub << (octave - LATENCY_SUB_BITS));
+}
+
+/**
+ * Latency below which a share of a stage's presses fell.
+ *
+ * @param stage Stage.
+ * @param percent Share, 1 to 100.
+ * @returns Upper end of the bucket holding the percentile, no more than the
+ *          slowest press.
+ */
+static uint32_t _percentile(LatencyStage_t stage, uint32_t percent) {
+	uint32_t rank = (_count * percent + 99) / 100;
+	uint32_t seen = 0;
+	for (uint i = 0; i < LATENCY_BUCKETS - 1; i++) {
+		seen += _histograms[stage][i];
+		if (seen >= rank) {
+			uint32_t high = _bucket_low(i + 1) - 1;
+			return high < _max[stage] ? high : _max[stage];
+		}
+	}
+	return _max[stage];
+}
+
+/**
+ * Count one press's time in a stage.
+ *
+ * @param stage Stage.
+ * @param us Time spent in it.
+ */
+static void _record(LatencyStage_t stage, uint32_t us) {
+	_histograms[stage][_bucket(us)]++;
+	if (us > _max[stage]) _max[stage] = us;
+}
+#endif
+
+/**
+ * Start measuring a press: its handler is starting now. Ignored while an
+ * earlier press is still being measured, the screen is catching up with
+ * that one first.
+ *
+ * @param edge_us Time of the button edge, ButtonEvent_t.time_us.
+ */
+void latency_input(uint32_t edge_us) {
+#if INPUT_LATENCY
+	if (_measuring) return;
+	_measuring = true;
+	_drawing = false;
+	_edge_us = edge_us;
+	_handler_us = time_us_32();
+#else
+	(void)edge_us;
+#endif
+}
+
+/**
+ * Mark the handler of the press being measured starting to draw; only the
+ * first call after latency_input counts.
+ */
+void latency_draw() {
+#if INPUT_LATENCY
+	if (!_measuring || _drawing) return;
+	_drawing = true;
+	_draw_us = time_us_32();
+#endif
+}
+
+/**
+ * Finish measuring a press: what it drew has left the SPI (the lcd_ calls
+ * return once their last byte is out). Prints the stages every
+ * LATENCY_REPORT_EVERY presses.
+ */
+void latency_flushed() {
+#if INPUT_LATENCY
+	if (!_measuring || !_drawing) return;
+	uint32_t now = time_us_32();
+	_record(LATENCY_QUEUE, _handler_us - _edge_us);
+	_record(LATENCY_HANDLER, _draw_us - _handler_us);
+	_record(LATENCY_DRAW, now - _draw_us);
+	_record(LATENCY_TOTAL, now - _edge_us);
+	_count++;
+	_measuring = false;
+
+	if (_count % LATENCY_REPORT_EVERY == 0) latency_dump();
+#endif
+}
+
+/**
+ * Stop measuring the current press without recording it, when what it
+ * started isn't drawn by its handler (an app launching, say).
+ */
+void latency_cancel() {
+#if INPUT_LATENCY
+	_measuring = false;
+#endif
+}
+
+/**
+ * Get the percentiles of a stage.
+ *
+ * @param stage Stage.
+ * @param stats Filled in; all zero unless built with INPUT_LATENCY.
+ */
+void latency_stats(LatencyStage_t stage, LatencyStats_t* stats) {
+	*stats = (LatencyStats_t){ 0 };
+#if INPUT_LATENCY
+	if (_count == 0) return;
+	stats->count = _count;
+	stats->p50_us = _percentile(stage, 50);
+	stats->p99_us = _percentile(stage, 99);
+	stats->max_us = _max[stage];
+#else
+	(void)stage;
+#endif
+}
+
+/**
+ * Forget every press measured so far.
+ */
+void latency_reset() {
+#if INPUT_LATENCY
+	for (uint stage = 0; stage < LATENCY_STAGES; stage++) {
+		for (uint i = 0; i < LATENCY_BUCKETS; i++) _histograms[stage][i] = 0;
+		_max[stage] = 0;
+	}
+	_count = 0;
+	_measuring = false;
+#endif
+}
+
+/**
+ * Print the 50th and 99th percentile and slowest time of each stage over
+ * stdio.
+ */
+void latency_dump() {
+#if INPUT_LATENCY
+	printf("latency: %lu presses\n", (unsigned long)_count);
+	for (uint stage = 0; stage < LATENCY_STAGES; stage++) {
+		LatencyStats_t stats;
+		latency_stats(stage, &stats);
+		printf("  %-8s p50 %7lu us  p99 %7lu us  max %7lu us\n", _stage_names[stage],
+			(unsigned long)stats.p50_us, (unsigned long)stats.p99_us, (unsigned long)stats.max_us);
+	}
+#else
+	printf("latency: build with INPUT_LATENCY to measure it\n");
+#endif
+}
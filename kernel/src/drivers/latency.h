@@ -0,0 +1,47 @@
+#ifndef KERNEL_LATENCY_H
+#define KERNEL_LATENCY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// press-to-photon latency is only measured when built with INPUT_LATENCY
+// (CMake option), the calls cost nothing otherwise
+#ifndef INPUT_LATENCY
+#define INPUT_LATENCY 0
+#endif
+
+// histogram buckets: exact below 8 us, then 8 per power of two (at most
+// 12.5% wide) up to about 2 s, the last also takes everything slower
+#define LATENCY_SUB_BITS 3
+#define LATENCY_BUCKETS  152
+
+// print the stages every this many presses
+#ifndef LATENCY_REPORT_EVERY
+#define LATENCY_REPORT_EVERY 64
+#endif
+
+// stages of a press, see latency_input
+typedef enum LatencyStage {
+	LATENCY_QUEUE,   // button edge to the handler taking it (button_poll)
+	LATENCY_HANDLER, // handler to starting to draw
+	LATENCY_DRAW,    // drawing, up to the last byte leaving the SPI
+	LATENCY_TOTAL,   // button edge to the last byte leaving the SPI
+	LATENCY_STAGES
+} LatencyStage_t;
+
+typedef struct LatencyStats {
+	uint32_t count;
+	uint32_t p50_us; // upper end of the bucket holding the percentile
+	uint32_t p99_us;
+	uint32_t max_us;
+} LatencyStats_t;
+
+void latency_input(uint32_t edge_us);
+void latency_draw();
+void latency_flushed();
+void latency_cancel();
+void latency_stats(LatencyStage_t stage, LatencyStats_t* stats);
+void latency_reset();
+void latency_dump();
+
+#endif
@@ -0,0 +1,315 @@
+#include "memops.h"
+
+#if MEMOPS_DMA_THRESHOLD > 0
+#include "pico/stdlib.h"
+#include "hardware/dma.h"
+#include "hardware/sync.h"
+#endif
+
+// word accesses to memory of any type, the second one at any alignment (the
+// M33 handles unaligned LDR/STR, LDM/STM have to be aligned)
+typedef uint32_t __attribute__((may_alias)) word_t;
+typedef uint32_t __attribute__((may_alias, aligned(1))) unaligned_word_t;
+
+#define WORD_MASK   (sizeof(uint32_t) - 1)
+#define BLOCK_BYTES 32 // one pair of 4 register LDM/STM
+
+#if MEMOPS_DMA_THRESHOLD > 0
+// one channel per core, so the cores never wait on each other
+static int _dma_channels[2] = { -1, -1 };
+#endif
+
+/**
+ * Claim the DMA channels used for large copies and fills. Until this is
+ * called (and if no channel is free) everything is done on the CPU.
+ */
+void memops_init() {
+#if MEMOPS_DMA_THRESHOLD > 0
+	for (int core = 0; core < 2; core++) {
+		if (_dma_channels[core] < 0) _dma_channels[core] = dma_claim_unused_channel(false);
+	}
+#endif
+}
+
+#if MEMOPS_DMA_THRESHOLD > 0
+/**
+ * Copy or fill whole words with this core's DMA channel, waiting for it to
+ * finish.
+ *
+ * An interrupt handler calling in while the channel is running finds it busy
+ * and falls back to the CPU, interrupts are only held off while the channel
+ * is programmed.
+ *
+ * @param dest Word aligned destination.
+ * @param src Word aligned source, or the fill word.
+ * @param words Number of words.
+ * @param fill `true` to write `*src` `words` times.
+ * @returns `false` if the DMA wasn't available, nothing has been written.
+ */
+static bool _dma_words(word_t* dest, const word_t* src, uintptr_t words, bool fill) {
+	int channel = _dma_channels[get_core_num()];
+	if (channel < 0) return false;
+
+	uint32_t status = save_and_disable_interrupts();
+	if (dma_channel_is_busy(channel)) {
+		restore_interrupts(status);
+		return false;
+	}
+
+	dma_channel_config config = dma_channel_get_default_config(channel);
+	channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+	channel_config_set_read_increment(&config, !fill);
+	channel_config_set_write_increment(&config, true);
+	dma_channel_configure(channel, &config, dest, src, words, true);
+	restore_interrupts(status);
+
+	dma_channel_wait_for_finish_blocking(channel);
+	__compiler_memory_barrier();
+	return true;
+}
+#endif
+
+/**
+ * Copy `blocks` 32 byte blocks between word aligned buffers, eight words at a
+ * time with LDM/STM.
+ */
+static void _copy_blocks(word_t* dest, const word_t* src, uintptr_t blocks) {
+#if defined(__arm__) && __ARM_ARCH >= 7
+	__asm volatile (
+		"1:\n"
+		"ldmia %[src]!, {r3, r4, r5, r6}\n"
+		"stmia %[dest]!, {r3, r4, r5, r6}\n"
+		"ldmia %[src]!, {r3, r4, r5, r6}\n"
+		"stmia %[dest]!, {r3, r4, r5, r6}\n"
+		"subs %[blocks], %[blocks], #1\n"
+		"bne 1b\n"
+		: [dest] "+r" (dest), [src] "+r" (src), [blocks] "+r" (blocks)
+		:
+		: "r3", "r4", "r5", "r6", "cc", "memory"
+	);
+#else
+	for (; blocks > 0; blocks--) {
+		uint32_t a = src[0], b = src[1], c = src[2], d = src[3];
+		uint32_t e = src[4], f = src[5], g = src[6], h = src[7];
+		dest[0] = a; dest[1] = b; dest[2] = c; dest[3] = d;
+		dest[4] = e; dest[5] = f; dest[6] = g; dest[7] = h;
+		src += 8;
+		dest += 8;
+	}
+#endif
+}
+
+/**
+ * Fill `blocks` 32 byte blocks of a word aligned buffer with `word`.
+ */
+static void _fill_blocks(word_t* dest, uint32_t word, uintptr_t blocks) {
+#if defined(__arm__) && __ARM_ARCH >= 7
+	__asm volatile (
+		"mov r3, %[word]\n"
+		"mov r4, %[word]\n"
+		"mov r5, %[word]\n"
+		"mov r6, %[word]\n"
+		"1:\n"
+		"stmia %[dest]!, {r3, r4, r5, r6}\n"
+		"stmia %[dest]!, {r3, r4, r5, r6}\n"
+		"subs %[blocks], %[blocks], #1\n"
+		"bne 1b\n"
+		: [dest] "+r" (dest), [blocks] "+r" (blocks)
+		: [word] "r" (word)
+		: "r3", "r4", "r5", "r6", "cc", "memory"
+	);
+#else
+	for (; blocks > 0; blocks--) {
+		dest[0] = word; dest[1] = word; dest[2] = word; dest[3] = word;
+		dest[4] = word; dest[5] = word; dest[6] = word; dest[7] = word;
+		dest += 8;
+	}
+#endif
+}
+
+/**
+ * Copy front to back, safe for overlapping buffers when `dest` is below `src`.
+ */
+static void _copy_forward(uint8_t* dest, const uint8_t* src, uintptr_t n, bool dma) {
+	if (n >= MEMOPS_SMALL) {
+		// align the destination, the source may or may not follow
+		while ((uintptr_t)dest & WORD_MASK) {
+			*dest++ = *src++;
+			n--;
+		}
+
+		if (((uintptr_t)src & WORD_MASK) == 0) {
+			uintptr_t words = n / sizeof(uint32_t);
+#if MEMOPS_DMA_THRESHOLD > 0
+			if (dma && n >= MEMOPS_DMA_THRESHOLD && _dma_words((word_t*)dest, (const word_t*)src, words, false)) {
+				dest += words * sizeof(uint32_t);
+				src += words * sizeof(uint32_t);
+				n -= words * sizeof(uint32_t);
+			}
+#else
+			(void)dma;
+			(void)words;
+#endif
+			if (n >= BLOCK_BYTES) {
+				uintptr_t blocks = n / BLOCK_BYTES;
+				_copy_blocks((word_t*)dest, (const word_t*)src, blocks);
+				dest += blocks * BLOCK_BYTES;
+				src += blocks * BLOCK_BYTES;
+				n -= blocks * BLOCK_BYTES;
+			}
+			for (; n >= sizeof(uint32_t); n -= sizeof(uint32_t)) {
+				*(word_t*)dest = *(const word_t*)src;
+				dest += sizeof(uint32_t);
+				src += sizeof(uint32_t);
+			}
+		} else {
+			// misaligned source, unaligned loads into aligned stores
+			for (; n >= 4 * sizeof(uint32_t); n -= 4 * sizeof(uint32_t)) {
+				const unaligned_word_t* from = (const unaligned_word_t*)src;
+				uint32_t a = from[0], b = from[1], c = from[2], d = from[3];
+				word_t* to = (word_t*)dest;
+				to[0] = a; to[1] = b; to[2] = c; to[3] = d;
+				dest += 4 * sizeof(uint32_t);
+				src += 4 * sizeof(uint32_t);
+			}
+			for (; n >= sizeof(uint32_t); n -= sizeof(uint32_t)) {
+				*(word_t*)dest = *(const unaligned_word_t*)src;
+				dest += sizeof(uint32_t);
+				src += sizeof(uint32_t);
+			}
+		}
+	}
+
+	while (n > 0) {
+		*dest++ = *src++;
+		n--;
+	}
+}
+
+/**
+ * Copy back to front, for overlapping buffers when `dest` is above `src`.
+ */
+static void _copy_backward(uint8_t* dest, const uint8_t* src, uintptr_t n) {
+	dest += n;
+	src += n;
+
+	if (n >= MEMOPS_SMALL) {
+		while ((uintptr_t)dest & WORD_MASK) {
+			*--dest = *--src;
+			n--;
+		}
+
+		// unaligned loads cope with either source alignment; words are read
+		// before they're written, so overlap within a word can't bite
+		for (; n >= 4 * sizeof(uint32_t); n -= 4 * sizeof(uint32_t)) {
+			dest -= 4 * sizeof(uint32_t);
+			src -= 4 * sizeof(uint32_t);
+			const unaligned_word_t* from = (const unaligned_word_t*)src;
+			uint32_t a = from[0], b = from[1], c = from[2], d = from[3];
+			word_t* to = (word_t*)dest;
+			to[3] = d; to[2] = c; to[1] = b; to[0] = a;
+		}
+		for (; n >= sizeof(uint32_t); n -= sizeof(uint32_t)) {
+			dest -= sizeof(uint32_t);
+			src -= sizeof(uint32_t);
+			*(word_t*)dest = *(const unaligned_word_t*)src;
+		}
+	}
+
+	while (n > 0) {
+		*--dest = *--src;
+		n--;
+	}
+}
+
+/**
+ * Copy `n` bytes between non-overlapping buffers.
+ *
+ * Word aligned buffers (or buffers with the same misalignment, after a few
+ * head bytes) are copied 32 bytes at a time with LDM/STM, or by DMA from
+ * `MEMOPS_DMA_THRESHOLD` bytes up; otherwise with unaligned word loads.
+ *
+ * @param dest Destination buffer.
+ * @param src Source buffer, must not overlap `dest` (use `memmove`).
+ * @param n Number of bytes.
+ * @returns `dest`.
+ */
+void* memcpy(void* restrict dest, const void* restrict src, uintptr_t n) {
+	_copy_forward(dest, src, n, true);
+	return dest;
+}
+
+/**
+ * Copy `n` bytes between buffers that may overlap.
+ *
+ * @param dest Destination buffer.
+ * @param src Source buffer.
+ * @param n Number of bytes.
+ * @returns `dest`.
+ */
+void* memmove(void* dest, const void* src, uintptr_t n) {
+	uint8_t* to = dest;
+	const uint8_t* from = src;
+
+	if (to == from || n == 0) return dest;
+
+	if (to + n <= from || from + n <= to) {
+		_copy_forward(to, from, n, true);
+	} else if (to < from) {
+		// the DMA reads ahead of its writes, keep overlapping copies on the CPU
+		_copy_forward(to, from, n, false);
+	} else {
+		_copy_backward(to, from, n);
+	}
+
+	return dest;
+}
+
+/**
+ * Fill `n` bytes with `value`, 32 bytes at a time with STM once aligned, or
+ * by DMA from `MEMOPS_DMA_THRESHOLD` bytes up.
+ *
+ * @param dest Buffer to fill.
+ * @param value Byte value (converted to `uint8_t`).
+ * @param n Number of bytes.
+ * @returns `dest`.
+ */
+void* memset(void* dest, int value, uintptr_t n) {
+	uint8_t* to = dest;
+	uint8_t byte = (uint8_t)value;
+
+	if (n >= MEMOPS_SMALL) {
+		while ((uintptr_t)to & WORD_MASK) {
+			*to++ = byte;
+			n--;
+		}
+
+		uint32_t word = byte * 0x01010101u;
+#if MEMOPS_DMA_THRESHOLD > 0
+		if (n >= MEMOPS_DMA_THRESHOLD) {
+			uintptr_t words = n / sizeof(uint32_t);
+			if (_dma_words((word_t*)to, &word, words, true)) {
+				to += words * sizeof(uint32_t);
+				n -= words * sizeof(uint32_t);
+			}
+		}
+#endif
+		if (n >= BLOCK_BYTES) {
+			uintptr_t blocks = n / BLOCK_BYTES;
+			_fill_blocks((word_t*)to, word, blocks);
+			to += blocks * BLOCK_BYTES;
+			n -= blocks * BLOCK_BYTES;
+		}
+		for (; n >= sizeof(uint32_t); n -= sizeof(uint32_t)) {
+			*(word_t*)to = word;
+			to += sizeof(uint32_t);
+		}
+	}
+
+	while (n > 0) {
+		*to++ = byte;
+		n--;
+	}
+
+	return dest;
+}
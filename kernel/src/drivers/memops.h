@@ -0,0 +1,27 @@
+#ifndef KERNEL_MEMOPS_H
+#define KERNEL_MEMOPS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// copies and fills of at least this many bytes go through a DMA channel once
+// `memops_init` has claimed one, 0 keeps everything on the CPU
+#ifndef MEMOPS_DMA_THRESHOLD
+#define MEMOPS_DMA_THRESHOLD 1024
+#endif
+
+// below this a plain byte loop beats lining up for word accesses
+#define MEMOPS_SMALL 16
+
+void memops_init();
+
+// C++ (async.cpp) sees the C library's declarations of these instead, they
+// name the same functions
+#ifndef __cplusplus
+void* memcpy(void* restrict dest, const void* restrict src, uintptr_t n);
+void* memmove(void* dest, const void* src, uintptr_t n);
+void* memset(void* dest, int value, uintptr_t n);
+#endif
+
+#endif
@@ -1,5 +1,42 @@
 #include "memory.h"
 
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+#include "hardware/dma.h"
+#include "hardware/structs/busctrl.h"
+
+#include "allocator.h"
+#include "arena.h"
+
+#define KERNEL_MEMORY_SAFETY 1024 // 1 KB safety margin
+
+// the regions besides the heap are bump allocated: what goes in them (driver
+// buffers set up at boot) stays for good, so there's nothing to fragment
+static Arena_t _dma_region;
+static Arena_t _scratch_regions[2]; // by core, SCRATCH_Y for core 0 and SCRATCH_X for core 1
+static uintptr_t _bulk_used; // region_alloc's share of the heap
+static uint32_t _bulk_failures;
+
+// performance counter events of SRAM0 .. SRAM9
+static const uint8_t _bank_accesses[MEMORY_BANKS] = {
+	BUSCTRL_PERFSEL0_VALUE_SRAM0_ACCESS, BUSCTRL_PERFSEL0_VALUE_SRAM1_ACCESS,
+	BUSCTRL_PERFSEL0_VALUE_SRAM2_ACCESS, BUSCTRL_PERFSEL0_VALUE_SRAM3_ACCESS,
+	BUSCTRL_PERFSEL0_VALUE_SRAM4_ACCESS, BUSCTRL_PERFSEL0_VALUE_SRAM5_ACCESS,
+	BUSCTRL_PERFSEL0_VALUE_SRAM6_ACCESS, BUSCTRL_PERFSEL0_VALUE_SRAM7_ACCESS,
+	BUSCTRL_PERFSEL0_VALUE_SRAM8_ACCESS, BUSCTRL_PERFSEL0_VALUE_SRAM9_ACCESS,
+};
+static const uint8_t _bank_contested[MEMORY_BANKS] = {
+	BUSCTRL_PERFSEL0_VALUE_SRAM0_ACCESS_CONTESTED, BUSCTRL_PERFSEL0_VALUE_SRAM1_ACCESS_CONTESTED,
+	BUSCTRL_PERFSEL0_VALUE_SRAM2_ACCESS_CONTESTED, BUSCTRL_PERFSEL0_VALUE_SRAM3_ACCESS_CONTESTED,
+	BUSCTRL_PERFSEL0_VALUE_SRAM4_ACCESS_CONTESTED, BUSCTRL_PERFSEL0_VALUE_SRAM5_ACCESS_CONTESTED,
+	BUSCTRL_PERFSEL0_VALUE_SRAM6_ACCESS_CONTESTED, BUSCTRL_PERFSEL0_VALUE_SRAM7_ACCESS_CONTESTED,
+	BUSCTRL_PERFSEL0_VALUE_SRAM8_ACCESS_CONTESTED, BUSCTRL_PERFSEL0_VALUE_SRAM9_ACCESS_CONTESTED,
+};
+static const char* const _bank_names[MEMORY_BANKS] = {
+	"SRAM0", "SRAM1", "SRAM2", "SRAM3", "SRAM4", "SRAM5", "SRAM6", "SRAM7", "SCRATCH_X", "SCRATCH_Y",
+};
+
 /**
  * Get the start address of the heap region.
  *
@@ -9,18 +46,18 @@ uint8_t* heap_start() {
 	return &__end__;
 }
 /**
- * Provide the end address of the heap region.
- * @return Pointer to the heap end (address of the linker symbol `__StackLimit`) as `uint8_t *`.
+ * Provide the end address of the heap region: the end of main SRAM (the
+ * linker symbol `__StackLimit`) less the DMA region above it.
+ * @return Pointer to the heap end as `uint8_t *`.
  */
 uint8_t* heap_end() {
-	return &__StackLimit;
+	return &__StackLimit - MEMORY_DMA_REGION_SIZE;
 }
 /**
  * Compute the number of free bytes remaining in the heap after reserving a 1KB safety margin.
  *
  * @returns Number of free bytes available for allocation after reserving 1024 bytes (returned as a `size_t`).
  */
-#define KERNEL_MEMORY_SAFETY 1024 // 1 KB safety margin
 size_t total_free_bytes() {
 	size_t available =  heap_end() - heap_start();
 	if (available < KERNEL_MEMORY_SAFETY) {
@@ -28,3 +65,232 @@ size_t total_free_bytes() {
 	}
 	return available - KERNEL_MEMORY_SAFETY;
 }
+
+/**
+ * Set up the memory regions besides the heap (see `region_alloc`): the top
+ * MEMORY_DMA_REGION_SIZE bytes of SRAM4-7, and whatever the scratch banks
+ * have left between what was linked into them and the stacks.
+ *
+ * Call once at boot, before anything asks for region memory.
+ */
+void memory_init() {
+	arena_init(&_dma_region, heap_end(), MEMORY_DMA_REGION_SIZE);
+	arena_init(&_scratch_regions[0], &__scratch_y_end__, &__StackBottom - &__scratch_y_end__);
+	arena_init(&_scratch_regions[1], &__scratch_x_end__, &__StackOneBottom - &__scratch_x_end__);
+}
+
+/**
+ * Allocate memory in a given region, so data lands on banks that whatever
+ * else uses them at the same time doesn't contend for:
+ *  - MEMORY_DMA: the top of SRAM4-7, above the heap. Buffers the DMA streams
+ *    through (line buffers, sector buffers), so it doesn't stall the CPU on
+ *    the banks its data and the heap's low end live on.
+ *  - MEMORY_SCRATCH: the calling core's scratch bank, shared only with its
+ *    own stack. Small, hot, single core data. Under 2 KiB per core.
+ *  - MEMORY_BULK: the heap.
+ *
+ * Region memory is never freed, it's meant for buffers set up once at boot
+ * (`malloc` and `handle_alloc` are for everything else).
+ *
+ * @param region Where.
+ * @param bytes Bytes needed.
+ * @param alignment Power of two, e.g. a DMA ring's size, 0 for malloc's.
+ * @returns The memory, or `NULL` if the region is full.
+ */
+void* region_alloc(MemoryRegion_t region, uintptr_t bytes, uintptr_t alignment) {
+	if (alignment == 0) alignment = ALIGN;
+
+	switch (region) {
+		case MEMORY_DMA:
+			return arena_alloc_aligned(&_dma_region, bytes, alignment);
+		case MEMORY_SCRATCH:
+			return arena_alloc_aligned(&_scratch_regions[get_core_num()], bytes, alignment);
+		case MEMORY_BULK: {
+			// aligned by hand, the block is never freed anyway
+			uint8_t* block = bytes > UINTPTR_MAX - alignment ? NULL : malloc_tagged(bytes + alignment - 1, "region");
+			if (block == NULL) {
+				_bulk_failures++;
+				return NULL;
+			}
+			uintptr_t aligned = ((uintptr_t)block + (alignment - 1)) & ~(alignment - 1);
+			_bulk_used += bytes;
+			return (void*)aligned;
+		}
+		default:
+			return NULL;
+	}
+}
+
+/**
+ * Get a region's address range and use. For MEMORY_SCRATCH that's the
+ * calling core's bank; for MEMORY_BULK the heap, with `used` only counting
+ * `region_alloc`'s share of it.
+ */
+void region_stats(MemoryRegion_t region, MemoryRegionStats_t* stats) {
+	const Arena_t* arena = NULL;
+	switch (region) {
+		case MEMORY_DMA:
+			arena = &_dma_region;
+			break;
+		case MEMORY_SCRATCH:
+			arena = &_scratch_regions[get_core_num()];
+			break;
+		case MEMORY_BULK:
+			*stats = (MemoryRegionStats_t){
+				.start = (uintptr_t)heap_start(),
+				.capacity = total_free_bytes(),
+				.used = _bulk_used,
+				.failures = _bulk_failures,
+			};
+			return;
+		default:
+			*stats = (MemoryRegionStats_t){ 0 };
+			return;
+	}
+
+	*stats = (MemoryRegionStats_t){
+		.start = (uintptr_t)arena->start,
+		.capacity = arena_capacity(arena),
+		.used = arena_used(arena),
+		.failures = arena->failures,
+	};
+}
+
+/**
+ * Count every SRAM bank's accesses, and the accesses that had to wait for
+ * another bus master (the other core, the DMA), while `workload` runs.
+ *
+ * The bus fabric has four counters, so the workload is run five times, each
+ * time counting another four events; it should do the same thing every time
+ * and be short enough for the counters' 24 bits (a few ms).
+ *
+ * @param workload Function to measure.
+ * @param arg Passed to it.
+ * @param result Filled in.
+ */
+void memory_contention_measure(void (*workload)(void* arg), void* arg, MemoryContention_t* result) {
+	*result = (MemoryContention_t){ .time_us = UINT32_MAX };
+	uint32_t* counts[2 * MEMORY_BANKS];
+	uint8_t events[2 * MEMORY_BANKS];
+	for (int bank = 0; bank < MEMORY_BANKS; bank++) {
+		counts[bank] = &result->accesses[bank];
+		events[bank] = _bank_accesses[bank];
+		counts[MEMORY_BANKS + bank] = &result->contested[bank];
+		events[MEMORY_BANKS + bank] = _bank_contested[bank];
+	}
+
+	busctrl_hw->perfctr_en = 1;
+	for (int first = 0; first < 2 * MEMORY_BANKS; first += 4) {
+		for (int i = 0; i < 4 && first + i < 2 * MEMORY_BANKS; i++) {
+			busctrl_hw->counter[i].sel = events[first + i];
+			busctrl_hw->counter[i].value = 0; // any write clears it
+		}
+
+		uint32_t start = time_us_32();
+		workload(arg);
+		uint32_t elapsed = time_us_32() - start;
+		if (elapsed < result->time_us) result->time_us = elapsed;
+
+		for (int i = 0; i < 4 && first + i < 2 * MEMORY_BANKS; i++) {
+			*counts[first + i] = busctrl_hw->counter[i].value;
+		}
+	}
+	busctrl_hw->perfctr_en = 0;
+}
+
+/**
+ * Print a `memory_contention_measure` result to stdio (USB serial), one
+ * line per bank that was used.
+ */
+void memory_contention_dump(const char* name, const MemoryContention_t* contention) {
+	uint32_t accesses = 0;
+	uint32_t contested = 0;
+	for (int bank = 0; bank < MEMORY_BANKS; bank++) {
+		accesses += contention->accesses[bank];
+		contested += contention->contested[bank];
+	}
+
+	printf("banks: %s, %lu us, %lu accesses, %lu contested (%.2f%%)\n", name, (unsigned long)contention->time_us,
+		(unsigned long)accesses, (unsigned long)contested, accesses ? 100.0f * contested / accesses : 0.0f);
+	for (int bank = 0; bank < MEMORY_BANKS; bank++) {
+		if (contention->accesses[bank] == 0) continue;
+		printf("banks:   %-9s %8lu accesses %8lu contested (%.2f%%)\n", _bank_names[bank],
+			(unsigned long)contention->accesses[bank], (unsigned long)contention->contested[bank],
+			100.0f * contention->contested[bank] / contention->accesses[bank]);
+	}
+}
+
+#define CONTENTION_WORDS  128  // CPU working set, half a KiB
+#define CONTENTION_ROUNDS 200
+
+typedef struct ContentionRun {
+	volatile uint32_t* cpu; // CONTENTION_WORDS the CPU keeps updating
+	volatile uint32_t* dma; // two words the DMA copies one to the other, flat out
+	int channel;
+} ContentionRun_t;
+
+// CPU loads and stores while the DMA hammers its two words
+static void _contention_workload(void* arg) {
+	ContentionRun_t* run = arg;
+
+	dma_channel_config config = dma_channel_get_default_config(run->channel);
+	channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+	channel_config_set_read_increment(&config, false);
+	channel_config_set_write_increment(&config, false);
+	dma_channel_configure(run->channel, &config, &run->dma[1], &run->dma[0], 1u << 24, true);
+
+	for (int round = 0; round < CONTENTION_ROUNDS; round++) {
+		for (int i = 0; i < CONTENTION_WORDS; i++) run->cpu[i] += (uint32_t)i;
+	}
+
+	dma_channel_abort(run->channel);
+}
+
+/**
+ * Measure bank contention between the CPU and the DMA with their data in
+ * different places, and print each (see `memory_contention_dump`): both on
+ * the heap (where everything went before there were regions), the DMA's in
+ * MEMORY_DMA, then the CPU's in its scratch bank too. Built in with the
+ * MEMORY_CONTENTION CMake option, run once at boot.
+ */
+void memory_contention_report() {
+	ContentionRun_t run = { .channel = dma_claim_unused_channel(false) };
+	if (run.channel < 0) {
+		printf("banks: no DMA channel free\n");
+		return;
+	}
+
+	// on the stack, which is core 0's scratch bank
+	uint32_t scratch[CONTENTION_WORDS];
+	MemoryContention_t contention;
+
+	uint32_t* heap_cpu = malloc(CONTENTION_WORDS * sizeof(uint32_t));
+	uint32_t* heap_dma = malloc(2 * sizeof(uint32_t));
+	// kept, this runs once
+	uint32_t* region_dma = region_alloc(MEMORY_DMA, 2 * sizeof(uint32_t), 0);
+
+	if (heap_cpu != NULL && heap_dma != NULL) {
+		run.cpu = heap_cpu;
+		run.dma = heap_dma;
+		memory_contention_measure(_contention_workload, &run, &contention);
+		memory_contention_dump("cpu heap, dma heap", &contention);
+	}
+
+	if (heap_cpu != NULL && region_dma != NULL) {
+		run.cpu = heap_cpu;
+		run.dma = region_dma;
+		memory_contention_measure(_contention_workload, &run, &contention);
+		memory_contention_dump("cpu heap, dma region", &contention);
+	}
+
+	if (region_dma != NULL) {
+		run.cpu = scratch;
+		run.dma = region_dma;
+		memory_contention_measure(_contention_workload, &run, &contention);
+		memory_contention_dump("cpu scratch, dma region", &contention);
+	}
+
+	free(heap_cpu);
+	free(heap_dma);
+	dma_channel_unclaim(run.channel);
+}
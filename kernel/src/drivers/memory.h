@@ -2,13 +2,76 @@
 #define KERNEL_MEMORY_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stddef.h>
 
+#include "pico/platform.h"
+
 extern uint8_t __end__;
 extern uint8_t __StackLimit;
 
+// linker symbols around the two scratch banks: what's been placed in them
+// (SCRATCH_CORE0 etc.) and the bottom of the stack at the top of each
+extern uint8_t __scratch_x_end__;
+extern uint8_t __scratch_y_end__;
+extern uint8_t __StackOneBottom;
+extern uint8_t __StackBottom;
+
+// RP2350 SRAM: SRAM0-3 and SRAM4-7 are each word-striped over 256 KiB, so
+// sequential accesses spread over four banks, then come the two 4 KiB
+// scratch banks, SRAM8 (SCRATCH_X, core 1's stack) and SRAM9 (SCRATCH_Y,
+// core 0's stack). Bus masters only stall each other on the same bank.
+#define MEMORY_SRAM_LOWER 0x20000000u // SRAM0-3
+#define MEMORY_SRAM_UPPER 0x20040000u // SRAM4-7
+#define MEMORY_SCRATCH_X  0x20080000u // SRAM8
+#define MEMORY_SCRATCH_Y  0x20081000u // SRAM9
+#define MEMORY_BANKS      10
+
+// bytes at the top of SRAM4-7 kept out of the heap for DMA buffers, see
+// region_alloc
+#ifndef MEMORY_DMA_REGION_SIZE
+#define MEMORY_DMA_REGION_SIZE (16 * 1024)
+#endif
+
+// hot state of code that runs on core 0 (or core 1), in that core's scratch
+// bank next to its stack, where neither the DMA nor the other core go:
+//   static uint8_t SCRATCH_CORE0("lcd") _line_buffer[640];
+// The banks are 4 KiB with the stack, keep it to small, busy things.
+#define SCRATCH_CORE0(group) __scratch_y(group)
+#define SCRATCH_CORE1(group) __scratch_x(group)
+
+typedef enum MemoryRegion {
+	MEMORY_BULK,    // the heap (malloc), everything else
+	MEMORY_DMA,     // top of SRAM4-7, buffers the DMA streams through
+	MEMORY_SCRATCH, // the calling core's scratch bank, small and uncontended
+	MEMORY_REGION_COUNT
+} MemoryRegion_t;
+
+typedef struct MemoryRegionStats {
+	uintptr_t start;
+	uintptr_t capacity;
+	uintptr_t used;
+	uint32_t failures; // region_alloc calls that didn't fit
+} MemoryRegionStats_t;
+
+// bus fabric performance counters over one run of a workload per bank:
+// accesses and accesses that had to wait for another master
+typedef struct MemoryContention {
+	uint32_t accesses[MEMORY_BANKS];
+	uint32_t contested[MEMORY_BANKS];
+	uint32_t time_us; // of the workload, the fastest run
+} MemoryContention_t;
+
 uint8_t* heap_start();
 uint8_t* heap_end();
 size_t total_free_bytes();
 
+void memory_init();
+void* region_alloc(MemoryRegion_t region, uintptr_t bytes, uintptr_t alignment);
+void region_stats(MemoryRegion_t region, MemoryRegionStats_t* stats);
+
+void memory_contention_measure(void (*workload)(void* arg), void* arg, MemoryContention_t* result);
+void memory_contention_dump(const char* name, const MemoryContention_t* contention);
+void memory_contention_report();
+
 #endif
@@ -0,0 +1,164 @@
+#include "pool.h"
+
+#ifdef DEBUG
+#include <stdlib.h>
+#include <stdio.h>
+#endif
+
+// the pool's bookkeeping sits in front of its slots in one heap block
+#define POOL_HEADER_SIZE ((sizeof(Pool_t) + (POOL_ALIGN - 1)) & ~(uintptr_t)(POOL_ALIGN - 1))
+
+/**
+ * Create a pool of `count` objects of `obj_size` bytes in a single heap
+ * allocation. Objects carry no header, a free object's first word links it
+ * into the pool's free list.
+ *
+ * @param obj_size Size of each object in bytes.
+ * @param count Number of objects.
+ * @returns The pool, or `NULL` if the heap couldn't fit it.
+ */
+Pool_t* pool_create(uintptr_t obj_size, uint32_t count) {
+	if (obj_size == 0 || count == 0) return NULL;
+
+	uintptr_t slot_size = POOL_SLOT_SIZE(obj_size);
+	if (slot_size > UINT32_MAX || count > (UINTPTR_MAX - POOL_HEADER_SIZE) / slot_size) return NULL;
+
+	uint8_t* block = malloc_tagged(POOL_HEADER_SIZE + slot_size * count, "pool");
+	if (block == NULL) return NULL;
+
+	Pool_t* pool = (Pool_t*)block;
+	pool_init(pool, block + POOL_HEADER_SIZE, obj_size, count);
+	pool->owns_storage = true;
+	return pool;
+}
+
+/**
+ * Set up a pool over caller supplied storage, e.g. a static array.
+ *
+ * @param pool Pool to initialise.
+ * @param buffer Storage of at least `POOL_BUFFER_SIZE(obj_size, count)`
+ * bytes, aligned to `POOL_ALIGN`.
+ * @param obj_size Size of each object in bytes.
+ * @param count Number of objects.
+ * @returns `false` if the arguments are invalid.
+ */
+bool pool_init(Pool_t* pool, void* buffer, uintptr_t obj_size, uint32_t count) {
+	if (pool == NULL || buffer == NULL || obj_size == 0 || count == 0) return false;
+	if ((uintptr_t)buffer & (POOL_ALIGN - 1)) return false;
+
+	pool->slot_size = POOL_SLOT_SIZE(obj_size);
+	pool->slots = buffer;
+	pool->end = pool->slots + (uintptr_t)pool->slot_size * count;
+	pool->owns_storage = false;
+	pool_reset(pool);
+	return true;
+}
+
+/**
+ * Destroy a pool. Storage from `pool_create` goes back to the heap, caller
+ * supplied storage is left alone. Objects still allocated become invalid.
+ *
+ * @param pool Pool to destroy, may be `NULL`.
+ */
+void pool_destroy(Pool_t* pool) {
+	if (pool == NULL) return;
+
+	if (pool->owns_storage) {
+		free(pool);
+	} else {
+		pool->slots = pool->unused = pool->end = NULL;
+		pool->free_list = NULL;
+	}
+}
+
+/**
+ * Take an object from the pool: reuses the most recently freed one, otherwise
+ * the next never used slot, so creating a pool doesn't have to touch every
+ * slot up front.
+ *
+ * @param pool Pool to allocate from.
+ * @returns Pointer to an uninitialised object, or `NULL` if the pool is full.
+ */
+void* pool_alloc(Pool_t* pool) {
+	void* ptr = pool->free_list;
+
+	if (ptr != NULL) {
+		pool->free_list = *(void**)ptr;
+	} else if (pool->unused < pool->end) {
+		ptr = pool->unused;
+		pool->unused += pool->slot_size;
+	} else {
+		pool->failures++;
+		return NULL;
+	}
+
+	if (++pool->used > pool->peak) pool->peak = pool->used;
+	return ptr;
+}
+
+/**
+ * Give an object back to its pool.
+ *
+ * @param pool Pool the object came from.
+ * @param ptr Object from `pool_alloc` on this pool, or `NULL`.
+ */
+void pool_free(Pool_t* pool, void* ptr) {
+	if (ptr == NULL) return;
+
+#ifdef DEBUG
+	if (!pool_owns(pool, ptr)) {
+		fprintf(stderr, "Error: %p freed to a pool it doesn't belong to\n", ptr);
+		abort();
+	}
+	for (void* slot = pool->free_list; slot != NULL; slot = *(void**)slot) {
+		if (slot == ptr) {
+			fprintf(stderr, "Error: double free detected at %p\n", ptr);
+			abort();
+		}
+	}
+#endif
+
+	*(void**)ptr = pool->free_list;
+	pool->free_list = ptr;
+	pool->used--;
+}
+
+/**
+ * Free every object in the pool at once. Statistics other than the number of
+ * objects in use are kept.
+ *
+ * @param pool Pool to reset.
+ */
+void pool_reset(Pool_t* pool) {
+	pool->unused = pool->slots;
+	pool->free_list = NULL;
+	pool->used = 0;
+}
+
+/**
+ * Check whether a pointer is the start of one of the pool's slots.
+ *
+ * @param pool Pool to check.
+ * @param ptr Pointer to check.
+ * @returns `true` if `ptr` could have come from `pool_alloc` on this pool.
+ */
+bool pool_owns(const Pool_t* pool, const void* ptr) {
+	const uint8_t* bytes = ptr;
+	if (bytes < pool->slots || bytes >= pool->end) return false;
+	return (uintptr_t)(bytes - pool->slots) % pool->slot_size == 0;
+}
+
+/**
+ * Get a pool's slot size, capacity, how many slots are in use and the most
+ * ever in use at once, and how many allocations found it full.
+ *
+ * @param pool Pool to inspect.
+ * @param stats Filled in with the counters.
+ */
+void pool_stats(const Pool_t* pool, PoolStats_t* stats) {
+	stats->obj_size = pool->slot_size;
+	stats->capacity = (uint32_t)((pool->end - pool->slots) / pool->slot_size);
+	stats->used = pool->used;
+	stats->peak = pool->peak;
+	stats->failures = pool->failures;
+}
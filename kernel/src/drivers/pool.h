@@ -0,0 +1,54 @@
+#ifndef KERNEL_POOL_H
+#define KERNEL_POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "allocator.h"
+
+// objects are padded to this so every slot is aligned like malloc's blocks
+#define POOL_ALIGN ALIGN
+
+// slot size for objects of `obj_size` bytes, at least big enough for the
+// free list link that's stored in free slots
+#define POOL_SLOT_SIZE(obj_size) \
+	((((obj_size) < sizeof(void*) ? sizeof(void*) : (obj_size)) + (POOL_ALIGN - 1)) & ~(uintptr_t)(POOL_ALIGN - 1))
+
+// bytes of buffer `pool_init` needs for `count` objects
+#define POOL_BUFFER_SIZE(obj_size, count) (POOL_SLOT_SIZE(obj_size) * (count))
+
+typedef struct PoolStats {
+	uint32_t obj_size; // slot size, after padding
+	uint32_t capacity;
+	uint32_t used;
+	uint32_t peak;     // most slots in use at once
+	uint32_t failures; // pool_alloc calls that found the pool full
+} PoolStats_t;
+
+// fixed size object pool, either from `pool_create` (storage from the heap)
+// or `pool_init` (storage supplied by the caller)
+typedef struct Pool {
+	uint8_t* slots;
+	uint8_t* unused; // slots from here on have never been handed out
+	uint8_t* end;
+	void* free_list; // freed slots, the link is the slot's first word
+	uint32_t slot_size;
+	uint32_t used;
+	uint32_t peak;
+	uint32_t failures;
+	bool owns_storage;
+} Pool_t;
+
+Pool_t* pool_create(uintptr_t obj_size, uint32_t count);
+bool pool_init(Pool_t* pool, void* buffer, uintptr_t obj_size, uint32_t count);
+void pool_destroy(Pool_t* pool);
+
+void* pool_alloc(Pool_t* pool);
+void pool_free(Pool_t* pool, void* ptr);
+void pool_reset(Pool_t* pool);
+
+bool pool_owns(const Pool_t* pool, const void* ptr);
+void pool_stats(const Pool_t* pool, PoolStats_t* stats);
+
+#endif
@@ -0,0 +1,225 @@
+#include "scheduler.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+#include "pico/platform.h"
+#include "hardware/sync.h"
+
+#include "trace.h"
+
+typedef struct Scheduler {
+	Task_t* tasks;
+	atomic_uint pending; // events signalled since the last pass
+	bool running;
+	uint64_t start_us;
+	uint64_t idle_us;
+	uint32_t sleeps;
+} Scheduler_t;
+
+static Scheduler_t _schedulers[SCHED_CORES];
+
+/**
+ * Get the calling core's scheduler.
+ *
+ * @returns The scheduler.
+ */
+static Scheduler_t* _local_scheduler() {
+	return &_schedulers[get_core_num()];
+}
+
+/**
+ * Add a task to the calling core's scheduler and make it ready, so it runs
+ * on the next pass. The task structure must stay valid from then on, there's
+ * no removing tasks; a task that's done stops by not waiting for anything.
+ *
+ * @param task Caller-owned task storage.
+ * @param name Name in sched_dump.
+ * @param func Called each time the task is ready.
+ * @param user Stored in the task for `func`.
+ */
+void task_start(Task_t* task, const char* name, TaskFunc_t func, void* user) {
+	Scheduler_t* sched = _local_scheduler();
+	*task = (Task_t){
+		.name = name,
+		.func = func,
+		.user = user,
+		.next = sched->tasks,
+		.state = TASK_READY,
+	};
+	sched->tasks = task;
+}
+
+/**
+ * Make a task ready, so it runs on the scheduler's next pass; from the task
+ * itself that's a yield. Only from tasks on the same core, interrupt handlers
+ * and the other core wake tasks with sched_signal.
+ *
+ * @param task Task.
+ */
+void task_wake(Task_t* task) {
+	task->state = TASK_READY;
+	task->timed = false;
+	task->wait_events = 0;
+}
+
+/**
+ * Have a task run when any of the given events is signalled, or at its
+ * deadline if it also sleeps; whichever comes first wakes it, after which it
+ * waits for nothing until it says so again.
+ *
+ * @param task Task.
+ * @param events SCHED_EVENT_ bits.
+ */
+void task_wait(Task_t* task, uint32_t events) {
+	task->state = TASK_WAITING;
+	task->wait_events |= events;
+}
+
+/**
+ * Have a task run at a given time (or earlier, on an event it waits for, or
+ * at an earlier deadline already set). For something periodic, sleep until
+ * the last deadline plus the period so it doesn't drift.
+ *
+ * @param task Task.
+ * @param time_us Deadline, from time_us_32.
+ */
+void task_sleep_until(Task_t* task, uint32_t time_us) {
+	if (!task->timed || (int32_t)(time_us - task->deadline_us) < 0) task->deadline_us = time_us;
+	task->timed = true;
+	task->state = TASK_WAITING;
+}
+
+/**
+ * Have a task run after a while, see task_sleep_until.
+ *
+ * @param task Task.
+ * @param us Microseconds from now.
+ */
+void task_sleep(Task_t* task, uint32_t us) {
+	task_sleep_until(task, time_us_32() + us);
+}
+
+/**
+ * Wake the tasks waiting for any of the given events, on both cores. Safe
+ * from interrupt handlers and either core. Events nobody is waiting for are
+ * dropped.
+ *
+ * @param events SCHED_EVENT_ bits.
+ */
+void sched_signal(uint32_t events) {
+	for (uint core = 0; core < SCHED_CORES; core++) {
+		atomic_fetch_or_explicit(&_schedulers[core].pending, events, memory_order_release);
+	}
+	// wake a core sleeping in sched_run (on this core, the interrupt did)
+	__sev();
+}
+
+/**
+ * Run one task once, counting its time.
+ *
+ * @param task Ready task.
+ */
+static void _run_task(Task_t* task) {
+	task->state = TASK_STOPPED;
+
+	uint64_t start = time_us_64();
+	TRACE_BEGIN(task->name);
+	task->func(task);
+	TRACE_END(task->name);
+	uint32_t us = (uint32_t)(time_us_64() - start);
+
+	task->events = 0;
+	task->runs++;
+	task->cpu_us += us;
+	if (us > task->max_us) task->max_us = us;
+}
+
+/**
+ * Run the calling core's tasks, forever. Each pass wakes the tasks whose
+ * events came in or whose deadline has passed, then runs every ready task
+ * once. When none is ready the core sleeps (WFE) until the earliest deadline
+ * or until an interrupt or sched_signal, there's no tick.
+ */
+void sched_run() {
+	Scheduler_t* sched = _local_scheduler();
+	sched->start_us = time_us_64();
+	sched->running = true;
+
+	while (1) {
+		uint32_t events = atomic_exchange_explicit(&sched->pending, 0, memory_order_acquire);
+		uint32_t now = time_us_32();
+
+		bool ready = false;
+		bool timed = false;
+		uint32_t deadline = 0;
+		for (Task_t* task = sched->tasks; task != NULL; task = task->next) {
+			if (task->state == TASK_WAITING) {
+				uint32_t woken = task->wait_events & events;
+				if (woken != 0 || (task->timed && (int32_t)(now - task->deadline_us) >= 0)) {
+					task_wake(task);
+					task->events = woken;
+				} else if (task->timed && (!timed || (int32_t)(task->deadline_us - deadline) < 0)) {
+					deadline = task->deadline_us;
+					timed = true;
+				}
+			}
+			if (task->state == TASK_READY) ready = true;
+		}
+
+		if (ready) {
+			for (Task_t* task = sched->tasks; task != NULL; task = task->next) {
+				if (task->state == TASK_READY) _run_task(task);
+			}
+			continue;
+		}
+
+		// nothing to do: sleep until the next deadline, or an interrupt or a
+		// signal (which sets the event register, so one that came in since
+		// the exchange above doesn't get slept through)
+		uint64_t sleep_start = time_us_64();
+		if (timed) {
+			int32_t wait = (int32_t)(deadline - time_us_32());
+			if (wait > 0) best_effort_wfe_or_timeout(make_timeout_time_us(wait));
+		} else {
+			__wfe();
+		}
+		// the cycle counter stops while the core sleeps
+		TRACE_SYNC();
+		sched->idle_us += time_us_64() - sleep_start;
+		sched->sleeps++;
+	}
+}
+
+/**
+ * Get the calling core's scheduler counters.
+ *
+ * @param stats Filled in with the counters.
+ */
+void sched_stats(SchedStats_t* stats) {
+	Scheduler_t* sched = _local_scheduler();
+	stats->running_us = !sched->running ? 0 : time_us_64() - sched->start_us;
+	stats->idle_us = sched->idle_us;
+	stats->sleeps = sched->sleeps;
+	stats->tasks = 0;
+	for (Task_t* task = sched->tasks; task != NULL; task = task->next) stats->tasks++;
+}
+
+/**
+ * Print how the calling core's time went since sched_run started: asleep,
+ * and in each task (runs, total and longest run) over stdio.
+ */
+void sched_dump() {
+	Scheduler_t* sched = _local_scheduler();
+	SchedStats_t stats;
+	sched_stats(&stats);
+	double running = stats.running_us > 0 ? (double)stats.running_us : 1.0;
+
+	printf("sched: core %u, %llu us, idle %.1f%% (%lu sleeps)\n", (unsigned)get_core_num(),
+		(unsigned long long)stats.running_us, 100.0 * stats.idle_us / running, (unsigned long)stats.sleeps);
+	for (Task_t* task = sched->tasks; task != NULL; task = task->next) {
+		printf("  %-12s %8lu runs %10llu us (%.1f%%) max %lu us\n", task->name, (unsigned long)task->runs,
+			(unsigned long long)task->cpu_us, 100.0 * task->cpu_us / running, (unsigned long)task->max_us);
+	}
+}
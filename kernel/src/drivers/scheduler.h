@@ -0,0 +1,63 @@
+#ifndef KERNEL_SCHEDULER_H
+#define KERNEL_SCHEDULER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SCHED_CORES 2
+
+// events tasks wait for (task_wait), raised with sched_signal from anywhere,
+// interrupt handlers and the other core included
+#define SCHED_EVENT_INPUT (1u << 0) // button_poll has something new
+#define SCHED_EVENT_ASYNC (1u << 1) // an operation a coroutine awaits is done
+#define SCHED_EVENT_USER  (1u << 8) // the first one free for apps
+
+// task states
+#define TASK_STOPPED 0 // until task_wake
+#define TASK_READY   1 // runs on the scheduler's next pass
+#define TASK_WAITING 2 // for its events or its deadline
+
+struct Task;
+typedef void (*TaskFunc_t)(struct Task* task);
+
+// A task is a function the scheduler calls whenever the task is ready; it
+// does a bit of work, says what it's waiting for next (task_wait,
+// task_sleep, task_wake to go again straight away) and returns. A task that
+// returns without waiting for anything is stopped. Tasks run on the core
+// that started them, one at a time, and are never interrupted by each other.
+typedef struct Task {
+	const char* name;
+	TaskFunc_t func;
+	void* user;
+	uint32_t events; // while it runs: the events that woke it, 0 for the
+	                 // deadline or task_wake
+
+	// owned by the scheduler
+	struct Task* next;
+	uint8_t state;
+	bool timed;
+	uint32_t wait_events;
+	uint32_t deadline_us;
+	uint32_t runs;
+	uint32_t max_us;
+	uint64_t cpu_us;
+} Task_t;
+
+typedef struct SchedStats {
+	uint64_t running_us; // since sched_run
+	uint64_t idle_us;    // of that, asleep
+	uint32_t sleeps;
+	uint32_t tasks;
+} SchedStats_t;
+
+void task_start(Task_t* task, const char* name, TaskFunc_t func, void* user);
+void task_wake(Task_t* task);
+void task_wait(Task_t* task, uint32_t events);
+void task_sleep(Task_t* task, uint32_t us);
+void task_sleep_until(Task_t* task, uint32_t time_us);
+void sched_signal(uint32_t events);
+void sched_run();
+void sched_stats(SchedStats_t* stats);
+void sched_dump();
+
+#endif
@@ -2,17 +2,201 @@
 
 //#include <stdio.h>
 
+#include "hardware/dma.h"
+
 #include "pins.h"
+#include "spi_bus.h"
+#include "trace.h"
+
+#define SD_READ_RETRIES 3
+
+// CRC7 (x^7 + x^3 + 1) lookup table, the CRC is kept in the top 7 bits so the
+// final command byte is just `crc | 1` (end bit)
+static const uint8_t _crc7_table[256] = {
+	0x00, 0x12, 0x24, 0x36, 0x48, 0x5A, 0x6C, 0x7E,
+	0x90, 0x82, 0xB4, 0xA6, 0xD8, 0xCA, 0xFC, 0xEE,
+	0x32, 0x20, 0x16, 0x04, 0x7A, 0x68, 0x5E, 0x4C,
+	0xA2, 0xB0, 0x86, 0x94, 0xEA, 0xF8, 0xCE, 0xDC,
+	0x64, 0x76, 0x40, 0x52, 0x2C, 0x3E, 0x08, 0x1A,
+	0xF4, 0xE6, 0xD0, 0xC2, 0xBC, 0xAE, 0x98, 0x8A,
+	0x56, 0x44, 0x72, 0x60, 0x1E, 0x0C, 0x3A, 0x28,
+	0xC6, 0xD4, 0xE2, 0xF0, 0x8E, 0x9C, 0xAA, 0xB8,
+	0xC8, 0xDA, 0xEC, 0xFE, 0x80, 0x92, 0xA4, 0xB6,
+	0x58, 0x4A, 0x7C, 0x6E, 0x10, 0x02, 0x34, 0x26,
+	0xFA, 0xE8, 0xDE, 0xCC, 0xB2, 0xA0, 0x96, 0x84,
+	0x6A, 0x78, 0x4E, 0x5C, 0x22, 0x30, 0x06, 0x14,
+	0xAC, 0xBE, 0x88, 0x9A, 0xE4, 0xF6, 0xC0, 0xD2,
+	0x3C, 0x2E, 0x18, 0x0A, 0x74, 0x66, 0x50, 0x42,
+	0x9E, 0x8C, 0xBA, 0xA8, 0xD6, 0xC4, 0xF2, 0xE0,
+	0x0E, 0x1C, 0x2A, 0x38, 0x46, 0x54, 0x62, 0x70,
+	0x82, 0x90, 0xA6, 0xB4, 0xCA, 0xD8, 0xEE, 0xFC,
+	0x12, 0x00, 0x36, 0x24, 0x5A, 0x48, 0x7E, 0x6C,
+	0xB0, 0xA2, 0x94, 0x86, 0xF8, 0xEA, 0xDC, 0xCE,
+	0x20, 0x32, 0x04, 0x16, 0x68, 0x7A, 0x4C, 0x5E,
+	0xE6, 0xF4, 0xC2, 0xD0, 0xAE, 0xBC, 0x8A, 0x98,
+	0x76, 0x64, 0x52, 0x40, 0x3E, 0x2C, 0x1A, 0x08,
+	0xD4, 0xC6, 0xF0, 0xE2, 0x9C, 0x8E, 0xB8, 0xAA,
+	0x44, 0x56, 0x60, 0x72, 0x0C, 0x1E, 0x28, 0x3A,
+	0x4A, 0x58, 0x6E, 0x7C, 0x02, 0x10, 0x26, 0x34,
+	0xDA, 0xC8, 0xFE, 0xEC, 0x92, 0x80, 0xB6, 0xA4,
+	0x78, 0x6A, 0x5C, 0x4E, 0x30, 0x22, 0x14, 0x06,
+	0xE8, 0xFA, 0xCC, 0xDE, 0xA0, 0xB2, 0x84, 0x96,
+	0x2E, 0x3C, 0x0A, 0x18, 0x66, 0x74, 0x42, 0x50,
+	0xBE, 0xAC, 0x9A, 0x88, 0xF6, 0xE4, 0xD2, 0xC0,
+	0x1C, 0x0E, 0x38, 0x2A, 0x54, 0x46, 0x70, 0x62,
+	0x8C, 0x9E, 0xA8, 0xBA, 0xC4, 0xD6, 0xE0, 0xF2
+};
+
+// DMA channels used for block transfers, claimed on first init
+static int _dma_tx = -1;
+static int _dma_rx = -1;
+
+// source byte for the TX channel while clocking data in
+static const uint8_t _fill_byte = 0xFF;
+
+static uint32_t _crc_errors = 0;
+
+/**
+ * Compute the 7-bit CRC of an SD command packet.
+ *
+ * @param data Bytes to checksum (the first 5 bytes of a command packet).
+ * @param len Number of bytes in `data`.
+ * @returns The CRC7 in the top 7 bits of the byte (bit 0 clear).
+ */
+static uint8_t _crc7(const uint8_t* data, size_t len) {
+	uint8_t crc = 0;
+	for (size_t i = 0; i < len; i++) {
+		crc = _crc7_table[crc ^ data[i]];
+	}
+	return crc;
+}
+
+// sink for the RX channel while clocking data out
+static uint8_t _drain_byte;
+
+/**
+ * Start clocking a 512-byte data block in from the card using DMA, with the
+ * DMA sniffer computing the block's CRC16 (CCITT) as the bytes land in `buffer`.
+ *
+ * Returns immediately; completion is signalled by the RX channel (see
+ * `sd_dma_busy` and `sd_dma_acknowledge_irq`), then `sd_dma_crc` gives the CRC.
+ *
+ * @param buffer Destination buffer with space for `SD_BLOCK_SIZE` bytes.
+ */
+void sd_dma_start_read(uint8_t* buffer) {
+	spi_hw_t* hw = spi_get_hw(SPI_PORT);
+
+	// TX keeps the clock running by sending 0xFF from a fixed address
+	dma_channel_config tx = dma_channel_get_default_config(_dma_tx);
+	channel_config_set_transfer_data_size(&tx, DMA_SIZE_8);
+	channel_config_set_read_increment(&tx, false);
+	channel_config_set_write_increment(&tx, false);
+	channel_config_set_dreq(&tx, spi_get_dreq(SPI_PORT, true));
+	dma_channel_configure(_dma_tx, &tx, &hw->dr, &_fill_byte, SD_BLOCK_SIZE, false);
+
+	// RX drains the FIFO into the buffer, this is the channel being sniffed
+	dma_channel_config rx = dma_channel_get_default_config(_dma_rx);
+	channel_config_set_transfer_data_size(&rx, DMA_SIZE_8);
+	channel_config_set_read_increment(&rx, false);
+	channel_config_set_write_increment(&rx, true);
+	channel_config_set_dreq(&rx, spi_get_dreq(SPI_PORT, false));
+	channel_config_set_sniff_enable(&rx, true);
+	dma_channel_configure(_dma_rx, &rx, buffer, &hw->dr, SD_BLOCK_SIZE, false);
+
+	// SD data CRC is CRC16-CCITT with a zero seed
+	dma_sniffer_enable(_dma_rx, DMA_SNIFF_CTRL_CALC_VALUE_CRC16, true);
+	dma_sniffer_set_data_accumulator(0);
+
+	dma_start_channel_mask((1u << _dma_tx) | (1u << _dma_rx));
+}
+
+/**
+ * Start clocking a 512-byte data block out to the card using DMA, with the
+ * DMA sniffer computing the CRC16 that has to follow the block.
+ *
+ * The RX channel still runs (into a dummy byte) so the SPI RX FIFO is drained
+ * and its completion marks the last byte being fully clocked out.
+ *
+ * @param buffer Source buffer holding `SD_BLOCK_SIZE` bytes.
+ */
+void sd_dma_start_write(const uint8_t* buffer) {
+	spi_hw_t* hw = spi_get_hw(SPI_PORT);
+
+	// TX streams the buffer out, this is the channel being sniffed
+	dma_channel_config tx = dma_channel_get_default_config(_dma_tx);
+	channel_config_set_transfer_data_size(&tx, DMA_SIZE_8);
+	channel_config_set_read_increment(&tx, true);
+	channel_config_set_write_increment(&tx, false);
+	channel_config_set_dreq(&tx, spi_get_dreq(SPI_PORT, true));
+	channel_config_set_sniff_enable(&tx, true);
+	dma_channel_configure(_dma_tx, &tx, &hw->dr, buffer, SD_BLOCK_SIZE, false);
+
+	dma_channel_config rx = dma_channel_get_default_config(_dma_rx);
+	channel_config_set_transfer_data_size(&rx, DMA_SIZE_8);
+	channel_config_set_read_increment(&rx, false);
+	channel_config_set_write_increment(&rx, false);
+	channel_config_set_dreq(&rx, spi_get_dreq(SPI_PORT, false));
+	dma_channel_configure(_dma_rx, &rx, &_drain_byte, &hw->dr, SD_BLOCK_SIZE, false);
+
+	dma_sniffer_enable(_dma_tx, DMA_SNIFF_CTRL_CALC_VALUE_CRC16, true);
+	dma_sniffer_set_data_accumulator(0);
+
+	dma_start_channel_mask((1u << _dma_tx) | (1u << _dma_rx));
+}
+
+/**
+ * Check whether a block transfer started by `sd_dma_start_read` or
+ * `sd_dma_start_write` is still in flight.
+ *
+ * @returns `true` while the RX channel has bytes left to move.
+ */
+bool sd_dma_busy() {
+	return dma_channel_is_busy(_dma_rx);
+}
+
+/**
+ * Finish a block transfer and collect the CRC16 computed by the sniffer.
+ *
+ * @returns CRC16 of the 512 bytes that were transferred.
+ */
+uint16_t sd_dma_crc() {
+	uint16_t crc = (uint16_t)dma_sniffer_get_data_accumulator();
+	dma_sniffer_disable();
+	return crc;
+}
+
+/**
+ * Enable or disable the DMA_IRQ_0 interrupt raised when a block transfer completes.
+ *
+ * @param enabled Whether completion of the RX channel should raise DMA_IRQ_0.
+ */
+void sd_dma_set_irq_enabled(bool enabled) {
+	dma_channel_set_irq0_enabled(_dma_rx, enabled);
+}
+
+/**
+ * Acknowledge the block transfer completion interrupt, for use from a shared DMA_IRQ_0 handler.
+ *
+ * @returns `true` if the interrupt was raised by the SD transfer (and has now been cleared), `false` if it belongs to someone else.
+ */
+bool sd_dma_acknowledge_irq() {
+	if (_dma_rx < 0 || !dma_channel_get_irq0_status(_dma_rx)) return false;
+	dma_channel_acknowledge_irq0(_dma_rx);
+	return true;
+}
 
 /**
  * Send a 6-byte SD command packet and return the card's response.
+ * Selects the card; the caller must own the bus (SD transaction) and deselects when done.
+ *
+ * The CRC7 is always computed, so commands stay valid once CRC mode is
+ * enabled with CMD59.
  *
  * @param cmd SD command index (command number).
  * @param arg 32-bit command argument, transmitted MSB first.
- * @param crc CRC byte for the command packet.
  * @return R1 response byte from the card (first response with MSB cleared); `0xFF` if no valid response was received.
  */
-uint8_t sd_send_cmd(uint8_t cmd, uint32_t arg, uint8_t crc) {
+uint8_t sd_send_cmd(uint8_t cmd, uint32_t arg) {
 	// create packet
 	uint8_t packet[6];
 	packet[0] = 0x40 | cmd;
@@ -20,9 +204,9 @@ uint8_t sd_send_cmd(uint8_t cmd, uint32_t arg, uint8_t crc) {
 	packet[2] = (arg >> 16) & 0xFF;
 	packet[3] = (arg >> 8) & 0xFF;
 	packet[4] = arg & 0xFF;
-	packet[5] = crc;
+	packet[5] = _crc7(packet, 5) | 0x01;
 
-	gpio_put(PIN_SDCS, 0);
+	spi_bus_select(SPI_DEVICE_SD, true);
 
 	// wait for card to be ready
 	uint8_t busy = 0;
@@ -45,95 +229,128 @@ uint8_t sd_send_cmd(uint8_t cmd, uint32_t arg, uint8_t crc) {
 }
 
 /**
- * Initialize the SD card and wait until it enters the ready (operational) state.
+ * Send CMD12 (STOP_TRANSMISSION) to end a multi-block read.
  *
- * Performs the card reset and initialization sequence, including a GO_IDLE (CMD0),
- * voltage range check (CMD8), and repeated application initialization (ACMD41)
- * until the card signals readiness.
+ * Unlike `sd_send_cmd` this does not wait for the card to be idle first (it is
+ * still streaming data), and it discards the stuff byte that follows CMD12.
+ * The card may signal busy afterwards, the caller is responsible for waiting
+ * for MISO to return high.
  *
- * @returns `true` if the card completed initialization and is ready (R1 response 0x00), `false` otherwise.
+ * @return R1 response byte from the card; `0xFF` if no valid response was received.
  */
-bool sd_init() {
+uint8_t sd_stop_transmission() {
+	uint8_t packet[6] = { 0x40 | 12, 0, 0, 0, 0, 0 };
+	packet[5] = _crc7(packet, 5) | 0x01;
+
+	spi_write_blocking(SPI_PORT, packet, 6);
+
+	// skip the stuff byte
 	uint8_t response = 0xFF;
+	spi_read_blocking(SPI_PORT, 0xFF, &response, 1);
 
-	// deselect everything
-	gpio_put(PIN_CS, 1);
-	gpio_put(PIN_SDCS, 1);
+	for (int i = 0; i < 100; i++) {
+		spi_read_blocking(SPI_PORT, 0xFF, &response, 1);
+		if ((response & 0x80) == 0) break;
+	}
 
-	spi_set_baudrate(SPI_PORT, SD_INIT_MHZ);
+	return response;
+}
 
-	// send 80 dummy clocks (10 bytes of 0xFF) to tell the SD card to wake up
+/**
+ * Run the SPI-mode initialization sequence, with the card's transaction already open.
+ *
+ * @returns `true` if the card reached the ready state.
+ */
+static bool _init_card() {
+	uint8_t response = 0xFF;
+
+	// send 80 dummy clocks (10 bytes of 0xFF) with the card deselected to tell it to wake up
+	spi_bus_select(SPI_DEVICE_SD, false);
 	uint16_t dummy[] = { 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF };
 	spi_write_blocking(SPI_PORT, (uint8_t*)dummy, 10);
 
-	response = sd_send_cmd(0, 0, 0x95);
-	gpio_put(PIN_SDCS, 1);
-	if (response != 0x01) {
-		spi_set_baudrate(SPI_PORT, DEFAULT_MHZ);
-		return false;
-	}
+	response = sd_send_cmd(0, 0);
+	spi_bus_select(SPI_DEVICE_SD, false);
+	if (response != 0x01) return false;
 
 	// CMD8 check voltage
-	response = sd_send_cmd(8, 0x1AA, 0x87); // arg: 3.3V pattern
+	response = sd_send_cmd(8, 0x1AA); // arg: 3.3V pattern
 	uint8_t r7[4];
 	spi_read_blocking(SPI_PORT, 0xFF, r7, 4);
-	gpio_put(PIN_SDCS, 1);
+	spi_bus_select(SPI_DEVICE_SD, false);
 
 	// Verify R7: last byte should echo 0xAA, and voltage accepted (0x01)
 	if (response != 0x01 || r7[3] != 0xAA || (r7[2] & 0x0F) != 0x01) {
 		// Not a v2+ SDHC/SDXC card — unsupported
-		spi_set_baudrate(SPI_PORT, DEFAULT_MHZ);
 		return false;
 	}
 
+	// CMD59 turn on CRC checking, from here on the card rejects commands and
+	// data with bad CRCs instead of silently accepting them
+	response = sd_send_cmd(59, 1);
+	spi_bus_select(SPI_DEVICE_SD, false);
+	if (response != 0x01) return false;
+
 	// ACMD41 loop (wake up)
 	// (send CMD55 + CMD41 until response is 0x00)
 	for (int i = 0; i < 1000; i++) {
-		sd_send_cmd(55, 0, 0x65);
-		gpio_put(PIN_SDCS, 1);
+		sd_send_cmd(55, 0);
+		spi_bus_select(SPI_DEVICE_SD, false);
 
-		response = sd_send_cmd(41, 0x40000000, 0x77);
-		gpio_put(PIN_SDCS, 1);
+		response = sd_send_cmd(41, 0x40000000);
+		spi_bus_select(SPI_DEVICE_SD, false);
 
-		if (response == 0x00) {
-			spi_set_baudrate(SPI_PORT, DEFAULT_MHZ);
-			return true;
-		}
+		if (response == 0x00) return true;
 		sleep_ms(10);
 	}
 
-	spi_set_baudrate(SPI_PORT, DEFAULT_MHZ);
-
 	return false;
 }
 
 /**
- * Read a 512-byte sector (single block) from the SD card into the provided buffer.
+ * Initialize the SD card and wait until it enters the ready (operational) state.
  *
- * Sends CMD17 for the specified block index (assumes block-addressing / SDHC),
- * waits for the start-block token (0xFE) with a timeout, reads 512 bytes into
- * `buffer`, consumes the trailing 2-byte CRC, and deselects the card.
+ * Performs the card reset and initialization sequence, including a GO_IDLE (CMD0),
+ * voltage range check (CMD8), enabling CRC checking (CMD59), and repeated
+ * application initialization (ACMD41) until the card signals readiness.
  *
- * @param sector Block index to read (block-addressing; use sector for SDHC).
- * @param buffer Pointer to a buffer with space for at least 512 bytes where data
- *               will be stored.
- * @returns `true` if the sector was read successfully and stored in `buffer`,
- *          `false` on timeout or command/transfer failure.
+ * Runs at `SD_INIT_MHZ` in its own bus transaction, then sets the card's
+ * clock to `SD_MHZ` for subsequent transactions.
+ *
+ * @returns `true` if the card completed initialization and is ready (R1 response 0x00), `false` otherwise.
  */
-bool sd_read_sector(uint32_t sector, uint8_t* buffer) {
-	// CMD17 == read single block
-	// SDHC uses block addressing (0, 1, 2)
-	// SDSC uses byte addressing (0, 512, 1024)
-	// assume SDHC on modern cards
+bool sd_init() {
+	if (_dma_tx < 0) {
+		_dma_tx = dma_claim_unused_channel(true);
+		_dma_rx = dma_claim_unused_channel(true);
+	}
+
+	spi_bus_set_baudrate(SPI_DEVICE_SD, SD_INIT_MHZ);
+	spi_bus_begin(SPI_DEVICE_SD);
 
-	spi_set_baudrate(SPI_PORT, SD_MHZ);
+	bool ready = _init_card();
 
-	uint8_t response = sd_send_cmd(17, sector, 0x00);
+	spi_bus_end(SPI_DEVICE_SD);
+	spi_bus_set_baudrate(SPI_DEVICE_SD, SD_MHZ);
+
+	return ready;
+}
+
+/**
+ * Uncounted single attempt at reading a sector, see `sd_read_sector`.
+ *
+ * @param sector Block index to read.
+ * @param buffer Destination buffer with space for `SD_BLOCK_SIZE` bytes.
+ * @returns `SD_OK`, `SD_ERR_CRC` if the command or data CRC check failed
+ *          (worth retrying), or `SD_ERR_IO` on timeout/other failure.
+ */
+static int _read_sector_once(uint32_t sector, uint8_t* buffer) {
+	uint8_t response = sd_send_cmd(17, sector);
 
 	if (response != 0x00) {
-		gpio_put(PIN_SDCS, 1);
-		spi_set_baudrate(SPI_PORT, DEFAULT_MHZ);
-		return false;
+		spi_bus_select(SPI_DEVICE_SD, false);
+		// R1 bit 3 is "command CRC error"
+		return (response != 0xFF && (response & 0x08)) ? SD_ERR_CRC : SD_ERR_IO;
 	}
 
 	// wait for start block token (0xFE)
@@ -145,21 +362,67 @@ bool sd_read_sector(uint32_t sector, uint8_t* buffer) {
 	}
 
 	if (token != 0xFE) {
-		gpio_put(PIN_SDCS, 1);
-		spi_set_baudrate(SPI_PORT, DEFAULT_MHZ);
-		return false;
+		spi_bus_select(SPI_DEVICE_SD, false);
+		return SD_ERR_IO;
 	}
 
-	// read 512 bytes of data
-	spi_read_blocking(SPI_PORT, 0xFF, buffer, 512);
+	// read 512 bytes of data, the sniffer checksums it on the way in
+	sd_dma_start_read(buffer);
+	while (sd_dma_busy()) tight_loop_contents();
+	uint16_t computed = sd_dma_crc();
 
-	// read 2 bytes CRC (checksum)
+	// read 2 bytes CRC (checksum), sent MSB first
 	uint8_t crc[2];
 	spi_read_blocking(SPI_PORT, 0xFF, crc, 2);
 
-	spi_set_baudrate(SPI_PORT, DEFAULT_MHZ);
+	spi_bus_select(SPI_DEVICE_SD, false);
 
-	gpio_put(PIN_SDCS, 1);
+	uint16_t received = ((uint16_t)crc[0] << 8) | crc[1];
+	return (computed == received) ? SD_OK : SD_ERR_CRC;
+}
 
-	return true;
-}
\ No newline at end of file
+/**
+ * Read a 512-byte sector (single block) from the SD card into the provided buffer.
+ *
+ * Sends CMD17 for the specified block index (assumes block-addressing / SDHC),
+ * waits for the start-block token (0xFE) with a timeout, DMAs 512 bytes into
+ * `buffer` while the DMA sniffer computes the CRC16, and checks it against the
+ * trailing 2-byte CRC sent by the card. CRC failures (command or data) are
+ * retried up to `SD_READ_RETRIES` times, timeouts are not.
+ *
+ * @param sector Block index to read (block-addressing; use sector for SDHC).
+ * @param buffer Pointer to a buffer with space for at least 512 bytes where data
+ *               will be stored.
+ * @returns `true` if the sector was read successfully and stored in `buffer`,
+ *          `false` on timeout, command/transfer failure, or persistent CRC errors.
+ */
+bool sd_read_sector(uint32_t sector, uint8_t* buffer) {
+	// CMD17 == read single block
+	// SDHC uses block addressing (0, 1, 2)
+	// SDSC uses byte addressing (0, 512, 1024)
+	// assume SDHC on modern cards
+
+	TRACE_BEGIN("sd_read_sector");
+	spi_bus_begin(SPI_DEVICE_SD);
+
+	int result = SD_ERR_IO;
+	for (int attempt = 0; attempt < SD_READ_RETRIES; attempt++) {
+		result = _read_sector_once(sector, buffer);
+		if (result != SD_ERR_CRC) break;
+		_crc_errors++;
+	}
+
+	spi_bus_end(SPI_DEVICE_SD);
+	TRACE_END("sd_read_sector");
+
+	return result == SD_OK;
+}
+
+/**
+ * Get the number of CRC failures (command or data) seen since boot.
+ *
+ * @returns Total CRC errors detected, including ones that were recovered by a retry.
+ */
+uint32_t sd_crc_error_count() {
+	return _crc_errors;
+}
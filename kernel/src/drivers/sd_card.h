@@ -4,8 +4,26 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#define SD_BLOCK_SIZE 512
+
+// transfer results
+#define SD_OK       0
+#define SD_ERR_IO  -1
+#define SD_ERR_CRC -2
+
 bool test_sd_card();
+uint8_t sd_send_cmd(uint8_t cmd, uint32_t arg);
+uint8_t sd_stop_transmission();
 bool sd_init();
 bool sd_read_sector(uint32_t sector, uint8_t* buffer);
+uint32_t sd_crc_error_count();
+
+// low level block transfers, used by the request queue
+void sd_dma_start_read(uint8_t* buffer);
+void sd_dma_start_write(const uint8_t* buffer);
+bool sd_dma_busy();
+uint16_t sd_dma_crc();
+void sd_dma_set_irq_enabled(bool enabled);
+bool sd_dma_acknowledge_irq();
 
 #endif
@@ -0,0 +1,499 @@
+#include "sd_queue.h"
+
+#include <stdio.h>
+
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+
+#include "pins.h"
+#include "spi_bus.h"
+#include "trace.h"
+
+#define SD_QUEUE_RETRIES    3
+#define SD_POLL_BYTES       8      // bytes sampled per step while waiting on the card
+#define SD_TOKEN_TIMEOUT_US 100000 // 100 ms
+#define SD_BUSY_TIMEOUT_US  500000 // 500 ms (SDHC write timeout is 250 ms)
+
+typedef enum {
+	SD_STATE_IDLE,  // nothing in flight
+	SD_STATE_TOKEN, // read: waiting for the start block token
+	SD_STATE_DATA,  // block DMA in flight
+	SD_STATE_BUSY   // write: card holding MISO low while it programs
+} SdState_t;
+
+static SdRequest_t* _head = NULL;
+static SdRequest_t* _tail = NULL;
+static SdRequest_t* _active = NULL;
+
+static SdState_t _state = SD_STATE_IDLE;
+static bool _multi = false;    // active transfer uses CMD18/CMD25
+static bool _stopping = false; // busy wait ends the request rather than starting the next block
+static uint32_t _wait_start_us = 0;
+
+static volatile bool _in_step = false;
+static volatile bool _kick = false; // _run was called during a pass, go round again
+
+static SdQueueStats_t _stats;
+
+static uint8_t* _block_buffer(SdRequest_t* request) {
+	return request->buffer + request->blocks_done * SD_BLOCK_SIZE;
+}
+
+/**
+ * Complete the active request: end the SD bus transaction, record statistics and run the callback.
+ *
+ * @param result `SD_OK` or one of the `SD_ERR_*` codes.
+ */
+static void _finish(int result) {
+	SdRequest_t* request = _active;
+
+	spi_bus_end(SPI_DEVICE_SD);
+
+	_active = NULL;
+	_state = SD_STATE_IDLE;
+
+	request->latency_us = time_us_32() - request->submitted_us;
+	request->result = (int8_t)result;
+
+	uint32_t bucket = 31 - __builtin_clz(request->latency_us | 1);
+	if (bucket >= SD_QUEUE_LATENCY_BUCKETS) bucket = SD_QUEUE_LATENCY_BUCKETS - 1;
+	_stats.latency_histogram[bucket]++;
+	_stats.depth--;
+	TRACE_COUNTER("sd_queue depth", _stats.depth);
+	if (result == SD_OK) {
+		_stats.completed++;
+	} else {
+		_stats.failed++;
+	}
+
+	request->status = SD_REQ_DONE;
+
+	if (request->callback != NULL) {
+		request->callback(request);
+	}
+}
+
+/**
+ * Wait (bounded, blocking) for the card to release MISO after a stop command or token.
+ * Only used on error paths, the normal path waits for busy through the state machine.
+ */
+static void _wait_not_busy() {
+	uint32_t start = time_us_32();
+	uint8_t response = 0x00;
+	while (response != 0xFF && time_us_32() - start < SD_BUSY_TIMEOUT_US) {
+		spi_read_blocking(SPI_PORT, 0xFF, &response, 1);
+	}
+}
+
+/**
+ * Abandon a multi-block transfer part way through so the card returns to the
+ * transfer state, then deselect it.
+ */
+static void _abort_stream() {
+	if (_multi) {
+		if (_active->op == SD_REQ_READ) {
+			sd_stop_transmission();
+		} else {
+			uint8_t stop_token = 0xFD;
+			spi_write_blocking(SPI_PORT, &stop_token, 1);
+			uint8_t skip;
+			spi_read_blocking(SPI_PORT, 0xFF, &skip, 1);
+		}
+		_wait_not_busy();
+	}
+	spi_bus_select(SPI_DEVICE_SD, false);
+}
+
+/**
+ * Begin sending the next block of a write: gap byte, start token, then the data by DMA.
+ */
+static void _send_block() {
+	uint8_t header[2] = { 0xFF, _multi ? 0xFC : 0xFE };
+	spi_write_blocking(SPI_PORT, header, 2);
+
+	sd_dma_start_write(_block_buffer(_active));
+	_state = SD_STATE_DATA;
+}
+
+static void _start(SdRequest_t* request);
+
+/**
+ * Retry the active request from the first block that has not completed yet, or
+ * fail it if it has run out of retries.
+ */
+static void _retry() {
+	_abort_stream();
+	_stats.crc_retries++;
+
+	if (++_active->retries > SD_QUEUE_RETRIES) {
+		_finish(SD_ERR_CRC);
+		return;
+	}
+
+	_start(_active);
+}
+
+/**
+ * Issue the command for the remaining blocks of `request` and move to the first waiting state.
+ * The SD bus transaction must already be open.
+ *
+ * @param request Request to (re)start, becomes the active request.
+ */
+static void _start(SdRequest_t* request) {
+	_active = request;
+	request->status = SD_REQ_ACTIVE;
+
+	uint32_t remaining = request->count - request->blocks_done;
+	_multi = remaining > 1;
+
+	uint8_t cmd;
+	if (request->op == SD_REQ_READ) {
+		// CMD17 == read single block, CMD18 == read multiple blocks
+		cmd = _multi ? 18 : 17;
+	} else {
+		// CMD24 == write single block, CMD25 == write multiple blocks
+		cmd = _multi ? 25 : 24;
+	}
+
+	uint8_t response = sd_send_cmd(cmd, request->sector + request->blocks_done);
+	if (response != 0x00) {
+		// R1 bit 3 is "command CRC error", worth another go
+		bool crc_error = response != 0xFF && (response & 0x08);
+		_multi = false;
+		if (crc_error) {
+			_retry();
+		} else {
+			_finish(SD_ERR_IO);
+		}
+		return;
+	}
+
+	if (request->op == SD_REQ_READ) {
+		_state = SD_STATE_TOKEN;
+		_wait_start_us = time_us_32();
+	} else {
+		_send_block();
+	}
+}
+
+/**
+ * Handle the end of a block DMA: check/send the CRC and decide what comes next.
+ */
+static void _block_done() {
+	uint16_t crc = sd_dma_crc();
+
+	if (_active->op == SD_REQ_READ) {
+		uint8_t received[2];
+		spi_read_blocking(SPI_PORT, 0xFF, received, 2);
+
+		if ((((uint16_t)received[0] << 8) | received[1]) != crc) {
+			_retry();
+			return;
+		}
+
+		_active->blocks_done++;
+		if (_active->blocks_done < _active->count) {
+			_state = SD_STATE_TOKEN;
+			_wait_start_us = time_us_32();
+			return;
+		}
+
+		if (!_multi) {
+			_finish(SD_OK);
+			return;
+		}
+
+		sd_stop_transmission();
+		_stopping = true;
+		_state = SD_STATE_BUSY;
+		_wait_start_us = time_us_32();
+		return;
+	}
+
+	// write: CRC follows the data, MSB first
+	uint8_t trailer[2] = { crc >> 8, crc & 0xFF };
+	spi_write_blocking(SPI_PORT, trailer, 2);
+
+	// data response token: xxx0sss1, 010 == accepted, 101 == CRC error
+	uint8_t response;
+	spi_read_blocking(SPI_PORT, 0xFF, &response, 1);
+	response &= 0x1F;
+	if (response != 0x05) {
+		if (response == 0x0B) {
+			_retry();
+		} else {
+			_abort_stream();
+			_finish(SD_ERR_IO);
+		}
+		return;
+	}
+
+	_active->blocks_done++;
+	_stopping = false;
+	if (_active->blocks_done == _active->count) {
+		if (_multi) {
+			// stop tran token, then one byte before busy is signalled
+			uint8_t stop[2] = { 0xFD, 0xFF };
+			spi_write_blocking(SPI_PORT, stop, 2);
+		}
+		_stopping = true;
+	}
+
+	_state = SD_STATE_BUSY;
+	_wait_start_us = time_us_32();
+}
+
+/**
+ * Advance the state machine by one bounded step.
+ *
+ * @returns `true` if progress was made and another step may be possible straight
+ *          away, `false` if the queue is waiting on the card or the DMA.
+ */
+static bool _step() {
+	switch (_state) {
+	case SD_STATE_IDLE: {
+		if (_head == NULL) return false;
+
+		// let a device waiting on the bus (e.g. an LCD band) go first,
+		// and never take the bus from under one mid-transfer
+		if (spi_bus_waiting() || !spi_bus_try_begin(SPI_DEVICE_SD)) return false;
+
+		uint32_t irq = save_and_disable_interrupts();
+		SdRequest_t* request = _head;
+		_head = request->next;
+		if (_head == NULL) _tail = NULL;
+		restore_interrupts(irq);
+
+		request->next = NULL;
+		_start(request);
+		return true;
+	}
+	case SD_STATE_TOKEN: {
+		for (int i = 0; i < SD_POLL_BYTES; i++) {
+			uint8_t token;
+			spi_read_blocking(SPI_PORT, 0xFF, &token, 1);
+			if (token == 0xFE) {
+				sd_dma_start_read(_block_buffer(_active));
+				_state = SD_STATE_DATA;
+				return true;
+			}
+			if (token != 0xFF) {
+				// data error token
+				_abort_stream();
+				_finish(SD_ERR_IO);
+				return true;
+			}
+		}
+		if (time_us_32() - _wait_start_us > SD_TOKEN_TIMEOUT_US) {
+			_abort_stream();
+			_finish(SD_ERR_IO);
+			return true;
+		}
+		return false;
+	}
+	case SD_STATE_DATA:
+		if (sd_dma_busy()) return false;
+		_block_done();
+		return true;
+	case SD_STATE_BUSY: {
+		for (int i = 0; i < SD_POLL_BYTES; i++) {
+			uint8_t response;
+			spi_read_blocking(SPI_PORT, 0xFF, &response, 1);
+			if (response == 0xFF) {
+				if (_stopping) {
+					_finish(SD_OK);
+				} else {
+					_send_block();
+				}
+				return true;
+			}
+		}
+		if (time_us_32() - _wait_start_us > SD_BUSY_TIMEOUT_US) {
+			spi_bus_select(SPI_DEVICE_SD, false);
+			_finish(SD_ERR_IO);
+			return true;
+		}
+		return false;
+	}
+	}
+
+	return false;
+}
+
+/**
+ * Run the state machine until it has to wait. A call arriving during a pass
+ * (the DMA interrupt while `sd_queue_poll` is mid-step, or a submit from a
+ * completion callback) only sets `_kick`, and the interrupted pass goes round
+ * again, so a completion landing after its last step isn't left waiting for
+ * the next poll.
+ */
+static void _run() {
+	if (_in_step) {
+		_kick = true;
+		return;
+	}
+	do {
+		_in_step = true;
+		_kick = false;
+		while (_step()) {}
+		_in_step = false;
+	} while (_kick);
+}
+
+static bool _has_work() {
+	return _head != NULL;
+}
+
+static void _dma_irq_handler() {
+	if (!sd_dma_acknowledge_irq()) return;
+	_run();
+}
+
+/**
+ * Initialize the SD request queue, hook block transfer completion to DMA_IRQ_0,
+ * and register the queue as the SPI bus yield hook.
+ *
+ * Must be called after a successful `sd_init`. From then on the queue owns the
+ * card, blocking calls such as `sd_read_sector` must not be mixed with queued requests.
+ */
+void sd_queue_init() {
+	_head = NULL;
+	_tail = NULL;
+	_active = NULL;
+	_state = SD_STATE_IDLE;
+	sd_queue_reset_stats();
+
+	irq_add_shared_handler(DMA_IRQ_0, _dma_irq_handler,
+		PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+	irq_set_enabled(DMA_IRQ_0, true);
+	sd_dma_set_irq_enabled(true);
+
+	// let long LCD flushes hand the bus over between bands
+	spi_bus_set_yield_hook(_has_work, sd_queue_poll);
+}
+
+/**
+ * Queue a read or write of `count` consecutive 512-byte sectors.
+ *
+ * The request structure is owned by the caller and must stay valid until its
+ * status reaches `SD_REQ_DONE`. The callback (if any) may run from the DMA
+ * interrupt, so it should be short and must not submit blocking work.
+ *
+ * @param request Caller-owned request storage; also serves as the handle to poll.
+ * @param op `SD_REQ_READ` or `SD_REQ_WRITE`.
+ * @param sector First block index (block-addressing, SDHC).
+ * @param count Number of sectors to transfer, at least 1.
+ * @param buffer Buffer of `count * SD_BLOCK_SIZE` bytes to read into or write from.
+ * @param callback Completion callback, or `NULL` to poll `request->status` instead.
+ * @param user Opaque pointer stored in the request for the callback.
+ * @returns `true` if the request was queued, `false` if the arguments were invalid or the request is still in flight.
+ */
+bool sd_queue_submit(SdRequest_t* request, uint8_t op, uint32_t sector, uint32_t count,
+		uint8_t* buffer, SdCallback_t callback, void* user) {
+	if (request == NULL || buffer == NULL || count == 0) return false;
+	if (request->status == SD_REQ_PENDING || request->status == SD_REQ_ACTIVE) return false;
+
+	request->next = NULL;
+	request->submitted_us = time_us_32();
+	request->blocks_done = 0;
+	request->retries = 0;
+	request->op = op;
+	request->sector = sector;
+	request->count = count;
+	request->buffer = buffer;
+	request->callback = callback;
+	request->user = user;
+	request->result = SD_OK;
+	request->latency_us = 0;
+	request->status = SD_REQ_PENDING;
+
+	uint32_t irq = save_and_disable_interrupts();
+	if (_tail == NULL) {
+		_head = request;
+	} else {
+		_tail->next = request;
+	}
+	_tail = request;
+
+	_stats.depth++;
+	TRACE_COUNTER("sd_queue depth", _stats.depth);
+	if (_stats.depth > _stats.max_depth) {
+		_stats.max_depth = _stats.depth;
+	}
+	restore_interrupts(irq);
+
+	// start straight away if the card is idle
+	_run();
+
+	return true;
+}
+
+/**
+ * Give the request queue a chance to make progress without blocking.
+ *
+ * Call this regularly (e.g. once per main loop iteration); waits on the card
+ * (start token, write busy) are polled a few bytes at a time here, while the
+ * end of each block's DMA moves the request on from the interrupt (or, if it
+ * came during a poll, from that poll).
+ */
+void sd_queue_poll() {
+	_run();
+}
+
+/**
+ * Check whether the queue has nothing pending or in flight.
+ *
+ * @returns `true` if no request is queued or active.
+ */
+bool sd_queue_idle() {
+	return _active == NULL && _head == NULL;
+}
+
+/**
+ * Block until a submitted request completes, polling the queue meanwhile.
+ *
+ * @param request Request previously passed to `sd_queue_submit`.
+ * @returns The request's result, `SD_OK` or one of the `SD_ERR_*` codes.
+ */
+int sd_queue_wait(SdRequest_t* request) {
+	while (request->status != SD_REQ_DONE) {
+		sd_queue_poll();
+		tight_loop_contents();
+	}
+	return request->result;
+}
+
+/**
+ * Get the queue statistics (depth, completions, latency histogram).
+ *
+ * @returns Pointer to the live statistics, valid for the lifetime of the program.
+ */
+const SdQueueStats_t* sd_queue_stats() {
+	return &_stats;
+}
+
+/**
+ * Reset all counters and the latency histogram. The current depth is preserved.
+ */
+void sd_queue_reset_stats() {
+	uint32_t depth = _stats.depth;
+	_stats = (SdQueueStats_t){ 0 };
+	_stats.depth = depth;
+	_stats.max_depth = depth;
+}
+
+/**
+ * Print the queue statistics and latency histogram over stdio.
+ */
+void sd_queue_dump_stats() {
+	printf("sd queue: depth %lu (max %lu), completed %lu, failed %lu, crc retries %lu\n",
+		(unsigned long)_stats.depth, (unsigned long)_stats.max_depth,
+		(unsigned long)_stats.completed, (unsigned long)_stats.failed,
+		(unsigned long)_stats.crc_retries);
+
+	for (int i = 0; i < SD_QUEUE_LATENCY_BUCKETS; i++) {
+		if (_stats.latency_histogram[i] == 0) continue;
+		printf("  %7lu us+ : %lu\n", 1ul << i, (unsigned long)_stats.latency_histogram[i]);
+	}
+}
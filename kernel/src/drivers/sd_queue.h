@@ -0,0 +1,65 @@
+#ifndef KERNEL_SD_QUEUE_H
+#define KERNEL_SD_QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sd_card.h"
+
+#define SD_QUEUE_LATENCY_BUCKETS 16
+
+// request operations
+#define SD_REQ_READ  0
+#define SD_REQ_WRITE 1
+
+// request status
+#define SD_REQ_IDLE    0
+#define SD_REQ_PENDING 1
+#define SD_REQ_ACTIVE  2
+#define SD_REQ_DONE    3
+
+struct SdRequest;
+typedef void (*SdCallback_t)(struct SdRequest* request);
+
+typedef struct SdRequest {
+	// owned by the queue while the request is in flight
+	struct SdRequest* next;
+	uint32_t submitted_us;
+	uint32_t blocks_done;
+	uint8_t retries;
+
+	uint8_t op;
+	uint32_t sector;
+	uint32_t count;
+	uint8_t* buffer;
+	SdCallback_t callback;
+	void* user;
+
+	volatile uint8_t status;
+	int8_t result;
+	uint32_t latency_us;
+} SdRequest_t;
+
+typedef struct SdQueueStats {
+	uint32_t depth;
+	uint32_t max_depth;
+	uint32_t completed;
+	uint32_t failed;
+	uint32_t crc_retries;
+	// bucket i counts requests with latency in [2^i, 2^(i+1)) us,
+	// the last bucket also takes everything slower
+	uint32_t latency_histogram[SD_QUEUE_LATENCY_BUCKETS];
+} SdQueueStats_t;
+
+void sd_queue_init();
+bool sd_queue_submit(SdRequest_t* request, uint8_t op, uint32_t sector, uint32_t count,
+	uint8_t* buffer, SdCallback_t callback, void* user);
+void sd_queue_poll();
+bool sd_queue_idle();
+int sd_queue_wait(SdRequest_t* request);
+
+const SdQueueStats_t* sd_queue_stats();
+void sd_queue_reset_stats();
+void sd_queue_dump_stats();
+
+#endif
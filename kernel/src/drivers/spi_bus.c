@@ -0,0 +1,302 @@
+#include "spi_bus.h"
+
+#include "hardware/sync.h"
+
+typedef struct SpiDevice {
+	uint cs_pin;
+	uint baudrate;
+	spi_cpol_t cpol;
+	spi_cpha_t cpha;
+} SpiDevice_t;
+
+static SpiDevice_t _devices[SPI_DEVICE_COUNT] = {
+	[SPI_DEVICE_NONE] = { 0, 0, SPI_CPOL_0, SPI_CPHA_0 },
+	[SPI_DEVICE_LCD]  = { PIN_CS, DEFAULT_MHZ, SPI_CPOL_0, SPI_CPHA_0 },
+	[SPI_DEVICE_SD]   = { PIN_SDCS, SD_MHZ, SPI_CPOL_0, SPI_CPHA_0 },
+};
+
+// what the peripheral is currently programmed with
+static uint _current_baudrate = 0;
+static spi_cpol_t _current_cpol = SPI_CPOL_0;
+static spi_cpha_t _current_cpha = SPI_CPHA_0;
+
+static volatile uint8_t _owner = SPI_DEVICE_NONE;
+static uint8_t _depth = 0;
+static volatile uint8_t _waiting = SPI_DEVICE_NONE;
+static volatile bool _exclusive = false; // a transfer running on its own, see spi_bus_try_begin_exclusive
+static SpiBusService_t _finish = NULL;   // moves that transfer along
+
+static SpiBusPending_t _pending = NULL;
+static SpiBusService_t _service = NULL;
+
+static SpiBusStats_t _stats;
+
+/**
+ * Program the SPI clock and format for `device`, skipping whatever already matches.
+ *
+ * @param device Device about to use the bus.
+ */
+static void _configure(uint8_t device) {
+	SpiDevice_t* config = &_devices[device];
+
+	if (config->baudrate != _current_baudrate) {
+		spi_set_baudrate(SPI_PORT, config->baudrate);
+		_current_baudrate = config->baudrate;
+		_stats.reconfigurations++;
+	}
+
+	if (config->cpol != _current_cpol || config->cpha != _current_cpha) {
+		spi_set_format(SPI_PORT, 8, config->cpol, config->cpha, SPI_MSB_FIRST);
+		_current_cpol = config->cpol;
+		_current_cpha = config->cpha;
+		_stats.reconfigurations++;
+	}
+}
+
+/**
+ * Try to take ownership of the bus without waiting.
+ *
+ * @param device Device wanting the bus.
+ * @param exclusive Only if it's free, and keep everyone else out (even
+ *        `device`) until the transaction ends.
+ * @returns `true` if `device` now owns the bus (or already did).
+ */
+static bool _acquire(uint8_t device, bool exclusive) {
+	uint32_t irq = save_and_disable_interrupts();
+	bool acquired = !_exclusive && (_owner == SPI_DEVICE_NONE || (_owner == device && !exclusive));
+	if (acquired) {
+		_owner = device;
+		_exclusive = exclusive;
+	}
+	restore_interrupts(irq);
+	return acquired;
+}
+
+/**
+ * Take ownership of the bus, waiting for the current owner to release it.
+ * The yield hook's service function, and the finish function of a transfer
+ * that has the bus to itself, are run while waiting so the owner (e.g. the
+ * SD request queue) can make progress.
+ *
+ * @param device Device wanting the bus.
+ */
+static void _wait_acquire(uint8_t device) {
+	if (_acquire(device, false)) return;
+
+	_stats.contended++;
+	_waiting = device;
+	while (!_acquire(device, false)) {
+		SpiBusService_t finish = _finish;
+		if (_exclusive && finish != NULL) finish();
+		if (_service != NULL) _service();
+		tight_loop_contents();
+	}
+	_waiting = SPI_DEVICE_NONE;
+}
+
+/**
+ * Open (or nest) a transaction on a bus `device` already owns.
+ *
+ * @param device Owning device.
+ */
+static void _open(uint8_t device) {
+	if (_depth++ == 0) {
+		_stats.transactions++;
+		_configure(device);
+		gpio_put(_devices[device].cs_pin, 0);
+	}
+}
+
+/**
+ * Initialize the shared SPI peripheral, its pins, and every device's chip select (deasserted).
+ */
+void spi_bus_init() {
+	spi_init(SPI_PORT, DEFAULT_MHZ);
+	_current_baudrate = DEFAULT_MHZ;
+	_current_cpol = SPI_CPOL_0;
+	_current_cpha = SPI_CPHA_0;
+
+	gpio_set_function(PIN_SCK, GPIO_FUNC_SPI);
+	gpio_set_function(PIN_MOSI, GPIO_FUNC_SPI);
+	gpio_set_function(PIN_MISO, GPIO_FUNC_SPI);
+
+	for (uint8_t device = SPI_DEVICE_NONE + 1; device < SPI_DEVICE_COUNT; device++) {
+		pin_init(_devices[device].cs_pin);
+	}
+
+	_owner = SPI_DEVICE_NONE;
+	_depth = 0;
+	_waiting = SPI_DEVICE_NONE;
+	_exclusive = false;
+	_finish = NULL;
+	_stats = (SpiBusStats_t){ 0 };
+}
+
+/**
+ * Set the SPI clock a device should be driven at.
+ *
+ * Takes effect at the device's next transaction, or immediately if it
+ * currently owns the bus (e.g. the SD card switching from 400 kHz init to full speed).
+ *
+ * @param device Device to configure.
+ * @param baudrate Requested clock in Hz.
+ */
+void spi_bus_set_baudrate(uint8_t device, uint baudrate) {
+	_devices[device].baudrate = baudrate;
+	if (_owner == device) {
+		_configure(device);
+	}
+}
+
+/**
+ * Start (or nest) a transaction for `device`: take the bus, waiting for any
+ * other device to finish, apply its clock/format if they differ from the
+ * current ones, and assert its chip select.
+ *
+ * While waiting, the yield hook's service function is run so the current owner
+ * (e.g. the SD request queue) can make progress and release the bus.
+ *
+ * Transactions nest, so back-to-back operations for the same device inside an
+ * outer transaction cost nothing beyond a counter.
+ *
+ * @param device Device starting the transaction.
+ */
+void spi_bus_begin(uint8_t device) {
+	_wait_acquire(device);
+	_open(device);
+}
+
+/**
+ * Start a transaction for `device` only if the bus is free right now.
+ * Safe to call from interrupt handlers.
+ *
+ * @param device Device starting the transaction.
+ * @returns `true` if the transaction was started, `false` if another device owns the bus.
+ */
+bool spi_bus_try_begin(uint8_t device) {
+	if (!_acquire(device, false)) return false;
+
+	_open(device);
+	return true;
+}
+
+/**
+ * Start a transaction for a transfer that runs on its own (a DMA to the
+ * device), only if the bus is free right now. Until its spi_bus_end nothing
+ * else gets the bus, not even another transaction of `device` that would
+ * otherwise nest into it and write alongside the DMA: spi_bus_begin waits
+ * for it, running `finish` meanwhile so the transfer can be completed and
+ * ended. Like the rest of the bus, only from one core.
+ *
+ * @param device Device starting the transaction.
+ * @param finish Ends the transaction once the transfer is done, if it is.
+ * @returns `true` if the transaction was started, `false` if the bus is in use.
+ */
+bool spi_bus_try_begin_exclusive(uint8_t device, SpiBusService_t finish) {
+	if (!_acquire(device, true)) return false;
+
+	_finish = finish;
+	_open(device);
+	return true;
+}
+
+/**
+ * End (or un-nest) a transaction for `device`. The outermost end deasserts
+ * chip select and releases the bus; the clock is left as-is so the next
+ * transaction for the same device does not reprogram it.
+ *
+ * @param device Device ending its transaction; must be the current owner.
+ */
+void spi_bus_end(uint8_t device) {
+	if (_owner != device || _depth == 0) return;
+
+	if (--_depth == 0) {
+		gpio_put(_devices[device].cs_pin, 1);
+		_exclusive = false;
+		_owner = SPI_DEVICE_NONE;
+	}
+}
+
+/**
+ * Drive the chip select of the device owning the bus by hand, for protocols
+ * that need it toggled between commands inside one transaction (SD framing,
+ * dummy clocks with the card deselected).
+ *
+ * @param device Owning device.
+ * @param selected `true` to assert (drive low), `false` to deassert.
+ */
+void spi_bus_select(uint8_t device, bool selected) {
+	if (_owner != device) return;
+	gpio_put(_devices[device].cs_pin, selected ? 0 : 1);
+}
+
+/**
+ * Offer the bus to other devices between batches of a long transfer (e.g. in
+ * between LCD bands), so queued SD work can interleave with display flushes.
+ *
+ * Only yields from the outermost transaction and only when the yield hook
+ * reports pending work; otherwise this is just a check.
+ *
+ * @param device Device currently owning the bus.
+ * @returns `true` if the bus was actually handed over (the caller's chip
+ *          select was released and reasserted, so it may need to resume its
+ *          operation), `false` if nothing happened.
+ */
+bool spi_bus_yield(uint8_t device) {
+	if (_owner != device || _depth != 1) return false;
+	if (_pending == NULL || !_pending()) return false;
+
+	gpio_put(_devices[device].cs_pin, 1);
+	_depth = 0;
+	_owner = SPI_DEVICE_NONE;
+
+	_stats.yields++;
+	_service();
+
+	// waits for the other device to release the bus, servicing it meanwhile
+	_wait_acquire(device);
+	_depth = 1;
+	_configure(device);
+	gpio_put(_devices[device].cs_pin, 0);
+
+	return true;
+}
+
+/**
+ * Check whether some device is blocked in `spi_bus_begin` waiting for the bus,
+ * so the owner can avoid starting new work.
+ *
+ * @returns `true` if another device is waiting.
+ */
+bool spi_bus_waiting() {
+	return _waiting != SPI_DEVICE_NONE;
+}
+
+/**
+ * Get the device that currently owns the bus.
+ *
+ * @returns `SPI_DEVICE_*` id, `SPI_DEVICE_NONE` if the bus is free.
+ */
+uint8_t spi_bus_owner() {
+	return _owner;
+}
+
+/**
+ * Register the functions used to arbitrate with background bus users.
+ *
+ * @param pending Returns `true` if there is work that wants the bus.
+ * @param service Makes non-blocking progress on that work (may take and release the bus).
+ */
+void spi_bus_set_yield_hook(SpiBusPending_t pending, SpiBusService_t service) {
+	_pending = pending;
+	_service = service;
+}
+
+/**
+ * Get the bus statistics (transactions, reconfigurations, yields, contention).
+ *
+ * @returns Pointer to the live statistics.
+ */
+const SpiBusStats_t* spi_bus_stats() {
+	return &_stats;
+}
@@ -0,0 +1,39 @@
+#ifndef KERNEL_SPI_BUS_H
+#define KERNEL_SPI_BUS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pins.h"
+
+// devices sharing SPI_PORT
+#define SPI_DEVICE_NONE  0
+#define SPI_DEVICE_LCD   1
+#define SPI_DEVICE_SD    2
+#define SPI_DEVICE_COUNT 3
+
+typedef bool (*SpiBusPending_t)();
+typedef void (*SpiBusService_t)();
+
+typedef struct SpiBusStats {
+	uint32_t transactions;     // outermost begin/end pairs
+	uint32_t reconfigurations; // clock or format actually reprogrammed
+	uint32_t yields;           // bands handed over to another device
+	uint32_t contended;        // begins that had to wait for another device
+} SpiBusStats_t;
+
+void spi_bus_init();
+void spi_bus_set_baudrate(uint8_t device, uint baudrate);
+void spi_bus_begin(uint8_t device);
+bool spi_bus_try_begin(uint8_t device);
+bool spi_bus_try_begin_exclusive(uint8_t device, SpiBusService_t finish);
+void spi_bus_end(uint8_t device);
+void spi_bus_select(uint8_t device, bool selected);
+bool spi_bus_yield(uint8_t device);
+bool spi_bus_waiting();
+uint8_t spi_bus_owner();
+void spi_bus_set_yield_hook(SpiBusPending_t pending, SpiBusService_t service);
+
+const SpiBusStats_t* spi_bus_stats();
+
+#endif
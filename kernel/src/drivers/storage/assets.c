@@ -0,0 +1,195 @@
+#include "assets.h"
+
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/regs/addressmap.h"
+
+// XIP cache lines are 8 bytes, touching one word per line pulls it in
+#define ASSET_CACHE_LINE 8
+
+#ifdef ASSET_PACK_FILE
+// from asset_pack.S
+extern const uint8_t __asset_pack_start[];
+#endif
+
+static const uint8_t* _pack = NULL;
+static const AssetPackHeader_t* _header = NULL;
+static const AssetEntry_t* _index = NULL;
+static const char* _names = NULL;
+
+static uint32_t _fnv1a(const void* data, size_t length) {
+	const uint8_t* bytes = data;
+	uint32_t hash = 0x811C9DC5;
+
+	for (size_t i = 0; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= 0x01000193;
+	}
+
+	return hash;
+}
+
+static void _fill(const AssetEntry_t* entry, Asset_t* asset) {
+	asset->data = _pack + entry->offset;
+	asset->size = entry->size;
+	asset->width = entry->width;
+	asset->height = entry->height;
+	asset->type = entry->type;
+	asset->flags = entry->flags;
+}
+
+/**
+ * Mount the asset pack, linked into the firmware if one was built in,
+ * otherwise the one flashed at `ASSET_PACK_FLASH_OFFSET`.
+ *
+ * @returns `true` if a valid pack was found.
+ */
+bool assets_init() {
+#ifdef ASSET_PACK_FILE
+	return assets_mount(__asset_pack_start);
+#else
+	return assets_mount((const void*)(XIP_BASE + ASSET_PACK_FLASH_OFFSET));
+#endif
+}
+
+/**
+ * Mount an asset pack in place (normally in XIP flash, nothing is copied).
+ *
+ * Checks the header and index checksum, then warms assets flagged hot into the
+ * XIP cache, up to `ASSET_PREFETCH_BUDGET` bytes.
+ *
+ * @param pack Start of the pack, must be 4-byte aligned.
+ * @returns `true` if the pack is valid, otherwise nothing is mounted.
+ */
+bool assets_mount(const void* pack) {
+	const AssetPackHeader_t* header = pack;
+	_pack = NULL;
+
+	if (header->magic != ASSET_MAGIC || header->version != ASSET_VERSION) return false;
+	if (header->index_offset + header->count * sizeof(AssetEntry_t) > header->names_offset) return false;
+	if (header->names_offset > header->data_offset || header->data_offset > header->total_size) return false;
+
+	const uint8_t* bytes = pack;
+	uint32_t checksum = _fnv1a(bytes + header->index_offset, header->data_offset - header->index_offset);
+	if (checksum != header->checksum) return false;
+
+	_pack = bytes;
+	_header = header;
+	_index = (const AssetEntry_t*)(bytes + header->index_offset);
+	_names = (const char*)(bytes + header->names_offset);
+
+	uint32_t budget = ASSET_PREFETCH_BUDGET;
+	for (uint16_t i = 0; i < header->count; i++) {
+		if (!(_index[i].flags & ASSET_FLAG_HOT) || _index[i].size > budget) continue;
+
+		Asset_t asset;
+		_fill(&_index[i], &asset);
+		assets_prefetch(&asset);
+		budget -= _index[i].size;
+	}
+
+	return true;
+}
+
+/**
+ * Check whether an asset pack is mounted.
+ *
+ * @returns `true` if `assets_mount` found a valid pack.
+ */
+bool assets_mounted() {
+	return _pack != NULL;
+}
+
+/**
+ * Look up an asset by name, binary searching the hash-sorted index.
+ *
+ * @param name Asset name as given in the manifest.
+ * @param asset Filled with a view of the asset in place.
+ * @returns `true` if found.
+ */
+bool assets_find(const char* name, Asset_t* asset) {
+	if (_pack == NULL) return false;
+
+	uint32_t hash = _fnv1a(name, strlen(name));
+
+	// first entry with this hash
+	uint32_t low = 0;
+	uint32_t high = _header->count;
+	while (low < high) {
+		uint32_t middle = (low + high) / 2;
+		if (_index[middle].hash < hash) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	// collisions sit next to each other
+	for (uint32_t i = low; i < _header->count && _index[i].hash == hash; i++) {
+		if (strcmp(_names + _index[i].name, name) == 0) {
+			_fill(&_index[i], asset);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Shorthand for `assets_find` when only the bytes are needed.
+ *
+ * @param name Asset name.
+ * @param size Set to the asset size if not `NULL`.
+ * @returns Pointer to the asset in place, or `NULL` if not found.
+ */
+const void* assets_data(const char* name, uint32_t* size) {
+	Asset_t asset;
+	if (!assets_find(name, &asset)) return NULL;
+
+	if (size != NULL) *size = asset.size;
+	return asset.data;
+}
+
+/**
+ * Get the number of assets in the mounted pack.
+ *
+ * @returns Asset count, 0 if no pack is mounted.
+ */
+uint16_t assets_count() {
+	return _pack != NULL ? _header->count : 0;
+}
+
+/**
+ * Get the name of an asset by its position in the index, for listing the
+ * pack (the order is the index's, by name hash).
+ *
+ * @param index 0 to `assets_count() - 1`.
+ * @returns The asset name, or `NULL` if `index` is out of range or no pack
+ *          is mounted.
+ */
+const char* assets_name_at(uint16_t index) {
+	if (index >= assets_count()) return NULL;
+	return _names + _index[index].name;
+}
+
+/**
+ * Warm an asset into the XIP cache ahead of time-critical drawing.
+ *
+ * Only a hint: the read happens now instead of in the middle of a frame, but
+ * later flash accesses may evict it again. Assets outside the cached XIP
+ * window (e.g. a pack mounted from RAM) are left alone.
+ *
+ * @param asset Asset from `assets_find`.
+ */
+void assets_prefetch(const Asset_t* asset) {
+	uintptr_t start = (uintptr_t)asset->data;
+	if (start < XIP_BASE || start >= XIP_BASE + PICO_FLASH_SIZE_BYTES) return;
+
+	const volatile uint32_t* word = (const volatile uint32_t*)(start & ~(uintptr_t)(ASSET_CACHE_LINE - 1));
+	const volatile uint32_t* end = (const volatile uint32_t*)(start + asset->size);
+
+	for (; word < end; word += ASSET_CACHE_LINE / sizeof(uint32_t)) {
+		(void)*word;
+	}
+}
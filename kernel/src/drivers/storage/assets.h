@@ -0,0 +1,73 @@
+#ifndef KERNEL_STORAGE_ASSETS_H
+#define KERNEL_STORAGE_ASSETS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// pack built by tools/mkassets.py, either linked into the firmware
+// (ASSET_PACK_FILE) or flashed on its own at this offset into flash
+#ifndef ASSET_PACK_FLASH_OFFSET
+#define ASSET_PACK_FLASH_OFFSET 0x200000
+#endif
+
+#define ASSET_MAGIC   0x4B505341 // "ASPK"
+#define ASSET_VERSION 1
+#define ASSET_ALIGN   32         // every blob starts on this boundary
+
+// asset types
+#define ASSET_RAW     0
+#define ASSET_SPRITE  1 // RGB565, high byte first (LCD order), width x height
+#define ASSET_PALETTE 2 // native uint16_t RGB565, width entries
+#define ASSET_FONT    3 // 1bpp glyphs, width x height cell
+
+// asset flags
+#define ASSET_FLAG_HOT 0x01 // warmed into the XIP cache at mount
+
+#define ASSET_PREFETCH_BUDGET 8192 // hot bytes warmed at mount, half the XIP cache
+
+typedef struct AssetPackHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t count;
+	uint32_t index_offset;
+	uint32_t names_offset;
+	uint32_t data_offset;
+	uint32_t total_size;
+	uint32_t checksum; // FNV-1a from the index up to the first blob
+	uint32_t reserved;
+} AssetPackHeader_t;
+
+typedef struct AssetEntry {
+	uint32_t hash;   // FNV-1a of the name, index is sorted by (hash, name)
+	uint32_t offset; // from the start of the pack
+	uint32_t size;
+	uint16_t width;
+	uint16_t height;
+	uint16_t name;   // offset into the name table
+	uint8_t type;
+	uint8_t flags;
+} AssetEntry_t;
+
+// view of an asset in place in flash
+typedef struct Asset {
+	const void* data;
+	uint32_t size;
+	uint16_t width;
+	uint16_t height;
+	uint8_t type;
+	uint8_t flags;
+} Asset_t;
+
+bool assets_init();
+bool assets_mount(const void* pack);
+bool assets_mounted();
+
+bool assets_find(const char* name, Asset_t* asset);
+const void* assets_data(const char* name, uint32_t* size);
+uint16_t assets_count();
+const char* assets_name_at(uint16_t index);
+
+void assets_prefetch(const Asset_t* asset);
+
+#endif
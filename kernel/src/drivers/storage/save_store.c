@@ -0,0 +1,733 @@
+#include "save_store.h"
+
+#include <string.h>
+#include <stdalign.h>
+
+#include "../sd_queue.h"
+
+#define SAVE_MAGIC          0x5653504D // "MPSV"
+#define SAVE_BATCH_SEALED   0x01       // compaction finished, the older segment is dead
+#define SAVE_RECORD_DELETED 0x01
+
+#define SAVE_SEGMENT_SECTORS (SAVE_STORE_SECTORS / 2)
+#define SAVE_BATCH_BYTES     (SAVE_BATCH_SECTORS * SD_BLOCK_SIZE)
+
+/*
+ * On-card layout
+ *
+ * The region is two segments. Each is a log of batches; a batch is one
+ * multi-block write of whole sectors: a header, then packed records, zero
+ * padded to the sector boundary. Every batch in a segment carries the
+ * segment's generation and a sequence number one higher than the batch
+ * before it, and a CRC32 over header + records. Recovery replays batches
+ * until the first one that fails any of those checks, which is exactly where
+ * a torn (power-cut) write ends the log.
+ *
+ * Compaction copies the live records of the current segment into the other
+ * one under generation + 1, with normal commits also going there, then
+ * appends a sealed batch. An unsealed newer segment means compaction was cut
+ * short, so the older segment is replayed first and the newer on top of it.
+ */
+
+typedef struct SaveBatchHeader {
+	uint32_t magic;
+	uint32_t generation;
+	uint32_t sequence;
+	uint32_t flags;
+	uint16_t sectors;
+	uint16_t records;
+	uint32_t payload_bytes;
+	uint32_t crc;
+	uint32_t reserved;
+} SaveBatchHeader_t;
+
+typedef struct SaveRecord {
+	uint8_t key_length;
+	uint8_t flags;
+	uint16_t value_length;
+	// followed by the key, then the value, padded to 4 bytes
+} SaveRecord_t;
+
+typedef struct SaveIndexEntry {
+	uint32_t hash;
+	uint32_t sector; // absolute first sector of the batch holding the newest record
+	uint16_t offset; // byte offset of the value from the start of that batch
+	uint16_t length;
+	char key[SAVE_KEY_MAX + 1];
+} SaveIndexEntry_t;
+
+typedef struct SaveBatch {
+	alignas(4) uint8_t data[SAVE_BATCH_BYTES];
+	uint32_t used; // bytes including the header
+	uint16_t records;
+	uint16_t new_keys;
+} SaveBatch_t;
+
+typedef struct SaveSegmentScan {
+	bool valid;
+	bool sealed;
+	uint32_t generation;
+	uint32_t last_sequence;
+	uint32_t end; // first free sector (relative to the segment)
+	uint32_t batches;
+} SaveSegmentScan_t;
+
+static bool _mounted = false;
+
+static SaveIndexEntry_t _index[SAVE_STORE_MAX_KEYS];
+static uint32_t _keys = 0;
+
+static uint32_t _write_segment = 0;
+static uint32_t _write_pos = 0;
+static uint32_t _generation = 0;
+static uint32_t _sequence = 0;
+
+static bool _compacting = false;
+static uint32_t _source_segment = 0;
+
+static SaveBatch_t _pending; // staged by put/delete, written by commit
+static SaveBatch_t _copy;    // compaction copies
+static alignas(4) uint8_t _sector[SD_BLOCK_SIZE];
+
+static uint32_t _commits = 0;
+static uint32_t _compactions = 0;
+static uint32_t _recovered = 0;
+
+static const uint32_t _crc32_nibbles[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+	0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+	0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+static uint32_t _crc32(uint32_t crc, const uint8_t* data, uint32_t length) {
+	crc = ~crc;
+	for (uint32_t i = 0; i < length; i++) {
+		crc ^= data[i];
+		crc = (crc >> 4) ^ _crc32_nibbles[crc & 0x0F];
+		crc = (crc >> 4) ^ _crc32_nibbles[crc & 0x0F];
+	}
+	return ~crc;
+}
+
+// FNV-1a, only used to skip most string compares in the index
+static uint32_t _hash(const char* key) {
+	uint32_t hash = 0x811C9DC5;
+	while (*key) {
+		hash = (hash ^ (uint8_t)*key++) * 0x01000193;
+	}
+	return hash;
+}
+
+static uint32_t _align4(uint32_t value) {
+	return (value + 3) & ~3u;
+}
+
+static uint32_t _segment_start(uint32_t segment) {
+	return SAVE_STORE_FIRST_SECTOR + segment * SAVE_SEGMENT_SECTORS;
+}
+
+static bool _in_segment(uint32_t sector, uint32_t segment) {
+	uint32_t start = _segment_start(segment);
+	return sector >= start && sector < start + SAVE_SEGMENT_SECTORS;
+}
+
+static bool _valid_key(const char* key) {
+	if (key == NULL) return false;
+	size_t length = strlen(key);
+	return length > 0 && length <= SAVE_KEY_MAX;
+}
+
+/**
+ * Synchronously transfer whole sectors through the SD request queue.
+ *
+ * @returns `SAVE_OK` or `SAVE_ERR_IO`.
+ */
+static int _io(uint8_t op, uint32_t sector, uint32_t count, uint8_t* buffer) {
+	SdRequest_t request = { 0 };
+	if (!sd_queue_submit(&request, op, sector, count, buffer, NULL, NULL)) return SAVE_ERR_IO;
+	return sd_queue_wait(&request) == SD_OK ? SAVE_OK : SAVE_ERR_IO;
+}
+
+static int _index_find(const char* key, uint32_t hash) {
+	for (uint32_t i = 0; i < _keys; i++) {
+		if (_index[i].hash == hash && strcmp(_index[i].key, key) == 0) return (int)i;
+	}
+	return -1;
+}
+
+static void _index_set(const char* key, uint32_t sector, uint16_t offset, uint16_t length) {
+	uint32_t hash = _hash(key);
+	int i = _index_find(key, hash);
+	if (i < 0) {
+		// put() refuses new keys once the index is full, so this only
+		// happens with a store written by a build with a larger index
+		if (_keys == SAVE_STORE_MAX_KEYS) return;
+		i = (int)_keys++;
+		_index[i].hash = hash;
+		strcpy(_index[i].key, key);
+	}
+	_index[i].sector = sector;
+	_index[i].offset = offset;
+	_index[i].length = length;
+}
+
+static void _index_remove(const char* key) {
+	int i = _index_find(key, _hash(key));
+	if (i < 0) return;
+	_index[i] = _index[--_keys];
+}
+
+static void _batch_reset(SaveBatch_t* batch) {
+	batch->used = sizeof(SaveBatchHeader_t);
+	batch->records = 0;
+	batch->new_keys = 0;
+}
+
+/**
+ * Walk the records of a batch, calling `visit` for each with the key copied
+ * out as a C string.
+ */
+typedef void (*SaveRecordVisitor_t)(const SaveRecord_t* record, const char* key,
+	uint16_t value_offset, void* context);
+
+static void _batch_foreach(const uint8_t* data, uint16_t records, SaveRecordVisitor_t visit, void* context) {
+	uint32_t offset = sizeof(SaveBatchHeader_t);
+	for (uint16_t i = 0; i < records; i++) {
+		const SaveRecord_t* record = (const SaveRecord_t*)(data + offset);
+		char key[SAVE_KEY_MAX + 1];
+		memcpy(key, data + offset + sizeof(SaveRecord_t), record->key_length);
+		key[record->key_length] = '\0';
+
+		uint16_t value_offset = offset + sizeof(SaveRecord_t) + record->key_length;
+		visit(record, key, value_offset, context);
+
+		offset = _align4(value_offset + record->value_length);
+	}
+}
+
+/**
+ * Append a record to a batch being built.
+ *
+ * @returns `SAVE_OK`, `SAVE_ERR_TOO_BIG` if it could never fit in a batch, or
+ *          `SAVE_ERR_FULL` if it does not fit in what is left of this one.
+ */
+static int _batch_append(SaveBatch_t* batch, const char* key, uint8_t flags,
+		const void* value, uint16_t length) {
+	uint32_t key_length = strlen(key);
+	uint32_t size = _align4(sizeof(SaveRecord_t) + key_length + length);
+
+	if (sizeof(SaveBatchHeader_t) + size > SAVE_BATCH_BYTES) return SAVE_ERR_TOO_BIG;
+	if (batch->used + size > SAVE_BATCH_BYTES) return SAVE_ERR_FULL;
+
+	SaveRecord_t* record = (SaveRecord_t*)(batch->data + batch->used);
+	record->key_length = (uint8_t)key_length;
+	record->flags = flags;
+	record->value_length = length;
+
+	uint8_t* out = batch->data + batch->used + sizeof(SaveRecord_t);
+	memcpy(out, key, key_length);
+	if (length > 0) memcpy(out + key_length, value, length);
+	memset(out + key_length + length, 0, size - sizeof(SaveRecord_t) - key_length - length);
+
+	batch->used += size;
+	batch->records++;
+	return SAVE_OK;
+}
+
+static void _apply_record(const SaveRecord_t* record, const char* key, uint16_t value_offset, void* context) {
+	uint32_t sector = *(const uint32_t*)context;
+	if (record->flags & SAVE_RECORD_DELETED) {
+		_index_remove(key);
+	} else {
+		_index_set(key, sector, value_offset, record->value_length);
+	}
+}
+
+/**
+ * Write a batch at the append position of the write segment in a single
+ * multi-block write, then point the index at its records.
+ *
+ * @returns `SAVE_OK`, `SAVE_ERR_FULL` if the segment has no room, or `SAVE_ERR_IO`.
+ */
+static int _batch_write(SaveBatch_t* batch, uint32_t flags) {
+	uint32_t sectors = (batch->used + SD_BLOCK_SIZE - 1) / SD_BLOCK_SIZE;
+	if (_write_pos + sectors > SAVE_SEGMENT_SECTORS) return SAVE_ERR_FULL;
+
+	memset(batch->data + batch->used, 0, sectors * SD_BLOCK_SIZE - batch->used);
+
+	SaveBatchHeader_t* header = (SaveBatchHeader_t*)batch->data;
+	header->magic = SAVE_MAGIC;
+	header->generation = _generation;
+	header->sequence = _sequence + 1;
+	header->flags = flags;
+	header->sectors = (uint16_t)sectors;
+	header->records = batch->records;
+	header->payload_bytes = batch->used - sizeof(SaveBatchHeader_t);
+	header->reserved = 0;
+	header->crc = 0;
+	header->crc = _crc32(0, batch->data, batch->used);
+
+	uint32_t sector = _segment_start(_write_segment) + _write_pos;
+	int result = _io(SD_REQ_WRITE, sector, sectors, batch->data);
+	if (result != SAVE_OK) return result;
+
+	_write_pos += sectors;
+	_sequence++;
+
+	_batch_foreach(batch->data, batch->records, _apply_record, &sector);
+	_batch_reset(batch);
+
+	return SAVE_OK;
+}
+
+/**
+ * Read and validate the batch at `pos` of `segment` into `batch->data`.
+ *
+ * @returns `true` if a complete batch with a good CRC was read.
+ */
+static bool _batch_read(uint32_t segment, uint32_t pos, SaveBatch_t* batch) {
+	uint32_t sector = _segment_start(segment) + pos;
+	if (_io(SD_REQ_READ, sector, 1, batch->data) != SAVE_OK) return false;
+
+	SaveBatchHeader_t* header = (SaveBatchHeader_t*)batch->data;
+	if (header->magic != SAVE_MAGIC) return false;
+	if (header->sectors == 0 || header->sectors > SAVE_BATCH_SECTORS) return false;
+	if (pos + header->sectors > SAVE_SEGMENT_SECTORS) return false;
+	if (sizeof(SaveBatchHeader_t) + header->payload_bytes > header->sectors * SD_BLOCK_SIZE) return false;
+
+	if (header->sectors > 1 &&
+			_io(SD_REQ_READ, sector + 1, header->sectors - 1, batch->data + SD_BLOCK_SIZE) != SAVE_OK) {
+		return false;
+	}
+
+	uint32_t crc = header->crc;
+	header->crc = 0;
+	bool valid = _crc32(0, batch->data, sizeof(SaveBatchHeader_t) + header->payload_bytes) == crc;
+	header->crc = crc;
+
+	return valid;
+}
+
+/**
+ * Walk the log of a segment, optionally replaying it into the index.
+ *
+ * @param segment Segment number (0 or 1).
+ * @param scan Filled with what was found.
+ * @param apply Whether to apply each valid batch to the index.
+ */
+static void _scan_segment(uint32_t segment, SaveSegmentScan_t* scan, bool apply) {
+	*scan = (SaveSegmentScan_t){ 0 };
+
+	uint32_t pos = 0;
+	while (pos < SAVE_SEGMENT_SECTORS && _batch_read(segment, pos, &_copy)) {
+		SaveBatchHeader_t* header = (SaveBatchHeader_t*)_copy.data;
+
+		if (scan->valid) {
+			// stale batches from an older generation, or sectors left
+			// behind by a torn write, end the log
+			if (header->generation != scan->generation) break;
+			if (header->sequence != scan->last_sequence + 1) break;
+		} else {
+			scan->valid = true;
+			scan->generation = header->generation;
+		}
+
+		if (apply) {
+			uint32_t sector = _segment_start(segment) + pos;
+			_batch_foreach(_copy.data, header->records, _apply_record, &sector);
+		}
+
+		if (header->flags & SAVE_BATCH_SEALED) scan->sealed = true;
+		scan->last_sequence = header->sequence;
+		scan->batches++;
+		pos += header->sectors;
+	}
+
+	scan->end = pos;
+	_batch_reset(&_copy);
+}
+
+/**
+ * Read the first `length` bytes of an indexed value from the card, a sector at a time.
+ *
+ * @returns `SAVE_OK` or `SAVE_ERR_IO`.
+ */
+static int _read_value(const SaveIndexEntry_t* entry, uint8_t* out, uint16_t length) {
+	uint32_t position = entry->offset;
+
+	while (length > 0) {
+		uint32_t sector = entry->sector + position / SD_BLOCK_SIZE;
+		if (_io(SD_REQ_READ, sector, 1, _sector) != SAVE_OK) return SAVE_ERR_IO;
+
+		uint32_t start = position % SD_BLOCK_SIZE;
+		uint32_t chunk = SD_BLOCK_SIZE - start;
+		if (chunk > length) chunk = length;
+
+		memcpy(out, _sector + start, chunk);
+		out += chunk;
+		position += chunk;
+		length -= chunk;
+	}
+
+	return SAVE_OK;
+}
+
+/**
+ * Switch appends to the other segment under the next generation; the current
+ * segment becomes the compaction source.
+ */
+static void _start_compaction() {
+	_source_segment = _write_segment;
+	_write_segment = 1 - _write_segment;
+	_write_pos = 0;
+	_generation++;
+	_compacting = true;
+}
+
+/**
+ * Append a copy of an indexed record (value read back from the card) to the compaction batch.
+ *
+ * @returns `SAVE_OK`, `SAVE_ERR_FULL` if the batch has no room left, or `SAVE_ERR_IO`.
+ */
+static int _copy_entry(const SaveIndexEntry_t* entry) {
+	uint32_t key_length = strlen(entry->key);
+	uint32_t size = _align4(sizeof(SaveRecord_t) + key_length + entry->length);
+	if (_copy.used + size > SAVE_BATCH_BYTES) return SAVE_ERR_FULL;
+
+	SaveRecord_t* record = (SaveRecord_t*)(_copy.data + _copy.used);
+	record->key_length = (uint8_t)key_length;
+	record->flags = 0;
+	record->value_length = entry->length;
+
+	uint8_t* out = _copy.data + _copy.used + sizeof(SaveRecord_t);
+	memcpy(out, entry->key, key_length);
+
+	int result = _read_value(entry, out + key_length, entry->length);
+	if (result != SAVE_OK) return result;
+
+	memset(out + key_length + entry->length, 0, size - sizeof(SaveRecord_t) - key_length - entry->length);
+	_copy.used += size;
+	_copy.records++;
+	return SAVE_OK;
+}
+
+/**
+ * Mount the save store: rebuild the index by replaying the log, resuming an
+ * interrupted compaction if there was one. A region with no valid data is
+ * formatted.
+ *
+ * Requires the SD request queue to be initialized.
+ *
+ * @returns `SAVE_OK` or `SAVE_ERR_IO`.
+ */
+int save_store_mount() {
+	_mounted = false;
+	_keys = 0;
+	_compacting = false;
+	_recovered = 0;
+	_batch_reset(&_pending);
+	_batch_reset(&_copy);
+
+	SaveSegmentScan_t scans[2];
+	_scan_segment(0, &scans[0], false);
+	_scan_segment(1, &scans[1], false);
+
+	if (!scans[0].valid && !scans[1].valid) {
+		return save_store_format();
+	}
+
+	uint32_t newer;
+	if (!scans[1].valid) {
+		newer = 0;
+	} else if (!scans[0].valid) {
+		newer = 1;
+	} else {
+		newer = scans[1].generation > scans[0].generation ? 1 : 0;
+	}
+	uint32_t older = 1 - newer;
+
+	// an unsealed newer segment directly following the older one means a
+	// compaction was cut short: its records only make sense on top of the older log
+	bool replay_older = scans[older].valid && !scans[newer].sealed
+		&& scans[newer].generation == scans[older].generation + 1;
+
+	SaveSegmentScan_t scan;
+	if (replay_older) {
+		_scan_segment(older, &scan, true);
+		_recovered += scan.batches;
+	}
+	_scan_segment(newer, &scan, true);
+	_recovered += scan.batches;
+
+	_write_segment = newer;
+	_write_pos = scan.end;
+	_generation = scan.generation;
+	_sequence = scan.last_sequence;
+
+	if (replay_older) {
+		_compacting = true;
+		_source_segment = older;
+	}
+
+	_mounted = true;
+	return SAVE_OK;
+}
+
+/**
+ * Erase the store: write an empty sealed batch at the start of segment 0 and
+ * invalidate segment 1. The batch's generation is above any already on the
+ * card, so batches left behind it in segment 0 end the log instead of being
+ * replayed.
+ *
+ * @returns `SAVE_OK` or `SAVE_ERR_IO`.
+ */
+int save_store_format() {
+	_mounted = false;
+	_keys = 0;
+	_compacting = false;
+	_batch_reset(&_pending);
+	_batch_reset(&_copy);
+
+	SaveSegmentScan_t scans[2];
+	_scan_segment(0, &scans[0], false);
+	_scan_segment(1, &scans[1], false);
+	uint32_t generation = scans[0].generation > scans[1].generation ? scans[0].generation : scans[1].generation;
+
+	memset(_sector, 0, SD_BLOCK_SIZE);
+	if (_io(SD_REQ_WRITE, _segment_start(1), 1, _sector) != SAVE_OK) return SAVE_ERR_IO;
+
+	_write_segment = 0;
+	_write_pos = 0;
+	_generation = generation + 1;
+	_sequence = 0;
+
+	int result = _batch_write(&_copy, SAVE_BATCH_SEALED);
+	if (result != SAVE_OK) return result;
+
+	_mounted = true;
+	return SAVE_OK;
+}
+
+/**
+ * Unmount the store, dropping the index and any uncommitted changes.
+ */
+void save_store_unmount() {
+	_mounted = false;
+	_keys = 0;
+	_batch_reset(&_pending);
+}
+
+static bool _pending_has_key(const char* key) {
+	bool found = false;
+	uint32_t offset = sizeof(SaveBatchHeader_t);
+	size_t key_length = strlen(key);
+	for (uint16_t i = 0; i < _pending.records && !found; i++) {
+		const SaveRecord_t* record = (const SaveRecord_t*)(_pending.data + offset);
+		found = record->key_length == key_length
+			&& memcmp(_pending.data + offset + sizeof(SaveRecord_t), key, key_length) == 0;
+		offset = _align4(offset + sizeof(SaveRecord_t) + record->key_length + record->value_length);
+	}
+	return found;
+}
+
+static int _stage(const char* key, uint8_t flags, const void* value, uint16_t length) {
+	if (!_mounted) return SAVE_ERR_UNMOUNTED;
+	if (!_valid_key(key)) return SAVE_ERR_NOT_FOUND;
+
+	bool new_key = _index_find(key, _hash(key)) < 0 && !_pending_has_key(key);
+	if (new_key && !(flags & SAVE_RECORD_DELETED)
+			&& _keys + _pending.new_keys >= SAVE_STORE_MAX_KEYS) {
+		return SAVE_ERR_FULL;
+	}
+
+	int result = _batch_append(&_pending, key, flags, value, length);
+	if (result == SAVE_ERR_FULL) {
+		// batch is full, flush it and start another
+		result = save_store_commit();
+		if (result != SAVE_OK) return result;
+		result = _batch_append(&_pending, key, flags, value, length);
+	}
+
+	if (result == SAVE_OK && new_key && !(flags & SAVE_RECORD_DELETED)) {
+		_pending.new_keys++;
+	}
+	return result;
+}
+
+/**
+ * Stage a value for `key`. Nothing reaches the card until `save_store_commit`
+ * (unless the staging batch fills up, which commits it early).
+ *
+ * @param key NUL-terminated key, 1 to `SAVE_KEY_MAX` characters.
+ * @param value Value bytes.
+ * @param length Number of value bytes.
+ * @returns `SAVE_OK` or a `SAVE_ERR_*` code.
+ */
+int save_store_put(const char* key, const void* value, uint16_t length) {
+	return _stage(key, 0, value, length);
+}
+
+/**
+ * Stage the removal of `key`.
+ *
+ * @param key Key to remove.
+ * @returns `SAVE_OK` or a `SAVE_ERR_*` code.
+ */
+int save_store_delete(const char* key) {
+	return _stage(key, SAVE_RECORD_DELETED, NULL, 0);
+}
+
+/**
+ * Make all staged changes durable with a single multi-block write.
+ *
+ * If the segment being appended to has no room, compaction is run to
+ * completion first (normally it runs ahead of this in the background via
+ * `save_store_compact_step`).
+ *
+ * @returns `SAVE_OK`, `SAVE_ERR_FULL` if even a compacted store cannot take
+ *          the batch, or `SAVE_ERR_IO`.
+ */
+int save_store_commit() {
+	if (!_mounted) return SAVE_ERR_UNMOUNTED;
+	if (_pending.records == 0) return SAVE_OK;
+
+	int result = _batch_write(&_pending, 0);
+	if (result != SAVE_ERR_FULL) {
+		if (result == SAVE_OK) _commits++;
+		return result;
+	}
+
+	// out of room, finish (or do) a compaction and try again
+	if (!_compacting) _start_compaction();
+	for (uint32_t i = 0; i < SAVE_SEGMENT_SECTORS && _compacting; i++) {
+		save_store_compact_step();
+	}
+	if (_compacting) return SAVE_ERR_FULL;
+
+	result = _batch_write(&_pending, 0);
+	if (result == SAVE_OK) _commits++;
+	return result;
+}
+
+/**
+ * Read the value stored for `key`, including staged but uncommitted changes.
+ *
+ * @param key Key to look up.
+ * @param buffer Destination for the value.
+ * @param capacity Size of `buffer`; longer values are truncated.
+ * @returns The full length of the value, or a `SAVE_ERR_*` code.
+ */
+int save_store_get(const char* key, void* buffer, uint16_t capacity) {
+	if (!_mounted) return SAVE_ERR_UNMOUNTED;
+	if (!_valid_key(key)) return SAVE_ERR_NOT_FOUND;
+
+	// newest staged record wins
+	size_t key_length = strlen(key);
+	const SaveRecord_t* staged = NULL;
+	uint32_t staged_value = 0;
+	uint32_t offset = sizeof(SaveBatchHeader_t);
+	for (uint16_t i = 0; i < _pending.records; i++) {
+		const SaveRecord_t* record = (const SaveRecord_t*)(_pending.data + offset);
+		uint32_t value_offset = offset + sizeof(SaveRecord_t) + record->key_length;
+		if (record->key_length == key_length
+				&& memcmp(_pending.data + offset + sizeof(SaveRecord_t), key, key_length) == 0) {
+			staged = record;
+			staged_value = value_offset;
+		}
+		offset = _align4(value_offset + record->value_length);
+	}
+	if (staged != NULL) {
+		if (staged->flags & SAVE_RECORD_DELETED) return SAVE_ERR_NOT_FOUND;
+		uint16_t copy = staged->value_length < capacity ? staged->value_length : capacity;
+		memcpy(buffer, _pending.data + staged_value, copy);
+		return staged->value_length;
+	}
+
+	int i = _index_find(key, _hash(key));
+	if (i < 0) return SAVE_ERR_NOT_FOUND;
+
+	SaveIndexEntry_t* entry = &_index[i];
+	uint16_t length = entry->length < capacity ? entry->length : capacity;
+	if (_read_value(entry, (uint8_t*)buffer, length) != SAVE_OK) return SAVE_ERR_IO;
+
+	return entry->length;
+}
+
+/**
+ * Do one bounded unit of background compaction: start it if the live segment
+ * is past `SAVE_COMPACT_THRESHOLD`, otherwise copy up to one batch worth of
+ * live records out of the old segment, or seal the new segment once nothing
+ * is left to copy.
+ *
+ * Call from the main loop (or a background task) when there is idle time.
+ *
+ * @returns `true` while a compaction is in progress.
+ */
+bool save_store_compact_step() {
+	if (!_mounted) return false;
+
+	if (!_compacting) {
+		if (_write_pos * 100 < SAVE_SEGMENT_SECTORS * SAVE_COMPACT_THRESHOLD) return false;
+		_start_compaction();
+	}
+
+	_batch_reset(&_copy);
+	for (uint32_t i = 0; i < _keys; i++) {
+		if (!_in_segment(_index[i].sector, _source_segment)) continue;
+
+		int result = _copy_entry(&_index[i]);
+		if (result == SAVE_ERR_FULL) break;
+		// on failure, try again next step
+		if (result != SAVE_OK) return true;
+	}
+
+	if (_copy.records > 0) {
+		_batch_write(&_copy, 0);
+		return true;
+	}
+
+	// everything has been copied, seal the new segment
+	if (_batch_write(&_copy, SAVE_BATCH_SEALED) != SAVE_OK) return true;
+
+	_compacting = false;
+	_compactions++;
+	return false;
+}
+
+/**
+ * Get the number of keys currently stored (committed).
+ *
+ * @returns Key count.
+ */
+uint32_t save_store_key_count() {
+	return _keys;
+}
+
+/**
+ * Get a stored key by position, for listing. Positions change when keys are removed.
+ *
+ * @param index Position, less than `save_store_key_count()`.
+ * @returns The key, or `NULL` if `index` is out of range.
+ */
+const char* save_store_key_at(uint32_t index) {
+	if (index >= _keys) return NULL;
+	return _index[index].key;
+}
+
+/**
+ * Fill `stats` with the current state of the store.
+ *
+ * @param stats Destination.
+ */
+void save_store_get_stats(SaveStoreStats_t* stats) {
+	stats->generation = _generation;
+	stats->sequence = _sequence;
+	stats->keys = _keys;
+	stats->used_sectors = _write_pos;
+	stats->segment_sectors = SAVE_SEGMENT_SECTORS;
+	stats->commits = _commits;
+	stats->compactions = _compactions;
+	stats->recovered_batches = _recovered;
+	stats->compacting = _compacting;
+}
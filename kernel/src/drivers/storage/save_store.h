@@ -0,0 +1,55 @@
+#ifndef KERNEL_STORAGE_SAVE_STORE_H
+#define KERNEL_STORAGE_SAVE_STORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// reserved SD region: 1 MiB starting 1 MiB in, clear of the partition table
+// and split into two equal segments (one live, one compaction target)
+#ifndef SAVE_STORE_FIRST_SECTOR
+#define SAVE_STORE_FIRST_SECTOR 2048
+#endif
+#ifndef SAVE_STORE_SECTORS
+#define SAVE_STORE_SECTORS      2048
+#endif
+
+#define SAVE_STORE_MAX_KEYS      64
+#define SAVE_KEY_MAX             23
+#define SAVE_BATCH_SECTORS       8    // largest single commit (4 KiB)
+#define SAVE_COMPACT_THRESHOLD   75   // % of the live segment used before compaction starts
+
+// results
+#define SAVE_OK             0
+#define SAVE_ERR_IO        -1
+#define SAVE_ERR_FULL      -2
+#define SAVE_ERR_NOT_FOUND -3
+#define SAVE_ERR_TOO_BIG   -4
+#define SAVE_ERR_UNMOUNTED -5
+
+typedef struct SaveStoreStats {
+	uint32_t generation;       // generation of the live segment
+	uint32_t sequence;         // last committed batch
+	uint32_t keys;
+	uint32_t used_sectors;     // in the segment being appended to
+	uint32_t segment_sectors;
+	uint32_t commits;
+	uint32_t compactions;
+	uint32_t recovered_batches; // replayed by the last mount
+	bool compacting;
+} SaveStoreStats_t;
+
+int save_store_mount();
+int save_store_format();
+void save_store_unmount();
+
+int save_store_put(const char* key, const void* value, uint16_t length);
+int save_store_delete(const char* key);
+int save_store_commit();
+int save_store_get(const char* key, void* buffer, uint16_t capacity);
+
+bool save_store_compact_step();
+uint32_t save_store_key_count();
+const char* save_store_key_at(uint32_t index);
+void save_store_get_stats(SaveStoreStats_t* stats);
+
+#endif
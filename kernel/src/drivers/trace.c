@@ -0,0 +1,200 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+
+#if CYCLE_TRACE
+TraceRing_t trace_rings[2];
+volatile bool trace_enabled;
+
+// names sent so far in the dump being written, id = index + 1 (0 is "?")
+static const char* _names[TRACE_NAMES];
+static uint32_t _name_count;
+
+static void _put(uint8_t byte) {
+	// raw, stdio would turn a 0x0A into CR LF
+	putchar_raw(byte);
+}
+
+static void _put_u32(uint32_t value) {
+	for (int i = 0; i < 4; i++) _put((uint8_t)(value >> (8 * i)));
+}
+
+/**
+ * Send a number 7 bits at a time, low first, the top bit of each byte set
+ * if more follow.
+ */
+static void _put_varint(uint32_t value) {
+	while (value >= 0x80) {
+		_put((uint8_t)(value | 0x80));
+		value >>= 7;
+	}
+	_put((uint8_t)value);
+}
+
+/**
+ * Send a signed number as a varint, small negative ones staying short.
+ */
+static void _put_signed(int32_t value) {
+	_put_varint(((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+}
+
+/**
+ * Get the id of an event's name in the dump being written, sending the name
+ * first if it hasn't been yet.
+ *
+ * @param name Name, as recorded.
+ * @returns Its id, 0 if there's no room for more names.
+ */
+static uint32_t _name_id(const char* name) {
+	for (uint32_t i = 0; i < _name_count; i++) {
+		if (_names[i] == name) return i + 1;
+	}
+	if (_name_count == TRACE_NAMES || name == NULL) return 0;
+
+	_names[_name_count++] = name;
+	size_t length = strlen(name);
+	if (length > 63) length = 63;
+	_put(TRACE_TAG_NAME);
+	_put_varint(_name_count);
+	_put((uint8_t)length);
+	for (size_t i = 0; i < length; i++) _put((uint8_t)name[i]);
+	return _name_count;
+}
+
+/**
+ * Send one core's ring, oldest event first, and empty it.
+ *
+ * @param core Core.
+ */
+static void _dump_core(uint32_t core) {
+	TraceRing_t* ring = &trace_rings[core];
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint32_t count = head < TRACE_EVENTS ? head : TRACE_EVENTS;
+	uint32_t first = head - count;
+
+	// the latest sync goes first if it's been overwritten, or is from before
+	// the last dump
+	bool old_sync = ring->sync.type == TRACE_EVENT_SYNC && (int32_t)(ring->sync_slot - first) < 0;
+
+	_put(TRACE_TAG_CORE);
+	_put((uint8_t)core);
+	_put_varint(first);
+	_put_varint(count + old_sync);
+	uint32_t previous = old_sync ? ring->sync.cycles : count > 0 ? ring->events[first & (TRACE_EVENTS - 1)].cycles : 0;
+	_put_u32(previous);
+
+	for (uint32_t i = first - old_sync; i != head; i++) {
+		const TraceEvent_t* event = i == first - 1 && old_sync ? &ring->sync : &ring->events[i & (TRACE_EVENTS - 1)];
+		uint32_t id = event->type == TRACE_EVENT_SYNC ? 0 : _name_id(event->name);
+
+		// deltas are signed: a handler that records between another event's
+		// timestamp and its slot puts the two out of order
+		_put(TRACE_TAG_EVENT + event->type);
+		_put_signed((int32_t)(event->cycles - previous));
+		previous = event->cycles;
+
+		if (event->type == TRACE_EVENT_SYNC) {
+			_put_varint((uint32_t)event->value);
+			continue;
+		}
+		_put_varint(id);
+		if (event->type == TRACE_EVENT_COUNTER) _put_signed(event->value);
+	}
+
+	ring->sync_slot = (uint32_t)-1;
+	atomic_store_explicit(&ring->head, 0, memory_order_release);
+}
+
+/**
+ * Record where the calling core's cycle counter stands against the shared
+ * timer, after it wakes up (the counter stops while the core sleeps).
+ */
+void trace_sync() {
+	if (!trace_enabled) return;
+	TraceEvent_t sync = {
+		.cycles = m33_hw->dwt_cyccnt,
+		.name = NULL,
+		.value = (int32_t)time_us_32(),
+		.type = TRACE_EVENT_SYNC,
+	};
+	TraceRing_t* ring = &trace_rings[get_core_num()];
+	uint32_t slot = atomic_fetch_add_explicit(&ring->head, 1, memory_order_relaxed);
+	ring->events[slot & (TRACE_EVENTS - 1)] = sync;
+	ring->sync = sync;
+	ring->sync_slot = slot;
+}
+#endif
+
+/**
+ * Start tracing on the calling core: turn its cycle counter on (each core
+ * has its own) and record where it stands against the shared timer. Call on
+ * each core that records events.
+ */
+void trace_init() {
+#if CYCLE_TRACE
+	m33_hw->demcr |= M33_DEMCR_TRCENA_BITS;
+	m33_hw->dwt_ctrl |= M33_DWT_CTRL_CYCCNTENA_BITS;
+	trace_enabled = true;
+	TRACE_SYNC();
+#endif
+}
+
+/**
+ * Get how many events a core recorded since the last dump.
+ *
+ * @param core Core.
+ * @param stats Filled in with the counts.
+ */
+void trace_stats(uint32_t core, TraceStats_t* stats) {
+	*stats = (TraceStats_t){ 0 };
+#if CYCLE_TRACE
+	if (core > 1) return;
+	uint32_t head = atomic_load_explicit(&trace_rings[core].head, memory_order_relaxed);
+	stats->recorded = head;
+	stats->lost = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+#else
+	(void)core;
+#endif
+}
+
+/**
+ * Send both cores' events over stdio in the binary format
+ * tools/trace2json.py reads, after a line saying how many there are, and
+ * start again with empty rings. Recording stops while it's sent.
+ */
+void trace_dump() {
+#if CYCLE_TRACE
+	TraceStats_t stats[2];
+	trace_stats(0, &stats[0]);
+	trace_stats(1, &stats[1]);
+	printf("trace: core 0 %lu events (%lu lost), core 1 %lu events (%lu lost)\n",
+		(unsigned long)stats[0].recorded, (unsigned long)stats[0].lost,
+		(unsigned long)stats[1].recorded, (unsigned long)stats[1].lost);
+	stdio_flush();
+
+	// stop, and give an event being written (on the other core, say) time
+	// to land
+	trace_enabled = false;
+	__dmb();
+	busy_wait_us(10);
+
+	_name_count = 0;
+	_put_u32(TRACE_MAGIC);
+	_put(TRACE_VERSION);
+	_put(2);
+	_put(0);
+	_put(0);
+	_put_u32(clock_get_hz(clk_sys));
+	_dump_core(0);
+	_dump_core(1);
+	_put(TRACE_TAG_END);
+	stdio_flush();
+
+	__dmb();
+	trace_enabled = true;
+#endif
+}
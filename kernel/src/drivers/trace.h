@@ -0,0 +1,123 @@
+#ifndef KERNEL_TRACE_H
+#define KERNEL_TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Zones, counters and instant events timestamped with each core's DWT cycle
+// counter, for a timeline of where the time goes:
+//
+//     TRACE_BEGIN("lcd_fill_rect");
+//     ...
+//     TRACE_END("lcd_fill_rect");
+//     TRACE_COUNTER("sd depth", depth);
+//
+// Only recorded when built with CYCLE_TRACE (CMake option), the macros cost
+// nothing otherwise. Names are string literals, kept by pointer. Each core
+// records into a ring of its own, the oldest events giving way to the
+// newest; trace_dump() sends both over stdio in a compact binary format that
+// tools/trace2json.py turns into Chrome trace/Perfetto JSON.
+#ifndef CYCLE_TRACE
+#define CYCLE_TRACE 0
+#endif
+
+// events per core, a power of two
+#ifndef TRACE_EVENTS
+#define TRACE_EVENTS 2048
+#endif
+
+// distinct names one dump can tell apart, later ones show as "?"
+#ifndef TRACE_NAMES
+#define TRACE_NAMES 128
+#endif
+
+#define TRACE_MAGIC   0x45435254 // "TRCE"
+#define TRACE_VERSION 1
+
+// event types
+#define TRACE_EVENT_BEGIN   0
+#define TRACE_EVENT_END     1
+#define TRACE_EVENT_INSTANT 2
+#define TRACE_EVENT_COUNTER 3
+#define TRACE_EVENT_SYNC    4 // value is time_us_32 at that cycle count
+
+// dump records, each starting with a tag byte (see tools/trace2json.py)
+#define TRACE_TAG_END   0x00
+#define TRACE_TAG_NAME  0x01
+#define TRACE_TAG_CORE  0x02
+#define TRACE_TAG_EVENT 0x10 // + event type
+
+typedef struct TraceEvent {
+	uint32_t cycles;
+	const char* name;
+	int32_t value;
+	uint32_t type;
+} TraceEvent_t;
+
+typedef struct TraceStats {
+	uint32_t recorded; // since the last dump
+	uint32_t lost;     // overwritten before they were dumped
+} TraceStats_t;
+
+#if CYCLE_TRACE
+#include <stdatomic.h>
+
+#include "pico/platform.h"
+#include "hardware/timer.h"
+#include "hardware/structs/m33.h"
+
+typedef struct TraceRing {
+	atomic_uint head; // events ever recorded, the next goes at head % TRACE_EVENTS
+	TraceEvent_t events[TRACE_EVENTS];
+
+	// the latest sync, kept after the ring's moved past it so older events
+	// still have a time
+	TraceEvent_t sync;
+	uint32_t sync_slot; // head it was recorded at
+} TraceRing_t;
+
+extern TraceRing_t trace_rings[2];
+extern volatile bool trace_enabled;
+
+/**
+ * Record an event on the calling core. Safe from interrupt handlers: the slot
+ * is claimed with one atomic add, so a handler recording meanwhile takes the
+ * next one.
+ *
+ * @param type TRACE_EVENT_ type.
+ * @param name String literal.
+ * @param value Counter value, or 0.
+ */
+static inline void trace_record(uint32_t type, const char* name, int32_t value) {
+	if (!trace_enabled) return;
+	uint32_t cycles = m33_hw->dwt_cyccnt;
+	TraceRing_t* ring = &trace_rings[get_core_num()];
+	uint32_t slot = atomic_fetch_add_explicit(&ring->head, 1, memory_order_relaxed) & (TRACE_EVENTS - 1);
+	TraceEvent_t* event = &ring->events[slot];
+	event->cycles = cycles;
+	event->name = name;
+	event->value = value;
+	event->type = type;
+}
+
+#define TRACE_BEGIN(name)          trace_record(TRACE_EVENT_BEGIN, (name), 0)
+#define TRACE_END(name)            trace_record(TRACE_EVENT_END, (name), 0)
+#define TRACE_INSTANT(name)        trace_record(TRACE_EVENT_INSTANT, (name), 0)
+#define TRACE_COUNTER(name, value) trace_record(TRACE_EVENT_COUNTER, (name), (int32_t)(value))
+#define TRACE_SYNC()               trace_sync()
+#else
+#define TRACE_BEGIN(name)          ((void)0)
+#define TRACE_END(name)            ((void)0)
+#define TRACE_INSTANT(name)        ((void)0)
+#define TRACE_COUNTER(name, value) ((void)sizeof(value))
+#define TRACE_SYNC()               ((void)0)
+#endif
+
+#if CYCLE_TRACE
+void trace_sync();
+#endif
+void trace_init();
+void trace_stats(uint32_t core, TraceStats_t* stats);
+void trace_dump();
+
+#endif
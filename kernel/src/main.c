@@ -5,79 +5,233 @@
 #include "hardware/interp.h"
 
 #include "drivers/pins.h"
+#include "drivers/spi_bus.h"
 #include "drivers/memory.h"
 #include "drivers/allocator.h"
+#include "drivers/memops.h"
 #include "drivers/graphics/lcd.h"
 #include "drivers/graphics/os.h"
 #include "drivers/sd_card.h"
+#include "drivers/sd_queue.h"
+#include "drivers/storage/save_store.h"
+#include "drivers/storage/assets.h"
 #include "drivers/buttons.h"
+#include "drivers/latency.h"
+#include "drivers/trace.h"
+#include "drivers/scheduler.h"
+#include "drivers/jobs.h"
+#include "drivers/apps.h"
+
+#if ASYNC_COROUTINES
+#include "drivers/async.h"
+#endif
+
+#if MEMORY_CONTENTION
+#include "pico/stdio_usb.h"
+#endif
+
+// time each run of the compactor task gets, and how long it sleeps once
+// there's nothing left to move
+#define COMPACT_BUDGET_US 1000
+#define COMPACT_PERIOD_US 100000
+
+// core 1's heap, for what its jobs allocate
+#define CORE1_HEAP_SIZE (32 * 1024)
+
+// how long the screen stays green after OK (red if the app didn't load)
+#define OK_FLASH_US 200000
+
+// menu items that fit on the screen (the first apps in the store), and
+// placeholders without an app store
+#define MENU_VISIBLE      5
+#define MENU_PLACEHOLDERS 3
+
+typedef struct Menu {
+	int selected_app;
+	int total_apps;
+	bool update_screen;
+	bool flashing;
+	uint32_t flash_until;
+	bool in_app;
+} Menu_t;
 
 /**
- * Initialize hardware and run the interactive LCD menu loop.
+ * Menu task: handles UP/DOWN menu navigation with wrap-around and
+ * auto-repeat, an OK action that launches the selected app (or, without an
+ * app store or if it doesn't load, fills the display for OK_FLASH_US and
+ * then refreshes the menu), and redraws visible menu items when the
+ * selection changes. Runs on new input, at the end of the flash, when a held
+ * button is due to repeat and when the app exits; it's stopped while the app
+ * runs.
+ *
+ * @param task The task, its user data is the Menu_t.
+ */
+static void _menu_task(Task_t* task) {
+	Menu_t* menu = task->user;
+
+	// back from an app, which had the screen
+	if (menu->in_app) {
+		menu->in_app = false;
+		draw_menu();
+		menu->update_screen = true;
+	}
+
+	ButtonEvent_t event;
+	while (button_poll(&event)) {
+		if (event.type == BUTTON_RELEASE) continue;
+		if (event.type == BUTTON_PRESS) latency_input(event.time_us);
+
+		// UP and DOWN together print the press-to-photon latencies and where
+		// the time goes
+		if (event.type == BUTTON_CHORD && event.held == (BUTTON_MASK(PIN_BTN_UP) | BUTTON_MASK(PIN_BTN_DOWN))) {
+			latency_dump();
+			sched_dump();
+			jobs_dump();
+			apps_dump();
+#if ASYNC_COROUTINES
+			async_dump();
+#endif
+			// last, it's binary
+			trace_dump();
+		}
+
+		if (event.button == PIN_BTN_UP) {
+			menu->selected_app--;
+			if (menu->selected_app < 0) {
+				menu->selected_app = menu->total_apps - 1;
+			}
+			menu->update_screen = true;
+		}
+
+		if (event.button == PIN_BTN_DOWN) {
+			menu->selected_app++;
+			if (menu->selected_app >= menu->total_apps) {
+				menu->selected_app = 0;
+			}
+			menu->update_screen = true;
+		}
+
+		if (event.button == PIN_BTN_OK && !menu->flashing) {
+			int result = APP_ERR_NOT_FOUND;
+			if (apps_count() > 0) result = apps_launch(menu->selected_app, task);
+			if (result == APP_OK) {
+				// woken again when it exits; the app draws from here on, so
+				// this press isn't measured
+				latency_cancel();
+				menu->in_app = true;
+				return;
+			}
+
+			latency_draw();
+			lcd_fill_rect(0, 0, 240, 320, apps_count() > 0 ? RED : GREEN);
+			latency_flushed();
+			menu->flashing = true;
+			menu->flash_until = time_us_32() + OK_FLASH_US;
+		}
+	}
+
+	if (menu->flashing && (int32_t)(time_us_32() - menu->flash_until) >= 0) {
+		draw_menu();
+		menu->flashing = false;
+		menu->update_screen = true;
+	}
+
+	if (menu->update_screen && !menu->flashing) {
+		latency_draw();
+		for (int i = 0; i < menu->total_apps; i++) {
+			draw_menu_item(60 + 50 * i, i, (menu->selected_app == i));
+		}
+		latency_flushed();
+		menu->update_screen = false;
+	}
+
+	task_wait(task, SCHED_EVENT_INPUT);
+	if (menu->flashing) task_sleep_until(task, menu->flash_until);
+	uint32_t repeat_at;
+	if (buttons_next_repeat(&repeat_at)) task_sleep_until(task, repeat_at);
+}
+
+/**
+ * Compactor task: slides relocatable blocks down so big allocations keep
+ * fitting, a slice at a time while there's something to move.
+ *
+ * @param task The task.
+ */
+static void _compact_task(Task_t* task) {
+	if (alloc_compact(COMPACT_BUDGET_US) > 0) {
+		task_wake(task);
+	} else {
+		task_sleep(task, COMPACT_PERIOD_US);
+	}
+}
+
+/**
+ * Initialize hardware and run the interactive LCD menu.
  *
  * Sets up stdio, SPI, control GPIOs, buttons, LCD, and the memory allocator,
- * then enters an infinite polling loop that handles UP/DOWN menu navigation
- * with wrap-around, an OK action that temporarily fills the display and
- * refreshes the menu, and redraws visible menu items when the selection changes.
+ * then starts the menu and compactor tasks and hands the core to the
+ * scheduler, which sleeps it whenever neither has anything to do.
  *
  * @returns Exit status code. Does not return under normal operation.
  */
 int main() {
 	// initialise
 	stdio_init_all();
+	trace_init();
 
-	spi_init(SPI_PORT, DEFAULT_MHZ); // 62.5 MHz
-
-	gpio_set_function(PIN_SCK, GPIO_FUNC_SPI);
-	gpio_set_function(PIN_MOSI, GPIO_FUNC_SPI);
-	gpio_set_function(PIN_MISO, GPIO_FUNC_SPI);
+	// shared SPI bus, also sets up the LCD and SD chip selects
+	spi_bus_init();
 
-	pin_init(PIN_CS);
 	pin_init(PIN_DC);
 	pin_init(PIN_RST);
-	pin_init(PIN_SDCS);
 
-	buttons_init();
 	lcd_init();
 
+	// DMA and scratch regions, the heap gets the rest
+	memory_init();
 	alloc_init(heap_start(), total_free_bytes());
 
-	int selected_app = 0;
-	int total_apps = 3;
-	bool update_screen = true;
-	draw_menu();
-	while (1) {
-		if (button_pressed(PIN_BTN_UP)) {
-			selected_app--;
-			if (selected_app < 0) {
-				selected_app = total_apps - 1;
-			}
-			update_screen = true;
-			sleep_ms(150);
-		}
+	// core 1 runs jobs, its own and core 0's when it's idle
+	alloc_init_core(1, CORE1_HEAP_SIZE);
+	jobs_init();
 
-		if (button_pressed(PIN_BTN_DOWN)) {
-			selected_app++;
-			if (selected_app >= total_apps) {
-				selected_app = 0;
-			}
-			update_screen = true;
-			sleep_ms(150);
-		}
+	buttons_init();
 
-		if (button_pressed(PIN_BTN_OK)) {
-			lcd_fill_rect(0, 0, 240, 320, GREEN);
-			sleep_ms(200);
-			draw_menu();
-			update_screen = true;
-			sleep_ms(200);
-		}
+	// large memcpy/memset go through DMA from here on
+	memops_init();
 
-		if (update_screen) {
-			draw_menu_item(60,  0, (selected_app == 0));
-			draw_menu_item(110, 1, (selected_app == 1));
-			draw_menu_item(160, 2, (selected_app == 2));
-			update_screen = false;
-		}
+#if MEMORY_CONTENTION
+	// SRAM bank contention with data in each region, once the serial port is open
+	while (!stdio_usb_connected()) sleep_ms(100);
+	memory_contention_report();
+#endif
+
+	// sprites, fonts and palettes are used in place from flash
+	assets_init();
+
+	// apps come from the card's app store, if there's a card, and keep
+	// their state in its save store (left unmounted if it can't be read,
+	// apps then get SAVE_ERR_UNMOUNTED)
+	apps_init();
+	if (sd_init()) {
+		sd_queue_init();
+		save_store_mount();
+		apps_mount();
 	}
+
+	// holding OK would only relaunch
+	button_set_repeat(PIN_BTN_OK, 0, 0);
+
+	static Menu_t menu = { .total_apps = MENU_PLACEHOLDERS, .update_screen = true };
+	if (apps_count() > 0) menu.total_apps = apps_count() < MENU_VISIBLE ? apps_count() : MENU_VISIBLE;
+	static Task_t menu_task;
+	static Task_t compact_task;
+	draw_menu();
+	task_start(&menu_task, "menu", _menu_task, &menu);
+	task_start(&compact_task, "compact", _compact_task, NULL);
+#if ASYNC_COROUTINES
+	// coroutines (async.hpp) run on this core, between the tasks
+	async_init();
+#endif
+	sched_run();
 }
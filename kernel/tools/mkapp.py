@@ -0,0 +1,241 @@
+#!/usr/bin/env python3
+"""
+Build loadable apps for the kernel's app store (see drivers/app_api.h and
+drivers/apps.h).
+
+    mkapp.py image ELF OUTPUT --name NAME [--version N]
+    mkapp.py store OUTPUT IMAGE...
+
+`image` turns an app linked with apps/app.ld and --emit-relocs into an app
+image: the app is linked at address 0, and every absolute address it holds
+(R_ARM_ABS32 and R_ARM_TARGET1 relocations against its own sections) goes in
+the relocation table so the kernel can move it to wherever it loads it.
+PC-relative relocations need nothing; absolute MOVW/MOVT pairs can't be
+fixed up word by word and are an error.
+
+Image layout (little endian):
+    header       64 bytes
+    text         code and read-only data, linked at 0
+    data         initialised data, right after text
+    relocations  uint32_t offsets from the start of text
+
+`store` packs images into the app store, written to the card at
+APP_STORE_FIRST_SECTOR:
+    directory    one sector: 16 byte header, then 40 bytes per app
+    images       each starting on a sector of its own
+"""
+
+import argparse
+import struct
+import sys
+
+APP_MAGIC = 0x50504143  # "CAPP"
+APP_IMAGE_VERSION = 1
+APP_API_VERSION = 1
+APP_NAME_MAX = 24
+
+APP_STORE_MAGIC = 0x53505041  # "APPS"
+APP_STORE_VERSION = 1
+APP_STORE_MAX_APPS = 12
+SECTOR = 512
+
+HEADER = struct.Struct("<IHHIIIIIIII24s")
+STORE_HEADER = struct.Struct("<IHH8x")
+STORE_ENTRY = struct.Struct("<24sIII4x")
+
+# ELF32
+EHDR = struct.Struct("<16sHHIIIIIHHHHHH")
+SHDR = struct.Struct("<IIIIIIIIII")
+SYM = struct.Struct("<IIIBBH")
+REL = struct.Struct("<II")
+RELA = struct.Struct("<IIi")
+
+EM_ARM = 40
+SHT_SYMTAB = 2
+SHT_RELA = 4
+SHT_NOBITS = 8
+SHT_REL = 9
+SHF_ALLOC = 0x2
+SHN_UNDEF = 0
+SHN_ABS = 0xFFF1
+
+R_ARM_ABS32 = 2
+R_ARM_TARGET1 = 38
+ABSOLUTE = {R_ARM_ABS32, R_ARM_TARGET1}
+# relative to the place or the GOT-free code itself, fine wherever it loads
+RELATIVE = {0, 3, 10, 11, 28, 29, 30, 40, 42, 49, 50, 51, 53, 54, 102, 103}
+MOVW_MOVT = {43, 44, 47, 48}
+
+
+def fnv1a(data):
+	h = 0x811C9DC5
+	for b in data:
+		h ^= b
+		h = (h * 0x01000193) & 0xFFFFFFFF
+	return h
+
+
+class Elf:
+	def __init__(self, data):
+		if data[:4] != b"\x7fELF" or data[4] != 1 or data[5] != 1:
+			raise ValueError("not a 32 bit little endian ELF file")
+		fields = EHDR.unpack_from(data, 0)
+		if fields[2] != EM_ARM:
+			raise ValueError("not an ARM ELF file")
+		self.data = data
+		self.entry = fields[4]
+		shoff, shentsize, shnum = fields[6], fields[11], fields[12]
+		self.sections = [SHDR.unpack_from(data, shoff + i * shentsize) for i in range(shnum)]
+		strtab = self.sections[fields[13]]
+		self.names = [self.string(strtab, s[0]) for s in self.sections]
+
+	def string(self, section, offset):
+		start = section[4] + offset
+		return self.data[start:self.data.index(b"\0", start)].decode()
+
+	def contents(self, section):
+		return self.data[section[4]:section[4] + section[5]]
+
+	def symbols(self):
+		for section in self.sections:
+			if section[1] != SHT_SYMTAB:
+				continue
+			strtab = self.sections[section[6]]
+			table = self.contents(section)
+			return [SYM.unpack_from(table, i) for i in range(0, len(table), SYM.size)], strtab
+		raise ValueError("no symbol table (was the app stripped?)")
+
+
+def relocations(elf, symbols):
+	# offsets of the words holding absolute addresses in loaded sections
+	offsets = set()
+	for section, name in zip(elf.sections, elf.names):
+		if section[1] not in (SHT_REL, SHT_RELA):
+			continue
+		target = elf.sections[section[7]]
+		if not target[2] & SHF_ALLOC:
+			continue  # debug info
+		entry = REL if section[1] == SHT_REL else RELA
+		table = elf.contents(section)
+		for i in range(0, len(table), entry.size):
+			offset, info = entry.unpack_from(table, i)[:2]
+			kind, symbol = info & 0xFF, info >> 8
+			if kind in RELATIVE:
+				continue
+			if kind in MOVW_MOVT:
+				raise ValueError(f"absolute MOVW/MOVT relocation in {name} at 0x{offset:x}, "
+					"build with literal pools (no -mpure-code or -mslow-flash-data)")
+			if kind not in ABSOLUTE:
+				raise ValueError(f"unsupported relocation type {kind} in {name} at 0x{offset:x}")
+			shndx = symbols[symbol][5]
+			if symbol == 0 or shndx == SHN_ABS:
+				continue  # a fixed address, stays put
+			if shndx == SHN_UNDEF:
+				raise ValueError(f"undefined symbol in {name} at 0x{offset:x}, apps only call the kernel table")
+			if offset & 3:
+				raise ValueError(f"unaligned address in {name} at 0x{offset:x}")
+			offsets.add(offset)
+	return sorted(offsets)
+
+
+def build_image(data, name, version):
+	elf = Elf(data)
+	symbols, strtab = elf.symbols()
+	addresses = {elf.string(strtab, s[0]): s[1] for s in symbols if s[0]}
+	try:
+		data_start = addresses["__app_data_start"]
+		data_end = addresses["__app_data_end"]
+		bss_end = addresses["__app_bss_end"]
+	except KeyError as missing:
+		raise ValueError(f"{missing.args[0]} missing, link with apps/app.ld")
+	if (data_start | data_end | bss_end) & 3:
+		raise ValueError("sections not word aligned")
+
+	image = bytearray(data_end)
+	for section, section_name in zip(elf.sections, elf.names):
+		if not section[2] & SHF_ALLOC or section[5] == 0:
+			continue
+		address, size = section[3], section[5]
+		if section[1] == SHT_NOBITS:
+			if address < data_end or address + size > bss_end:
+				raise ValueError(f"{section_name} outside bss")
+			continue
+		if address + size > data_end:
+			raise ValueError(f"{section_name} past the end of data")
+		image[address:address + size] = elf.contents(section)
+
+	offsets = relocations(elf, symbols)
+	for offset in offsets:
+		if offset + 4 > data_end:
+			raise ValueError(f"relocation at 0x{offset:x} outside text and data")
+
+	entry = elf.entry & ~1
+	if entry >= data_start:
+		raise ValueError("entry point outside text")
+
+	encoded = name.encode()
+	if not encoded or len(encoded) >= APP_NAME_MAX:
+		raise ValueError(f"name must be 1 to {APP_NAME_MAX - 1} bytes")
+
+	body = bytes(image) + struct.pack(f"<{len(offsets)}I", *offsets)
+	header = HEADER.pack(APP_MAGIC, APP_IMAGE_VERSION, APP_API_VERSION, data_start,
+		data_end - data_start, bss_end - data_end, entry, len(offsets), fnv1a(body), version, 0, encoded)
+	return header + body, len(offsets)
+
+
+def build_store(images):
+	if len(images) > APP_STORE_MAX_APPS:
+		raise ValueError(f"at most {APP_STORE_MAX_APPS} apps")
+
+	directory = bytearray(STORE_HEADER.pack(APP_STORE_MAGIC, APP_STORE_VERSION, len(images)))
+	blobs = bytearray()
+	for image in images:
+		fields = HEADER.unpack_from(image, 0)
+		if fields[0] != APP_MAGIC or fields[1] != APP_IMAGE_VERSION:
+			raise ValueError("not an app image")
+		sector = 1 + len(blobs) // SECTOR
+		directory += STORE_ENTRY.pack(fields[11], sector, len(image), fields[8])
+		blobs += image
+		blobs += bytes(-len(blobs) % SECTOR)
+
+	directory += bytes(SECTOR - len(directory))
+	return bytes(directory) + bytes(blobs)
+
+
+def main():
+	parser = argparse.ArgumentParser(prog="mkapp.py", description="Build app images and the app store.")
+	commands = parser.add_subparsers(dest="command", required=True)
+	image = commands.add_parser("image", help="turn a linked app into an app image")
+	image.add_argument("elf")
+	image.add_argument("output")
+	image.add_argument("--name", required=True)
+	image.add_argument("--version", type=int, default=0)
+	store = commands.add_parser("store", help="pack app images into an app store")
+	store.add_argument("output")
+	store.add_argument("images", nargs="+")
+	args = parser.parse_args()
+
+	try:
+		if args.command == "image":
+			with open(args.elf, "rb") as f:
+				output, relocs = build_image(f.read(), args.name, args.version)
+			summary = f"{args.name}, {len(output)} bytes, {relocs} relocations"
+		else:
+			images = []
+			for path in args.images:
+				with open(path, "rb") as f:
+					images.append(f.read())
+			output = build_store(images)
+			summary = f"{len(images)} apps, {len(output)} bytes"
+	except (OSError, ValueError) as error:
+		print(f"mkapp: {error}", file=sys.stderr)
+		return 1
+
+	with open(args.output, "wb") as f:
+		f.write(output)
+	print(f"mkapp: {summary}")
+	return 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())
@@ -0,0 +1,202 @@
+#!/usr/bin/env python3
+"""
+Build an asset pack for the kernel's flash-resident asset store.
+
+The manifest has one asset per line:
+
+    NAME TYPE PATH [hot]
+
+TYPE is one of:
+    raw      file copied as is
+    sprite   binary PPM (P6) converted to RGB565, high byte first so rows can
+             be sent straight to the LCD
+    palette  text file with one colour per line, #RRGGBB or an RGB565 number
+             (; starts a comment), stored as native uint16_t RGB565
+    font     raw 1bpp glyph bitmaps, PATH may be followed by WIDTHxHEIGHT
+
+`hot` marks assets the kernel warms into the XIP cache at mount.
+Blank lines and lines starting with # are ignored, paths are relative to the
+manifest.
+
+Pack layout (little endian, see drivers/storage/assets.h):
+    header   32 bytes
+    index    20 bytes per asset, sorted by (FNV-1a hash, name)
+    names    NUL terminated, zero padded up to the first blob
+    blobs    each aligned to ASSET_ALIGN
+"""
+
+import os
+import struct
+import sys
+
+ASSET_MAGIC = 0x4B505341  # "ASPK"
+ASSET_VERSION = 1
+ASSET_ALIGN = 32
+
+HEADER = struct.Struct("<IHHIIIII4x")
+ENTRY = struct.Struct("<IIIHHHBB")
+
+TYPES = {"raw": 0, "sprite": 1, "palette": 2, "font": 3}
+FLAG_HOT = 0x01
+
+
+def fnv1a(data):
+	h = 0x811C9DC5
+	for b in data:
+		h ^= b
+		h = (h * 0x01000193) & 0xFFFFFFFF
+	return h
+
+
+def rgb565(r, g, b):
+	return ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3)
+
+
+def _ppm_tokens(data):
+	# header tokens of a P6 file, skipping comments
+	tokens = []
+	i = 0
+	while len(tokens) < 4:
+		while data[i:i + 1].isspace():
+			i += 1
+		if data[i:i + 1] == b"#":
+			while data[i:i + 1] not in (b"\n", b""):
+				i += 1
+			continue
+		start = i
+		while not data[i:i + 1].isspace():
+			i += 1
+		tokens.append(data[start:i])
+	return tokens, i + 1
+
+
+def load_sprite(path):
+	with open(path, "rb") as f:
+		data = f.read()
+	tokens, offset = _ppm_tokens(data)
+	if tokens[0] != b"P6" or int(tokens[3]) != 255:
+		raise ValueError(f"{path}: only 8-bit binary PPM (P6) is supported")
+	width, height = int(tokens[1]), int(tokens[2])
+	pixels = data[offset:offset + width * height * 3]
+	if len(pixels) != width * height * 3:
+		raise ValueError(f"{path}: truncated pixel data")
+
+	out = bytearray()
+	for i in range(0, len(pixels), 3):
+		out += struct.pack(">H", rgb565(pixels[i], pixels[i + 1], pixels[i + 2]))
+	return bytes(out), width, height
+
+
+def load_palette(path):
+	colours = []
+	with open(path) as f:
+		for line in f:
+			line = line.split(";")[0].strip()
+			if not line:
+				continue
+			if line.startswith("#"):
+				value = int(line[1:], 16)
+				colours.append(rgb565(value >> 16, (value >> 8) & 0xFF, value & 0xFF))
+			else:
+				colours.append(int(line, 0) & 0xFFFF)
+	return struct.pack(f"<{len(colours)}H", *colours), len(colours), 1
+
+
+def load_asset(kind, path, args):
+	if kind == "sprite":
+		return load_sprite(path)
+	if kind == "palette":
+		return load_palette(path)
+
+	with open(path, "rb") as f:
+		data = f.read()
+	width = height = 0
+	if kind == "font" and args and "x" in args[0]:
+		width, height = (int(v) for v in args.pop(0).split("x"))
+	return data, width, height
+
+
+def read_manifest(manifest):
+	base = os.path.dirname(os.path.abspath(manifest))
+	assets = []
+	with open(manifest) as f:
+		for number, line in enumerate(f, 1):
+			fields = line.split()
+			if not fields or fields[0].startswith("#"):
+				continue
+			if len(fields) < 3 or fields[1] not in TYPES:
+				raise ValueError(f"{manifest}:{number}: expected NAME TYPE PATH [hot]")
+
+			name, kind, path = fields[0], fields[1], os.path.join(base, fields[2])
+			args = fields[3:]
+			data, width, height = load_asset(kind, path, args)
+
+			flags = 0
+			if "hot" in args:
+				flags |= FLAG_HOT
+			assets.append((name.encode(), TYPES[kind], flags, width, height, data))
+	return assets
+
+
+def align(value):
+	return (value + ASSET_ALIGN - 1) & ~(ASSET_ALIGN - 1)
+
+
+def build_pack(assets):
+	assets.sort(key=lambda a: (fnv1a(a[0]), a[0]))
+	names = set()
+	for asset in assets:
+		if asset[0] in names:
+			raise ValueError(f"duplicate asset name {asset[0].decode()}")
+		names.add(asset[0])
+
+	index_offset = HEADER.size
+	names_offset = index_offset + ENTRY.size * len(assets)
+
+	name_table = bytearray()
+	name_offsets = []
+	for asset in assets:
+		name_offsets.append(len(name_table))
+		name_table += asset[0] + b"\0"
+	if len(name_table) > 0xFFFF:
+		raise ValueError("name table too large")
+
+	data_offset = align(names_offset + len(name_table))
+	blobs = bytearray()
+	index = bytearray()
+	for asset, name_offset in zip(assets, name_offsets):
+		name, kind, flags, width, height, data = asset
+		offset = data_offset + len(blobs)
+		blobs += data
+		blobs += bytes(align(len(blobs)) - len(blobs))
+		index += ENTRY.pack(fnv1a(name), offset, len(data), width, height, name_offset, kind, flags)
+
+	tables = index + name_table
+	tables += bytes(data_offset - index_offset - len(tables))
+
+	total = data_offset + len(blobs)
+	header = HEADER.pack(ASSET_MAGIC, ASSET_VERSION, len(assets), index_offset,
+		names_offset, data_offset, total, fnv1a(tables))
+	return header + bytes(tables) + bytes(blobs)
+
+
+def main():
+	if len(sys.argv) != 3:
+		print("usage: mkassets.py MANIFEST OUTPUT", file=sys.stderr)
+		return 2
+
+	try:
+		assets = read_manifest(sys.argv[1])
+		pack = build_pack(assets)
+	except (OSError, ValueError) as error:
+		print(f"mkassets: {error}", file=sys.stderr)
+		return 1
+
+	with open(sys.argv[2], "wb") as f:
+		f.write(pack)
+	print(f"mkassets: {len(assets)} assets, {len(pack)} bytes")
+	return 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())
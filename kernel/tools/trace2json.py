@@ -0,0 +1,236 @@
+#!/usr/bin/env python3
+"""
+Convert trace dumps captured from the kernel's USB serial into Chrome
+trace/Perfetto JSON (open it in ui.perfetto.dev or chrome://tracing).
+
+    trace2json.py CAPTURE OUTPUT
+
+CAPTURE is everything read from the serial port, e.g. `cat /dev/ttyACM0 >
+capture.bin` while pressing UP and DOWN together: each press sends a dump
+(see drivers/trace.h), text around them is skipped, and the dumps end up on
+one timeline.
+
+Dump layout (little endian):
+    header   u32 magic, u8 version, u8 cores, u16 reserved, u32 clk_sys Hz
+    records  each a tag byte:
+      0x01 name     varint id, u8 length, bytes; sent before the first
+                    event using it
+      0x02 core     u8 core, varint events lost, varint count, u32 cycles
+      0x10+type     event: zigzag varint cycles since the core's last event,
+                    then for a sync a varint time_us_32, otherwise a varint
+                    name id and, for a counter, a zigzag varint value
+      0x00 end
+
+Cycle counts become times through the core's syncs: each pairs the cycle
+counter with the shared microsecond timer, and one is recorded every time
+the core wakes up, since the counter stops while it sleeps.
+"""
+
+import json
+import struct
+import sys
+
+TRACE_MAGIC = 0x45435254  # "TRCE"
+TRACE_VERSION = 1
+HEADER = struct.Struct("<IBBHI")
+
+TAG_END = 0x00
+TAG_NAME = 0x01
+TAG_CORE = 0x02
+TAG_EVENT = 0x10
+
+BEGIN, END, INSTANT, COUNTER, SYNC = range(5)
+
+
+class Reader:
+	def __init__(self, data, offset):
+		self.data = data
+		self.offset = offset
+
+	def byte(self):
+		if self.offset >= len(self.data):
+			raise ValueError("dump cut short")
+		value = self.data[self.offset]
+		self.offset += 1
+		return value
+
+	def u32(self):
+		if self.offset + 4 > len(self.data):
+			raise ValueError("dump cut short")
+		value = struct.unpack_from("<I", self.data, self.offset)[0]
+		self.offset += 4
+		return value
+
+	def varint(self):
+		value = 0
+		for shift in range(0, 35, 7):
+			byte = self.byte()
+			value |= (byte & 0x7F) << shift
+			if not byte & 0x80:
+				return value
+		raise ValueError("bad varint")
+
+	def signed(self):
+		value = self.varint()
+		return (value >> 1) ^ -(value & 1)
+
+
+def read_dump(data, offset):
+	# one dump: {core: [(cycles, type, name, value)]} with cycles made
+	# monotonic across wraps, and how many events each core lost
+	reader = Reader(data, offset + HEADER.size)
+	_, version, cores, _, hz = HEADER.unpack_from(data, offset)
+	if version != TRACE_VERSION or hz == 0:
+		raise ValueError(f"unsupported dump version {version}")
+
+	names = {0: "?"}
+	events = {}
+	lost = {}
+
+	def read_name():
+		key = reader.varint()
+		length = reader.byte()
+		names[key] = bytes(reader.byte() for _ in range(length)).decode(errors="replace")
+
+	while True:
+		tag = reader.byte()
+		if tag == TAG_END:
+			return events, lost, hz, reader.offset
+		if tag == TAG_NAME:
+			read_name()
+		elif tag == TAG_CORE:
+			core = reader.byte()
+			if core >= cores:
+				raise ValueError(f"core {core} of {cores}")
+			lost[core] = reader.varint()
+			count = reader.varint()
+			cycles = reader.u32()
+			core_events = events.setdefault(core, [])
+			for _ in range(count):
+				# names are sent just before the first event using them
+				tag = reader.byte()
+				while tag == TAG_NAME:
+					read_name()
+					tag = reader.byte()
+				kind = tag - TAG_EVENT
+				if kind not in (BEGIN, END, INSTANT, COUNTER, SYNC):
+					raise ValueError(f"bad event tag 0x{tag:02x}")
+				cycles += reader.signed()
+				if kind == SYNC:
+					core_events.append((cycles, kind, None, reader.varint()))
+					continue
+				name = names.get(reader.varint(), "?")
+				value = reader.signed() if kind == COUNTER else 0
+				core_events.append((cycles, kind, name, value))
+		else:
+			raise ValueError(f"bad tag 0x{tag:02x}")
+
+
+def find_dumps(data):
+	magic = struct.pack("<I", TRACE_MAGIC)
+	offset = data.find(magic)
+	while offset >= 0:
+		try:
+			events, lost, hz, end = read_dump(data, offset)
+		except (ValueError, struct.error) as error:
+			print(f"trace2json: skipping dump at byte {offset}: {error}", file=sys.stderr)
+			offset = data.find(magic, offset + 1)
+			continue
+		yield events, lost, hz
+		offset = data.find(magic, end)
+
+
+def unwrap(value, near):
+	# the time_us_32 value as a full count of microseconds, the one closest to
+	# `near`
+	return near + ((value - near + 0x80000000) & 0xFFFFFFFF) - 0x80000000
+
+
+def timestamps(core_events, hz, near):
+	# microseconds for each event, from the latest sync before it (the first
+	# one for events before any), and the time of the last sync
+	syncs = [(cycles, value) for cycles, kind, _, value in core_events if kind == SYNC]
+	if not syncs:
+		return None, near
+
+	times = []
+	sync_cycles = syncs[0][0]
+	sync_us = near = unwrap(syncs[0][1], near)
+	for cycles, kind, _, value in core_events:
+		if kind == SYNC:
+			sync_cycles = cycles
+			sync_us = near = unwrap(value, near)
+		times.append(sync_us + (cycles - sync_cycles) * 1e6 / hz)
+	return times, near
+
+
+def convert(dumps):
+	trace = []
+	for core in range(2):
+		trace.append({"name": "thread_name", "ph": "M", "pid": 0, "tid": core, "args": {"name": f"core {core}"}})
+
+	skipped = 0
+	near = None
+	for events, lost, hz in dumps:
+		for core, core_events in sorted(events.items()):
+			if near is None:
+				near = next((value for _, kind, _, value in core_events if kind == SYNC), 0)
+			times, near = timestamps(core_events, hz, near)
+			if times is None:
+				skipped += len(core_events)
+				continue
+
+			# in time order, and an end whose begin was overwritten dropped
+			ordered = sorted(zip(times, core_events), key=lambda item: item[0])
+			depth = 0
+			for ts, (_, kind, name, value) in ordered:
+				event = {"name": name, "pid": 0, "tid": core, "ts": round(ts, 3)}
+				if kind == BEGIN:
+					depth += 1
+					event["ph"] = "B"
+				elif kind == END:
+					if depth == 0:
+						continue
+					depth -= 1
+					event["ph"] = "E"
+				elif kind == INSTANT:
+					event["ph"] = "i"
+					event["s"] = "t"
+				elif kind == COUNTER:
+					event["ph"] = "C"
+					event["args"] = {name: value}
+				else:
+					continue
+				trace.append(event)
+			if lost.get(core):
+				print(f"trace2json: core {core} lost {lost[core]} events", file=sys.stderr)
+
+	if skipped:
+		print(f"trace2json: {skipped} events without a sync skipped", file=sys.stderr)
+	return {"traceEvents": trace, "displayTimeUnit": "ns"}
+
+
+def main():
+	if len(sys.argv) != 3:
+		print("usage: trace2json.py CAPTURE OUTPUT", file=sys.stderr)
+		return 2
+
+	try:
+		with open(sys.argv[1], "rb") as f:
+			dumps = list(find_dumps(f.read()))
+	except OSError as error:
+		print(f"trace2json: {error}", file=sys.stderr)
+		return 1
+	if not dumps:
+		print("trace2json: no trace dumps found", file=sys.stderr)
+		return 1
+
+	result = convert(dumps)
+	with open(sys.argv[2], "w") as f:
+		json.dump(result, f, separators=(",", ":"))
+	print(f"trace2json: {len(dumps)} dumps, {len(result['traceEvents']) - 2} events")
+	return 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())